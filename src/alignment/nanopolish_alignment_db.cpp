@@ -8,11 +8,13 @@
 //
 #include <assert.h>
 #include <algorithm>
+#include <set>
 #include "nanopolish_alignment_db.h"
 #include "htslib/faidx.h"
 #include "htslib/hts.h"
 #include "htslib/sam.h"
 #include "nanopolish_methyltrain.h"
+#include "nanopolish_squiggle_read_cache.h"
 
 // Various file handle and structures
 // needed to traverse a bam file
@@ -31,8 +33,26 @@ AlignmentDB::AlignmentDB(const std::string& reads_file,
                             m_reference_file(reference_file),
                             m_sequence_bam(sequence_bam),
                             m_event_bam(event_bam),
-                            m_fast5_name_map(reads_file),
-                            m_calibrate_on_load(calibrate_reads)
+                            m_calibrate_on_load(calibrate_reads),
+                            m_fast5_name_map(std::make_shared<const Fast5Map>(reads_file)),
+                            m_prefetch_start(-1),
+                            m_prefetch_end(-1)
+{
+    _clear_region();
+}
+
+AlignmentDB::AlignmentDB(const std::shared_ptr<const Fast5Map>& fast5_name_map,
+                         const std::string& reference_file,
+                         const std::string& sequence_bam,
+                         const std::string& event_bam,
+                         bool calibrate_reads) :
+                            m_reference_file(reference_file),
+                            m_sequence_bam(sequence_bam),
+                            m_event_bam(event_bam),
+                            m_calibrate_on_load(calibrate_reads),
+                            m_fast5_name_map(fast5_name_map),
+                            m_prefetch_start(-1),
+                            m_prefetch_end(-1)
 {
     _clear_region();
 }
@@ -276,6 +296,8 @@ void AlignmentDB::load_region(const std::string& contig,
                               int start_position,
                               int stop_position)
 {
+    // discard the previous region, if any
+    _clear_region();
 
     // load reference fai file
     faidx_t *fai = fai_load(m_reference_file.c_str());
@@ -294,8 +316,17 @@ void AlignmentDB::load_region(const std::string& contig,
     // load base-space alignments
     _load_sequence_by_region();
 
-    // load event-space alignments
-    _load_events_by_region();
+    // load event-space alignments, using the records read by prefetch_region if it was called for this region
+    std::vector<EventAlignmentRecord> event_records;
+    std::vector<std::string> read_names;
+    if(contig == m_prefetch_contig && start_position == m_prefetch_start && stop_position == m_prefetch_end) {
+        event_records.swap(m_prefetch_records);
+        read_names.swap(m_prefetch_read_names);
+        m_prefetch_contig.clear();
+    } else {
+        _read_event_records(m_region_contig, m_region_start, m_region_end, event_records, read_names);
+    }
+    _load_events_by_region(event_records, read_names);
 
     free(ref_segment);
     fai_destroy(fai);
@@ -303,14 +334,7 @@ void AlignmentDB::load_region(const std::string& contig,
 
 void AlignmentDB::_clear_region()
 {
-    // Delete the SquiggleReads
-    for(SquiggleReadMap::iterator iter = m_squiggle_read_map.begin();
-        iter != m_squiggle_read_map.end(); ++iter) 
-    {
-        delete iter->second;
-        iter->second = NULL;
-    }
-
+    // Release the SquiggleReads, they may stay in the SquiggleReadCache
     m_squiggle_read_map.clear();
     m_sequence_records.clear();
     m_event_records.clear();
@@ -387,13 +411,13 @@ void AlignmentDB::_load_sequence_by_region()
     sam_close(handles.bam_fh);
 }
 
-void AlignmentDB::_load_events_by_region()
+void AlignmentDB::_read_event_records(const std::string& contig,
+                                      int start_position,
+                                      int stop_position,
+                                      std::vector<EventAlignmentRecord>& records,
+                                      std::vector<std::string>& read_names) const
 {
-    assert(!m_region_contig.empty());
-    assert(m_region_start >= 0);
-    assert(m_region_end >= 0);
-
-    BamHandles handles = _initialize_bam_itr(m_event_bam, m_region_contig, m_region_start, m_region_end);
+    BamHandles handles = _initialize_bam_itr(m_event_bam, contig, start_position, stop_position);
 
     int result;
     while((result = sam_itr_next(handles.bam_fh, handles.itr, handles.bam_record)) >= 0) {
@@ -411,21 +435,8 @@ void AlignmentDB::_load_events_by_region()
             is_template = false;
         }
 
-        std::string read_name = full_name.substr(0, suffix_pos);
-        std::string fast5_path = m_fast5_name_map.get_path(read_name);
-
-        // Do we need to load this fast5 file?
-        if(m_squiggle_read_map.find(read_name) == m_squiggle_read_map.end()) {
-            SquiggleRead* sr = new SquiggleRead(read_name, fast5_path);
-            // Switch the read to use an alternative kmer model
-            if(!m_model_type_string.empty()) {
-                sr->replace_models(m_model_type_string);
-            }
-
-            m_squiggle_read_map[read_name] = sr;
-        }
-
-        event_record.sr = m_squiggle_read_map[read_name];
+        // the read is loaded by the caller
+        event_record.sr = NULL;
 
         // extract the event stride tag which tells us whether the
         // event indices are increasing or decreasing
@@ -438,6 +449,42 @@ void AlignmentDB::_load_events_by_region()
         event_record.rc = bam_is_rev(handles.bam_record);
         event_record.stride = event_stride;
         event_record.strand = is_template ? T_IDX : C_IDX;
+        records.push_back(event_record);
+        read_names.push_back(full_name.substr(0, suffix_pos));
+    }
+
+    // cleanup
+    sam_itr_destroy(handles.itr);
+    bam_destroy1(handles.bam_record);
+    sam_close(handles.bam_fh);
+}
+
+void AlignmentDB::_load_events_by_region(std::vector<EventAlignmentRecord>& records,
+                                         const std::vector<std::string>& read_names)
+{
+    assert(!m_region_contig.empty());
+    assert(m_region_start >= 0);
+    assert(m_region_end >= 0);
+    assert(records.size() == read_names.size());
+
+    for(size_t ri = 0; ri < records.size(); ++ri) {
+        EventAlignmentRecord& event_record = records[ri];
+        const std::string& read_name = read_names[ri];
+
+        // Do we need to load this fast5 file?
+        if(m_squiggle_read_map.find(read_name) == m_squiggle_read_map.end()) {
+            std::string fast5_path = m_fast5_name_map->get_path(read_name);
+
+            // Calibration modifies the read so it cannot be shared with other windows
+            SquiggleReadCache& cache = SquiggleReadCache::instance();
+            if(m_calibrate_on_load) {
+                m_squiggle_read_map[read_name] = cache.get_copy(read_name, fast5_path, m_model_type_string);
+            } else {
+                m_squiggle_read_map[read_name] = cache.get(read_name, fast5_path, m_model_type_string);
+            }
+        }
+
+        event_record.sr = m_squiggle_read_map[read_name].get();
         m_event_records.push_back(event_record);
         
         if(m_calibrate_on_load) {
@@ -448,23 +495,35 @@ void AlignmentDB::_load_events_by_region()
             recalibrate_model(*event_record.sr, event_record.strand, event_alignment, &gDNAAlphabet, true, false);
             event_record.sr->print_scaling_parameters(stderr, event_record.strand);
         }
+    }
+}
 
-        /*
-        printf("event_record[%zu] name: %s stride: %d align bounds [%d %d] [%d %d]\n", 
-            m_event_records.size() - 1,
-            bam_get_qname(handles.bam_record),
-            event_stride,
-            m_event_records.back().aligned_events.front().ref_pos,
-            m_event_records.back().aligned_events.front().read_pos,
-            m_event_records.back().aligned_events.back().ref_pos,
-            m_event_records.back().aligned_events.back().read_pos);
-        */
+void AlignmentDB::prefetch_region(const std::string& contig,
+                                  int start_position,
+                                  int stop_position)
+{
+    SquiggleReadCache& cache = SquiggleReadCache::instance();
+    if(!cache.is_enabled()) {
+        return;
     }
 
-    // cleanup
-    sam_itr_destroy(handles.itr);
-    bam_destroy1(handles.bam_record);
-    sam_close(handles.bam_fh);
+    m_prefetch_records.clear();
+    m_prefetch_read_names.clear();
+    _read_event_records(contig, start_position, stop_position, m_prefetch_records, m_prefetch_read_names);
+    m_prefetch_contig = contig;
+    m_prefetch_start = start_position;
+    m_prefetch_end = stop_position;
+
+    std::vector<SquiggleReadCacheRequest> requests;
+    std::set<std::string> seen;
+    for(size_t ri = 0; ri < m_prefetch_read_names.size(); ++ri) {
+        const std::string& read_name = m_prefetch_read_names[ri];
+        if(seen.insert(read_name).second) {
+            SquiggleReadCacheRequest request = { read_name, m_fast5_name_map->get_path(read_name) };
+            requests.push_back(request);
+        }
+    }
+    cache.prefetch(requests, m_model_type_string);
 }
 
 std::vector<EventAlignment> AlignmentDB::_build_event_alignment(const EventAlignmentRecord& event_record) const
@@ -495,6 +554,7 @@ std::vector<EventAlignment> AlignmentDB::_build_event_alignment(const EventAlign
         ea.rc = event_record.rc;
         ea.model_kmer = kmer;
         ea.hmm_state = 'M';
+        ea.l_event = -INFINITY; // not computed
         alignment.push_back(ea);
     }
 
@@ -12,6 +12,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include "nanopolish_anchor.h"
 #include "nanopolish_variant.h"
 
@@ -32,7 +33,7 @@ struct EventAlignmentRecord
 };
 
 // typedefs
-typedef std::map<std::string, SquiggleRead*> SquiggleReadMap;
+typedef std::map<std::string, std::shared_ptr<SquiggleRead> > SquiggleReadMap;
 
 class AlignmentDB
 {
@@ -43,6 +44,13 @@ class AlignmentDB
                     const std::string& event_bam,
                     const bool calibrate_reads = false);
 
+        // As above, sharing a read name -> fast5 map that has already been loaded
+        AlignmentDB(const std::shared_ptr<const Fast5Map>& fast5_name_map,
+                    const std::string& reference_file,
+                    const std::string& sequence_bam,
+                    const std::string& event_bam,
+                    const bool calibrate_reads = false);
+
         ~AlignmentDB();
 
         void load_region(const std::string& contig,
@@ -65,6 +73,14 @@ class AlignmentDB
 
         std::vector<HMMInputData> get_events_aligned_to(const std::string& contig, int position) const;
 
+        // Read the event alignments for the region and start loading their reads
+        // into the SquiggleReadCache. A later call to load_region for the same
+        // region uses these records rather than reading the bam again and
+        // does not have to wait for the reads.
+        void prefetch_region(const std::string& contig,
+                             int start_position,
+                             int stop_position);
+
         std::vector<Variant> get_variants_in_region(const std::string& contig,
                                                     int start_position,
                                                     int stop_position,
@@ -83,9 +99,19 @@ class AlignmentDB
     private:
         
         void _load_sequence_by_region();
-        void _load_events_by_region();
+        void _load_events_by_region(std::vector<EventAlignmentRecord>& records,
+                                    const std::vector<std::string>& read_names);
         void _clear_region();
 
+        // Read the event alignment records for the region from the bam. The
+        // SquiggleRead of the records is not set, read_names holds the name of
+        // the read for each record.
+        void _read_event_records(const std::string& contig,
+                                 int start_position,
+                                 int stop_position,
+                                 std::vector<EventAlignmentRecord>& records,
+                                 std::vector<std::string>& read_names) const;
+
         std::vector<EventAlignment> _build_event_alignment(const EventAlignmentRecord& event_record) const;
 
         // Search the vector of AlignedPairs using lower_bound/upper_bound
@@ -121,11 +147,18 @@ class AlignmentDB
         int m_region_end;
 
         // cached alignments for a region
-        Fast5Map m_fast5_name_map;
+        std::shared_ptr<const Fast5Map> m_fast5_name_map;
         std::vector<SequenceAlignmentRecord> m_sequence_records;
         std::vector<EventAlignmentRecord> m_event_records;
         SquiggleReadMap m_squiggle_read_map;
         std::string m_model_type_string;
+
+        // event alignment records read by prefetch_region
+        std::string m_prefetch_contig;
+        int m_prefetch_start;
+        int m_prefetch_end;
+        std::vector<EventAlignmentRecord> m_prefetch_records;
+        std::vector<std::string> m_prefetch_read_names;
 };
 
 #endif
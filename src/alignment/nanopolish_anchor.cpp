@@ -16,6 +16,7 @@
 #include "nanopolish_scorereads.h"
 #include "nanopolish_methyltrain.h"
 #include "nanopolish_squiggle_read.h"
+#include "nanopolish_squiggle_read_cache.h"
 
 HMMRealignmentInput build_input_for_region(const std::string& bam_filename,
                                            const std::string& ref_filename,
@@ -76,12 +77,9 @@ HMMRealignmentInput build_input_for_region(const std::string& bam_filename,
         std::string read_name = bam_get_qname(record);
         std::string fast5_path = read_name_map.get_path(read_name);
 
-        // load read
-        ret.reads.push_back(std::unique_ptr<SquiggleRead>(new SquiggleRead(read_name, fast5_path)));
+        // load read, the read is recalibrated for this region so we need our own copy
+        ret.reads.push_back(SquiggleReadCache::instance().get_copy(read_name, fast5_path, alternative_model_type));
         SquiggleRead& sr = *ret.reads.back();
-        if(!alternative_model_type.empty()) {
-            sr.replace_models(alternative_model_type);
-        }
 
         // Recalibrate each strand
         for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; strand_idx++) {
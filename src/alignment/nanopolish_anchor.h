@@ -75,7 +75,7 @@ struct HMMAnchoredColumn
 //
 struct HMMRealignmentInput
 {
-    std::vector<std::unique_ptr<SquiggleRead> > reads;
+    std::vector<std::shared_ptr<SquiggleRead> > reads;
     std::vector<HMMAnchoredColumn> anchored_columns;
     std::string original_sequence;
 };
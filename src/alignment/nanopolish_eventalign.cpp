@@ -17,11 +17,14 @@
 #include <algorithm>
 #include <sstream>
 #include <set>
+#include <map>
 #include <omp.h>
 #include <getopt.h>
 #include <iterator>
+#include <thread>
 #include "htslib/faidx.h"
 #include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_format.h"
 #include "nanopolish_iupac.h"
 #include "nanopolish_poremodel.h"
 #include "nanopolish_transition_parameters.h"
@@ -31,7 +34,9 @@
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_hmm_input_sequence.h"
 #include "nanopolish_pore_model_set.h"
-#include "H5pubconf.h"
+#include "nanopolish_text_format.h"
+#include "nanopolish_output_queue.h"
+#include "nanopolish_read_pipeline.h"
 #include "profiler.h"
 #include "progress.h"
 
@@ -54,13 +59,19 @@ static const char *EVENTALIGN_USAGE_MESSAGE =
 "      --version                        display version\n"
 "      --help                           display this help and exit\n"
 "      --sam                            write output in SAM format\n"
+"      --format=STR                     write the event table as tsv or binary (default: tsv)\n"
+"                                       binary output can be converted to tsv with view-eventalign\n"
 "  -w, --window=STR                     compute the consensus for window STR (format: ctg:start_id-end_id)\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
 "  -g, --genome=FILE                    the genome we are computing a consensus for is in FILE\n"
-"  -t, --threads=NUM                    use NUM threads (default: 1)\n"
+"  -t, --threads=NUM                    process reads on NUM threads (default: 1). A bam reader and a\n"
+"                                       fast5 loader thread, plus two bgzf threads if NUM > 1, run alongside\n"
 "      --scale-events                   scale events to the model, rather than vice-versa\n"
 "      --progress                       print out a progress message\n"
+"      --ordered                        write the reads in the order they appear in the bam file\n"
+"      --chunk-size=NUM                 align reads spanning at least 2*NUM reference bases in chunks of NUM bases\n"
+"                                       on multiple threads, NUM >= 400 (default: 0, align each read on one thread)\n"
 "  -n, --print-read-names               print read names instead of indexes\n"
 "      --summary=FILE                   summarize the alignment of each read/strand in FILE\n"
 "      --stdv                           enable stdv modelling\n"
@@ -77,12 +88,14 @@ namespace opt
     static std::string region;
     static std::string summary_file;
     static std::string models_fofn;
+    static std::string format = "tsv";
     static std::string alternative_model_type = DEFAULT_MODEL_TYPE;
     static int output_sam = 0;
     static int progress = 0;
+    static int ordered = 0;
     static int num_threads = 1;
+    static int chunk_size = 0;
     static int scale_events = 0;
-    static int batch_size = 128;
     static bool print_read_names;
     static bool full_output;
     static bool write_samples = false;
@@ -90,7 +103,7 @@ namespace opt
 
 static const char* shortopts = "r:b:g:t:w:vn";
 
-enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_SAM, OPT_SUMMARY, OPT_SCALE_EVENTS, OPT_STDV, OPT_MODELS_FOFN, OPT_SAMPLES };
+enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_SAM, OPT_SUMMARY, OPT_SCALE_EVENTS, OPT_STDV, OPT_MODELS_FOFN, OPT_SAMPLES, OPT_ORDERED, OPT_FORMAT, OPT_CHUNK_SIZE };
 
 static const struct option longopts[] = {
     { "verbose",          no_argument,       NULL, 'v' },
@@ -106,20 +119,44 @@ static const struct option longopts[] = {
     { "samples",          no_argument,       NULL, OPT_SAMPLES },
     { "scale-events",     no_argument,       NULL, OPT_SCALE_EVENTS },
     { "sam",              no_argument,       NULL, OPT_SAM },
+    { "format",           required_argument, NULL, OPT_FORMAT },
     { "progress",         no_argument,       NULL, OPT_PROGRESS },
+    { "ordered",          no_argument,       NULL, OPT_ORDERED },
+    { "chunk-size",       required_argument, NULL, OPT_CHUNK_SIZE },
     { "help",             no_argument,       NULL, OPT_HELP },
     { "version",          no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
 };
 
-// convenience wrapper for the two output modes
+// convenience wrapper for the output modes
 struct EventalignWriter
 {
     FILE* tsv_fp;
     htsFile* sam_fp;
+    EventalignBinaryWriter* binary_writer;
     FILE* summary_fp;
 };
 
+// The output for one read, formatted by the worker thread
+// that aligned it and written by the writer thread
+struct EventalignChunk
+{
+    std::string tsv;
+    std::vector<bam1_t*> sam_records; // owned by the chunk until they are written
+    std::string binary; // the encoded block, if the read has any records
+    EventalignIndexEntry index_entry;
+    std::string summary;
+
+    void swap(EventalignChunk& other)
+    {
+        tsv.swap(other.tsv);
+        sam_records.swap(other.sam_records);
+        binary.swap(other.binary);
+        std::swap(index_entry, other.index_entry);
+        summary.swap(other.summary);
+    }
+};
+
 // Summarize the event alignment for a read strand
 struct EventalignSummary
 {
@@ -207,17 +244,24 @@ std::string get_reference_region_ts(const faidx_t* fai, const char* ref_name, in
 //
 //
 
-void emit_tsv_header(FILE* fp)
+// The table options given on the command line and the contigs of the bam
+EventalignFileHeader make_eventalign_header(const bam_hdr_t* hdr)
 {
-    fprintf(fp, "%s\t%s\t%s\t%s\t%s\t", "contig", "position", "reference_kmer",
-            (not opt::print_read_names? "read_index" : "read_name"), "strand");
-    fprintf(fp, "%s\t%s\t%s\t%s\t", "event_index", "event_level_mean", "event_stdv", "event_length");
-    fprintf(fp, "%s\t%s\t%s\t%s", "model_kmer", "model_mean", "model_stdv", "standardized_level");
-
-    if(opt::write_samples) {
-        fprintf(fp, "\t%s", "samples");
+    EventalignFileHeader header;
+    header.alphabet = &gDNAAlphabet;
+    header.print_read_names = opt::print_read_names;
+    header.write_samples = opt::write_samples;
+    if(hdr != NULL) {
+        header.contig_names.assign(hdr->target_name, hdr->target_name + hdr->n_targets);
     }
-    fprintf(fp, "\n");
+    return header;
+}
+
+void emit_tsv_header(FILE* fp, const EventalignFileHeader& header)
+{
+    std::string out;
+    format_eventalign_tsv_header(out, header);
+    fwrite(out.data(), 1, out.size(), fp);
 }
 
 void emit_sam_header(samFile* fp, const bam_hdr_t* hdr)
@@ -299,14 +343,14 @@ std::vector<uint32_t> event_alignment_to_cigar(const std::vector<EventAlignment>
     return out;
 }
 
-void emit_event_alignment_sam(htsFile* fp,
-                              const SquiggleRead& sr,
-                              const bam_hdr_t* base_hdr,
-                              const bam1_t* base_record, 
-                              const std::vector<EventAlignment>& alignments)
+// Make the SAM record for the alignment of the events to the reference,
+// or NULL if the alignment is empty. The caller must free the record.
+bam1_t* make_event_alignment_sam_record(const SquiggleRead& sr,
+                                        const bam1_t* base_record,
+                                        const std::vector<EventAlignment>& alignments)
 {
     if(alignments.empty())
-        return;
+        return NULL;
     bam1_t* event_record = bam_init1();
     
     // Variable-length data
@@ -361,40 +405,30 @@ void emit_event_alignment_sam(htsFile* fp,
     int stride = alignments.front().event_idx < alignments.back().event_idx ? 1 : -1;
     bam_aux_append(event_record, "ES", 'i', 4, reinterpret_cast<uint8_t*>(&stride));
 
-    sam_write1(fp, base_hdr, event_record);
-    bam_destroy1(event_record); // automatically frees malloc'd segment
+    return event_record;
 }
 
-void emit_event_alignment_tsv(FILE* fp,
-                              const SquiggleRead& sr,
-                              uint32_t strand_idx,
-                              const EventAlignmentParameters& params,
-                              const std::vector<EventAlignment>& alignments)
+// Add the records of the alignment of one strand of the read to the block
+void append_event_alignment_records(EventalignBlock& block,
+                                    const SquiggleRead& sr,
+                                    uint32_t strand_idx,
+                                    const EventAlignmentParameters& params,
+                                    const std::vector<EventAlignment>& alignments)
 {
     uint32_t k = sr.pore_model[strand_idx].k;
+    assert(block.records.empty() || block.k == k);
+    block.k = k;
+
     for(size_t i = 0; i < alignments.size(); ++i) {
 
         const EventAlignment& ea = alignments[i];
+        EventalignRecord record;
 
         // basic information
-        if (not opt::print_read_names)
-        {
-            fprintf(fp, "%s\t%d\t%s\t%zu\t%c\t",
-                    ea.ref_name.c_str(),
-                    ea.ref_position,
-                    ea.ref_kmer.c_str(),
-                    ea.read_idx,
-                    "tc"[ea.strand_idx]);
-        }
-        else
-        {
-            fprintf(fp, "%s\t%d\t%s\t%s\t%c\t",
-                    ea.ref_name.c_str(),
-                    ea.ref_position,
-                    ea.ref_kmer.c_str(),
-                    sr.read_name.c_str(),
-                    "tc"[ea.strand_idx]);
-        }
+        record.ref_position = ea.ref_position;
+        record.ref_kmer_rank = params.alphabet->kmer_rank(ea.ref_kmer.c_str(), k);
+        record.strand_idx = ea.strand_idx;
+        record.event_idx = ea.event_idx;
 
         // event information
         float event_mean = sr.get_drift_corrected_level(ea.event_idx, ea.strand_idx);
@@ -426,24 +460,54 @@ void emit_event_alignment_tsv(FILE* fp,
         }
 
         float standard_level = (event_mean - model_mean) / (sqrt(sr.pore_model[ea.strand_idx].var) * model_stdv);
-        fprintf(fp, "%d\t%.2lf\t%.3lf\t%.5lf\t", ea.event_idx, event_mean, event_stdv, event_duration);
-        fprintf(fp, "%s\t%.2lf\t%.2lf\t%.2lf", ea.model_kmer.c_str(),
-                                               model_mean,
-                                               model_stdv,
-                                               standard_level);
-
+        record.event_level_mean = event_mean;
+        record.event_stdv = event_stdv;
+        record.event_length = event_duration;
+        record.model_kmer_rank = ea.hmm_state != 'B' ? rank : EVENTALIGN_NO_KMER;
+        record.model_mean = model_mean;
+        record.model_stdv = model_stdv;
+        record.standardized_level = standard_level;
+
+        record.samples_start = block.samples.size();
+        record.num_samples = 0;
         if(opt::write_samples) {
             std::vector<float> samples = sr.get_scaled_samples_for_event(ea.strand_idx, ea.event_idx);
-            std::stringstream sample_ss;
-            std::copy(samples.begin(), samples.end(), std::ostream_iterator<float>(sample_ss, ","));
-
-            // remove training comma
-            std::string sample_str = sample_ss.str();
-            sample_str.resize(sample_str.size() - 1);
-            fprintf(fp, "\t%s", sample_str.c_str());
+            block.samples.insert(block.samples.end(), samples.begin(), samples.end());
+            record.num_samples = samples.size();
         }
-        fprintf(fp, "\n");
+        block.records.push_back(record);
+    }
+}
+
+void format_event_alignment_tsv(std::string& out,
+                                const SquiggleRead& sr,
+                                uint32_t strand_idx,
+                                const EventAlignmentParameters& params,
+                                const std::vector<EventAlignment>& alignments)
+{
+    if(alignments.empty()) {
+        return;
     }
+
+    EventalignBlock block;
+    block.read_idx = alignments.front().read_idx;
+    block.read_name = sr.read_name;
+    append_event_alignment_records(block, sr, strand_idx, params, alignments);
+
+    EventalignFileHeader header = make_eventalign_header(NULL);
+    header.alphabet = params.alphabet;
+    format_eventalign_block_tsv(out, header, alignments.front().ref_name.c_str(), block);
+}
+
+void emit_event_alignment_tsv(FILE* fp,
+                              const SquiggleRead& sr,
+                              uint32_t strand_idx,
+                              const EventAlignmentParameters& params,
+                              const std::vector<EventAlignment>& alignments)
+{
+    std::string out;
+    format_event_alignment_tsv(out, sr, strand_idx, params, alignments);
+    fwrite(out.data(), 1, out.size(), fp);
 }
 
 EventalignSummary summarize_alignment(const SquiggleRead& sr,
@@ -499,9 +563,10 @@ EventalignSummary summarize_alignment(const SquiggleRead& sr,
     return summary;
 }
 
-// Realign the read in event space
-void realign_read(EventalignWriter writer,
-                  const Fast5Map& name_map, 
+// Realign the read in event space and format the output into chunk
+void realign_read(EventalignChunk& chunk,
+                  const EventalignFileHeader& header,
+                  SquiggleRead& sr,
                   const faidx_t* fai, 
                   const bam_hdr_t* hdr, 
                   const bam1_t* record, 
@@ -509,12 +574,7 @@ void realign_read(EventalignWriter writer,
                   int region_start,
                   int region_end)
 {
-    // Load a squiggle read for the mapped read
     std::string read_name = bam_get_qname(record);
-    std::string fast5_path = name_map.get_path(read_name);
-
-    // load read
-    SquiggleRead sr(read_name, fast5_path, opt::write_samples ? SRF_LOAD_RAW_SAMPLES : 0);
 
     if(!opt::alternative_model_type.empty()) {
         sr.replace_models(opt::alternative_model_type);
@@ -525,6 +585,12 @@ void realign_read(EventalignWriter writer,
                 read_name.c_str(), sr.events[0].size(), sr.events[1].size());
     }
     
+    // the tsv and binary tables are made from the records of both strands
+    EventalignBlock block;
+    block.read_idx = read_idx;
+    block.read_name = read_name;
+    block.contig_id = record->core.tid;
+
     for(int strand_idx = 0; strand_idx < 2; ++strand_idx) {
         
         // Do not align this strand if it was not sequenced
@@ -542,83 +608,117 @@ void realign_read(EventalignWriter writer,
         params.read_idx = read_idx;
         params.region_start = region_start;
         params.region_end = region_end;
+        params.chunk_size = opt::chunk_size;
 
         std::vector<EventAlignment> alignment = align_read_to_ref(params);
 
         EventalignSummary summary;
-        if(writer.summary_fp != NULL) {
+        if(!opt::summary_file.empty()) {
             summary = summarize_alignment(sr, strand_idx, params, alignment);
         }
 
-        // write to disk
-        #pragma omp critical
-        {
-            if(opt::output_sam) {
-                emit_event_alignment_sam(writer.sam_fp, sr, hdr, record, alignment);
-            } else {
-                emit_event_alignment_tsv(writer.tsv_fp, sr, strand_idx, params, alignment);
+        if(opt::output_sam) {
+            bam1_t* event_record = make_event_alignment_sam_record(sr, record, alignment);
+            if(event_record != NULL) {
+                chunk.sam_records.push_back(event_record);
             }
+        } else {
+            append_event_alignment_records(block, sr, strand_idx, params, alignment);
+        }
 
-            if(writer.summary_fp != NULL && summary.num_events > 0) {
+        if(!opt::summary_file.empty() && summary.num_events > 0) {
 
-                PoreModel& pore_model = sr.pore_model[strand_idx];
-                fprintf(writer.summary_fp, "%zu\t%s\t%s\t", read_idx, read_name.c_str(), sr.fast5_path.c_str());
-                fprintf(writer.summary_fp, "%s\t%s\t", pore_model.name.c_str(), strand_idx == 0 ? "template" : "complement");
-                fprintf(writer.summary_fp, "%d\t%d\t%d\t%d\t", summary.num_events, summary.num_matches, summary.num_skips, summary.num_stays);
-                fprintf(writer.summary_fp, "%.2lf\t%.3lf\t%.3lf\t%.3lf\t%.3lf\n", summary.sum_duration, pore_model.shift, pore_model.scale, pore_model.drift, pore_model.var);
-            }
+            PoreModel& pore_model = sr.pore_model[strand_idx];
+            append_printf(chunk.summary, "%zu\t%s\t%s\t", read_idx, read_name.c_str(), sr.fast5_path.c_str());
+            append_printf(chunk.summary, "%s\t%s\t", pore_model.name.c_str(), strand_idx == 0 ? "template" : "complement");
+            append_printf(chunk.summary, "%d\t%d\t%d\t%d\t", summary.num_events, summary.num_matches, summary.num_skips, summary.num_stays);
+            append_printf(chunk.summary, "%.2lf\t%.3lf\t%.3lf\t%.3lf\t%.3lf\n", summary.sum_duration, pore_model.shift, pore_model.scale, pore_model.drift, pore_model.var);
         }
     }
+
+    if(block.records.empty()) {
+        return;
+    }
+
+    if(opt::format == "binary") {
+        encode_eventalign_block(chunk.binary, header, block, chunk.index_entry);
+    } else {
+        format_eventalign_block_tsv(chunk.tsv, header, hdr->target_name[block.contig_id], block);
+    }
 }
 
-std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& params)
+// Write the chunks of every read as they are finished, on a dedicated thread
+void write_eventalign_chunks(EventalignWriter writer, const bam_hdr_t* hdr, OutputQueue<EventalignChunk>* queue)
 {
-    // Sanity check input parameters
-    assert(params.sr != NULL);
-    assert(params.fai != NULL);
-    assert(params.hdr != NULL);
-    assert(params.record != NULL);
-    assert(params.strand_idx < NUM_STRANDS);
-    assert( (params.region_start == -1 && params.region_end == -1) || (params.region_start <= params.region_end));
-
-    std::vector<EventAlignment> alignment_output;
+    EventalignChunk chunk;
+    while(queue->pop(chunk)) {
+        if(writer.tsv_fp != NULL) {
+            fwrite(chunk.tsv.data(), 1, chunk.tsv.size(), writer.tsv_fp);
+        }
 
-    // Extract the reference subsequence for the entire alignment
-    int fetched_len = 0;
-    int ref_offset = params.record->core.pos;
-    std::string ref_name(params.hdr->target_name[params.record->core.tid]);
-    std::string ref_seq = get_reference_region_ts(params.fai, ref_name.c_str(), ref_offset, 
-                                                  bam_endpos(params.record), &fetched_len);
+        if(writer.binary_writer != NULL && !chunk.binary.empty()) {
+            writer.binary_writer->write_block(chunk.binary, chunk.index_entry);
+        }
 
-    // k from read pore model
-    const uint32_t k = params.sr->pore_model[params.strand_idx].k;
+        for(size_t i = 0; i < chunk.sam_records.size(); ++i) {
+            sam_write1(writer.sam_fp, hdr, chunk.sam_records[i]);
+            bam_destroy1(chunk.sam_records[i]);
+        }
+        chunk.sam_records.clear();
 
-    // If the reference sequence contains ambiguity codes
-    // switch them to the lexicographically lowest base
-    ref_seq = params.alphabet->disambiguate(ref_seq);
-    std::string rc_ref_seq = params.alphabet->reverse_complement(ref_seq);
+        if(writer.summary_fp != NULL) {
+            fwrite(chunk.summary.data(), 1, chunk.summary.size(), writer.summary_fp);
+        }
+    }
+}
 
-    if(ref_offset == 0)
-        return alignment_output;
+// Build a band for the HMM around the events the bam aligns to the
+// bases of a segment, aligned_pairs[first_pair_idx] to aligned_pairs[last_pair_idx]
+static HMMBand make_segment_band(const EventAlignmentParameters& params,
+                                 const std::vector<AlignedPair>& aligned_pairs,
+                                 int first_pair_idx,
+                                 int last_pair_idx,
+                                 int segment_start_ref,
+                                 const HMMInputData& input,
+                                 uint32_t num_kmers,
+                                 uint32_t width)
+{
+    uint32_t num_events = abs((int)input.event_stop_idx - (int)input.event_start_idx) + 1;
 
-    // Make a vector of aligned (ref_pos, read_pos) pairs
-    std::vector<AlignedPair> aligned_pairs = get_aligned_pairs(params.record);
+    std::vector<HMMBandAnchor> anchors;
+    for(int pi = std::max(first_pair_idx, 0); pi <= last_pair_idx; ++pi) {
+        int read_kidx = aligned_pairs[pi].read_pos;
+        if(bam_is_rev(params.record)) {
+            read_kidx = params.sr->flip_k_strand(read_kidx);
+        }
 
-    if(params.region_start != -1 && params.region_end != -1) {
-        trim_aligned_pairs_to_ref_region(aligned_pairs, params.region_start, params.region_end);
+        int event_idx = params.sr->get_closest_event_to(read_kidx, params.strand_idx);
+        int event_offset = (event_idx - (int)input.event_start_idx) * input.event_stride;
+        int kmer_idx = aligned_pairs[pi].ref_pos - segment_start_ref;
+        if(event_offset >= 0 && kmer_idx >= 0) {
+            anchors.push_back({ (uint32_t)event_offset, (uint32_t)kmer_idx });
+        }
     }
+    return make_anchored_band(anchors, num_events, num_kmers, width);
+}
 
-    // Trim the aligned pairs to be within the range of the maximum kmer index
-    int max_kmer_idx = params.sr->read_sequence.size() - k;
-    trim_aligned_pairs_to_kmer(aligned_pairs, max_kmer_idx);
-
-    if(aligned_pairs.empty())
-        return alignment_output;
+// Align the events of the read to the reference between the first and last aligned pairs,
+// walking along the reference align_stride bases at a time
+static std::vector<EventAlignment> align_pairs_to_events(const EventAlignmentParameters& params,
+                                                         const std::string& ref_name,
+                                                         const std::string& ref_seq,
+                                                         const std::string& rc_ref_seq,
+                                                         int ref_offset,
+                                                         const std::vector<AlignedPair>& aligned_pairs)
+{
+    std::vector<EventAlignment> alignment_output;
+    const uint32_t k = params.sr->pore_model[params.strand_idx].k;
 
     bool do_base_rc = bam_is_rev(params.record);
     bool rc_flags[2] = { do_base_rc, !do_base_rc }; // indexed by strand
     const int align_stride = 100; // approximately how many reference bases to align to at once
     const int output_stride = 50; // approximately how many event alignments to output at once
+    const uint32_t band_width = 50; // how many k-mers around the bam's alignment the HMM considers
 
     // get the event range of the read to re-align
     int read_kidx_start = aligned_pairs.front().read_pos;
@@ -686,7 +786,16 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
         input.event_stride = input.event_start_idx < input.event_stop_idx ? 1 : -1;
         input.rc = rc_flags[params.strand_idx];
 
-        std::vector<HMMAlignmentState> event_alignment = profile_hmm_align(hmm_sequence, input);
+        // Only fill the matrix around the bam's alignment of the segment. If the
+        // best path reaches the edge of the band it may have been cut off so the
+        // segment is aligned again with the full matrix.
+        HMMBand band = make_segment_band(params, aligned_pairs, curr_pair_idx, end_pair_idx, curr_start_ref,
+                                         input, hmm_sequence.length() - k + 1, band_width);
+        bool hit_band_edge = false;
+        std::vector<HMMAlignmentState> event_alignment = profile_hmm_align_banded(hmm_sequence, input, band, 0, &hit_band_edge);
+        if(hit_band_edge) {
+            event_alignment = profile_hmm_align(hmm_sequence, input);
+        }
         
         // Output alignment
         size_t num_output = 0;
@@ -736,6 +845,7 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
 
                 // hmm
                 ea.hmm_state = as.state;
+                ea.l_event = as.l_fm - (event_align_idx > 0 ? event_alignment[event_align_idx - 1].l_fm : 0.0);
 
                 if(ea.hmm_state != 'B') {
                     ea.model_kmer = hmm_sequence.get_kmer(as.kmer_idx, k, input.rc);
@@ -774,6 +884,169 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
     return alignment_output;
 }
 
+// Append the alignment of the next chunk of the read to out. The chunks overlap by
+// flank bases on either side of boundary. The alignments are joined at the 'M'
+// state in the overlap that both chunks aligned identically and that the less
+// confident of the two chunks gave the highest l_event. Ties, including alignments
+// without l_event, go to the match closest to the boundary, which is the point
+// furthest from the ends of both alignments.
+void stitch_chunk_alignment(std::vector<EventAlignment>& out,
+                            const std::vector<EventAlignment>& next,
+                            int boundary,
+                            int flank)
+{
+    if(next.empty()) {
+        return;
+    } else if(out.empty()) {
+        out = next;
+        return;
+    }
+
+    // the match states of out in the overlap, by event
+    std::map<int, size_t> out_matches;
+    for(size_t i = out.size(); i > 0 && out[i - 1].ref_position >= boundary - flank; --i) {
+        if(out[i - 1].hmm_state == 'M') {
+            out_matches[out[i - 1].event_idx] = i - 1;
+        }
+    }
+
+    int best_distance = -1;
+    double best_l_event = -INFINITY;
+    size_t best_out_idx = 0;
+    size_t best_next_idx = 0;
+    for(size_t j = 0; j < next.size() && next[j].ref_position <= boundary + flank; ++j) {
+        if(next[j].hmm_state != 'M') {
+            continue;
+        }
+
+        std::map<int, size_t>::const_iterator iter = out_matches.find(next[j].event_idx);
+        if(iter != out_matches.end() && out[iter->second].ref_position == next[j].ref_position) {
+            double l_event = std::min(out[iter->second].l_event, next[j].l_event);
+            int distance = abs(next[j].ref_position - boundary);
+            if(best_distance == -1 || l_event > best_l_event ||
+               (l_event == best_l_event && distance < best_distance)) {
+                best_l_event = l_event;
+                best_distance = distance;
+                best_out_idx = iter->second;
+                best_next_idx = j;
+            }
+        }
+    }
+
+    if(best_distance != -1) {
+        out.resize(best_out_idx + 1);
+        out.insert(out.end(), next.begin() + best_next_idx + 1, next.end());
+        return;
+    }
+
+    // The alignments never agree on a match in the overlap. Join them at the last
+    // alignment of out before the boundary that next continues from with the following event.
+    std::map<int, size_t> next_by_event;
+    for(size_t j = 0; j < next.size() && next[j].ref_position <= boundary + flank; ++j) {
+        next_by_event[next[j].event_idx] = j;
+    }
+
+    int stride = out.front().event_idx <= next.back().event_idx ? 1 : -1;
+    for(size_t i = out.size(); i > 0 && out[i - 1].ref_position >= boundary - flank; --i) {
+        const EventAlignment& last = out[i - 1];
+        std::map<int, size_t>::const_iterator iter = next_by_event.find(last.event_idx + stride);
+        if(last.ref_position < boundary && iter != next_by_event.end() && next[iter->second].ref_position >= last.ref_position) {
+            out.resize(i);
+            out.insert(out.end(), next.begin() + iter->second, next.end());
+            return;
+        }
+    }
+
+    // Like the serial walk when a segment fails, the alignment of the read ends here.
+    // The later chunks can not be joined either as they do not overlap out.
+}
+
+std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& params)
+{
+    // Sanity check input parameters
+    assert(params.sr != NULL);
+    assert(params.fai != NULL);
+    assert(params.hdr != NULL);
+    assert(params.record != NULL);
+    assert(params.strand_idx < NUM_STRANDS);
+    assert( (params.region_start == -1 && params.region_end == -1) || (params.region_start <= params.region_end));
+
+    std::vector<EventAlignment> alignment_output;
+
+    // Extract the reference subsequence for the entire alignment
+    int fetched_len = 0;
+    int ref_offset = params.record->core.pos;
+    std::string ref_name(params.hdr->target_name[params.record->core.tid]);
+    std::string ref_seq = get_reference_region_ts(params.fai, ref_name.c_str(), ref_offset, 
+                                                  bam_endpos(params.record), &fetched_len);
+
+    // k from read pore model
+    const uint32_t k = params.sr->pore_model[params.strand_idx].k;
+
+    // If the reference sequence contains ambiguity codes
+    // switch them to the lexicographically lowest base
+    ref_seq = params.alphabet->disambiguate(ref_seq);
+    std::string rc_ref_seq = params.alphabet->reverse_complement(ref_seq);
+
+    if(ref_offset == 0)
+        return alignment_output;
+
+    // Make a vector of aligned (ref_pos, read_pos) pairs
+    std::vector<AlignedPair> aligned_pairs = get_aligned_pairs(params.record);
+
+    if(params.region_start != -1 && params.region_end != -1) {
+        trim_aligned_pairs_to_ref_region(aligned_pairs, params.region_start, params.region_end);
+    }
+
+    // Trim the aligned pairs to be within the range of the maximum kmer index
+    int max_kmer_idx = params.sr->read_sequence.size() - k;
+    trim_aligned_pairs_to_kmer(aligned_pairs, max_kmer_idx);
+
+    if(aligned_pairs.empty())
+        return alignment_output;
+
+    assert(params.chunk_size <= 0 || params.chunk_size >= 2 * EVENTALIGN_CHUNK_FLANK);
+    if(params.chunk_size <= 0 || aligned_pairs.back().ref_pos - aligned_pairs.front().ref_pos < 2 * params.chunk_size) {
+        return align_pairs_to_events(params, ref_name, ref_seq, rc_ref_seq, ref_offset, aligned_pairs);
+    }
+
+    // Split the alignment into chunks of chunk_size reference bases, extended by
+    // chunk_flank bases on both sides, that are aligned independently. The walk
+    // of each chunk starts at the event the bam aligns to its first base.
+    const int chunk_flank = EVENTALIGN_CHUNK_FLANK;
+    int first_ref = aligned_pairs.front().ref_pos;
+    int num_chunks = (aligned_pairs.back().ref_pos - first_ref) / params.chunk_size;
+    std::vector< std::vector<EventAlignment> > chunk_alignments(num_chunks);
+
+    for(int ci = 0; ci < num_chunks; ++ci) {
+
+        // the last chunk takes the remainder
+        int chunk_start = ci == 0 ? first_ref : first_ref + ci * params.chunk_size - chunk_flank;
+        int chunk_end = ci == num_chunks - 1 ? aligned_pairs.back().ref_pos : first_ref + (ci + 1) * params.chunk_size + chunk_flank;
+
+        std::vector<AlignedPair>::const_iterator pair_start =
+            std::lower_bound(aligned_pairs.begin(), aligned_pairs.end(), chunk_start, AlignedPairRefLBComp());
+        std::vector<AlignedPair>::const_iterator pair_end =
+            std::upper_bound(aligned_pairs.begin(), aligned_pairs.end(), chunk_end, AlignedPairRefUBComp());
+
+        // Other threads of the team run the chunks as they become free, including the
+        // threads that have no reads left. Runs inline when not in a parallel region.
+        #pragma omp task default(shared) firstprivate(ci, pair_start, pair_end)
+        {
+            std::vector<AlignedPair> chunk_pairs(pair_start, pair_end);
+            if(!chunk_pairs.empty()) {
+                chunk_alignments[ci] = align_pairs_to_events(params, ref_name, ref_seq, rc_ref_seq, ref_offset, chunk_pairs);
+            }
+        }
+    }
+    #pragma omp taskwait
+
+    for(int ci = 0; ci < num_chunks; ++ci) {
+        stitch_chunk_alignment(alignment_output, chunk_alignments[ci], first_ref + ci * params.chunk_size, chunk_flank);
+    }
+    return alignment_output;
+}
+
 void parse_eventalign_options(int argc, char** argv)
 {
     bool die = false;
@@ -794,7 +1067,10 @@ void parse_eventalign_options(int argc, char** argv)
             case OPT_SCALE_EVENTS: opt::scale_events = true; break;
             case OPT_SUMMARY: arg >> opt::summary_file; break;
             case OPT_SAM: opt::output_sam = true; break;
+            case OPT_FORMAT: arg >> opt::format; break;
             case OPT_PROGRESS: opt::progress = true; break;
+            case OPT_ORDERED: opt::ordered = true; break;
+            case OPT_CHUNK_SIZE: arg >> opt::chunk_size; break;
             case OPT_HELP:
                 std::cout << EVENTALIGN_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -818,6 +1094,22 @@ void parse_eventalign_options(int argc, char** argv)
         die = true;
     }
 
+    if(opt::chunk_size < 0) {
+        std::cerr << SUBPROGRAM ": invalid chunk size: " << opt::chunk_size << "\n";
+        die = true;
+    } else if(opt::chunk_size > 0 && opt::chunk_size < 2 * EVENTALIGN_CHUNK_FLANK) {
+        std::cerr << SUBPROGRAM ": the chunk size must be 0 or at least " << 2 * EVENTALIGN_CHUNK_FLANK << ": " << opt::chunk_size << "\n";
+        die = true;
+    }
+
+    if(opt::format != "tsv" && opt::format != "binary") {
+        std::cerr << SUBPROGRAM ": unknown --format: " << opt::format << "\n";
+        die = true;
+    } else if(opt::format == "binary" && opt::output_sam) {
+        std::cerr << SUBPROGRAM ": --format=binary can not be used with --sam\n";
+        die = true;
+    }
+
     if(opt::reads_file.empty()) {
         std::cerr << SUBPROGRAM ": a --reads file must be provided\n";
         die = true;
@@ -856,55 +1148,31 @@ int eventalign_main(int argc, char** argv)
     Fast5Map name_map(opt::reads_file);
     
     // Open the BAM and iterate over reads
+    ReadPipeline pipeline(opt::bam_file, opt::region, name_map,
+                          opt::write_samples ? SRF_LOAD_RAW_SAMPLES : 0, opt::num_threads);
+    pipeline.set_show_progress(opt::progress);
+    pipeline.set_in_order(opt::ordered);
+    const bam_hdr_t* hdr = pipeline.get_bam_header();
 
-    // load bam file
-    htsFile* bam_fh = sam_open(opt::bam_file.c_str(), "r");
-    assert(bam_fh != NULL);
-
-    // load bam index file
-    std::string index_filename = opt::bam_file + ".bai";
-    hts_idx_t* bam_idx = bam_index_load(index_filename.c_str());
-    assert(bam_idx != NULL);
-
-    // read the bam header
-    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
-    
     // load reference fai file
     faidx_t *fai = fai_load(opt::genome_file.c_str());
 
-    hts_itr_t* itr;
-
     // If processing a region of the genome, only emit events aligned to this window
-    int clip_start = -1;
-    int clip_end = -1;
-
-    if(opt::region.empty()) {
-        // TODO: is this valid?
-        itr = sam_itr_queryi(bam_idx, HTS_IDX_START, 0, 0);
-    } else {
-
-        fprintf(stderr, "Region: %s\n", opt::region.c_str());
-        itr = sam_itr_querys(bam_idx, hdr, opt::region.c_str());
-        hts_parse_reg(opt::region.c_str(), &clip_start, &clip_end);
-    }
-
-#ifndef H5_HAVE_THREADSAFE
-    if(opt::num_threads > 1) {
-        fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
-        fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
-        exit(1);
-    }
-#endif
+    int clip_start = pipeline.get_region_start();
+    int clip_end = pipeline.get_region_end();
 
     // Initialize output
-    EventalignWriter writer = { NULL, NULL, NULL };
+    EventalignWriter writer = { NULL, NULL, NULL, NULL };
+    EventalignFileHeader header = make_eventalign_header(hdr);
 
     if(opt::output_sam) {
         writer.sam_fp = hts_open("-", "w");
         emit_sam_header(writer.sam_fp, hdr);
+    } else if(opt::format == "binary") {
+        writer.binary_writer = new EventalignBinaryWriter(stdout, header);
     } else {
         writer.tsv_fp = stdout;
-        emit_tsv_header(writer.tsv_fp);
+        emit_tsv_header(writer.tsv_fp, header);
     }
 
     if(!opt::summary_file.empty()) {
@@ -913,63 +1181,40 @@ int eventalign_main(int argc, char** argv)
         fprintf(writer.summary_fp, "read_index\tread_name\tfast5_path\tmodel_name\tstrand\tnum_events\t");
         fprintf(writer.summary_fp, "num_matches\tnum_skips\tnum_stays\ttotal_duration\tshift\tscale\tdrift\tvar\n");
     }
-    
-    // Initialize iteration
-    std::vector<bam1_t*> records(opt::batch_size, NULL);
-    for(size_t i = 0; i < records.size(); ++i) {
-        records[i] = bam_init1();
-    }
 
-    int result;
-    size_t num_reads_realigned = 0;
-    size_t num_records_buffered = 0;
-    Progress progress("[eventalign]");
+    // The workers format the output of each read and hand it to a writer
+    // thread, so they never wait for each other to write. The number of
+    // reads that can be waiting to be written is bounded to limit memory use.
+    OutputQueue<EventalignChunk> output_queue(std::max(16, 4 * opt::num_threads), opt::ordered);
+    std::thread writer_thread(write_eventalign_chunks, writer, hdr, &output_queue);
 
-    do {
-        assert(num_records_buffered < records.size());
-        
-        // read a record into the next slot in the buffer
-        result = sam_itr_next(bam_fh, itr, records[num_records_buffered]);
-        num_records_buffered += result >= 0;
-
-        // realign if we've hit the max buffer size or reached the end of file
-        if(num_records_buffered == records.size() || result < 0) {
-            #pragma omp parallel for            
-            for(size_t i = 0; i < num_records_buffered; ++i) {
-                bam1_t* record = records[i];
-                size_t read_idx = num_reads_realigned + i;
-                if( (record->core.flag & BAM_FUNMAP) == 0) {
-                    realign_read(writer, name_map, fai, hdr, record, read_idx, clip_start, clip_end);
-                }
-            }
-
-            num_reads_realigned += num_records_buffered;
-            num_records_buffered = 0;
-        }
+    // With --ordered the pipeline starts the reads in order, so the
+    // read that is next to be written is always being worked on
+    pipeline.run([&](const bam1_t* record, size_t read_idx, SquiggleRead* sr) {
 
-        if(opt::progress) {
-            fprintf(stderr, "Realigned %zu reads in %.1lfs\r", num_reads_realigned, progress.get_elapsed_seconds());
+        // unmapped reads have an empty chunk to keep the order
+        EventalignChunk chunk;
+        if(sr != NULL) {
+            realign_read(chunk, header, *sr, fai, hdr, record, read_idx, clip_start, clip_end);
         }
-    } while(result >= 0);
- 
-    assert(num_records_buffered == 0);
+        output_queue.push(read_idx, chunk);
+    });
 
-    // cleanup records
-    for(size_t i = 0; i < records.size(); ++i) {
-        bam_destroy1(records[i]);
-    }
+    output_queue.close();
+    writer_thread.join();
 
     // cleanup
-    sam_itr_destroy(itr);
-    bam_hdr_destroy(hdr);
     fai_destroy(fai);
-    sam_close(bam_fh);
-    hts_idx_destroy(bam_idx);
 
     if(writer.sam_fp != NULL) {
         hts_close(writer.sam_fp);
     }
 
+    if(writer.binary_writer != NULL) {
+        writer.binary_writer->close();
+        delete writer.binary_writer;
+    }
+
     if(writer.summary_fp != NULL) {
         fclose(writer.summary_fp);
     }
@@ -14,6 +14,10 @@
 #include "nanopolish_alphabet.h"
 #include "nanopolish_common.h"
 
+// The chunks of a read aligned in parallel overlap by this many reference
+// bases on either side of their boundaries, see EventAlignmentParameters
+static const int EVENTALIGN_CHUNK_FLANK = 200;
+
 //
 // Structs
 //
@@ -31,6 +35,7 @@ struct EventAlignmentParameters
         read_idx = -1;
         region_start = -1;
         region_end = -1;
+        chunk_size = 0;
     }
 
     // Mandatory
@@ -45,6 +50,11 @@ struct EventAlignmentParameters
     int read_idx;
     int region_start;
     int region_end;
+
+    // align the read in independent chunks of this many reference
+    // bases in parallel, 0 to align it in a single pass. Must be
+    // at least 2 * EVENTALIGN_CHUNK_FLANK when not 0.
+    int chunk_size;
 };
 
 struct EventAlignment
@@ -63,6 +73,7 @@ struct EventAlignment
     // hmm data
     std::string model_kmer;
     char hmm_state;
+    double l_event; // log-likelihood the hmm path gained with this event, -INFINITY if not computed
 };
 
 // Entry point from nanopolish.cpp
@@ -75,9 +86,23 @@ void emit_event_alignment_tsv(FILE* fp,
                               const EventAlignmentParameters& params,
                               const std::vector<EventAlignment>& alignments);
 
+// append the same table to a string
+void format_event_alignment_tsv(std::string& out,
+                                const SquiggleRead& sr,
+                                uint32_t strand_idx,
+                                const EventAlignmentParameters& params,
+                                const std::vector<EventAlignment>& alignments);
+
 // The main function to realign a read
 std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& params);
 
+// Append the alignment of the next chunk of a read to out. The chunks overlap
+// by flank reference bases on either side of boundary.
+void stitch_chunk_alignment(std::vector<EventAlignment>& out,
+                            const std::vector<EventAlignment>& next,
+                            int boundary,
+                            int flank);
+
 // get the specified reference region, threadsafe
 std::string get_reference_region_ts(const faidx_t* fai, const char* ref_name, int start, int end, int* fetched_len);
 
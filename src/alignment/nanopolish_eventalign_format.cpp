@@ -0,0 +1,674 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_eventalign_format -- the event alignment table
+// and its tsv and binary encodings
+//
+// The binary file is little-endian and laid out as
+//
+//   "NPEA" version:u32 flags:u32 alphabet:str num_contigs:u32 contig:str...
+//   'B' compressed_size:u32 size:u32 zlib(block)    one per read
+//   ...
+//   'I' num_entries:u32 (offset:u64 contig:u32 start:i32 end:i32)...
+//   index_offset:u64 "NPEI"
+//
+// where a str is its length as a u32 followed by its characters. The
+// block stores its records column by column so each column compresses
+// well on its own:
+//
+//   read_idx read_name contig k num_records      varints, the name after its length
+//   strand                                       a byte per record
+//   ref_position, event_idx                      zigzag varints of the difference to the previous record
+//   ref_kmer, model_kmer                         rank + 1 (0 for no k-mer) in the fewest bytes that fit
+//   6 float columns                              32 bits each
+//   num_samples, samples                         if the header has the samples flag
+//
+// The fixed width columns are stored byte plane by byte plane, the
+// lowest byte of every value first, which puts the bytes that rarely
+// change next to each other. The floats are stored exactly so the tsv
+// converted from the binary file is identical to the tsv eventalign writes.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sstream>
+#include <algorithm>
+#include <zlib.h>
+#include "nanopolish_eventalign_format.h"
+#include "nanopolish_text_format.h"
+
+#define EVENTALIGN_MAGIC "NPEA"
+#define EVENTALIGN_INDEX_MAGIC "NPEI"
+#define EVENTALIGN_VERSION 1
+
+#define EVENTALIGN_FLAG_READ_NAMES 1
+#define EVENTALIGN_FLAG_SAMPLES 2
+
+#define EVENTALIGN_BLOCK_TAG 'B'
+#define EVENTALIGN_INDEX_TAG 'I'
+
+// 'I', num_entries
+#define EVENTALIGN_INDEX_HEADER_SIZE 5
+#define EVENTALIGN_INDEX_ENTRY_SIZE 20
+#define EVENTALIGN_TRAILER_SIZE 12
+
+//
+// TSV
+//
+void format_eventalign_tsv_header(std::string& out, const EventalignFileHeader& header)
+{
+    out.append("contig\tposition\treference_kmer\t");
+    out.append(header.print_read_names ? "read_name" : "read_index");
+    out.append("\tstrand\tevent_index\tevent_level_mean\tevent_stdv\tevent_length\t");
+    out.append("model_kmer\tmodel_mean\tmodel_stdv\tstandardized_level");
+
+    if(header.write_samples) {
+        out.append("\tsamples");
+    }
+    out.push_back('\n');
+}
+
+// Append the k-mer with the given rank
+static void append_kmer(std::string& out, const Alphabet* alphabet, uint32_t rank, uint32_t k)
+{
+    size_t n = out.size();
+    out.resize(n + k);
+    for(uint32_t i = 0; i < k; ++i) {
+        if(rank == EVENTALIGN_NO_KMER) {
+            out[n + k - i - 1] = 'N';
+        } else {
+            out[n + k - i - 1] = alphabet->base(rank % alphabet->size());
+            rank /= alphabet->size();
+        }
+    }
+}
+
+void format_eventalign_record_tsv(std::string& out,
+                                  const EventalignFileHeader& header,
+                                  const char* contig_name,
+                                  const EventalignBlock& block,
+                                  size_t record_idx)
+{
+    const EventalignRecord& record = block.records[record_idx];
+
+    out.append(contig_name);
+    out.push_back('\t');
+    append_int(out, record.ref_position);
+    out.push_back('\t');
+    append_kmer(out, header.alphabet, record.ref_kmer_rank, block.k);
+    out.push_back('\t');
+    if(!header.print_read_names) {
+        append_uint(out, block.read_idx);
+    } else {
+        out.append(block.read_name);
+    }
+    out.push_back('\t');
+    out.push_back("tc"[record.strand_idx]);
+    out.push_back('\t');
+
+    append_int(out, record.event_idx);
+    out.push_back('\t');
+    append_fixed(out, record.event_level_mean, 2);
+    out.push_back('\t');
+    append_fixed(out, record.event_stdv, 3);
+    out.push_back('\t');
+    append_fixed(out, record.event_length, 5);
+    out.push_back('\t');
+    append_kmer(out, header.alphabet, record.model_kmer_rank, block.k);
+    out.push_back('\t');
+    append_fixed(out, record.model_mean, 2);
+    out.push_back('\t');
+    append_fixed(out, record.model_stdv, 2);
+    out.push_back('\t');
+    append_fixed(out, record.standardized_level, 2);
+
+    if(header.write_samples) {
+        std::stringstream sample_ss;
+        for(uint32_t i = 0; i < record.num_samples; ++i) {
+            if(i > 0) {
+                sample_ss << ',';
+            }
+            sample_ss << block.samples[record.samples_start + i];
+        }
+        out.push_back('\t');
+        out.append(sample_ss.str());
+    }
+    out.push_back('\n');
+}
+
+void format_eventalign_block_tsv(std::string& out,
+                                 const EventalignFileHeader& header,
+                                 const char* contig_name,
+                                 const EventalignBlock& block)
+{
+    for(size_t i = 0; i < block.records.size(); ++i) {
+        format_eventalign_record_tsv(out, header, contig_name, block, i);
+    }
+}
+
+//
+// Binary encoding
+//
+static void put_u32(std::string& out, uint32_t v)
+{
+    for(int i = 0; i < 4; ++i) {
+        out.push_back((char)(v >> (8 * i)));
+    }
+}
+
+static void put_u64(std::string& out, uint64_t v)
+{
+    for(int i = 0; i < 8; ++i) {
+        out.push_back((char)(v >> (8 * i)));
+    }
+}
+
+static void put_str(std::string& out, const std::string& s)
+{
+    put_u32(out, s.size());
+    out.append(s);
+}
+
+static void put_varint(std::string& out, uint64_t v)
+{
+    while(v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+// small differences of either sign become small varints
+static void put_zigzag(std::string& out, int64_t v)
+{
+    put_varint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void put_planes(std::string& out, const std::vector<uint32_t>& values, int width)
+{
+    for(int b = 0; b < width; ++b) {
+        for(size_t i = 0; i < values.size(); ++i) {
+            out.push_back((char)(values[i] >> (8 * b)));
+        }
+    }
+}
+
+static uint32_t float_bits(float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    return v;
+}
+
+static float bits_float(uint32_t v)
+{
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+// The number of bytes needed for a k-mer rank plus one, with 0 for EVENTALIGN_NO_KMER
+static int kmer_width(const Alphabet* alphabet, uint32_t k)
+{
+    uint64_t max_value = alphabet->get_num_strings(k);
+    int width = 1;
+    while(width < 4 && (max_value >> (8 * width)) > 0) {
+        width += 1;
+    }
+    return width;
+}
+
+static uint32_t encode_kmer_rank(uint32_t rank)
+{
+    return rank == EVENTALIGN_NO_KMER ? 0 : rank + 1;
+}
+
+void encode_eventalign_block(std::string& out,
+                             const EventalignFileHeader& header,
+                             const EventalignBlock& block,
+                             EventalignIndexEntry& entry)
+{
+    const std::vector<EventalignRecord>& records = block.records;
+    size_t n = records.size();
+
+    std::string payload;
+    put_varint(payload, block.read_idx);
+    put_varint(payload, block.read_name.size());
+    payload.append(block.read_name);
+    put_varint(payload, block.contig_id);
+    put_varint(payload, block.k);
+    put_varint(payload, n);
+
+    entry.offset = 0;
+    entry.contig_id = block.contig_id;
+    entry.start = n > 0 ? records[0].ref_position : 0;
+    entry.end = n > 0 ? records[0].ref_position : -1;
+
+    for(size_t i = 0; i < n; ++i) {
+        payload.push_back((char)records[i].strand_idx);
+    }
+
+    int64_t prev = 0;
+    for(size_t i = 0; i < n; ++i) {
+        put_zigzag(payload, (int64_t)records[i].ref_position - prev);
+        prev = records[i].ref_position;
+        entry.start = std::min(entry.start, records[i].ref_position);
+        entry.end = std::max(entry.end, records[i].ref_position);
+    }
+
+    prev = 0;
+    for(size_t i = 0; i < n; ++i) {
+        put_zigzag(payload, (int64_t)records[i].event_idx - prev);
+        prev = records[i].event_idx;
+    }
+
+    int width = kmer_width(header.alphabet, block.k);
+    std::vector<uint32_t> column(n);
+    for(size_t i = 0; i < n; ++i) {
+        column[i] = encode_kmer_rank(records[i].ref_kmer_rank);
+    }
+    put_planes(payload, column, width);
+
+    for(size_t i = 0; i < n; ++i) {
+        column[i] = encode_kmer_rank(records[i].model_kmer_rank);
+    }
+    put_planes(payload, column, width);
+
+    // the float columns, in the order of the table
+    float EventalignRecord::* float_fields[] = { &EventalignRecord::event_level_mean,
+                                                 &EventalignRecord::event_stdv,
+                                                 &EventalignRecord::event_length,
+                                                 &EventalignRecord::model_mean,
+                                                 &EventalignRecord::model_stdv,
+                                                 &EventalignRecord::standardized_level };
+
+    for(size_t fi = 0; fi < sizeof(float_fields) / sizeof(float_fields[0]); ++fi) {
+        for(size_t i = 0; i < n; ++i) {
+            column[i] = float_bits(records[i].*float_fields[fi]);
+        }
+        put_planes(payload, column, 4);
+    }
+
+    if(header.write_samples) {
+        std::vector<uint32_t> samples;
+        for(size_t i = 0; i < n; ++i) {
+            put_varint(payload, records[i].num_samples);
+            for(uint32_t j = 0; j < records[i].num_samples; ++j) {
+                samples.push_back(float_bits(block.samples[records[i].samples_start + j]));
+            }
+        }
+        put_planes(payload, samples, 4);
+    }
+
+    uLongf compressed_size = compressBound(payload.size());
+    std::string compressed(compressed_size, '\0');
+    int ret = compress2((Bytef*)&compressed[0], &compressed_size,
+                        (const Bytef*)payload.data(), payload.size(), Z_DEFAULT_COMPRESSION);
+    if(ret != Z_OK) {
+        fprintf(stderr, "Error: could not compress the eventalign block of %s (zlib error %d)\n", block.read_name.c_str(), ret);
+        exit(EXIT_FAILURE);
+    }
+
+    out.push_back(EVENTALIGN_BLOCK_TAG);
+    put_u32(out, compressed_size);
+    put_u32(out, payload.size());
+    out.append(compressed.data(), compressed_size);
+}
+
+//
+// Writer
+//
+EventalignBinaryWriter::EventalignBinaryWriter(FILE* fp, const EventalignFileHeader& header) : m_fp(fp), m_offset(0), m_closed(false)
+{
+    std::string out(EVENTALIGN_MAGIC);
+    put_u32(out, EVENTALIGN_VERSION);
+    put_u32(out, (header.print_read_names ? EVENTALIGN_FLAG_READ_NAMES : 0) |
+                 (header.write_samples ? EVENTALIGN_FLAG_SAMPLES : 0));
+    put_str(out, header.alphabet->get_name());
+    put_u32(out, header.contig_names.size());
+    for(size_t i = 0; i < header.contig_names.size(); ++i) {
+        put_str(out, header.contig_names[i]);
+    }
+
+    fwrite(out.data(), 1, out.size(), m_fp);
+    m_offset += out.size();
+}
+
+void EventalignBinaryWriter::write_block(const std::string& encoded, const EventalignIndexEntry& entry)
+{
+    assert(!m_closed);
+    m_index.push_back(entry);
+    m_index.back().offset = m_offset;
+
+    fwrite(encoded.data(), 1, encoded.size(), m_fp);
+    m_offset += encoded.size();
+}
+
+void EventalignBinaryWriter::close()
+{
+    assert(!m_closed);
+    std::string out;
+    out.push_back(EVENTALIGN_INDEX_TAG);
+    put_u32(out, m_index.size());
+    for(size_t i = 0; i < m_index.size(); ++i) {
+        put_u64(out, m_index[i].offset);
+        put_u32(out, m_index[i].contig_id);
+        put_u32(out, (uint32_t)m_index[i].start);
+        put_u32(out, (uint32_t)m_index[i].end);
+    }
+    put_u64(out, m_offset);
+    out.append(EVENTALIGN_INDEX_MAGIC);
+
+    fwrite(out.data(), 1, out.size(), m_fp);
+    fflush(m_fp);
+    m_closed = true;
+}
+
+//
+// Reader
+//
+static void die_corrupt(const std::string& filename)
+{
+    fprintf(stderr, "Error: the eventalign file %s is truncated or corrupt\n", filename.c_str());
+    exit(EXIT_FAILURE);
+}
+
+// Read little-endian values from a buffer, exiting if it is too short
+class EventalignByteReader
+{
+    public:
+        EventalignByteReader(const std::string& filename, const char* data, size_t size) : m_filename(filename),
+                                                                                           m_ptr((const uint8_t*)data),
+                                                                                           m_end((const uint8_t*)data + size) {}
+
+        const uint8_t* take(size_t n)
+        {
+            if((size_t)(m_end - m_ptr) < n) {
+                die_corrupt(m_filename);
+            }
+            const uint8_t* p = m_ptr;
+            m_ptr += n;
+            return p;
+        }
+
+        uint32_t u32()
+        {
+            const uint8_t* p = take(4);
+            return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        }
+
+        uint64_t u64()
+        {
+            uint64_t lo = u32();
+            uint64_t hi = u32();
+            return lo | hi << 32;
+        }
+
+        uint64_t varint()
+        {
+            uint64_t v = 0;
+            for(int shift = 0; shift < 64; shift += 7) {
+                uint8_t b = *take(1);
+                v |= (uint64_t)(b & 0x7f) << shift;
+                if((b & 0x80) == 0) {
+                    return v;
+                }
+            }
+            die_corrupt(m_filename);
+            return 0;
+        }
+
+        int64_t zigzag()
+        {
+            uint64_t v = varint();
+            return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+        }
+
+        std::string str(size_t n)
+        {
+            const uint8_t* p = take(n);
+            return std::string((const char*)p, n);
+        }
+
+        // read n values of width bytes stored by put_planes
+        void planes(std::vector<uint32_t>& values, size_t n, int width)
+        {
+            values.assign(n, 0);
+            const uint8_t* p = take(n * width);
+            for(int b = 0; b < width; ++b) {
+                for(size_t i = 0; i < n; ++i) {
+                    values[i] |= (uint32_t)p[b * n + i] << (8 * b);
+                }
+            }
+        }
+
+        bool done() const { return m_ptr == m_end; }
+
+    private:
+        const std::string& m_filename;
+        const uint8_t* m_ptr;
+        const uint8_t* m_end;
+};
+
+EventalignReader::EventalignReader(const std::string& filename) : m_filename(filename)
+{
+    if(filename == "-") {
+        m_fp = stdin;
+    } else {
+        m_fp = fopen(filename.c_str(), "rb");
+    }
+
+    if(m_fp == NULL) {
+        fprintf(stderr, "Error: could not open %s for read\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    char magic[4];
+    read_bytes(magic, 4);
+    if(memcmp(magic, EVENTALIGN_MAGIC, 4) != 0) {
+        fprintf(stderr, "Error: %s is not a binary eventalign file\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    char fixed[12];
+    read_bytes(fixed, sizeof(fixed));
+    EventalignByteReader reader(m_filename, fixed, sizeof(fixed));
+    uint32_t version = reader.u32();
+    uint32_t flags = reader.u32();
+    uint32_t name_length = reader.u32();
+
+    if(version != EVENTALIGN_VERSION) {
+        fprintf(stderr, "Error: %s has eventalign format version %u, expected %u\n", filename.c_str(), version, EVENTALIGN_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    m_header.print_read_names = (flags & EVENTALIGN_FLAG_READ_NAMES) != 0;
+    m_header.write_samples = (flags & EVENTALIGN_FLAG_SAMPLES) != 0;
+
+    std::string alphabet_name(name_length, '\0');
+    read_bytes(&alphabet_name[0], name_length);
+    m_header.alphabet = get_alphabet_by_name(alphabet_name);
+
+    char length[4];
+    read_bytes(length, 4);
+    uint32_t num_contigs = EventalignByteReader(m_filename, length, 4).u32();
+    m_header.contig_names.resize(num_contigs);
+    for(uint32_t i = 0; i < num_contigs; ++i) {
+        read_bytes(length, 4);
+        m_header.contig_names[i].resize(EventalignByteReader(m_filename, length, 4).u32());
+        read_bytes(&m_header.contig_names[i][0], m_header.contig_names[i].size());
+    }
+}
+
+EventalignReader::~EventalignReader()
+{
+    if(m_fp != stdin) {
+        fclose(m_fp);
+    }
+}
+
+void EventalignReader::read_bytes(void* buffer, size_t n)
+{
+    if(n > 0 && fread(buffer, 1, n, m_fp) != n) {
+        die_corrupt(m_filename);
+    }
+}
+
+bool EventalignReader::next_block(EventalignBlock& block)
+{
+    int tag = fgetc(m_fp);
+    if(tag == EOF || tag == EVENTALIGN_INDEX_TAG) {
+        return false;
+    }
+
+    if(tag != EVENTALIGN_BLOCK_TAG) {
+        die_corrupt(m_filename);
+    }
+
+    char sizes[8];
+    read_bytes(sizes, sizeof(sizes));
+    EventalignByteReader size_reader(m_filename, sizes, sizeof(sizes));
+    uint32_t compressed_size = size_reader.u32();
+    uint32_t payload_size = size_reader.u32();
+
+    m_compressed.resize(compressed_size);
+    read_bytes(&m_compressed[0], compressed_size);
+
+    m_payload.resize(payload_size);
+    uLongf uncompressed_size = payload_size;
+    int ret = uncompress((Bytef*)&m_payload[0], &uncompressed_size, (const Bytef*)m_compressed.data(), compressed_size);
+    if(ret != Z_OK || uncompressed_size != payload_size) {
+        die_corrupt(m_filename);
+    }
+
+    EventalignByteReader reader(m_filename, m_payload.data(), m_payload.size());
+    block.read_idx = reader.varint();
+    block.read_name = reader.str(reader.varint());
+    block.contig_id = reader.varint();
+    block.k = reader.varint();
+    size_t n = reader.varint();
+
+    if(block.contig_id >= m_header.contig_names.size() || n > payload_size) {
+        die_corrupt(m_filename);
+    }
+
+    std::vector<EventalignRecord>& records = block.records;
+    records.resize(n);
+    block.samples.clear();
+
+    const uint8_t* strands = reader.take(n);
+    for(size_t i = 0; i < n; ++i) {
+        records[i].strand_idx = strands[i] != 0;
+        records[i].samples_start = 0;
+        records[i].num_samples = 0;
+    }
+
+    int64_t prev = 0;
+    for(size_t i = 0; i < n; ++i) {
+        prev += reader.zigzag();
+        records[i].ref_position = prev;
+    }
+
+    prev = 0;
+    for(size_t i = 0; i < n; ++i) {
+        prev += reader.zigzag();
+        records[i].event_idx = prev;
+    }
+
+    int width = kmer_width(m_header.alphabet, block.k);
+    std::vector<uint32_t> column;
+    reader.planes(column, n, width);
+    for(size_t i = 0; i < n; ++i) {
+        records[i].ref_kmer_rank = column[i] - 1;
+    }
+
+    reader.planes(column, n, width);
+    for(size_t i = 0; i < n; ++i) {
+        records[i].model_kmer_rank = column[i] - 1;
+    }
+
+    float EventalignRecord::* float_fields[] = { &EventalignRecord::event_level_mean,
+                                                 &EventalignRecord::event_stdv,
+                                                 &EventalignRecord::event_length,
+                                                 &EventalignRecord::model_mean,
+                                                 &EventalignRecord::model_stdv,
+                                                 &EventalignRecord::standardized_level };
+
+    for(size_t fi = 0; fi < sizeof(float_fields) / sizeof(float_fields[0]); ++fi) {
+        reader.planes(column, n, 4);
+        for(size_t i = 0; i < n; ++i) {
+            records[i].*float_fields[fi] = bits_float(column[i]);
+        }
+    }
+
+    if(m_header.write_samples) {
+        uint64_t num_samples = 0;
+        for(size_t i = 0; i < n; ++i) {
+            records[i].samples_start = num_samples;
+            records[i].num_samples = reader.varint();
+            num_samples += records[i].num_samples;
+        }
+
+        if(num_samples > payload_size) {
+            die_corrupt(m_filename);
+        }
+
+        reader.planes(column, num_samples, 4);
+        block.samples.resize(num_samples);
+        for(size_t i = 0; i < num_samples; ++i) {
+            block.samples[i] = bits_float(column[i]);
+        }
+    }
+
+    if(!reader.done()) {
+        die_corrupt(m_filename);
+    }
+    return true;
+}
+
+bool EventalignReader::load_index()
+{
+    m_index.clear();
+    if(m_fp == stdin || fseeko(m_fp, -EVENTALIGN_TRAILER_SIZE, SEEK_END) != 0) {
+        return false;
+    }
+
+    char trailer[EVENTALIGN_TRAILER_SIZE];
+    if(fread(trailer, 1, sizeof(trailer), m_fp) != sizeof(trailer) ||
+       memcmp(trailer + 8, EVENTALIGN_INDEX_MAGIC, 4) != 0) {
+        return false;
+    }
+    uint64_t index_offset = EventalignByteReader(m_filename, trailer, 8).u64();
+
+    char index_header[EVENTALIGN_INDEX_HEADER_SIZE];
+    if(fseeko(m_fp, index_offset, SEEK_SET) != 0) {
+        die_corrupt(m_filename);
+    }
+    read_bytes(index_header, sizeof(index_header));
+    if(index_header[0] != EVENTALIGN_INDEX_TAG) {
+        die_corrupt(m_filename);
+    }
+
+    uint32_t num_entries = EventalignByteReader(m_filename, index_header + 1, 4).u32();
+    std::string entries(num_entries * EVENTALIGN_INDEX_ENTRY_SIZE, '\0');
+    read_bytes(&entries[0], entries.size());
+
+    EventalignByteReader reader(m_filename, entries.data(), entries.size());
+    m_index.resize(num_entries);
+    for(uint32_t i = 0; i < num_entries; ++i) {
+        m_index[i].offset = reader.u64();
+        m_index[i].contig_id = reader.u32();
+        m_index[i].start = (int)reader.u32();
+        m_index[i].end = (int)reader.u32();
+    }
+    return true;
+}
+
+void EventalignReader::read_block_at(uint64_t offset, EventalignBlock& block)
+{
+    if(fseeko(m_fp, offset, SEEK_SET) != 0 || !next_block(block)) {
+        die_corrupt(m_filename);
+    }
+}
@@ -0,0 +1,163 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_eventalign_format -- the event alignment table
+// and its tsv and binary encodings
+//
+#ifndef NANOPOLISH_EVENTALIGN_FORMAT_H
+#define NANOPOLISH_EVENTALIGN_FORMAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "nanopolish_alphabet.h"
+
+// The model k-mer of events aligned to the background state
+static const uint32_t EVENTALIGN_NO_KMER = UINT32_MAX;
+
+// The parts of the table that are the same for every read
+struct EventalignFileHeader
+{
+    EventalignFileHeader() : alphabet(&gDNAAlphabet), print_read_names(false), write_samples(false) {}
+
+    const Alphabet* alphabet;
+    bool print_read_names;
+    bool write_samples;
+    std::vector<std::string> contig_names; // indexed by the target id of the bam
+};
+
+// One line of the table
+struct EventalignRecord
+{
+    int ref_position;
+    uint32_t ref_kmer_rank;
+    int strand_idx;
+    int event_idx;
+    float event_level_mean;
+    float event_stdv;
+    float event_length;
+    uint32_t model_kmer_rank; // EVENTALIGN_NO_KMER for background events
+    float model_mean;
+    float model_stdv;
+    float standardized_level;
+
+    // the raw samples of the event are samples[samples_start, samples_start + num_samples) of the block
+    uint32_t samples_start;
+    uint32_t num_samples;
+};
+
+// The lines of a single read. This is the unit that is compressed
+// and indexed in the binary format.
+struct EventalignBlock
+{
+    EventalignBlock() : read_idx(0), contig_id(0), k(0) {}
+
+    size_t read_idx;
+    std::string read_name;
+    uint32_t contig_id;
+    uint32_t k;
+    std::vector<EventalignRecord> records;
+    std::vector<float> samples;
+};
+
+// The location of a block in the binary file and the
+// reference positions its records cover, inclusive
+struct EventalignIndexEntry
+{
+    EventalignIndexEntry() : offset(0), contig_id(0), start(0), end(-1) {}
+
+    uint64_t offset;
+    uint32_t contig_id;
+    int start;
+    int end;
+};
+
+//
+// TSV
+//
+void format_eventalign_tsv_header(std::string& out, const EventalignFileHeader& header);
+
+// Append the line for records[record_idx] of the block
+void format_eventalign_record_tsv(std::string& out,
+                                  const EventalignFileHeader& header,
+                                  const char* contig_name,
+                                  const EventalignBlock& block,
+                                  size_t record_idx);
+
+void format_eventalign_block_tsv(std::string& out,
+                                 const EventalignFileHeader& header,
+                                 const char* contig_name,
+                                 const EventalignBlock& block);
+
+//
+// Binary
+//
+
+// Append the compressed block to out and describe it in entry. The
+// offset of the entry is set when the block is written.
+void encode_eventalign_block(std::string& out,
+                             const EventalignFileHeader& header,
+                             const EventalignBlock& block,
+                             EventalignIndexEntry& entry);
+
+// Write the header, the blocks encoded by encode_eventalign_block
+// and, once every block is written, the index
+class EventalignBinaryWriter
+{
+    public:
+        EventalignBinaryWriter(FILE* fp, const EventalignFileHeader& header);
+
+        void write_block(const std::string& encoded, const EventalignIndexEntry& entry);
+
+        // Write the index, no blocks can be written afterwards
+        void close();
+
+    private:
+        FILE* m_fp;
+        uint64_t m_offset;
+        std::vector<EventalignIndexEntry> m_index;
+        bool m_closed;
+};
+
+// Read a binary eventalign file block by block. The file can be
+// a pipe ("-" for stdin) unless the index is used.
+class EventalignReader
+{
+    public:
+        EventalignReader(const std::string& filename);
+        ~EventalignReader();
+
+        const EventalignFileHeader& get_header() const { return m_header; }
+
+        // Decode the next block into block. Returns false at the end of the file.
+        bool next_block(EventalignBlock& block);
+
+        // Load the index from the end of the file. Returns false if the file can
+        // not seek or has no index, which is the case when it was not completely written.
+        bool load_index();
+        const std::vector<EventalignIndexEntry>& get_index() const { return m_index; }
+
+        // Decode the block at the offset given by an index entry. next_block
+        // continues with the block after it.
+        void read_block_at(uint64_t offset, EventalignBlock& block);
+
+    private:
+
+        // not allowed
+        EventalignReader(const EventalignReader&);
+        EventalignReader& operator=(const EventalignReader&);
+
+        void read_bytes(void* buffer, size_t n);
+
+        std::string m_filename;
+        FILE* m_fp;
+        EventalignFileHeader m_header;
+        std::vector<EventalignIndexEntry> m_index;
+        std::string m_compressed;
+        std::string m_payload;
+};
+
+#endif
@@ -0,0 +1,185 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_view_eventalign.cpp - convert binary eventalign
+// output to tsv
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <getopt.h>
+#include "htslib/hts.h"
+#include "nanopolish_common.h"
+#include "nanopolish_eventalign_format.h"
+
+//
+// Getopt
+//
+#define SUBPROGRAM "view-eventalign"
+
+static const char *VIEW_EVENTALIGN_VERSION_MESSAGE =
+SUBPROGRAM " Version " PACKAGE_VERSION "\n"
+"Written by Jared Simpson.\n"
+"\n"
+"Copyright 2015 Ontario Institute for Cancer Research\n";
+
+static const char *VIEW_EVENTALIGN_USAGE_MESSAGE =
+"Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] eventalign.bin\n"
+"Write the output of eventalign --format=binary as tsv to stdout. Use - to read from stdin.\n"
+"\n"
+"  -v, --verbose                        display verbose output\n"
+"      --version                        display version\n"
+"      --help                           display this help and exit\n"
+"  -w, --window=STR                     only write the events aligned to window STR (format: ctg:start_id-end_id)\n"
+"      --no-header                      do not write the header line\n"
+"\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
+
+namespace opt
+{
+    static unsigned int verbose;
+    static std::string input_file;
+    static std::string region;
+    static int no_header = 0;
+}
+
+static const char* shortopts = "w:v";
+
+enum { OPT_HELP = 1, OPT_VERSION, OPT_NO_HEADER };
+
+static const struct option longopts[] = {
+    { "verbose",     no_argument,       NULL, 'v' },
+    { "window",      required_argument, NULL, 'w' },
+    { "no-header",   no_argument,       NULL, OPT_NO_HEADER },
+    { "help",        no_argument,       NULL, OPT_HELP },
+    { "version",     no_argument,       NULL, OPT_VERSION },
+    { NULL, 0, NULL, 0 }
+};
+
+void parse_view_eventalign_options(int argc, char** argv)
+{
+    bool die = false;
+    for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case '?': die = true; break;
+            case 'v': opt::verbose++; break;
+            case 'w': arg >> opt::region; break;
+            case OPT_NO_HEADER: opt::no_header = true; break;
+            case OPT_HELP:
+                std::cout << VIEW_EVENTALIGN_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+            case OPT_VERSION:
+                std::cout << VIEW_EVENTALIGN_VERSION_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (argc - optind < 1) {
+        std::cerr << SUBPROGRAM ": not enough arguments\n";
+        die = true;
+    } else if (argc - optind > 1) {
+        std::cerr << SUBPROGRAM ": too many arguments\n";
+        die = true;
+    } else {
+        opt::input_file = argv[optind++];
+    }
+
+    if (die)
+    {
+        std::cout << "\n" << VIEW_EVENTALIGN_USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Write the records of the block that are in [start, end] of the contig, or all of them if contig_id is -1
+static void write_block_tsv(std::string& out,
+                            const EventalignFileHeader& header,
+                            const EventalignBlock& block,
+                            int contig_id,
+                            int start,
+                            int end)
+{
+    const char* contig_name = header.contig_names[block.contig_id].c_str();
+    if(contig_id == -1) {
+        format_eventalign_block_tsv(out, header, contig_name, block);
+    } else if((int)block.contig_id == contig_id) {
+        for(size_t i = 0; i < block.records.size(); ++i) {
+            int ref_position = block.records[i].ref_position;
+            if(ref_position >= start && ref_position <= end) {
+                format_eventalign_record_tsv(out, header, contig_name, block, i);
+            }
+        }
+    }
+
+    // write in large pieces
+    if(out.size() > (1 << 20)) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+}
+
+int view_eventalign_main(int argc, char** argv)
+{
+    parse_view_eventalign_options(argc, argv);
+
+    EventalignReader reader(opt::input_file);
+    const EventalignFileHeader& header = reader.get_header();
+
+    // The same region semantics as eventalign's window
+    int contig_id = -1;
+    int start = -1;
+    int end = -1;
+    if(!opt::region.empty()) {
+        const char* name_end = hts_parse_reg(opt::region.c_str(), &start, &end);
+        if(name_end == NULL) {
+            fprintf(stderr, "Error: could not parse the window %s\n", opt::region.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        std::string contig(opt::region.c_str(), name_end);
+        for(size_t i = 0; i < header.contig_names.size(); ++i) {
+            if(header.contig_names[i] == contig) {
+                contig_id = i;
+            }
+        }
+
+        if(contig_id == -1) {
+            fprintf(stderr, "Error: the contig %s is not in %s\n", contig.c_str(), opt::input_file.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    std::string out;
+    if(!opt::no_header) {
+        format_eventalign_tsv_header(out, header);
+    }
+
+    EventalignBlock block;
+    if(contig_id != -1 && reader.load_index()) {
+
+        // only decode the blocks that overlap the window
+        const std::vector<EventalignIndexEntry>& index = reader.get_index();
+        for(size_t i = 0; i < index.size(); ++i) {
+            if((int)index[i].contig_id == contig_id && index[i].start <= end && index[i].end >= start) {
+                reader.read_block_at(index[i].offset, block);
+                write_block_tsv(out, header, block, contig_id, start, end);
+            }
+        }
+    } else {
+        if(contig_id != -1 && opt::verbose > 0) {
+            fprintf(stderr, "%s has no index, reading every block\n", opt::input_file.c_str());
+        }
+
+        while(reader.next_block(block)) {
+            write_block_tsv(out, header, block, contig_id, start, end);
+        }
+    }
+
+    fwrite(out.data(), 1, out.size(), stdout);
+    return EXIT_SUCCESS;
+}
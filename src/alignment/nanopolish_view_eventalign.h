@@ -0,0 +1,14 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_view_eventalign.h - convert binary eventalign
+// output to tsv
+//
+#ifndef NANOPOLISH_VIEW_EVENTALIGN_H
+#define NANOPOLISH_VIEW_EVENTALIGN_H
+
+int view_eventalign_main(int argc, char** argv);
+
+#endif
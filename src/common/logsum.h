@@ -65,4 +65,56 @@ p7_FLogsum(float a, float b)
   return (min == -eslINFINITY || (max-min) >= 15.7f) ? max : max + flogsum_lookup[(int)((max-min)*p7_LOGSUM_SCALE)];
 } 
 
+/* Coefficients of a polynomial P(t) with t * P(t) ~= log(1 + t)
+ * for 0 <= t <= 1. This is a Chebyshev fit of degree 8 with an
+ * absolute error below 1e-7. The SIMD HMM kernels use the same
+ * coefficients.
+ */
+#define p7_LOG1P_C0  9.9999996593e-01f
+#define p7_LOG1P_C1 -4.9999444976e-01f
+#define p7_LOG1P_C2  3.3318121708e-01f
+#define p7_LOG1P_C3 -2.4835398990e-01f
+#define p7_LOG1P_C4  1.9076880741e-01f
+#define p7_LOG1P_C5 -1.3602247635e-01f
+#define p7_LOG1P_C6  7.7516086898e-02f
+#define p7_LOG1P_C7 -2.9074064780e-02f
+#define p7_LOG1P_C8  5.1261021676e-03f
+
+/* Function:  p7_FLog1pExp()
+ * Synopsis:  Approximate $\log(1 + e^{-d})$ for $d \geq 0$.
+ *
+ * Purpose:   Polynomial replacement for the <flogsum_lookup> table.
+ *            It is more accurate than the table, which rounds <d>
+ *            down to a multiple of 0.001, and does not read memory.
+ */
+inline float
+p7_FLog1pExp(float d)
+{
+  const float t = expf(-d);
+  float p = p7_LOG1P_C8;
+  p = p * t + p7_LOG1P_C7;
+  p = p * t + p7_LOG1P_C6;
+  p = p * t + p7_LOG1P_C5;
+  p = p * t + p7_LOG1P_C4;
+  p = p * t + p7_LOG1P_C3;
+  p = p * t + p7_LOG1P_C2;
+  p = p * t + p7_LOG1P_C1;
+  p = p * t + p7_LOG1P_C0;
+  return t * p;
+}
+
+/* Function:  p7_FLogsumPoly()
+ * Synopsis:  Approximate $\log(e^a + e^b)$ without a lookup table.
+ *
+ * Purpose:   Same as <p7_FLogsum()> but using <p7_FLog1pExp()>.
+ */
+inline float
+p7_FLogsumPoly(float a, float b)
+{
+  const float max = ESL_MAX(a, b);
+  const float min = ESL_MIN(a, b);
+
+  return (min == -eslINFINITY || (max-min) >= 15.7f) ? max : max + p7_FLog1pExp(max-min);
+}
+
 #endif
@@ -34,7 +34,7 @@ const uint8_t DNAAlphabet::_rank[256] = {
 const char* DNAAlphabet::_name = "nucleotide";
 const char* DNAAlphabet::_base = "ACGT";
 const char* DNAAlphabet::_complement = "TGCA";
-const uint32_t DNAAlphabet::_size = 4;
+constexpr uint32_t DNAAlphabet::_size;
 
 //
 // methyl-cytosine in CG context
@@ -61,7 +61,7 @@ const uint8_t MethylCpGAlphabet::_rank[256] = {
 const char* MethylCpGAlphabet::_name = "cpg";
 const char* MethylCpGAlphabet::_base = "ACGMT";
 const char* MethylCpGAlphabet::_complement = "TGCGA";
-const uint32_t MethylCpGAlphabet::_size = 5;
+constexpr uint32_t MethylCpGAlphabet::_size;
 
 const uint32_t MethylCpGAlphabet::_num_recognition_sites = 1;
 const uint32_t MethylCpGAlphabet::_recognition_length = 2;
@@ -94,7 +94,7 @@ const uint8_t MethylDamAlphabet::_rank[256] = {
 const char* MethylDamAlphabet::_name = "dam";
 const char* MethylDamAlphabet::_base = "ACGMT";
 const char* MethylDamAlphabet::_complement = "TGCTA";
-const uint32_t MethylDamAlphabet::_size = 5;
+constexpr uint32_t MethylDamAlphabet::_size;
 
 const uint32_t MethylDamAlphabet::_num_recognition_sites = 1;
 const uint32_t MethylDamAlphabet::_recognition_length = 4;
@@ -127,7 +127,7 @@ const uint8_t MethylDcmAlphabet::_rank[256] = {
 const char* MethylDcmAlphabet::_name = "dcm";
 const char* MethylDcmAlphabet::_base = "ACGMT";
 const char* MethylDcmAlphabet::_complement = "TGCGA";
-const uint32_t MethylDcmAlphabet::_size = 5;
+constexpr uint32_t MethylDcmAlphabet::_size;
 
 const uint32_t MethylDcmAlphabet::_num_recognition_sites = 2;
 const uint32_t MethylDcmAlphabet::_recognition_length = 5;
@@ -54,6 +54,36 @@ inline RecognitionMatch match_to_site(const std::string& str, size_t i, const ch
     return match;
 }
 
+// Calculate the lexicographic ranks of the n - k + 1 kmers of str using
+// an alphabet's rank table. Each rank is computed from the previous one by
+// dropping its first base and appending the next base of str, so every
+// base is looked up once. SIZE, the number of symbols of the alphabet,
+// is a compile-time constant so no virtual call is needed per base.
+template<uint32_t SIZE>
+inline void rolling_kmer_ranks(const uint8_t* rank_table, const char* str, size_t n, uint32_t k, uint32_t* out)
+{
+    if(k == 0 || n < k) {
+        return;
+    }
+
+    // the value of the first base of a kmer
+    uint32_t first_place = 1;
+    for(uint32_t i = 1; i < k; ++i) {
+        first_place *= SIZE;
+    }
+
+    uint32_t r = 0;
+    for(uint32_t i = 0; i < k - 1; ++i) {
+        r = r * SIZE + rank_table[(uint8_t)str[i]];
+    }
+
+    for(size_t i = k - 1; i < n; ++i) {
+        r = r * SIZE + rank_table[(uint8_t)str[i]];
+        out[i - k + 1] = r;
+        r -= rank_table[(uint8_t)str[i - k + 1]] * first_place;
+    }
+}
+
 // Abstract base class for alphabets
 class Alphabet
 {
@@ -87,6 +117,10 @@ class Alphabet
             return r;
         }
         
+        // Calculate the ranks of all the kmers of str[0, n), see rolling_kmer_ranks.
+        // out must have room for n - k + 1 values.
+        virtual void kmer_ranks(const char* str, size_t n, uint32_t k, uint32_t* out) const = 0;
+
         // Increment the input string to be the next sequence in lexicographic order
         inline void lexicographic_next(std::string& str) const
         {
@@ -237,12 +271,13 @@ class Alphabet
         virtual inline bool contains_all(const char *bases) const = 0;
 };
 
+// _size is declared by each alphabet as a constexpr so that
+// rolling_kmer_ranks can be instantiated for it
 #define BASIC_MEMBER_BOILERPLATE \
     static const uint8_t _rank[256]; \
     static const char* _name; \
     static const char* _base; \
-    static const char* _complement; \
-    static const uint32_t _size; 
+    static const char* _complement;
 
 #define BASIC_ACCESSOR_BOILERPLATE \
     virtual std::string get_name() const { return _name; } \
@@ -250,11 +285,15 @@ class Alphabet
     virtual char base(uint8_t r) const { return _base[r]; } \
     virtual char complement(char b) const { return _complement[_rank[(int)b]]; } \
     virtual uint32_t size() const { return _size; } \
+    virtual void kmer_ranks(const char* str, size_t n, uint32_t k, uint32_t* out) const { \
+        rolling_kmer_ranks<_size>(_rank, str, n, k, out); \
+    }
 
 struct DNAAlphabet : public Alphabet
 {
     // members
     BASIC_MEMBER_BOILERPLATE
+    static constexpr uint32_t _size = 4;
 
     // functions
     BASIC_ACCESSOR_BOILERPLATE
@@ -298,6 +337,7 @@ struct MethylCpGAlphabet : public Alphabet
 {
     // member variables, expanded by macrocs
     BASIC_MEMBER_BOILERPLATE
+    static constexpr uint32_t _size = 5;
     METHYLATION_MEMBER_BOILERPLATE
     
     // member functions
@@ -318,6 +358,7 @@ struct MethylDamAlphabet : public Alphabet
 {
     // member variables, expanded by macrocs
     BASIC_MEMBER_BOILERPLATE
+    static constexpr uint32_t _size = 5;
     METHYLATION_MEMBER_BOILERPLATE
     
     // member functions
@@ -338,6 +379,7 @@ struct MethylDcmAlphabet : public Alphabet
 {
     // member variables, expanded by macrocs
     BASIC_MEMBER_BOILERPLATE
+    static constexpr uint32_t _size = 5;
     METHYLATION_MEMBER_BOILERPLATE
     
     // member functions
@@ -70,6 +70,19 @@ struct HMMAlignmentState
     char state;
 };
 
+// X-drop early termination of the forward algorithm, see profile_hmm_score
+struct HMMXDrop
+{
+    HMMXDrop(float x) : x_drop(x) {}
+
+    // how far the best cell of a row may fall below the reference's
+    float x_drop;
+
+    // the best cell of each row of the reference sequence's forward
+    // matrix, filled in by the first call that uses this struct
+    std::vector<float> lp_reference_rows;
+};
+
 // The parameters of a gaussian distribution
 struct GaussianParameters
 {
@@ -86,10 +99,19 @@ struct GaussianParameters
 //
 #define ESL_LOG_SUM 1
 
+// When set, add_logs uses a polynomial approximation instead of the
+// lookup table. This keeps the table out of the cache in the HMM inner loops.
+// Build with CPPFLAGS=-DESL_LOG_SUM_POLY=1 to enable.
+#ifndef ESL_LOG_SUM_POLY
+#define ESL_LOG_SUM_POLY 0
+#endif
+
 // Add the log-scaled values a and b using a transform to avoid precision errors
 inline double add_logs(const double a, const double b)
 {
-#if ESL_LOG_SUM
+#if ESL_LOG_SUM && ESL_LOG_SUM_POLY
+    return p7_FLogsumPoly(a, b);
+#elif ESL_LOG_SUM
     return p7_FLogsum(a, b);
 #else
     if(a == -INFINITY && b == -INFINITY)
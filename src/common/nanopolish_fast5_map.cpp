@@ -11,36 +11,235 @@
 #include <fstream>
 #include <ostream>
 #include <iostream>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_common.h"
 #include "htslib/kseq.h"
 
 //
 #define FOFN_SUFFIX ".fast5.fofn"
+#define INDEX_SUFFIX ".fast5.idx"
+
+static const char FAST5_INDEX_MAGIC[8] = { 'N', 'P', 'F', '5', 'I', 'D', 'X', '1' };
 
 KSEQ_INIT(gzFile, gzread)
 
+//
+Fast5MapIndex::Fast5MapIndex(const std::string& filename) : m_data(NULL),
+                                                             m_data_size(0),
+                                                             m_num_reads(0),
+                                                             m_entries(NULL),
+                                                             m_names(NULL),
+                                                             m_paths(NULL),
+                                                             m_names_size(0),
+                                                             m_paths_size(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "warning: could not open %s for read\n", filename.c_str());
+        return;
+    }
+
+    struct stat file_s;
+    fstat(fd, &file_s);
+    if((size_t)file_s.st_size < sizeof(Fast5MapIndexHeader)) {
+        fprintf(stderr, "warning: %s is not a fast5 index, ignoring it\n", filename.c_str());
+        close(fd);
+        return;
+    }
+
+    m_data_size = file_s.st_size;
+    m_data = mmap(NULL, m_data_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m_data == MAP_FAILED) {
+        fprintf(stderr, "warning: could not mmap %s\n", filename.c_str());
+        m_data = NULL;
+        return;
+    }
+
+    const Fast5MapIndexHeader* header = (const Fast5MapIndexHeader*)m_data;
+    m_num_reads = header->num_reads;
+    m_names_size = header->names_size;
+    m_paths_size = header->paths_size;
+
+    if(memcmp(header->magic, FAST5_INDEX_MAGIC, sizeof(FAST5_INDEX_MAGIC)) != 0 || !is_valid()) {
+        fprintf(stderr, "warning: %s is not a fast5 index or is corrupt, ignoring it\n", filename.c_str());
+        munmap(m_data, m_data_size);
+        m_data = NULL;
+        return;
+    }
+
+    m_entries = (const Fast5MapIndexEntry*)(header + 1);
+    m_names = (const char*)(m_entries + m_num_reads);
+    m_paths = m_names + m_names_size;
+}
+
+bool Fast5MapIndex::is_valid() const
+{
+    // The sizes in the header must account for the file exactly. Compare
+    // against the space remaining rather than summing so a corrupt count
+    // cannot overflow.
+    size_t remaining = m_data_size - sizeof(Fast5MapIndexHeader);
+    if(m_num_reads > remaining / sizeof(Fast5MapIndexEntry)) {
+        return false;
+    }
+    remaining -= m_num_reads * sizeof(Fast5MapIndexEntry);
+
+    if(m_names_size > remaining || m_paths_size != remaining - m_names_size) {
+        return false;
+    }
+
+    const Fast5MapIndexHeader* header = (const Fast5MapIndexHeader*)m_data;
+    const Fast5MapIndexEntry* entries = (const Fast5MapIndexEntry*)(header + 1);
+    const char* names = (const char*)(entries + m_num_reads);
+    const char* paths = names + m_names_size;
+
+    // A pool that ends with a null guarantees every string in it is terminated
+    if((m_names_size > 0 && names[m_names_size - 1] != '\0') ||
+       (m_paths_size > 0 && paths[m_paths_size - 1] != '\0')) {
+        return false;
+    }
+    return true;
+}
+
+Fast5MapIndex::~Fast5MapIndex()
+{
+    if(m_data != NULL) {
+        munmap(m_data, m_data_size);
+    }
+}
+
+const char* Fast5MapIndex::find(const std::string& read_name) const
+{
+    // binary search the sorted entries
+    size_t lo = 0;
+    size_t hi = m_num_reads;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const Fast5MapIndexEntry& entry = m_entries[mid];
+        if(entry.name_offset >= m_names_size || entry.path_offset >= m_paths_size) {
+            fprintf(stderr, "error: the fast5 index is corrupt, please rebuild it with nanopolish index\n");
+            exit(EXIT_FAILURE);
+        }
+
+        int cmp = strcmp(m_names + entry.name_offset, read_name.c_str());
+        if(cmp == 0) {
+            return m_paths + entry.path_offset;
+        } else if(cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+bool Fast5MapIndex::write(const std::string& filename, const std::map<std::string, std::string>& read_to_path_map)
+{
+    // The std::map is already sorted by name, lay out the pools in the same order
+    std::vector<Fast5MapIndexEntry> entries;
+    std::string names;
+    std::string paths;
+    entries.reserve(read_to_path_map.size());
+    for(std::map<std::string, std::string>::const_iterator iter = read_to_path_map.begin();
+        iter != read_to_path_map.end(); ++iter) {
+        Fast5MapIndexEntry entry = { names.size(), paths.size() };
+        entries.push_back(entry);
+        names.append(iter->first.c_str(), iter->first.size() + 1);
+        paths.append(iter->second.c_str(), iter->second.size() + 1);
+    }
+
+    Fast5MapIndexHeader header;
+    memcpy(header.magic, FAST5_INDEX_MAGIC, sizeof(FAST5_INDEX_MAGIC));
+    header.num_reads = entries.size();
+    header.names_size = names.size();
+    header.paths_size = paths.size();
+
+    // Write to a temporary file then move it into place so that
+    // other processes never see a partially written index
+    std::string tmp_filename = filename + ".tmp." + std::to_string(getpid());
+    FILE* fp = fopen(tmp_filename.c_str(), "wb");
+    if(fp == NULL) {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(entries.data(), sizeof(Fast5MapIndexEntry), entries.size(), fp) == entries.size() &&
+              fwrite(names.data(), 1, names.size(), fp) == names.size() &&
+              fwrite(paths.data(), 1, paths.size(), fp) == paths.size();
+    ok = (fclose(fp) == 0) && ok;
+
+    if(!ok || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        unlink(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+//
 Fast5Map::Fast5Map(const std::string& fasta_filename)
 {
-    // If the fofn file exists, load from it
+    // If the index or the legacy fofn file exists, load from it
     // otherwise parse the entire fasta file
+    std::string index_filename = fasta_filename + INDEX_SUFFIX;
     std::string fofn_filename = fasta_filename + FOFN_SUFFIX;
+    struct stat index_file_s;
     struct stat fofn_file_s;
     struct stat fasta_file_s;
+    int index_ret = stat(index_filename.c_str(), &index_file_s);
     int fofn_ret = stat(fofn_filename.c_str(), &fofn_file_s);
     stat(fasta_filename.c_str(), &fasta_file_s);
 
-    // Use the stored fofn if its available and newer than the fasta
+    // Use the stored index or fofn if its available and newer than the fasta.
+    // An index that can not be used is ignored.
+    if(index_ret == 0 && index_file_s.st_mtime > fasta_file_s.st_mtime) {
+        index = std::make_shared<const Fast5MapIndex>(index_filename);
+        if(index->is_open()) {
+            return;
+        }
+        index.reset();
+    }
+
     if(fofn_ret == 0 && fofn_file_s.st_mtime > fasta_file_s.st_mtime) {
         load_from_fofn(fofn_filename);
     } else {
         load_from_fasta(fasta_filename);
+
+        // Write the index so next time we don't have to parse the entire fasta
+        if(!Fast5MapIndex::write(index_filename, read_to_path_map)) {
+            fprintf(stderr, "warning: could not write fast5 index %s\n", index_filename.c_str());
+        }
     }
 }
 
+size_t Fast5Map::build_index(const std::string& fasta_filename)
+{
+    Fast5Map map;
+    map.load_from_fasta(fasta_filename);
+
+    std::string index_filename = fasta_filename + INDEX_SUFFIX;
+    if(!Fast5MapIndex::write(index_filename, map.read_to_path_map)) {
+        fprintf(stderr, "error: could not write fast5 index %s\n", index_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return map.read_to_path_map.size();
+}
+
 std::string Fast5Map::get_path(const std::string& read_name) const
 {
+    if(index) {
+        const char* path = index->find(read_name);
+        if(path == NULL) {
+            fprintf(stderr, "error: could not find fast5 path for %s\n", read_name.c_str());
+            exit(EXIT_FAILURE);
+        }
+        return path;
+    }
+
     std::map<std::string, std::string>::const_iterator 
         iter = read_to_path_map.find(read_name);
 
@@ -101,20 +300,6 @@ void Fast5Map::load_from_fasta(std::string fasta_filename)
             exit(EXIT_FAILURE);
         }
     }
-
-    // Write the map as a fofn file so next time we don't have to parse
-    // the entire fasta
-    write_to_fofn(fasta_filename + FOFN_SUFFIX);
-}
-
-void Fast5Map::write_to_fofn(std::string fofn_filename)
-{
-    std::ofstream outfile(fofn_filename.c_str());
-
-    for(std::map<std::string, std::string>::iterator iter = read_to_path_map.begin();
-        iter != read_to_path_map.end(); ++iter) {
-        outfile << iter->first << "\t" << iter->second << "\n";
-    }
 }
 
 //
@@ -8,32 +8,98 @@
 #ifndef NANOPOLISH_FAST5_MAP
 #define NANOPOLISH_FAST5_MAP
 
+#include <stdint.h>
 #include <string>
 #include <map>
+#include <memory>
+
+// A read-only index from read name to fast5 path stored in a binary file.
+// The file is memory mapped so processes using the same index share its pages.
+// Layout: a Fast5MapIndexHeader, one Fast5MapIndexEntry per read sorted
+// by read name, then the pools of null-terminated names and paths.
+struct Fast5MapIndexHeader
+{
+    char magic[8];
+    uint64_t num_reads;
+    uint64_t names_size;
+    uint64_t paths_size;
+};
+
+struct Fast5MapIndexEntry
+{
+    uint64_t name_offset; // into the name pool
+    uint64_t path_offset; // into the path pool
+};
+
+class Fast5MapIndex
+{
+    public:
+        // Map the index in filename. If the file can not be read or is not a
+        // valid index a warning is printed and is_open() returns false.
+        Fast5MapIndex(const std::string& filename);
+        ~Fast5MapIndex();
+
+        bool is_open() const { return m_data != NULL; }
+
+        // return the path for the given read name, or NULL if it is not in the index
+        const char* find(const std::string& read_name) const;
+
+        size_t size() const { return m_num_reads; }
+
+        // Write the index for the map to filename
+        static bool write(const std::string& filename, const std::map<std::string, std::string>& read_to_path_map);
+
+    private:
+
+        // not allowed
+        Fast5MapIndex(const Fast5MapIndex&);
+        Fast5MapIndex& operator=(const Fast5MapIndex&);
+
+        // Check that the header sizes are consistent with the file and that the
+        // pools are terminated. The entries are checked as they are looked up
+        // so opening the index does not touch every page of it.
+        bool is_valid() const;
+
+        void* m_data;
+        size_t m_data_size;
+        uint64_t m_num_reads;
+        const Fast5MapIndexEntry* m_entries;
+        const char* m_names;
+        const char* m_paths;
+        uint64_t m_names_size;
+        uint64_t m_paths_size;
+};
 
 class Fast5Map
 {
     public:
         Fast5Map(const std::string& fasta_filename);
-        
+
         // return the path for the given read name
         // if the read does not exist in the map, emits an error
         // and exits
         std::string get_path(const std::string& read_name) const;
 
+        // Parse the fasta file and write the index used by the constructor.
+        // Returns the number of reads in the index.
+        static size_t build_index(const std::string& fasta_filename);
+
     private:
 
+        // used by build_index
+        Fast5Map() {}
+
         // Read the read -> path map from the header of a fasta file
         void load_from_fasta(std::string fasta_filename);
 
         // Read the map from a pre-computed .fofn file
         void load_from_fofn(std::string fofn_filename);
-        
-        // Write the map to the .fofn file
-        void write_to_fofn(std::string fofn_filename);
 
         std::map<std::string, std::string> read_to_path_map;
 
+        // when an index is available it is used instead of read_to_path_map
+        // copies of the map share the mapped index
+        std::shared_ptr<const Fast5MapIndex> index;
 };
 
 #endif
@@ -0,0 +1,58 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_matrix -- matrix manipulation functions
+//
+#include "nanopolish_matrix.h"
+
+#define MATRIX_ARENA_ALIGNMENT 64
+
+MatrixArena::~MatrixArena()
+{
+    assert(num_leased == 0);
+    for(size_t i = 0; i < blocks.size(); ++i) {
+        free(blocks[i].data);
+    }
+}
+
+MatrixArena& MatrixArena::get_thread_arena()
+{
+    static thread_local MatrixArena arena;
+    return arena;
+}
+
+void* MatrixArena::acquire(size_t bytes)
+{
+    if(num_leased == blocks.size()) {
+        blocks.push_back({ NULL, 0 });
+    }
+
+    Block& block = blocks[num_leased++];
+    if(block.capacity >= bytes) {
+        return block.data;
+    }
+
+    // grow the block, there is no need to copy the old contents
+    free(block.data);
+    block.data = NULL;
+    block.capacity = 0;
+
+    // round up so that similar sizes do not cause repeated growth
+    size_t capacity = bytes + bytes / 4 + MATRIX_ARENA_ALIGNMENT;
+    capacity -= capacity % MATRIX_ARENA_ALIGNMENT;
+    if(posix_memalign(&block.data, MATRIX_ARENA_ALIGNMENT, capacity) != 0) {
+        fprintf(stderr, "Error: could not allocate %zu bytes for a matrix\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    block.capacity = capacity;
+    return block.data;
+}
+
+void MatrixArena::release(void* ptr)
+{
+    assert(num_leased > 0);
+    assert(blocks[num_leased - 1].data == ptr);
+    num_leased--;
+}
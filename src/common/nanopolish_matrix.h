@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <vector>
 #include "nanopolish_matrix.h"
 
 //
@@ -84,6 +86,61 @@ inline T get(const Matrix<T>& matrix, uint32_t row, uint32_t col)
     return matrix.cells[c];
 }
 
+//
+// Per-thread storage for matrices in the HMM hot path.
+// Blocks are 64-byte aligned and never shrink so after warm-up
+// leasing a matrix does not call into the allocator. The memory
+// is not cleared, the caller must initialize every cell it reads.
+//
+class MatrixArena
+{
+    public:
+        ~MatrixArena();
+
+        // the arena for the calling thread
+        static MatrixArena& get_thread_arena();
+
+        // Leases must be released in the reverse order they were acquired
+        void* acquire(size_t bytes);
+        void release(void* ptr);
+
+    private:
+        struct Block
+        {
+            void* data;
+            size_t capacity;
+        };
+
+        // blocks[i] holds the i-th outstanding lease
+        std::vector<Block> blocks;
+        size_t num_leased = 0;
+};
+
+// Allocate the cells of a matrix from the thread's arena
+// for the lifetime of this object
+template<typename T>
+class MatrixLease
+{
+    public:
+        MatrixLease(Matrix<T>& matrix, uint32_t n_rows, uint32_t n_cols) : p_matrix(&matrix)
+        {
+            matrix.n_rows = n_rows;
+            matrix.n_cols = n_cols;
+            matrix.cells = (T*)MatrixArena::get_thread_arena().acquire((size_t)n_rows * n_cols * sizeof(T));
+        }
+
+        ~MatrixLease()
+        {
+            MatrixArena::get_thread_arena().release(p_matrix->cells);
+            p_matrix->cells = NULL;
+        }
+
+    private:
+        MatrixLease(); // not allowed
+        MatrixLease(const MatrixLease&); // not allowed
+        Matrix<T>* p_matrix;
+};
+
 //
 inline void print_matrix(const DoubleMatrix& matrix, bool do_exp = false)
 {
@@ -0,0 +1,121 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_output_queue -- bounded queue that hands
+// finished output from worker threads to a writer thread
+//
+#ifndef NANOPOLISH_OUTPUT_QUEUE_H
+#define NANOPOLISH_OUTPUT_QUEUE_H
+
+#include <stddef.h>
+#include <assert.h>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Worker threads push the output of each input item, identified
+// by its index, and a single writer thread pops it. The lock is only
+// held to move an item in or out of the queue, never while the
+// output is formatted or written.
+//
+// When ordered is false items are popped in the order they were pushed and
+// push() waits while capacity items are queued. When ordered is true items
+// are popped in index order, starting at 0, so every index must be pushed
+// exactly once. push() then waits while the index is capacity or more
+// past the next index to be popped. The thread holding that index never
+// waits so the workers can not deadlock.
+template<class T>
+class OutputQueue
+{
+    public:
+        OutputQueue(size_t capacity, bool ordered) : m_capacity(capacity),
+                                                     m_ordered(ordered),
+                                                     m_next_idx(0),
+                                                     m_closed(false)
+        {
+            assert(m_capacity > 0);
+        }
+
+        void push(size_t idx, T& item)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_space_cv.wait(lock, [&] { return has_space(idx); });
+
+            if(m_ordered) {
+                assert(idx >= m_next_idx && m_items.find(idx) == m_items.end());
+                m_items[idx].swap(item);
+            } else {
+                m_unordered_items.push_back(T());
+                m_unordered_items.back().swap(item);
+            }
+            lock.unlock();
+            m_item_cv.notify_one();
+        }
+
+        // Wait for the next item and move it into item. Returns false
+        // once the queue is closed and every item has been popped.
+        bool pop(T& item)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_item_cv.wait(lock, [&] { return m_closed || has_next(); });
+            if(!has_next()) {
+                assert(m_ordered ? m_items.empty() : m_unordered_items.empty());
+                return false;
+            }
+
+            if(m_ordered) {
+                typename std::map<size_t, T>::iterator iter = m_items.begin();
+                item.swap(iter->second);
+                m_items.erase(iter);
+                m_next_idx++;
+            } else {
+                item.swap(m_unordered_items.front());
+                m_unordered_items.pop_front();
+            }
+            lock.unlock();
+
+            // in ordered mode several workers can be waiting for the next index to move
+            m_space_cv.notify_all();
+            return true;
+        }
+
+        // No more items will be pushed
+        void close()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_closed = true;
+            }
+            m_item_cv.notify_all();
+        }
+
+    private:
+
+        // the caller must hold m_mutex
+        bool has_space(size_t idx) const
+        {
+            return m_ordered ? idx < m_next_idx + m_capacity : m_unordered_items.size() < m_capacity;
+        }
+
+        // the caller must hold m_mutex
+        bool has_next() const
+        {
+            return m_ordered ? !m_items.empty() && m_items.begin()->first == m_next_idx : !m_unordered_items.empty();
+        }
+
+        size_t m_capacity;
+        bool m_ordered;
+
+        std::mutex m_mutex;
+        std::condition_variable m_space_cv;
+        std::condition_variable m_item_cv;
+        std::map<size_t, T> m_items; // by index, when ordered
+        std::deque<T> m_unordered_items;
+        size_t m_next_idx;
+        bool m_closed;
+};
+
+#endif
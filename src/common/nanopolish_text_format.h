@@ -0,0 +1,105 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_text_format -- append numbers to a string
+// without going through printf
+//
+#ifndef NANOPOLISH_TEXT_FORMAT_H
+#define NANOPOLISH_TEXT_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <math.h>
+#include <cmath>
+#include <string>
+
+// Append v in decimal, as printf's %zu
+inline void append_uint(std::string& out, uint64_t v)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while(v > 0);
+
+    while(n > 0) {
+        out.push_back(digits[--n]);
+    }
+}
+
+// Append v in decimal, as printf's %d
+inline void append_int(std::string& out, int64_t v)
+{
+    if(v < 0) {
+        out.push_back('-');
+        append_uint(out, (uint64_t)0 - (uint64_t)v);
+    } else {
+        append_uint(out, v);
+    }
+}
+
+// Append x with precision digits after the decimal point, as printf's %.<precision>f.
+// x * 10^precision is rounded half to even like printf does. This gives
+// the same digits as printf when the product is exact, which is always
+// the case for values that were floats and precision <= 5. Values
+// that are not finite or too large are written by snprintf.
+inline void append_fixed(std::string& out, double x, int precision)
+{
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    assert(precision >= 0 && precision <= 9);
+
+    double scaled = x * powers[precision];
+    if(!(fabs(scaled) < 9e15)) {
+        char buffer[512];
+        snprintf(buffer, sizeof(buffer), "%.*f", precision, x);
+        out.append(buffer);
+        return;
+    }
+
+    // printf keeps the sign of negative values that round to zero
+    if(std::signbit(x)) {
+        out.push_back('-');
+    }
+
+    uint64_t v = (uint64_t)fabs(nearbyint(scaled));
+    uint64_t divisor = (uint64_t)powers[precision];
+    append_uint(out, v / divisor);
+
+    if(precision > 0) {
+        char digits[9];
+        uint64_t fraction = v % divisor;
+        for(int i = precision - 1; i >= 0; --i) {
+            digits[i] = '0' + fraction % 10;
+            fraction /= 10;
+        }
+        out.push_back('.');
+        out.append(digits, precision);
+    }
+}
+
+// Append the printf-formatted arguments, for output that is not performance critical
+inline void append_printf(std::string& out, const char* format, ...)
+{
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if(n < (int)sizeof(buffer)) {
+        out.append(buffer, n > 0 ? n : 0);
+    } else {
+        std::string large(n + 1, '\0');
+        va_start(args, format);
+        vsnprintf(&large[0], large.size(), format, args);
+        va_end(args);
+        out.append(large.c_str(), n);
+    }
+}
+
+#endif
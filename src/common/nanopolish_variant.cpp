@@ -72,7 +72,7 @@ std::vector<Variant> select_variants(const std::vector<Variant>& candidate_varia
     // Calculate baseline probablilty
     std::vector<Variant> selected_variants;
 
-    double base_lp = profile_hmm_score(base_haplotype.get_sequence(), input);
+    double base_lp = profile_hmm_score(HMMInputSequenceView(base_haplotype.get_sequence()), input);
 
     while(!all_variants.empty()) {
  
@@ -82,7 +82,7 @@ std::vector<Variant> select_variants(const std::vector<Variant>& candidate_varia
 
         std::vector<double> base_lp_by_read; 
         for(size_t j = 0; j < input.size(); ++j) {
-            double tmp = profile_hmm_score(base_haplotype.get_sequence(), input[j]);
+            double tmp = profile_hmm_score(HMMInputSequenceView(base_haplotype.get_sequence()), input[j]);
             base_lp_by_read.push_back(tmp);
         }
 
@@ -98,7 +98,7 @@ std::vector<Variant> select_variants(const std::vector<Variant>& candidate_varia
             size_t supporting_reads = 0;
             #pragma omp parallel for
             for(size_t j = 0; j < input.size(); ++j) {
-                double tmp = profile_hmm_score(derived.get_sequence(), input[j]);
+                double tmp = profile_hmm_score(HMMInputSequenceView(derived.get_sequence()), input[j]);
                 #pragma omp critical
                 {
                     variant_lp += tmp;
@@ -161,35 +161,11 @@ std::vector<Variant> select_variant_set(const std::vector<Variant>& candidate_va
     }
     max_r -= 1;
 
-    // Calculate the likelihood of the haplotype with no additional variants added
-    // also do some bookkeeping about per-read/per-model likelihoods
-    double base_lp = 0.0f;
-    double base_lp_by_model_strand[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-    int read_counts[6] = { 0, 0, 0, 0, 0, 0 };
+    // Generate the haplotypes by adding 1, 2, ..., max_r variant sets to the base
+    // haplotype. The base haplotype is first, the others are compared to its score.
+    std::vector<std::vector<Variant>> haplotype_variant_sets(1);
+    std::vector<HMMInputSequence> haplotype_sequences(1, base_haplotype.get_sequence());
 
-    std::vector<double> base_lp_by_read(input.size()); 
-    
-    #pragma omp parallel for
-    for(size_t j = 0; j < input.size(); ++j) {
-
-        double tmp = profile_hmm_score(base_haplotype.get_sequence(), input[j], alignment_flags);
-
-        #pragma omp critical
-        {
-            base_lp_by_read[j] = tmp;
-            base_lp += tmp;
-
-            int mid = input[j].read->pore_model[input[j].strand].metadata.model_idx;
-            int cid = 2 * mid + input[j].rc;
-            base_lp_by_model_strand[cid] += tmp;
-            read_counts[cid] += 1;
-        }
-    }
-
-    double best_lp = -INFINITY;
-    std::vector<Variant> best_variant_set;
-
-    // Score haplotypes by adding 1, 2, ..., max_r variant sets to it
     for(size_t r = 1; r <= max_r; ++r) {
         // From: http://stackoverflow.com/questions/9430568/generating-combinations-in-c
         std::vector<bool> variant_selector(num_variants);
@@ -210,127 +186,160 @@ std::vector<Variant> select_variant_set(const std::vector<Variant>& candidate_va
             }
             
             // skip the haplotype if all the variants couldnt be added to it
-            if(!good_haplotype) {
-                continue;
+            if(good_haplotype) {
+                haplotype_variant_sets.push_back(current_variant_set);
+                haplotype_sequences.push_back(current_haplotype.get_sequence());
             }
+        } while(std::prev_permutation(variant_selector.begin(), variant_selector.end()));
+    }
 
-            // score the haplotype
-            double current_lp = 0.0f;
-            double current_lp_by_model_strand[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-            size_t supporting_reads = 0;
-            std::vector<double> relative_lp_by_read(input.size(), 0.0f);
+    // Score every haplotype against each read
+    std::vector<std::vector<float>> scores_by_read(input.size(), std::vector<float>(haplotype_sequences.size()));
 
-            #pragma omp parallel for
-            for(size_t j = 0; j < input.size(); ++j) {
-                double tmp = profile_hmm_score(current_haplotype.get_sequence(), input[j], alignment_flags);
+    #pragma omp parallel for
+    for(size_t hi = 0; hi < haplotype_sequences.size(); ++hi) {
+        std::vector<float> scores = profile_hmm_score_reads(haplotype_sequences[hi], input, alignment_flags);
+        for(size_t j = 0; j < input.size(); ++j) {
+            scores_by_read[j][hi] = scores[j];
+        }
+    }
 
-                #pragma omp critical
-                {
-                    current_lp += tmp;
-                    supporting_reads += tmp > base_lp_by_read[j];
-                    int mid = input[j].read->pore_model[input[j].strand].metadata.model_idx;
-                    int cid = 2 * mid + input[j].rc;
-                    current_lp_by_model_strand[cid] += tmp;
-                    relative_lp_by_read[j] = tmp - base_lp_by_read[j];
-                }
-            }
+    // Calculate the likelihood of the haplotype with no additional variants added
+    // also do some bookkeeping about per-read/per-model likelihoods
+    double base_lp = 0.0f;
+    double base_lp_by_model_strand[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    int read_counts[6] = { 0, 0, 0, 0, 0, 0 };
+
+    std::vector<double> base_lp_by_read(input.size()); 
+    
+    for(size_t j = 0; j < input.size(); ++j) {
+
+        double tmp = scores_by_read[j][0];
+        base_lp_by_read[j] = tmp;
+        base_lp += tmp;
+
+        int mid = input[j].read->pore_model[input[j].strand].metadata.model_idx;
+        int cid = 2 * mid + input[j].rc;
+        base_lp_by_model_strand[cid] += tmp;
+        read_counts[cid] += 1;
+    }
+
+    double best_lp = -INFINITY;
+    std::vector<Variant> best_variant_set;
+
+    for(size_t hi = 1; hi < haplotype_sequences.size(); ++hi) {
+        const std::vector<Variant>& current_variant_set = haplotype_variant_sets[hi];
+
+        // score the haplotype
+        double current_lp = 0.0f;
+        double current_lp_by_model_strand[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        size_t supporting_reads = 0;
+        std::vector<double> relative_lp_by_read(input.size(), 0.0f);
+
+        for(size_t j = 0; j < input.size(); ++j) {
+            double tmp = scores_by_read[j][hi];
+            current_lp += tmp;
+            supporting_reads += tmp > base_lp_by_read[j];
+            int mid = input[j].read->pore_model[input[j].strand].metadata.model_idx;
+            int cid = 2 * mid + input[j].rc;
+            current_lp_by_model_strand[cid] += tmp;
+            relative_lp_by_read[j] = tmp - base_lp_by_read[j];
+        }
+
+        if(current_lp > best_lp && current_lp - base_lp > 0.1) {
+            best_lp = current_lp;
+            best_variant_set = current_variant_set;
+
+            // Annotate variants
+            for(size_t vi = 0; vi < best_variant_set.size(); ++vi) {
+                Variant& v = best_variant_set[vi];
+                v.add_info("TotalReads", input.size());
+                v.add_info("SupportingReads", supporting_reads);
+                v.add_info("SupportFraction", (double)supporting_reads / input.size());
+
+                // Annotate variants with qualities from the three possible models
+                std::string names[3] = { "Template", "Comp.P1", "Comp.P2" };
+
+                for(int mid = 0; mid < 3; mid++) {
+                    int cid = 2 * mid;
+                    double s0 = current_lp_by_model_strand[cid] - base_lp_by_model_strand[cid];
+                    int c0 = read_counts[cid];
+
+                    double s1 = current_lp_by_model_strand[cid + 1] - base_lp_by_model_strand[cid + 1];
+                    int c1 = read_counts[cid + 1];
 
-            if(current_lp > best_lp && current_lp - base_lp > 0.1) {
-                best_lp = current_lp;
-                best_variant_set = current_variant_set;
-
-                // Annotate variants
-                for(size_t vi = 0; vi < best_variant_set.size(); ++vi) {
-                    Variant& v = best_variant_set[vi];
-                    v.add_info("TotalReads", input.size());
-                    v.add_info("SupportingReads", supporting_reads);
-                    v.add_info("SupportFraction", (double)supporting_reads / input.size());
-
-                    // Annotate variants with qualities from the three possible models
-                    std::string names[3] = { "Template", "Comp.P1", "Comp.P2" };
-
-                    for(int mid = 0; mid < 3; mid++) {
-                        int cid = 2 * mid;
-                        double s0 = current_lp_by_model_strand[cid] - base_lp_by_model_strand[cid];
-                        int c0 = read_counts[cid];
-
-                        double s1 = current_lp_by_model_strand[cid + 1] - base_lp_by_model_strand[cid + 1];
-                        int c1 = read_counts[cid + 1];
-
-                        std::stringstream ss;
-                        ss << std::setprecision(4) << s0 / c0 << "," << s1 / c1;
-                        v.add_info(names[mid], ss.str());
-                    }
-
-                    /*
-                    v.add_info("TemplateQuality", current_lp_by_strand[0] - base_lp_by_strand[0]);
-                    v.add_info("ComplementQuality", current_lp_by_strand[1] - base_lp_by_strand[1]);
-                    v.add_info("ForwardQuality", current_lp_by_rc[0] - base_lp_by_rc[0]);
-                    v.add_info("ReverseQuality", current_lp_by_rc[1] - base_lp_by_rc[1]);
-                    v.add_info("TAvgQuality", (current_lp_by_model[0] - base_lp_by_model[0]) / model_count[0]);
-                    v.add_info("C1AvgQuality", (current_lp_by_model[1] - base_lp_by_model[1]) / model_count[1]);
-                    v.add_info("C2AvgQuality", (current_lp_by_model[2] - base_lp_by_model[2]) / model_count[2]);
-                    */
-
-                    std::stringstream counts;
-                    std::ostream_iterator<int> rc_out(counts, ",");
-                    std::copy(std::begin(read_counts), std::end(read_counts), rc_out);
-                    std::string rc_str = counts.str();
-                    v.add_info("ReadCounts", rc_str.substr(0, rc_str.size() - 1));
-
-                    /*
-                    std::stringstream scores;
-                    std::ostream_iterator<float> scores_out(scores, ",");
-                    std::copy(std::begin(relative_lp_by_read), std::end(relative_lp_by_read), scores_out);
-                    std::string scores_str = scores.str();
-                    v.add_info("Scores", scores_str.substr(0, scores_str.size() - 1));
-                    */
-
-                    v.quality = best_lp - base_lp;
+                    std::stringstream ss;
+                    ss << std::setprecision(4) << s0 / c0 << "," << s1 / c1;
+                    v.add_info(names[mid], ss.str());
                 }
+
+                /*
+                v.add_info("TemplateQuality", current_lp_by_strand[0] - base_lp_by_strand[0]);
+                v.add_info("ComplementQuality", current_lp_by_strand[1] - base_lp_by_strand[1]);
+                v.add_info("ForwardQuality", current_lp_by_rc[0] - base_lp_by_rc[0]);
+                v.add_info("ReverseQuality", current_lp_by_rc[1] - base_lp_by_rc[1]);
+                v.add_info("TAvgQuality", (current_lp_by_model[0] - base_lp_by_model[0]) / model_count[0]);
+                v.add_info("C1AvgQuality", (current_lp_by_model[1] - base_lp_by_model[1]) / model_count[1]);
+                v.add_info("C2AvgQuality", (current_lp_by_model[2] - base_lp_by_model[2]) / model_count[2]);
+                */
+
+                std::stringstream counts;
+                std::ostream_iterator<int> rc_out(counts, ",");
+                std::copy(std::begin(read_counts), std::end(read_counts), rc_out);
+                std::string rc_str = counts.str();
+                v.add_info("ReadCounts", rc_str.substr(0, rc_str.size() - 1));
+
+                /*
+                std::stringstream scores;
+                std::ostream_iterator<float> scores_out(scores, ",");
+                std::copy(std::begin(relative_lp_by_read), std::end(relative_lp_by_read), scores_out);
+                std::string scores_str = scores.str();
+                v.add_info("Scores", scores_str.substr(0, scores_str.size() - 1));
+                */
+
+                v.quality = best_lp - base_lp;
             }
+        }
 #ifdef DEBUG_HAPLOTYPE_SELECTION
-            std::stringstream ss;
-            for(size_t vi = 0; vi < current_variant_set.size(); ++vi) {
-                const Variant& v = current_variant_set[vi];
-                ss << (vi > 0 ? "," : "") << v.key();
-            }
-            fprintf(stderr, "haplotype: %zu variants: %s relative score: %.2lf\n", hi, ss.str().c_str(), current_lp - base_lp);
+        std::stringstream ss;
+        for(size_t vi = 0; vi < current_variant_set.size(); ++vi) {
+            const Variant& v = current_variant_set[vi];
+            ss << (vi > 0 ? "," : "") << v.key();
+        }
+        fprintf(stderr, "haplotype: %zu variants: %s relative score: %.2lf\n", hi, ss.str().c_str(), current_lp - base_lp);
 #endif
-        } while(std::prev_permutation(variant_selector.begin(), variant_selector.end()));
     }
     return best_variant_set;
 }
 
+// The sum of the scores of the haplotype sequence against every read
+static double sum_read_scores(const std::string& sequence,
+                              const std::vector<HMMInputData>& input,
+                              const uint32_t alignment_flags)
+{
+    std::vector<float> scores = profile_hmm_score_reads(HMMInputSequenceView(sequence), input, alignment_flags);
+
+    double score = 0.0f;
+    for(size_t j = 0; j < scores.size(); ++j) {
+        score += scores[j];
+    }
+    return score;
+}
+
 std::vector<Variant> select_positive_scoring_variants(std::vector<Variant>& candidate_variants,
                                                       Haplotype base_haplotype, 
                                                       const std::vector<HMMInputData>& input,
                                                       const uint32_t alignment_flags)
 {
     std::vector<Variant> selected_variants;
-    double base_score = 0.0f;
-    #pragma omp parallel for
-    for(size_t j = 0; j < input.size(); ++j) {
-
-        double score = profile_hmm_score(base_haplotype.get_sequence(), input[j], alignment_flags);
-
-        #pragma omp atomic
-        base_score += score;
-    }
+    double base_score = sum_read_scores(base_haplotype.get_sequence(), input, alignment_flags);
 
     for(size_t vi = 0; vi < candidate_variants.size(); ++vi) {
 
         Haplotype current_haplotype = base_haplotype;
         current_haplotype.apply_variant(candidate_variants[vi]);
         
-        double haplotype_score = 0.0f;
-        #pragma omp parallel for
-        for(size_t j = 0; j < input.size(); ++j) {
-            double score = profile_hmm_score(current_haplotype.get_sequence(), input[j], alignment_flags);
-
-            #pragma omp atomic
-            haplotype_score += score;
-        }
+        double haplotype_score = sum_read_scores(current_haplotype.get_sequence(), input, alignment_flags);
 
         if(haplotype_score > base_score) {
             candidate_variants[vi].quality = haplotype_score - base_score;
@@ -348,22 +357,33 @@ Variant score_variant(const Variant& input_variant,
 {
     Variant out_variant = input_variant;
 
-    double base_score = 0.0f;
-    #pragma omp parallel for
-    for(size_t j = 0; j < input.size(); ++j) {
+    double base_score = sum_read_scores(base_haplotype.get_sequence(), input, alignment_flags);
+
+    base_haplotype.apply_variant(input_variant);
+    double haplotype_score = sum_read_scores(base_haplotype.get_sequence(), input, alignment_flags);
 
-        double score = profile_hmm_score(base_haplotype.get_sequence(), input[j], alignment_flags);
+    out_variant.quality = haplotype_score - base_score;
+    return out_variant;
+}
+
+Variant score_variant(const Variant& input_variant,
+                      Haplotype base_haplotype,
+                      const std::vector<HMMScoredBase>& base_scores)
+{
+    Variant out_variant = input_variant;
 
-        #pragma omp atomic
-        base_score += score;
+    double base_score = 0.0f;
+    for(size_t j = 0; j < base_scores.size(); ++j) {
+        base_score += base_scores[j].score;
     }
 
     base_haplotype.apply_variant(input_variant);
-        
+    HMMInputSequence sequence(base_haplotype.get_sequence());
+
     double haplotype_score = 0.0f;
 #pragma omp parallel for
-    for(size_t j = 0; j < input.size(); ++j) {
-        double score = profile_hmm_score(base_haplotype.get_sequence(), input[j], alignment_flags);
+    for(size_t j = 0; j < base_scores.size(); ++j) {
+        double score = profile_hmm_score_edit(base_scores[j], sequence);
 
 #pragma omp atomic
         haplotype_score += score;
@@ -372,4 +392,3 @@ Variant score_variant(const Variant& input_variant,
     out_variant.quality = haplotype_score - base_score;
     return out_variant;
 }
-
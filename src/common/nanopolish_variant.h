@@ -14,6 +14,7 @@
 
 // forward declare
 class Haplotype;
+struct HMMScoredBase;
 
 struct Variant
 {
@@ -130,4 +131,11 @@ Variant score_variant(const Variant& input_variant,
                       const std::vector<HMMInputData>& input,
                       const uint32_t alignment_flags);
 
+// Score a single variant using the base haplotype scores of each read
+// from profile_hmm_score_base. Only the part of each matrix around the
+// variant is computed.
+Variant score_variant(const Variant& input_variant,
+                      Haplotype base_haplotype,
+                      const std::vector<HMMScoredBase>& base_scores);
+
 #endif
@@ -22,7 +22,7 @@ std::vector<double> DurationModel::generate_aligned_durations(const std::string&
     size_t num_kmers = sequence.size() - k + 1;
     // initialize the vector of durations
     std::vector<double> duration_by_kmer_position(num_kmers, 0.0);
-    std::vector<HMMAlignmentState> alignment = profile_hmm_align(sequence, data, alignment_flags);
+    std::vector<HMMAlignmentState> alignment = profile_hmm_align(HMMInputSequenceView(sequence), data, alignment_flags);
     for(size_t ai = 0; ai < alignment.size(); ai++) {
 
         /*   
@@ -47,6 +47,11 @@ inline float log_normal_pdf(float x, const PoreModelStateParams& s)
     return log_inv_sqrt_2pi - s.level_log_stdv + (-0.5f * a * a);
 }
 
+inline float log_normal_pdf(float x, const PoreModelScaledLevel& s)
+{
+    float a = (x - s.mean) * s.inv_stdv;
+    return log_inv_sqrt_2pi - s.log_stdv + (-0.5f * a * a);
+}
 
 inline float log_normal_pdf(float x, const GaussianParameters& g)
 {
@@ -67,34 +72,64 @@ inline bool& model_stdv()
     return _model_stdv;
 }
 
-inline float log_probability_match_r9(const SquiggleRead& read,
-                                      uint32_t kmer_rank,
-                                      uint32_t event_idx,
-                                      uint8_t strand)
+inline float compute_log_probability_match_r9(const SquiggleRead& read,
+                                              uint32_t kmer_rank,
+                                              uint32_t event_idx,
+                                              uint8_t strand)
 {
     const PoreModel& pm = read.pore_model[strand];
 
     // event level mean
     float level = read.get_drift_corrected_level(event_idx, strand);
-    float stdv = read.get_stdv(event_idx, strand);
-    float log_stdv = read.get_log_stdv(event_idx, strand);
-    PoreModelStateParams state = pm.get_scaled_state(kmer_rank);
+    const PoreModelScaledLevel& scaled_level = pm.get_scaled_level(kmer_rank);
 
-    float lp = log_normal_pdf(level, state);
+    float lp = log_normal_pdf(level, scaled_level);
 
     if(model_stdv())
     {
-        float lp_stdv = log_invgauss_pdf(stdv, log_stdv, state);
+        float stdv = read.get_stdv(event_idx, strand);
+        float log_stdv = read.get_log_stdv(event_idx, strand);
+        float lp_stdv = log_invgauss_pdf(stdv, log_stdv, pm.get_scaled_state(kmer_rank));
         lp += lp_stdv;
     }
 
 #if DEBUG_HMM_EMISSION
-    printf("Event[%d] Kmer: %d -- L:%.1lf m: %.1lf s: %.1lf p: %.3lf p_old: %.3lf\n", event_idx, kmer_rank, level, state.level_mean, state.level_stdv, exp(lp), normal_pdf(level, state));
+    printf("Event[%d] Kmer: %d -- L:%.1lf m: %.1lf s: %.1lf p: %.3lf\n", event_idx, kmer_rank, level, scaled_level.mean, 1.0 / scaled_level.inv_stdv, exp(lp));
 #endif
 
     return lp;
 }
 
+// The cells of the read's emission table for the current model of the
+// strand, NULL when the table is disabled. The fills get them once and
+// pass them to log_probability_match_r9.
+inline std::shared_ptr<EmissionTableCells> get_emission_cells_r9(const SquiggleRead& read, uint8_t strand)
+{
+    const PoreModel& pm = read.pore_model[strand];
+    uint64_t model_key = pm.scaled_states_id != 0 ? (pm.scaled_states_id << 1) | model_stdv() : 0;
+    return read.emission_table[strand].get_cells(model_key, read.event_arrays[strand].means.size(), pm.get_num_states());
+}
+
+// As above, using the cells of the read's emission table when they are not NULL
+inline float log_probability_match_r9(const SquiggleRead& read,
+                                      uint32_t kmer_rank,
+                                      uint32_t event_idx,
+                                      uint8_t strand,
+                                      EmissionTableCells* cells)
+{
+    std::atomic<float>* cell = cells != NULL ? cells->get_cell(event_idx, kmer_rank) : NULL;
+    if(cell == NULL) {
+        return compute_log_probability_match_r9(read, kmer_rank, event_idx, strand);
+    }
+
+    float lp = cell->load(std::memory_order_relaxed);
+    if(lp != lp) { // NaN, not computed yet
+        lp = compute_log_probability_match_r9(read, kmer_rank, event_idx, strand);
+        cell->store(lp, std::memory_order_relaxed);
+    }
+    return lp;
+}
+
 inline float log_probability_match_r7(const SquiggleRead& read,
                                       uint32_t kmer_rank,
                                       uint32_t event_idx,
@@ -107,25 +142,24 @@ inline float log_probability_match_r7(const SquiggleRead& read,
     // event level mean
     float level = read.get_drift_corrected_level(event_idx, strand);
 
-    PoreModelStateParams state = pm.get_scaled_state(kmer_rank);
+    PoreModelScaledLevel scaled_level = pm.get_scaled_level(kmer_rank);
 
     // we go to great lengths to avoid calling log() in the inner loop of the HMM
     // for this reason we duplicate data here and require the caller to pass
     // in the scale and log(scale), presumably these are cached
-    state.level_stdv *= state_scale;
-    state.level_log_stdv += log_state_scale;
-    float lp = log_normal_pdf(level, state);
+    scaled_level.inv_stdv /= state_scale;
+    scaled_level.log_stdv += log_state_scale;
+    float lp = log_normal_pdf(level, scaled_level);
 
     if(model_stdv())
     {
         float stdv = read.get_stdv(event_idx, strand);
         float log_stdv = read.get_log_stdv(event_idx, strand);
-        float lp_stdv = log_invgauss_pdf(stdv, log_stdv, state);
-        lp += log_invgauss_pdf(stdv, log_stdv, state);
+        lp += log_invgauss_pdf(stdv, log_stdv, pm.get_scaled_state(kmer_rank));
     }
 
 #if DEBUG_HMM_EMISSION
-    printf("Event[%d] Kmer: %d -- L:%.1lf m: %.1lf s: %.1lf p: %.3lf p_old: %.3lf\n", event_idx, kmer_rank, level, state.level_mean, state.level_stdv, exp(lp), normal_pdf(level, state));
+    printf("Event[%d] Kmer: %d -- L:%.1lf m: %.1lf s: %.1lf p: %.3lf\n", event_idx, kmer_rank, level, scaled_level.mean, 1.0 / scaled_level.inv_stdv, exp(lp));
 #endif
 
     return lp;
@@ -0,0 +1,84 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_hmm_band -- restrict the HMM dynamic programming
+// matrix to the k-mers around an expected alignment
+//
+#include <assert.h>
+#include <algorithm>
+#include "nanopolish_hmm_band.h"
+
+HMMBand make_diagonal_band(uint32_t num_events, uint32_t num_kmers, uint32_t width)
+{
+    // the endpoints are always added by make_anchored_band
+    std::vector<HMMBandAnchor> anchors;
+    return make_anchored_band(anchors, num_events, num_kmers, width);
+}
+
+HMMBand make_anchored_band(const std::vector<HMMBandAnchor>& input_anchors,
+                           uint32_t num_events,
+                           uint32_t num_kmers,
+                           uint32_t width)
+{
+    assert(num_events > 0);
+    assert(num_kmers > 0);
+    assert(width > 0);
+
+    HMMBand band;
+    band.width = std::min(width, num_kmers);
+    band.num_kmers = num_kmers;
+    band.kmer_start.resize(num_events);
+
+    // The alignment must start at the first k-mer and end at the last one
+    // so these are always the outermost anchors. Drop anchors that are
+    // out of range or would make the path move backwards.
+    std::vector<HMMBandAnchor> anchors;
+    anchors.push_back({ 0, 0 });
+    for(size_t i = 0; i < input_anchors.size(); ++i) {
+        const HMMBandAnchor& a = input_anchors[i];
+        const HMMBandAnchor& prev = anchors.back();
+        if(a.event_offset > prev.event_offset && a.event_offset < num_events - 1 &&
+           a.kmer_idx >= prev.kmer_idx && a.kmer_idx < num_kmers) {
+            anchors.push_back(a);
+        }
+    }
+
+    if(num_events > 1) {
+        anchors.push_back({ num_events - 1, num_kmers - 1 });
+    }
+
+    uint32_t half_width = band.width / 2;
+    uint32_t max_start = num_kmers - band.width;
+
+    size_t ai = 0;
+    for(uint32_t ei = 0; ei < num_events; ++ei) {
+
+        // find the anchors bracketing this event
+        while(ai + 1 < anchors.size() && anchors[ai + 1].event_offset <= ei) {
+            ai++;
+        }
+
+        uint32_t center = anchors[ai].kmer_idx;
+        if(ai + 1 < anchors.size()) {
+            const HMMBandAnchor& a = anchors[ai];
+            const HMMBandAnchor& b = anchors[ai + 1];
+            double slope = (double)(b.kmer_idx - a.kmer_idx) / (b.event_offset - a.event_offset);
+            center = a.kmer_idx + (uint32_t)(slope * (ei - a.event_offset) + 0.5);
+        }
+
+        uint32_t start = center > half_width ? center - half_width : 0;
+        start = std::min(start, max_start);
+
+        // Consecutive bands must overlap, otherwise no path can pass through them.
+        // Skips within a row let the path move to the end of the band.
+        if(ei > 0) {
+            start = std::max(start, band.kmer_start[ei - 1]);
+            start = std::min(start, band.kmer_start[ei - 1] + band.width - 1);
+        }
+        band.kmer_start[ei] = start;
+    }
+
+    return band;
+}
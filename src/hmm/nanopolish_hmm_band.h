@@ -0,0 +1,52 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_hmm_band -- restrict the HMM dynamic programming
+// matrix to the k-mers around an expected alignment
+//
+#ifndef NANOPOLISH_HMM_BAND_H
+#define NANOPOLISH_HMM_BAND_H
+
+#include <stdint.h>
+#include <vector>
+
+// An expected alignment of an event to a k-mer of the input sequence.
+// Offsets are relative to the first event/k-mer of the input.
+struct HMMBandAnchor
+{
+    uint32_t event_offset;
+    uint32_t kmer_idx;
+};
+
+// For each event only the k-mers [kmer_start[i], kmer_start[i] + width)
+// are computed. Every other cell of the matrix is treated as -INFINITY.
+struct HMMBand
+{
+    uint32_t width;
+    uint32_t num_kmers;
+    std::vector<uint32_t> kmer_start; // one entry per event
+
+    // the band is hit if a path passes through its first or last k-mer,
+    // unless that is also the first or last k-mer of the sequence
+    inline bool is_edge(uint32_t event_offset, uint32_t kmer_idx) const
+    {
+        uint32_t start = kmer_start[event_offset];
+        uint32_t end = start + width - 1;
+        return (kmer_idx == start && start > 0) || (kmer_idx == end && end < num_kmers - 1);
+    }
+};
+
+// Build a band centered on the diagonal from the first event
+// and first k-mer to the last event and last k-mer
+HMMBand make_diagonal_band(uint32_t num_events, uint32_t num_kmers, uint32_t width);
+
+// Build a band centered on a path through the anchors, linearly interpolating
+// between them. The anchors must be sorted by event offset.
+HMMBand make_anchored_band(const std::vector<HMMBandAnchor>& anchors,
+                           uint32_t num_events,
+                           uint32_t num_kmers,
+                           uint32_t width);
+
+#endif
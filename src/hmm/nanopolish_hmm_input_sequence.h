@@ -10,6 +10,8 @@
 #define NANOPOLISH_HMM_INPUT_SEQUENCE
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include "nanopolish_common.h"
 #include "nanopolish_alphabet.h"
 
@@ -27,6 +29,7 @@ class HMMInputSequence
                              m_seq(seq)
         {
             m_rc_seq = m_alphabet->reverse_complement(seq);
+            store_kmer_ranks();
         }
 
         HMMInputSequence(const std::string& fwd,
@@ -36,15 +39,22 @@ class HMMInputSequence
                              m_seq(fwd),
                              m_rc_seq(rc)
         {
-
+            store_kmer_ranks();
         }
 
 
         //
         size_t length() const { return m_seq.length(); }
+        const std::string& get_sequence() const { return m_seq; }
+        const std::string& get_rc_sequence() const { return m_rc_seq; }
+        const Alphabet* get_alphabet() const { return m_alphabet; }
 
         // swap sequence and its reverse complement
-        void swap() { m_seq.swap(m_rc_seq); }
+        void swap() 
+        { 
+            m_seq.swap(m_rc_seq);
+            store_kmer_ranks();
+        }
 
         // returns the i-th kmer of the sequence
         inline std::string get_kmer(uint32_t i, uint32_t k, bool do_rc) const
@@ -62,11 +72,60 @@ class HMMInputSequence
         // NOT the ki-th kmer of the reverse-complemented sequence
         inline uint32_t get_kmer_rank(uint32_t i, uint32_t k, bool do_rc) const
         {
+            if(is_stored_k(k)) {
+                return m_kmer_ranks[do_rc][k - MIN_STORED_K][i];
+            }
             return ! do_rc ? _kmer_rank(i, k) : _rc_kmer_rank(i, k);
         }
 
+        // get the ranks of all kmers of the sequence, in the order of get_kmer_rank
+        std::vector<uint32_t> get_kmer_ranks(uint32_t k, bool do_rc) const
+        {
+            if(is_stored_k(k)) {
+                return m_kmer_ranks[do_rc][k - MIN_STORED_K];
+            }
+
+            std::vector<uint32_t> ranks;
+            calculate_kmer_ranks(k, do_rc, ranks);
+            return ranks;
+        }
+
     private:
 
+        // The ranks of every kmer of both strands are calculated once, at
+        // construction, for the kmer sizes of the pore models. Other sizes
+        // are calculated when they are asked for.
+        static const uint32_t MIN_STORED_K = 5;
+        static const uint32_t MAX_STORED_K = 6;
+
+        static bool is_stored_k(uint32_t k) { return k >= MIN_STORED_K && k <= MAX_STORED_K; }
+
+        void store_kmer_ranks()
+        {
+            for(uint32_t k = MIN_STORED_K; k <= MAX_STORED_K; ++k) {
+                calculate_kmer_ranks(k, false, m_kmer_ranks[0][k - MIN_STORED_K]);
+                calculate_kmer_ranks(k, true, m_kmer_ranks[1][k - MIN_STORED_K]);
+            }
+        }
+
+        void calculate_kmer_ranks(uint32_t k, bool do_rc, std::vector<uint32_t>& ranks) const
+        {
+            size_t n = length();
+            ranks.resize(n >= k ? n - k + 1 : 0);
+            if(ranks.empty()) {
+                return;
+            }
+
+            if(! do_rc) {
+                m_alphabet->kmer_ranks(m_seq.c_str(), n, k, ranks.data());
+            } else {
+                // the i-th rank is that of the kmer of the reverse
+                // complement that covers the same bases as the i-th kmer
+                m_alphabet->kmer_ranks(m_rc_seq.c_str(), n, k, ranks.data());
+                std::reverse(ranks.begin(), ranks.end());
+            }
+        }
+
         inline uint32_t _kmer_rank(uint32_t i, uint32_t k) const
         {
             return m_alphabet->kmer_rank(m_seq.c_str() + i, k);
@@ -82,6 +141,100 @@ class HMMInputSequence
 
         std::string m_seq;
         std::string m_rc_seq;
+
+        // indexed by strand, then by kmer size - MIN_STORED_K
+        std::vector<uint32_t> m_kmer_ranks[2][MAX_STORED_K - MIN_STORED_K + 1];
+};
+
+//
+// A non-owning view of a sequence that is input into the HMM.
+// The HMM functions take their sequence as a view so that scoring
+// a std::string neither copies it nor computes its reverse complement
+// and kmer ranks up front. The reverse complement is only computed
+// when the ranks of the reverse strand are asked for. A view of an
+// HMMInputSequence uses the ranks stored by the sequence.
+//
+// The viewed strings must outlive the view. Views made from the
+// arguments of a function call live until the call returns.
+//
+class HMMInputSequenceView
+{
+    public:
+
+        // constructors
+        explicit HMMInputSequenceView(const std::string& seq, const Alphabet* alphabet = &gDNAAlphabet) :
+                                 m_alphabet(alphabet),
+                                 m_seq(seq.c_str()),
+                                 m_rc_seq(NULL),
+                                 m_length(seq.length()),
+                                 m_owner(NULL) {}
+
+        HMMInputSequenceView(const std::string& fwd,
+                             const std::string& rc,
+                             const Alphabet* alphabet) :
+                                 m_alphabet(alphabet),
+                                 m_seq(fwd.c_str()),
+                                 m_rc_seq(rc.c_str()),
+                                 m_length(fwd.length()),
+                                 m_owner(NULL) {}
+
+        HMMInputSequenceView(const HMMInputSequence& sequence) :
+                                 m_alphabet(sequence.get_alphabet()),
+                                 m_seq(sequence.get_sequence().c_str()),
+                                 m_rc_seq(sequence.get_rc_sequence().c_str()),
+                                 m_length(sequence.length()),
+                                 m_owner(&sequence) {}
+
+        //
+        size_t length() const { return m_length; }
+
+        // swap sequence and its reverse complement, which must be known
+        void swap()
+        {
+            assert(m_rc_seq != NULL);
+            std::swap(m_seq, m_rc_seq);
+            m_owner = NULL;
+        }
+
+        // get the number of kmer ranks supported by the alphabet for this sequence
+        size_t get_num_kmer_ranks(size_t k) const { return m_alphabet->get_num_strings(k); }
+
+        // get the ranks of all kmers of the sequence, see HMMInputSequence::get_kmer_ranks
+        std::vector<uint32_t> get_kmer_ranks(uint32_t k, bool do_rc) const
+        {
+            if(m_owner != NULL) {
+                return m_owner->get_kmer_ranks(k, do_rc);
+            }
+
+            std::vector<uint32_t> ranks(m_length >= k ? m_length - k + 1 : 0);
+            if(ranks.empty()) {
+                return ranks;
+            }
+
+            if(! do_rc) {
+                m_alphabet->kmer_ranks(m_seq, m_length, k, ranks.data());
+            } else if(m_rc_seq != NULL) {
+                m_alphabet->kmer_ranks(m_rc_seq, m_length, k, ranks.data());
+                std::reverse(ranks.begin(), ranks.end());
+            } else {
+                std::string rc_seq = m_alphabet->reverse_complement(std::string(m_seq, m_length));
+                m_alphabet->kmer_ranks(rc_seq.c_str(), m_length, k, ranks.data());
+                std::reverse(ranks.begin(), ranks.end());
+            }
+            return ranks;
+        }
+
+    private:
+
+        HMMInputSequenceView(); // not allowed
+        const Alphabet* m_alphabet;
+
+        const char* m_seq;
+        const char* m_rc_seq; // NULL when it has not been computed
+        size_t m_length;
+
+        // the sequence being viewed, if any
+        const HMMInputSequence* m_owner;
 };
 
 #endif
@@ -8,10 +8,11 @@
 #include <algorithm>
 #include "nanopolish_profile_hmm.h"
 #include "nanopolish_profile_hmm_r9.h"
+#include "nanopolish_profile_hmm_r9_simd.h"
 #include "nanopolish_profile_hmm_r7.h"
 
 // convenience function to run the HMM over multiple inputs and sum the result
-float profile_hmm_score(const HMMInputSequence& sequence, const std::vector<HMMInputData>& data, const uint32_t flags)
+float profile_hmm_score(const HMMInputSequenceView& sequence, const std::vector<HMMInputData>& data, const uint32_t flags)
 {
     float score = 0.0f;
     for(size_t i = 0; i < data.size(); ++i) {
@@ -20,7 +21,7 @@ float profile_hmm_score(const HMMInputSequence& sequence, const std::vector<HMMI
     return score;
 }
 
-float profile_hmm_score(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags)
+float profile_hmm_score(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
 {
     if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
         return profile_hmm_score_r9(sequence, data, flags);
@@ -29,7 +30,108 @@ float profile_hmm_score(const HMMInputSequence& sequence, const HMMInputData& da
     }
 }
 
-std::vector<HMMAlignmentState> profile_hmm_align(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags)
+float profile_hmm_score(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags, HMMXDrop* xdrop)
+{
+    if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
+        return profile_hmm_score_r9(sequence, data, flags, xdrop);
+    } else {
+        return profile_hmm_score_r7(sequence, data, flags, xdrop);
+    }
+}
+
+float profile_hmm_score_linear(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
+{
+    if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
+        return profile_hmm_score_linear_r9(sequence, data, flags);
+    } else {
+        return profile_hmm_score_linear_r7(sequence, data, flags);
+    }
+}
+
+std::vector<float> profile_hmm_score_batch(const std::vector<HMMInputSequence>& sequences, const HMMInputData& data, const uint32_t flags)
+{
+    if(get_hmm_simd_level() != HSL_SCALAR) {
+        if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
+            return profile_hmm_score_batch_simd_r9(sequences, data, flags);
+        } else if(get_hmm_simd_r7()) {
+            return profile_hmm_score_batch_simd_r7(sequences, data, flags);
+        }
+    }
+
+    std::vector<float> scores(sequences.size());
+    for(size_t i = 0; i < sequences.size(); ++i) {
+        scores[i] = profile_hmm_score(sequences[i], data, flags);
+    }
+    return scores;
+}
+
+std::vector<float> profile_hmm_score_reads(const HMMInputSequenceView& sequence, const std::vector<HMMInputData>& data, const uint32_t flags)
+{
+    std::vector<float> scores(data.size());
+    if(get_hmm_simd_level() == HSL_SCALAR) {
+        #pragma omp parallel for
+        for(size_t i = 0; i < data.size(); ++i) {
+            scores[i] = profile_hmm_score(sequence, data[i], flags);
+        }
+        return scores;
+    }
+
+    // the reads of each model are scored together
+    std::vector<HMMInputData> data_by_kit[2];
+    std::vector<size_t> index_by_kit[2];
+    for(size_t i = 0; i < data.size(); ++i) {
+        int is_r9 = data[i].read->pore_model[data[i].strand].metadata.kit == KV_SQK007;
+        data_by_kit[is_r9].push_back(data[i]);
+        index_by_kit[is_r9].push_back(i);
+    }
+
+    for(int is_r9 = 0; is_r9 < 2; ++is_r9) {
+        if(data_by_kit[is_r9].empty()) {
+            continue;
+        }
+
+        // the R7 reads are scored one at a time unless their kernel is enabled
+        if(!is_r9 && !get_hmm_simd_r7()) {
+            const std::vector<HMMInputData>& kit_data = data_by_kit[is_r9];
+            #pragma omp parallel for
+            for(size_t i = 0; i < kit_data.size(); ++i) {
+                scores[index_by_kit[is_r9][i]] = profile_hmm_score_r7(sequence, kit_data[i], flags);
+            }
+            continue;
+        }
+
+        std::vector<float> kit_scores = is_r9 ? profile_hmm_score_reads_simd_r9(sequence, data_by_kit[is_r9], flags)
+                                              : profile_hmm_score_reads_simd_r7(sequence, data_by_kit[is_r9], flags);
+        for(size_t i = 0; i < kit_scores.size(); ++i) {
+            scores[index_by_kit[is_r9][i]] = kit_scores[i];
+        }
+    }
+    return scores;
+}
+
+HMMScoredBase profile_hmm_score_base(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
+{
+    HMMScoredBase base;
+    if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
+        profile_hmm_score_base_r9(sequence, data, flags, base);
+    } else {
+        base.data = data;
+        base.flags = flags;
+        base.score = profile_hmm_score_r7(sequence, data, flags);
+        base.n_cols = 0;
+    }
+    return base;
+}
+
+float profile_hmm_score_edit(const HMMScoredBase& base, const HMMInputSequenceView& sequence)
+{
+    if(base.forward.empty()) {
+        return profile_hmm_score(sequence, base.data, base.flags);
+    }
+    return profile_hmm_score_edit_r9(base, sequence);
+}
+
+std::vector<HMMAlignmentState> profile_hmm_align(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
 {
     if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
         return profile_hmm_align_r9(sequence, data, flags);
@@ -37,3 +139,27 @@ std::vector<HMMAlignmentState> profile_hmm_align(const HMMInputSequence& sequenc
         return profile_hmm_align_r7(sequence, data, flags);
     }
 }
+
+float profile_hmm_score_banded(const HMMInputSequenceView& sequence, const HMMInputData& data, const HMMBand& band, const uint32_t flags, bool* hit_band_edge)
+{
+    if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
+        return profile_hmm_score_banded_r9(sequence, data, band, flags, hit_band_edge);
+    } else {
+        if(hit_band_edge != NULL) {
+            *hit_band_edge = false;
+        }
+        return profile_hmm_score_r7(sequence, data, flags);
+    }
+}
+
+std::vector<HMMAlignmentState> profile_hmm_align_banded(const HMMInputSequenceView& sequence, const HMMInputData& data, const HMMBand& band, const uint32_t flags, bool* hit_band_edge)
+{
+    if(data.read->pore_model[data.strand].metadata.kit == KV_SQK007) {
+        return profile_hmm_align_banded_r9(sequence, data, band, flags, hit_band_edge);
+    } else {
+        if(hit_band_edge != NULL) {
+            *hit_band_edge = false;
+        }
+        return profile_hmm_align_r7(sequence, data, flags);
+    }
+}
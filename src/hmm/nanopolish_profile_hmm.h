@@ -15,23 +15,94 @@
 #include "nanopolish_common.h"
 #include "nanopolish_emissions.h"
 #include "nanopolish_hmm_input_sequence.h"
+#include "nanopolish_hmm_band.h"
 
 //
 // High level algorithms
 //
 
 // Calculate the probability of the nanopore events given a sequence
-float profile_hmm_score(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
-float profile_hmm_score(const HMMInputSequence& sequence, const std::vector<HMMInputData>& data, const uint32_t flags = 0);
+float profile_hmm_score(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
+float profile_hmm_score(const HMMInputSequenceView& sequence, const std::vector<HMMInputData>& data, const uint32_t flags = 0);
+
+// As above, giving up on sequences that score much worse than a reference.
+// The first call with xdrop scores the reference and records the best cell
+// of each row of its forward matrix. Later calls stop, returning -INFINITY,
+// as soon as the best cell of a row is more than xdrop->x_drop below the
+// reference's. Candidates usually differ from the reference in a short
+// region so a gap that large rarely closes in the remaining rows, but
+// unlike the score itself this is a heuristic. Only the vectorized kernels
+// stop early. xdrop may be NULL.
+float profile_hmm_score(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags, HMMXDrop* xdrop);
+
+// A faster approximation of profile_hmm_score for screening candidate
+// sequences. The forward algorithm is run in linear probability space,
+// dividing each row by its largest cell to keep the values in range as
+// in HMMER's rescaled filters, so the log-sums become multiply-adds.
+// Paths through cells more than ~87 nats below the largest cell of their
+// row are lost to underflow so the result can be slightly lower than
+// profile_hmm_score, or -INFINITY when a row underflows entirely. The
+// sequences that pass the screen should be re-scored with profile_hmm_score.
+float profile_hmm_score_linear(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
+
+// Calculate the probability of the nanopore events for each of a set of
+// related sequences, like the alternative bases at one position of a
+// haplotype. This is faster than calling profile_hmm_score on each
+// sequence when they share a prefix with the first sequence.
+std::vector<float> profile_hmm_score_batch(const std::vector<HMMInputSequence>& sequences, const HMMInputData& data, const uint32_t flags = 0);
+
+// Calculate the probability of the nanopore events of each read given
+// a single sequence. This scores several reads at once on the vector unit
+// and is faster than calling profile_hmm_score on each read.
+std::vector<float> profile_hmm_score_reads(const HMMInputSequenceView& sequence, const std::vector<HMMInputData>& data, const uint32_t flags = 0);
+
+// A sequence scored against one read, keeping the forward and backward
+// matrices so that sequences differing from it by a local edit can be
+// scored by profile_hmm_score_edit
+struct HMMScoredBase
+{
+    HMMInputData data;
+    uint32_t flags;
+    float score;
+    std::vector<uint32_t> kmer_ranks;
+
+    // Row-major matrices with n_cols columns. Empty when the
+    // model does not support incremental scoring (R7).
+    uint32_t n_cols;
+    std::vector<float> forward;
+    std::vector<float> backward;
+};
+
+HMMScoredBase profile_hmm_score_base(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
+
+// Calculate the probability of the read's events given a sequence that
+// differs from the base sequence in a single region, like a haplotype
+// with one variant applied. The columns of the matrix for the k-mers
+// before the region are taken from the base's forward matrix, the columns
+// for the k-mers in the region are computed and the k-mers after it are
+// accounted for by the base's backward matrix, so the cost is proportional
+// to the size of the region. Other sequences are scored in full.
+float profile_hmm_score_edit(const HMMScoredBase& base, const HMMInputSequenceView& sequence);
 
 // Run viterbi to align events to kmers
-std::vector<HMMAlignmentState> profile_hmm_align(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
+std::vector<HMMAlignmentState> profile_hmm_align(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
+
+// As above but only the cells of the matrix within the band are computed.
+// hit_band_edge, if not NULL, is set when the best path touches the edge of the band.
+// The band is currently only used for R9 data, R7 data is scored with the full matrix.
+float profile_hmm_score_banded(const HMMInputSequenceView& sequence, const HMMInputData& data, const HMMBand& band, const uint32_t flags = 0, bool* hit_band_edge = NULL);
+std::vector<HMMAlignmentState> profile_hmm_align_banded(const HMMInputSequenceView& sequence, const HMMInputData& data, const HMMBand& band, const uint32_t flags = 0, bool* hit_band_edge = NULL);
 
 // Flags to modify the behaviour of the HMM
+// HAF_CALCULATE_POSTERIORS is for callers of profile_hmm_align that want
+// per-event confidences. None of the subprograms set it yet, so eventalign
+// and training output are unchanged, and the extra forward-backward pass
+// is only paid for by callers that ask for it.
 enum HMMAlignmentFlags
 {
     HAF_ALLOW_PRE_CLIP = 1, // allow events to go unmatched before the aligning region
-    HAF_ALLOW_POST_CLIP = 2 // allow events to go unmatched after the aligning region
+    HAF_ALLOW_POST_CLIP = 2, // allow events to go unmatched after the aligning region
+    HAF_CALCULATE_POSTERIORS = 4 // fill in HMMAlignmentState::l_posterior (R9 only)
 };
 
 #endif
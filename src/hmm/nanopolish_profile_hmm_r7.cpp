@@ -8,6 +8,7 @@
 //
 #include <algorithm>
 #include "nanopolish_profile_hmm_r7.h"
+#include "nanopolish_profile_hmm_r9_simd.h"
 
 //#define DEBUG_FILL
 //#define PRINT_TRAINING_MESSAGES 1
@@ -37,8 +38,13 @@ float profile_hmm_forward_terminate_r7(const FloatMatrix& fm,
     return -INFINITY;
 }
 
-float profile_hmm_score_r7(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags)
+float profile_hmm_score_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags, HMMXDrop* xdrop)
 {
+    // Use the vectorized kernel when it is enabled and the CPU supports it
+    if(get_hmm_simd_r7() && get_hmm_simd_level() != HSL_SCALAR) {
+        return profile_hmm_score_simd_r7(sequence, data, flags, xdrop);
+    }
+
     const uint32_t k = data.read->pore_model[data.strand].k;
     uint32_t n_kmers = sequence.length() - k + 1;
 
@@ -54,19 +60,10 @@ float profile_hmm_score_r7(const HMMInputSequence& sequence, const HMMInputData&
 
     uint32_t n_rows = n_events + 1;
 
-    // Allocate a matrix to hold the HMM result
-    FloatMatrix fm;
-    allocate_matrix(fm, n_rows, n_states);
-
-    profile_hmm_forward_initialize_r7(fm);
-
-    ProfileHMMForwardOutputR7 output(&fm);
+    // Only the end state is needed so just two rows of the matrix are stored
+    ProfileHMMTwoRowForwardOutputR7 output(n_rows, n_states);
 
-    float score = profile_hmm_fill_generic_r7(sequence, data, e_start, flags, output);
-
-    // cleanup
-    free_matrix(fm);
-    return score;
+    return profile_hmm_fill_generic_r7(sequence, data, e_start, flags, output);
 }
 
 void profile_hmm_viterbi_initialize_r7(FloatMatrix& m)
@@ -75,7 +72,7 @@ void profile_hmm_viterbi_initialize_r7(FloatMatrix& m)
     profile_hmm_forward_initialize_r7(m);
 }
 
-std::vector<HMMAlignmentState> profile_hmm_align_r7(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags)
+std::vector<HMMAlignmentState> profile_hmm_align_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
 {
     std::vector<HMMAlignmentState> alignment;
     const uint32_t k = data.read->pore_model[data.strand].k;
@@ -96,10 +93,10 @@ std::vector<HMMAlignmentState> profile_hmm_align_r7(const HMMInputSequence& sequ
     
     // Allocate matrices to hold the HMM result
     FloatMatrix vm;
-    allocate_matrix(vm, n_rows, n_states);
+    MatrixLease<float> vm_lease(vm, n_rows, n_states);
     
     UInt8Matrix bm;
-    allocate_matrix(bm, n_rows, n_states);
+    MatrixLease<uint8_t> bm_lease(bm, n_rows, n_states);
 
     ProfileHMMViterbiOutputR7 output(&vm, &bm);
 
@@ -186,9 +183,5 @@ std::vector<HMMAlignmentState> profile_hmm_align_r7(const HMMInputSequence& sequ
     std::reverse(alignment.begin(), alignment.end());
 #endif
 
-    //
-    free_matrix(vm);
-    free_matrix(bm);
-
     return alignment;
 }
@@ -25,10 +25,10 @@
 //
 
 // Calculate the probability of the nanopore events given a sequence
-float profile_hmm_score_r7(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
+float profile_hmm_score_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0, HMMXDrop* xdrop = NULL);
 
 // Run viterbi to align events to kmers
-std::vector<HMMAlignmentState> profile_hmm_align_r7(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
+std::vector<HMMAlignmentState> profile_hmm_align_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
 
 //
 // Forward algorithm
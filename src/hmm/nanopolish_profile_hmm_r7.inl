@@ -6,7 +6,7 @@
 // nanopolish_profile_hmm -- Profile Hidden Markov Model
 // for R7 data
 //
-inline float calculate_skip_probability_r7(const HMMInputSequence& sequence,
+inline float calculate_skip_probability_r7(const std::vector<uint32_t>& kmer_ranks,
                                            const HMMInputData& data,
                                            uint32_t ki,
                                            uint32_t kj)
@@ -14,8 +14,8 @@ inline float calculate_skip_probability_r7(const HMMInputSequence& sequence,
     const PoreModel& pm = data.read->pore_model[data.strand];
     const TransitionParameters& parameters = data.read->parameters[data.strand];
 
-    uint32_t rank_i = sequence.get_kmer_rank(ki, pm.k, data.rc);
-    uint32_t rank_j = sequence.get_kmer_rank(kj, pm.k, data.rc);
+    uint32_t rank_i = kmer_ranks[ki];
+    uint32_t rank_j = kmer_ranks[kj];
 
     GaussianParameters level_i = pm.get_scaled_parameters(rank_i);
     GaussianParameters level_j = pm.get_scaled_parameters(rank_j);
@@ -23,16 +23,17 @@ inline float calculate_skip_probability_r7(const HMMInputSequence& sequence,
     return parameters.get_skip_probability(level_i.mean, level_j.mean);
 }
 
-inline std::vector<BlockTransitionsR7> calculate_transitions_r7(uint32_t num_kmers, const HMMInputSequence& sequence, const HMMInputData& data)
+inline std::vector<BlockTransitionsR7> calculate_transitions_r7(uint32_t num_kmers, const HMMInputSequenceView& sequence, const HMMInputData& data)
 {
     const TransitionParameters& parameters = data.read->parameters[data.strand];
+    std::vector<uint32_t> kmer_ranks = sequence.get_kmer_ranks(data.read->pore_model[data.strand].k, data.rc);
 
     std::vector<BlockTransitionsR7> transitions(num_kmers);
     
     for(uint32_t ki = 0; ki < num_kmers; ++ki) {
 
         // probability of skipping k_i from k_(i - 1)
-        float p_skip = ki > 0 ? calculate_skip_probability_r7(sequence, data, ki - 1, ki) : 0.0f;
+        float p_skip = ki > 0 ? calculate_skip_probability_r7(kmer_ranks, data, ki - 1, ki) : 0.0f;
 
         // transitions from match state in previous block
         float p_mk = p_skip;
@@ -115,6 +116,67 @@ class ProfileHMMForwardOutputR7
         float lp_end;
 };
 
+// Output writer for the Forward Algorithm that only keeps the previous
+// and current rows of the matrix. This is sufficient when only the
+// probability of the end state is needed.
+class ProfileHMMTwoRowForwardOutputR7
+{
+    public:
+        ProfileHMMTwoRowForwardOutputR7(uint32_t n_rows, uint32_t n_cols) : lease(fm, 2, n_cols), num_rows(n_rows), lp_end(-INFINITY)
+        {
+            // Every cell starts as -INFINITY. The fill never writes
+            // the start and terminal blocks so they stay that way.
+            for(uint32_t ri = 0; ri < fm.n_rows; ri++) {
+                for(uint32_t si = 0; si < fm.n_cols; si++) {
+                    ::set(fm, ri, si, -INFINITY);
+                }
+            }
+        }
+
+        inline void update_4(uint32_t row, uint32_t col, float m, float e, float k, float s, float lp_emission)
+        {
+            float sum_1 = add_logs(m, e);
+            float sum_2 = add_logs(k, s);
+            float sum = add_logs(sum_1, sum_2) + lp_emission;
+            ::set(fm, row & 1, col, sum);
+        }
+
+        inline void update_end(float v, uint32_t row, uint32_t col)
+        {
+            lp_end = add_logs(lp_end, v);
+        }
+
+        // only valid for the current and previous row
+        inline float get(uint32_t row, uint32_t col) const
+        {
+            return ::get(fm, row & 1, col);
+        }
+
+        inline float get_end() const
+        {
+            return lp_end;
+        }
+
+        inline size_t get_num_columns() const
+        {
+            return fm.n_cols;
+        }
+
+        inline size_t get_num_rows() const
+        {
+            return num_rows;
+        }
+
+    private:
+        ProfileHMMTwoRowForwardOutputR7(); // not allowed
+        ProfileHMMTwoRowForwardOutputR7(const ProfileHMMTwoRowForwardOutputR7&); // not allowed
+
+        FloatMatrix fm;
+        MatrixLease<float> lease;
+        uint32_t num_rows;
+        float lp_end;
+};
+
 // Output writer for the Viterbi Algorithm
 class ProfileHMMViterbiOutputR7
 {
@@ -261,14 +323,14 @@ inline std::vector<float> make_post_flanking_r7(const HMMInputData& data,
 // The templated ProfileHMMOutput class allows one to run either Viterbi
 // or the Forward algorithm.
 template<class ProfileHMMOutput>
-inline float profile_hmm_fill_generic_r7(const HMMInputSequence& _sequence,
+inline float profile_hmm_fill_generic_r7(const HMMInputSequenceView& _sequence,
                                          const HMMInputData& _data,
                                          const uint32_t _e_start,
                                          uint32_t flags,
                                          ProfileHMMOutput& output)
 {
     PROFILE_FUNC("profile_hmm_fill_generic")
-    HMMInputSequence sequence = _sequence;
+    HMMInputSequenceView sequence = _sequence;
     HMMInputData data = _data;
     assert( (data.rc && data.event_stride == -1) || (!data.rc && data.event_stride == 1));
 
@@ -305,9 +367,8 @@ inline float profile_hmm_fill_generic_r7(const HMMInputSequence& _sequence,
     // Make sure the HMMInputSequence's alphabet matches the state space of the read
     assert( data.read->pore_model[data.strand].states.size() == sequence.get_num_kmer_ranks(k) );
 
-    std::vector<uint32_t> kmer_ranks(num_kmers);
-    for(size_t ki = 0; ki < num_kmers; ++ki)
-        kmer_ranks[ki] = sequence.get_kmer_rank(ki, k, data.rc);
+    std::vector<uint32_t> kmer_ranks = sequence.get_kmer_ranks(k, data.rc);
+    assert(kmer_ranks.size() == num_kmers);
 
     size_t num_events = output.get_num_rows() - 1;
 
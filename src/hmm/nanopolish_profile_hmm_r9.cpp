@@ -6,11 +6,62 @@
 // nanopolish_profile_hmm -- Profile Hidden Markov Model
 //
 #include <algorithm>
+#include <string.h>
+#include <map>
 #include "nanopolish_profile_hmm_r9.h"
+#include "nanopolish_profile_hmm_r9_simd.h"
 
 //#define DEBUG_FILL
 //#define PRINT_TRAINING_MESSAGES 1
 
+//
+// Shared tables
+//
+
+// Return a table of at least min_size entries built by calculate. Each
+// thread keeps its own tables so the fills neither lock nor count references.
+// A table that is too short is replaced by one at least twice as long so that
+// slowly increasing sizes do not rebuild it on every call. Replaced tables are
+// kept as callers on the thread may still refer to them.
+template<typename T, typename CalculateFunc>
+static const std::vector<T>& get_thread_table(std::vector<std::unique_ptr<const std::vector<T>>>& tables,
+                                              size_t min_size,
+                                              CalculateFunc calculate)
+{
+    if(tables.empty() || tables.back()->size() < min_size) {
+        size_t size = tables.empty() ? min_size : std::max(min_size, 2 * tables.back()->size());
+        tables.emplace_back(new std::vector<T>(calculate(size)));
+    }
+    return *tables.back();
+}
+
+const std::vector<BlockTransitions>& get_transitions_r9(uint32_t num_kmers)
+{
+#ifdef USE_EXTERNAL_PARAMS
+    // the parameters can change between calls
+    static thread_local std::vector<BlockTransitions> table;
+    table.assign(num_kmers, calculate_block_transitions_r9());
+    return table;
+#else
+    static thread_local std::vector<std::unique_ptr<const std::vector<BlockTransitions>>> tables;
+    return get_thread_table(tables, num_kmers, [](size_t n) {
+        return std::vector<BlockTransitions>(n, calculate_block_transitions_r9());
+    });
+#endif
+}
+
+const std::vector<float>& get_flanking_r9(const HMMInputData& data, uint32_t num_events)
+{
+    // The clipping transitions are constants, the tables are kept
+    // for each background emission probability they were built with
+    float lp_background = log_probability_background(*data.read, data.event_start_idx, data.strand);
+
+    static thread_local std::map<float, std::vector<std::unique_ptr<const std::vector<float>>>> tables;
+    return get_thread_table(tables[lp_background], num_events + 1, [lp_background](size_t n) {
+        return calculate_flanking_r9(n - 1, lp_background);
+    });
+}
+
 void profile_hmm_forward_initialize_r9(FloatMatrix& fm)
 {
     // initialize forward calculation
@@ -25,8 +76,13 @@ void profile_hmm_forward_initialize_r9(FloatMatrix& fm)
     }
 }
 
-float profile_hmm_score_r9(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags)
+float profile_hmm_score_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags, HMMXDrop* xdrop)
 {
+    // Use the vectorized kernel when the CPU supports it
+    if(get_hmm_simd_level() != HSL_SCALAR) {
+        return profile_hmm_score_simd_r9(sequence, data, flags, xdrop);
+    }
+
     const uint32_t k = data.read->pore_model[data.strand].k;
     uint32_t n_kmers = sequence.length() - k + 1;
 
@@ -42,19 +98,10 @@ float profile_hmm_score_r9(const HMMInputSequence& sequence, const HMMInputData&
 
     uint32_t n_rows = n_events + 1;
 
-    // Allocate a matrix to hold the HMM result
-    FloatMatrix fm;
-    allocate_matrix(fm, n_rows, n_states);
-
-    profile_hmm_forward_initialize_r9(fm);
+    // Only the end state is needed so just two rows of the matrix are stored
+    ProfileHMMTwoRowForwardOutputR9 output(n_rows, n_states);
 
-    ProfileHMMForwardOutputR9 output(&fm);
-
-    float score = profile_hmm_fill_generic_r9(sequence, data, e_start, flags, output);
-
-    // cleanup
-    free_matrix(fm);
-    return score;
+    return profile_hmm_fill_generic_r9(sequence, data, e_start, flags, output);
 }
 
 void profile_hmm_viterbi_initialize_r9(FloatMatrix& m)
@@ -63,36 +110,17 @@ void profile_hmm_viterbi_initialize_r9(FloatMatrix& m)
     profile_hmm_forward_initialize_r9(m);
 }
 
-std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags)
+// Traceback through a filled Viterbi matrix to compute the alignment
+template<class ProfileHMMOutput>
+static std::vector<HMMAlignmentState> profile_hmm_backtrack_r9(const HMMInputSequenceView& sequence,
+                                                               const HMMInputData& data,
+                                                               const ProfileHMMOutput& output)
 {
     std::vector<HMMAlignmentState> alignment;
     const uint32_t k = data.read->pore_model[data.strand].k;
-
     uint32_t n_kmers = sequence.length() - k + 1;
-    uint32_t n_states = PSR9_NUM_STATES * (n_kmers + 2); // + 2 for explicit terminal states
-
+    uint32_t n_rows = output.get_num_rows();
     uint32_t e_start = data.event_start_idx;
-    uint32_t e_end = data.event_stop_idx;
-    uint32_t n_events = 0;
-    if(e_end > e_start)
-        n_events = e_end - e_start + 1;
-    else
-        n_events = e_start - e_end + 1;
-    assert(n_events >= 2);
-
-    uint32_t n_rows = n_events + 1;
-    
-    // Allocate matrices to hold the HMM result
-    FloatMatrix vm;
-    allocate_matrix(vm, n_rows, n_states);
-    
-    UInt8Matrix bm;
-    allocate_matrix(bm, n_rows, n_states);
-
-    ProfileHMMViterbiOutputR9 output(&vm, &bm);
-
-    profile_hmm_viterbi_initialize_r9(vm);
-    profile_hmm_fill_generic_r9(sequence, data, e_start, flags, output);
 
     // Traverse the backtrack matrix to compute the results
     int traversal_stride = data.event_stride;
@@ -122,19 +150,19 @@ std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequence& sequ
 #endif
 
         assert(block > 0);
-        assert(get(vm, row, col) != -INFINITY);
+        assert(output.get(row, col) != -INFINITY);
 
         HMMAlignmentState as;
         as.event_idx = event_idx;
         as.kmer_idx = kmer_idx;
         as.l_posterior = -INFINITY; // not computed
-        as.l_fm = get(vm, row, col);
+        as.l_fm = output.get(row, col);
         as.log_transition_probability = -INFINITY; // not computed
         as.state = ps2char(curr_ps);
         alignment.push_back(as);
 
         // Update the event (row) and k-mer using the backtrack matrix
-        HMMMovementType movement = (HMMMovementType)get(bm, row, col);
+        HMMMovementType movement = (HMMMovementType)output.get_backtrack(row, col);
         if(movement == HMT_FROM_SOFT) {
             break;
         }
@@ -189,9 +217,432 @@ std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequence& sequ
     std::reverse(alignment.begin(), alignment.end());
 #endif
 
-    //
-    free_matrix(vm);
-    free_matrix(bm);
+    return alignment;
+}
+
+std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
+{
+    const uint32_t k = data.read->pore_model[data.strand].k;
+
+    uint32_t n_kmers = sequence.length() - k + 1;
+    uint32_t n_states = PSR9_NUM_STATES * (n_kmers + 2); // + 2 for explicit terminal states
+
+    uint32_t e_start = data.event_start_idx;
+    uint32_t e_end = data.event_stop_idx;
+    uint32_t n_events = 0;
+    if(e_end > e_start)
+        n_events = e_end - e_start + 1;
+    else
+        n_events = e_start - e_end + 1;
+    assert(n_events >= 2);
+
+    uint32_t n_rows = n_events + 1;
+    
+    // Allocate matrices to hold the HMM result
+    FloatMatrix vm;
+    MatrixLease<float> vm_lease(vm, n_rows, n_states);
+    
+    UInt8Matrix bm;
+    MatrixLease<uint8_t> bm_lease(bm, n_rows, n_states);
+
+    ProfileHMMViterbiOutputR9 output(&vm, &bm);
+
+    profile_hmm_viterbi_initialize_r9(vm);
+    profile_hmm_fill_generic_r9(sequence, data, e_start, flags, output);
+
+    std::vector<HMMAlignmentState> alignment = profile_hmm_backtrack_r9(sequence, data, output);
+    if(flags & HAF_CALCULATE_POSTERIORS) {
+        profile_hmm_posterior_r9(sequence, data, flags, alignment);
+    }
+    return alignment;
+}
+
+// Returns the number of events between start and stop, inclusive
+static uint32_t count_events(const HMMInputData& data)
+{
+    uint32_t e_start = data.event_start_idx;
+    uint32_t e_end = data.event_stop_idx;
+    return e_end > e_start ? e_end - e_start + 1 : e_start - e_end + 1;
+}
+
+// Fill in one row of the backward matrix. curr[col] is the log probability
+// of the events after this row given the HMM is in state col after emitting
+// the event of this row. next is the following row, or NULL for the last row.
+static void profile_hmm_backward_row_r9(const HMMInputData& data,
+                                        uint32_t flags,
+                                        uint32_t row,
+                                        uint32_t num_events,
+                                        const std::vector<BlockTransitions>& transitions,
+                                        const std::vector<uint32_t>& kmer_ranks,
+                                        const std::vector<float>& post_flank,
+                                        EmissionTableCells* emission_cells,
+                                        const float* next,
+                                        float* curr)
+{
+    uint32_t num_kmers = kmer_ranks.size();
+    uint32_t num_blocks = num_kmers + 2;
+    std::fill(curr, curr + PSR9_NUM_STATES * num_blocks, -INFINITY);
+
+    // See profile_hmm_fill_generic_r9
+    float lp_ms = 0.0f;
+    float lp_emission_b = 0.0f;
+
+    // match emissions of the next event, by block
+    std::vector<float> lp_emission_m(num_blocks + 1, -INFINITY);
+    if(next != NULL) {
+        uint32_t event_idx = data.event_start_idx + row * data.event_stride;
+        for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+            lp_emission_m[ki + 1] = log_probability_match_r9(*data.read, kmer_ranks[ki], event_idx, data.strand, emission_cells);
+        }
+    }
+
+    // The silent kmer skip state leads to the next block of the same row
+    // so the blocks are processed from last to first
+    for(uint32_t block = num_kmers; block >= 1; --block) {
+        uint32_t curr_offset = PSR9_NUM_STATES * block;
+        uint32_t next_offset = PSR9_NUM_STATES * (block + 1);
+        bool has_next_block = block < num_kmers;
+
+        float end = -INFINITY;
+        if(block == num_kmers && ((flags & HAF_ALLOW_POST_CLIP) || row == num_events)) {
+            end = lp_ms + post_flank[row - 1];
+        }
 
+        const BlockTransitions& bt = transitions[block - 1];
+        float to_m_same = -INFINITY, to_b_same = -INFINITY;
+        float to_m_next = -INFINITY, to_k_next = -INFINITY;
+        if(next != NULL) {
+            to_m_same = lp_emission_m[block] + next[curr_offset + PSR9_MATCH];
+            to_b_same = lp_emission_b + next[curr_offset + PSR9_BAD_EVENT];
+        }
+
+        if(next != NULL && has_next_block) {
+            to_m_next = lp_emission_m[block + 1] + next[next_offset + PSR9_MATCH];
+        }
+
+        if(has_next_block) {
+            to_k_next = curr[next_offset + PSR9_KMER_SKIP];
+        }
+
+        // transitions out of this block use the transitions into the next block
+        BlockTransitions nt = has_next_block ? transitions[block] : bt;
+
+        float k = add_logs(end, nt.lp_km + to_m_next);
+        k = add_logs(k, nt.lp_kk + to_k_next);
+        curr[curr_offset + PSR9_KMER_SKIP] = k;
+
+        float m = add_logs(end, bt.lp_mm_self + to_m_same);
+        m = add_logs(m, nt.lp_mm_next + to_m_next);
+        m = add_logs(m, bt.lp_mb + to_b_same);
+        m = add_logs(m, nt.lp_mk + to_k_next);
+        curr[curr_offset + PSR9_MATCH] = m;
+
+        float b = add_logs(end, bt.lp_bm_self + to_m_same);
+        b = add_logs(b, nt.lp_bm_next + to_m_next);
+        b = add_logs(b, bt.lp_bb + to_b_same);
+        b = add_logs(b, nt.lp_bk + to_k_next);
+        curr[curr_offset + PSR9_BAD_EVENT] = b;
+    }
+}
+
+void profile_hmm_posterior_r9(const HMMInputSequenceView& sequence,
+                              const HMMInputData& data,
+                              const uint32_t flags,
+                              std::vector<HMMAlignmentState>& alignment)
+{
+    assert( (data.rc && data.event_stride == -1) || (!data.rc && data.event_stride == 1));
+#if HMM_REVERSE_FIX
+#error "profile_hmm_posterior_r9 does not support HMM_REVERSE_FIX"
+#endif
+
+    const uint32_t k = data.read->pore_model[data.strand].k;
+    uint32_t n_kmers = sequence.length() - k + 1;
+    uint32_t n_states = PSR9_NUM_STATES * (n_kmers + 2); // + 2 for explicit terminal states
+    uint32_t n_events = count_events(data);
+    uint32_t n_rows = n_events + 1;
+    uint32_t e_start = data.event_start_idx;
+
+    for(size_t ai = 0; ai < alignment.size(); ++ai) {
+        alignment[ai].l_posterior = -INFINITY;
+    }
+
+    // The tables are made once and shared by the forward pass,
+    // every segment recomputed from a checkpoint and the backward pass
+    ProfileHMMFillTablesR9 tables;
+    make_fill_tables_r9(sequence, data, n_kmers, n_events, tables);
+
+    // Forward pass, keeping every interval-th row
+    uint32_t interval = std::max(1, (int)ceil(sqrt(n_events)));
+    ProfileHMMCheckpointForwardOutputR9 checkpoints(n_rows, n_states, interval);
+    float lp_total = profile_hmm_fill_rows_r9(data, tables, flags, checkpoints, 1, n_events);
+    if(lp_total == -INFINITY) {
+        return;
+    }
+
+    // The matrix row and column of each state of the alignment
+    std::vector< std::pair<uint32_t, uint32_t> > cells(alignment.size());
+    for(size_t ai = 0; ai < alignment.size(); ++ai) {
+        const HMMAlignmentState& as = alignment[ai];
+        uint32_t row = (as.event_idx - e_start) * data.event_stride + 1;
+        uint32_t state = as.state == 'M' ? PSR9_MATCH : (as.state == 'B' ? PSR9_BAD_EVENT : PSR9_KMER_SKIP);
+        assert(row <= n_events && as.kmer_idx < n_kmers);
+        cells[ai] = std::make_pair(row, PSR9_NUM_STATES * (as.kmer_idx + 1) + state);
+    }
+
+    // alignment indices sorted by row
+    std::vector<size_t> order(alignment.size());
+    for(size_t ai = 0; ai < order.size(); ++ai) {
+        order[ai] = ai;
+    }
+    std::stable_sort(order.begin(), order.end(), [&cells](size_t a, size_t b) { return cells[a].first < cells[b].first; });
+
+    // Backward pass. The forward rows of each segment are
+    // recomputed from the checkpoint that precedes it.
+    std::vector<float> next_row(n_states, -INFINITY);
+    std::vector<float> curr_row(n_states, -INFINITY);
+    size_t order_idx = order.size();
+    uint32_t last_checkpoint = ((n_events - 1) / interval) * interval;
+    for(int64_t checkpoint = last_checkpoint; checkpoint >= 0; checkpoint -= interval) {
+        uint32_t first_row = checkpoint + 1;
+        uint32_t last_row = std::min((uint32_t)checkpoint + interval, n_events);
+
+        ProfileHMMSegmentForwardOutputR9 segment(n_rows, n_states, first_row, last_row, checkpoints.get_checkpoint(checkpoint));
+        profile_hmm_fill_rows_r9(data, tables, flags, segment, first_row, last_row);
+
+        for(uint32_t row = last_row; row >= first_row; --row) {
+            profile_hmm_backward_row_r9(data, flags, row, n_events, *tables.transitions, tables.kmer_ranks, tables.post_flank,
+                                        tables.emission_cells.get(), row == n_events ? NULL : next_row.data(), curr_row.data());
+
+            while(order_idx > 0 && cells[order[order_idx - 1]].first == row) {
+                size_t ai = order[--order_idx];
+                uint32_t col = cells[ai].second;
+                alignment[ai].l_posterior = segment.get(row, col) + curr_row[col] - lp_total;
+            }
+            std::swap(next_row, curr_row);
+        }
+    }
+}
+
+void profile_hmm_score_base_r9(const HMMInputSequenceView& sequence,
+                               const HMMInputData& data,
+                               const uint32_t flags,
+                               HMMScoredBase& base)
+{
+    assert( (data.rc && data.event_stride == -1) || (!data.rc && data.event_stride == 1));
+#if HMM_REVERSE_FIX
+#error "profile_hmm_score_base_r9 does not support HMM_REVERSE_FIX"
+#endif
+
+    const uint32_t k = data.read->pore_model[data.strand].k;
+    uint32_t n_kmers = sequence.length() - k + 1;
+    uint32_t n_states = PSR9_NUM_STATES * (n_kmers + 2); // + 2 for explicit terminal states
+    uint32_t n_events = count_events(data);
+    uint32_t n_rows = n_events + 1;
+    uint32_t e_start = data.event_start_idx;
+
+    base.data = data;
+    base.flags = flags;
+    base.n_cols = n_states;
+    base.kmer_ranks = sequence.get_kmer_ranks(k, data.rc);
+
+    // Fill the forward matrix with the kernel profile_hmm_score_r9 uses
+    // so that the base and the edits are scored the same way as a full rescore
+    if(get_hmm_simd_level() != HSL_SCALAR) {
+        base.score = profile_hmm_forward_matrix_simd_r9(sequence, data, flags, base.forward);
+    } else {
+        FloatMatrix fm;
+        allocate_matrix(fm, n_rows, n_states);
+        profile_hmm_forward_initialize_r9(fm);
+        ProfileHMMForwardOutputR9 output(&fm);
+        base.score = profile_hmm_fill_generic_r9(sequence, data, e_start, flags, output);
+        base.forward.assign(fm.cells, fm.cells + n_rows * n_states);
+        free_matrix(fm);
+    }
+
+    // row 0 of the backward matrix is not used
+    const std::vector<BlockTransitions>& transitions = get_transitions_r9(n_kmers);
+    std::vector<float> post_flank = make_post_flanking(data, e_start, n_events);
+    std::shared_ptr<EmissionTableCells> emission_cells = get_emission_cells_r9(*data.read, data.strand);
+    base.backward.assign(n_rows * n_states, -INFINITY);
+    for(uint32_t row = n_events; row >= 1; --row) {
+        const float* next = row == n_events ? NULL : &base.backward[(row + 1) * n_states];
+        profile_hmm_backward_row_r9(data, flags, row, n_events, transitions, base.kmer_ranks, post_flank, emission_cells.get(),
+                                    next, &base.backward[row * n_states]);
+    }
+}
+
+float profile_hmm_score_edit_r9(const HMMScoredBase& base, const HMMInputSequenceView& sequence)
+{
+    const HMMInputData& data = base.data;
+    const uint32_t k = data.read->pore_model[data.strand].k;
+    uint32_t n_kmers = sequence.length() - k + 1;
+    uint32_t n_base_kmers = base.kmer_ranks.size();
+    uint32_t n_events = count_events(data);
+
+    std::vector<uint32_t> kmer_ranks = sequence.get_kmer_ranks(k, data.rc);
+
+    if(kmer_ranks == base.kmer_ranks) {
+        return base.score;
+    }
+
+    // The k-mers shared with the start and the end of the base sequence
+    uint32_t max_shared = std::min(n_kmers, n_base_kmers);
+    uint32_t n_prefix = 0;
+    while(n_prefix < max_shared && kmer_ranks[n_prefix] == base.kmer_ranks[n_prefix]) {
+        n_prefix += 1;
+    }
+
+    uint32_t n_suffix = 0;
+    while(n_suffix < max_shared - n_prefix &&
+          kmer_ranks[n_kmers - n_suffix - 1] == base.kmer_ranks[n_base_kmers - n_suffix - 1]) {
+        n_suffix += 1;
+    }
+
+    // The edit must be surrounded by shared k-mers
+    if(n_prefix == 0 || n_suffix == 0) {
+        return profile_hmm_score_r9(sequence, data, base.flags);
+    }
+
+    // Compute the forward matrix for the blocks after the prefix up to last_block.
+    // Column 0 of the window is the last block of the prefix.
+    uint32_t first_block = n_prefix + 1;
+    uint32_t last_block = n_kmers - n_suffix;
+    uint32_t n_window_cols = PSR9_NUM_STATES * (last_block - first_block + 2);
+    uint32_t prefix_offset = PSR9_NUM_STATES * n_prefix;
+
+    const std::vector<BlockTransitions>& transitions = get_transitions_r9(n_kmers);
+    std::vector<float> window((n_events + 1) * n_window_cols, -INFINITY);
+    std::shared_ptr<EmissionTableCells> emission_cells = get_emission_cells_r9(*data.read, data.strand);
+
+    for(uint32_t row = 1; row <= n_events; ++row) {
+        float* curr = &window[row * n_window_cols];
+        const float* prev = &window[(row - 1) * n_window_cols];
+        memcpy(curr, &base.forward[row * base.n_cols + prefix_offset], PSR9_NUM_STATES * sizeof(float));
+
+        uint32_t event_idx = data.event_start_idx + (row - 1) * data.event_stride;
+        for(uint32_t block = first_block; block <= last_block; ++block) {
+
+            // summed in the same order as profile_hmm_fill_generic_r9 so at
+            // HSL_SCALAR the cells are identical to those of a full fill
+            const BlockTransitions& bt = transitions[block - 1];
+            uint32_t curr_offset = PSR9_NUM_STATES * (block - n_prefix);
+            uint32_t prev_offset = curr_offset - PSR9_NUM_STATES;
+            float lp_emission_m = log_probability_match_r9(*data.read, kmer_ranks[block - 1], event_idx, data.strand, emission_cells.get());
+
+            float lp_m = bt.lp_mm_self + prev[curr_offset + PSR9_MATCH];
+            lp_m = add_logs(lp_m, bt.lp_mm_next + prev[prev_offset + PSR9_MATCH]);
+            lp_m = add_logs(lp_m, bt.lp_bm_self + prev[curr_offset + PSR9_BAD_EVENT]);
+            lp_m = add_logs(lp_m, bt.lp_bm_next + prev[prev_offset + PSR9_BAD_EVENT]);
+            lp_m = add_logs(lp_m, bt.lp_km + prev[prev_offset + PSR9_KMER_SKIP]);
+            curr[curr_offset + PSR9_MATCH] = lp_m + lp_emission_m;
+
+            float lp_b = add_logs(bt.lp_mb + prev[curr_offset + PSR9_MATCH],
+                                  bt.lp_bb + prev[curr_offset + PSR9_BAD_EVENT]);
+            curr[curr_offset + PSR9_BAD_EVENT] = lp_b;
+
+            float lp_k = add_logs(bt.lp_mk + curr[prev_offset + PSR9_MATCH],
+                                  bt.lp_bk + curr[prev_offset + PSR9_BAD_EVENT]);
+            lp_k = add_logs(lp_k, bt.lp_kk + curr[prev_offset + PSR9_KMER_SKIP]);
+            curr[curr_offset + PSR9_KMER_SKIP] = lp_k;
+        }
+    }
+
+    // Every path moves from last_block to the next block exactly once,
+    // either to its match state in the next row or to its silent kmer
+    // skip state in the same row. The next block is the first block of the
+    // shared suffix so the rest of the path is in the base's backward matrix.
+    const BlockTransitions& nt = transitions[last_block];
+    uint32_t last_offset = n_window_cols - PSR9_NUM_STATES;
+    uint32_t base_next_offset = PSR9_NUM_STATES * (n_base_kmers - n_suffix + 1);
+    float lp_total = -INFINITY;
+    for(uint32_t row = 1; row <= n_events; ++row) {
+        const float* curr = &window[row * n_window_cols + last_offset];
+        const float* prev = &window[(row - 1) * n_window_cols + last_offset];
+        const float* backward = &base.backward[row * base.n_cols + base_next_offset];
+
+        uint32_t event_idx = data.event_start_idx + (row - 1) * data.event_stride;
+        float lp_emission_m = log_probability_match_r9(*data.read, kmer_ranks[last_block], event_idx, data.strand, emission_cells.get());
+
+        float to_m = add_logs(nt.lp_mm_next + prev[PSR9_MATCH], nt.lp_bm_next + prev[PSR9_BAD_EVENT]);
+        to_m = add_logs(to_m, nt.lp_km + prev[PSR9_KMER_SKIP]);
+        lp_total = add_logs(lp_total, to_m + lp_emission_m + backward[PSR9_MATCH]);
+
+        float to_k = add_logs(nt.lp_mk + curr[PSR9_MATCH], nt.lp_bk + curr[PSR9_BAD_EVENT]);
+        to_k = add_logs(to_k, nt.lp_kk + curr[PSR9_KMER_SKIP]);
+        lp_total = add_logs(lp_total, to_k + backward[PSR9_KMER_SKIP]);
+    }
+    return lp_total;
+}
+
+float profile_hmm_score_banded_r9(const HMMInputSequenceView& sequence,
+                                  const HMMInputData& data,
+                                  const HMMBand& band,
+                                  const uint32_t flags,
+                                  bool* hit_band_edge)
+{
+    const uint32_t k = data.read->pore_model[data.strand].k;
+    uint32_t n_kmers = sequence.length() - k + 1;
+    uint32_t n_events = count_events(data);
+    assert(band.num_kmers == n_kmers);
+    assert(band.kmer_start.size() == n_events);
+
+    ProfileHMMBandedForwardOutputR9 output(&band);
+    float score = profile_hmm_fill_generic_r9(sequence, data, data.event_start_idx, flags, output);
+
+    // The forward algorithm does not have a single best path. Check whether
+    // the most probable match state of any event is on the edge of the band.
+    if(hit_band_edge != NULL) {
+        *hit_band_edge = false;
+        for(uint32_t row = 1; row <= n_events && !*hit_band_edge; ++row) {
+            float best = -INFINITY;
+            uint32_t best_kmer = 0;
+            for(uint32_t block = output.get_first_block(row); block <= output.get_last_block(row); ++block) {
+                float lp = output.get(row, PSR9_NUM_STATES * block + PSR9_MATCH);
+                if(lp > best) {
+                    best = lp;
+                    best_kmer = block - 1;
+                }
+            }
+            *hit_band_edge = best != -INFINITY && band.is_edge(row - 1, best_kmer);
+        }
+    }
+    return score;
+}
+
+std::vector<HMMAlignmentState> profile_hmm_align_banded_r9(const HMMInputSequenceView& sequence,
+                                                           const HMMInputData& data,
+                                                           const HMMBand& band,
+                                                           const uint32_t flags,
+                                                           bool* hit_band_edge)
+{
+    const uint32_t k = data.read->pore_model[data.strand].k;
+    uint32_t n_kmers = sequence.length() - k + 1;
+    uint32_t n_events = count_events(data);
+    assert(n_events >= 2);
+    assert(band.num_kmers == n_kmers);
+    assert(band.kmer_start.size() == n_events);
+
+    ProfileHMMBandedViterbiOutputR9 output(&band);
+    float score = profile_hmm_fill_generic_r9(sequence, data, data.event_start_idx, flags, output);
+
+    // No path fits inside the band
+    if(score == -INFINITY) {
+        if(hit_band_edge != NULL) {
+            *hit_band_edge = true;
+        }
+        return std::vector<HMMAlignmentState>();
+    }
+
+    std::vector<HMMAlignmentState> alignment = profile_hmm_backtrack_r9(sequence, data, output);
+
+    if(hit_band_edge != NULL) {
+        *hit_band_edge = false;
+        for(size_t ai = 0; ai < alignment.size() && !*hit_band_edge; ++ai) {
+            const HMMAlignmentState& as = alignment[ai];
+            uint32_t event_offset = data.event_stride == 1 ? as.event_idx - data.event_start_idx
+                                                           : data.event_start_idx - as.event_idx;
+            *hit_band_edge = band.is_edge(event_offset, as.kmer_idx);
+        }
+    }
     return alignment;
 }
@@ -11,12 +11,15 @@
 
 #include <stdint.h>
 #include <vector>
+#include <algorithm>
+#include <memory>
 #include <string>
 #include "nanopolish_matrix.h"
 #include "nanopolish_common.h"
 #include "nanopolish_emissions.h"
 #include "nanopolish_hmm_input_sequence.h"
 #include "nanopolish_profile_hmm.h"
+#include "nanopolish_hmm_band.h"
 
 //#define HMM_REVERSE_FIX 1
 //#define DEBUG_FILL 1
@@ -26,10 +29,34 @@
 //
 
 // Calculate the probability of the nanopore events given a sequence
-float profile_hmm_score_r9(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
+float profile_hmm_score_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0, HMMXDrop* xdrop = NULL);
+
+// Score the sequence keeping the full forward and backward matrices in base
+void profile_hmm_score_base_r9(const HMMInputSequenceView& sequence,
+                               const HMMInputData& data,
+                               const uint32_t flags,
+                               HMMScoredBase& base);
+
+// Score a sequence that differs from base by a local edit, see profile_hmm_score_edit
+float profile_hmm_score_edit_r9(const HMMScoredBase& base, const HMMInputSequenceView& sequence);
 
 // Run viterbi to align events to kmers
-std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
+std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
+
+// Banded versions of the above. Only the cells within the band are computed
+// and stored. If hit_band_edge is not NULL it is set when the most probable
+// path touches the edge of the band, which indicates the band was too narrow.
+float profile_hmm_score_banded_r9(const HMMInputSequenceView& sequence,
+                                  const HMMInputData& data,
+                                  const HMMBand& band,
+                                  const uint32_t flags = 0,
+                                  bool* hit_band_edge = NULL);
+
+std::vector<HMMAlignmentState> profile_hmm_align_banded_r9(const HMMInputSequenceView& sequence,
+                                                           const HMMInputData& data,
+                                                           const HMMBand& band,
+                                                           const uint32_t flags = 0,
+                                                           bool* hit_band_edge = NULL);
 
 //
 // Forward algorithm
@@ -41,6 +68,21 @@ void profile_hmm_forward_initialize_r9(FloatMatrix& fm);
 // Terminate the forward algorithm
 float profile_hmm_forward_terminate_r9(const FloatMatrix& fm, uint32_t row);
 
+//
+// Forward-backward
+//
+
+// Set the l_posterior field of each state of the alignment to the log
+// posterior probability of the HMM being in that state at that event,
+// given all of the events. The alignment is usually the viterbi path
+// but can be any set of states. Only every sqrt(n_events)-th row of the
+// forward matrix is stored. The other rows are recomputed one segment
+// at a time during the backward pass.
+void profile_hmm_posterior_r9(const HMMInputSequenceView& sequence,
+                              const HMMInputData& data,
+                              const uint32_t flags,
+                              std::vector<HMMAlignmentState>& alignment);
+
 //
 // Viterbi
 //
@@ -94,6 +136,18 @@ struct BlockTransitions
     float lp_km;
 };
 
+// The R9 transitions and flanking probabilities do not depend on the read
+// or the sequence so they are calculated once by each thread and reused.
+// The returned tables may be longer than requested and stay valid
+// until the thread exits.
+
+// the transitions for (at least) num_kmers blocks
+const std::vector<BlockTransitions>& get_transitions_r9(uint32_t num_kmers);
+
+// the log probabilities of emitting the first i events from the background
+// state for i = 0 to (at least) num_events, see make_pre_flanking
+const std::vector<float>& get_flanking_r9(const HMMInputData& data, uint32_t num_events);
+
 //
 #include "nanopolish_profile_hmm_r9.inl"
 
@@ -12,61 +12,56 @@
 #define TRANS_CLIP_SELF 0.9
 #define TRANS_START_TO_CLIP 0.5
 
-inline std::vector<BlockTransitions> calculate_transitions(uint32_t num_kmers, const HMMInputSequence& sequence, const HMMInputData& data)
+// The transitions into a block. For R9 these are the same for every k-mer.
+inline BlockTransitions calculate_block_transitions_r9()
 {
-    std::vector<BlockTransitions> transitions(num_kmers);
-    
-    for(uint32_t ki = 0; ki < num_kmers; ++ki) {
-
-        // probability of skipping k_i from k_(i - 1)
-        float p_stay = 0.4; 
+    // probability of skipping k_i from k_(i - 1)
+    float p_stay = 0.4; 
 #ifndef USE_EXTERNAL_PARAMS
-        float p_skip = 0.0025; 
-        float p_bad = 0.001;
-        float p_bad_self = p_bad;
-        float p_skip_self = 0.3;
+    float p_skip = 0.0025; 
+    float p_bad = 0.001;
+    float p_bad_self = p_bad;
+    float p_skip_self = 0.3;
 #else
-        extern float g_p_skip, g_p_skip_self, g_p_bad, g_p_bad_self;
-        float p_skip = g_p_skip;
-        float p_skip_self = g_p_skip_self;
-        float p_bad = g_p_bad;
-        float p_bad_self = g_p_bad_self;
+    extern float g_p_skip, g_p_skip_self, g_p_bad, g_p_bad_self;
+    float p_skip = g_p_skip;
+    float p_skip_self = g_p_skip_self;
+    float p_bad = g_p_bad;
+    float p_bad_self = g_p_bad_self;
 #endif
 
-        // transitions from match state in previous block
-        float p_mk = p_skip; // probability of not observing an event at all
-        float p_mb = p_bad; // probabilty of observing a bad event
-        float p_mm_self = p_stay; // probability of observing additional events from this k-mer
-        float p_mm_next = 1.0f - p_mm_self - p_mk - p_mb; // normal movement from state to state
-
-        // transitions from event split state in previous block
-        float p_bb = p_bad_self;
-        float p_bk, p_bm_next, p_bm_self;
-        p_bk = p_bm_next = p_bm_self = (1.0f - p_bb) / 3;
-
-        // transitions from kmer skip state in previous block
-        float p_kk = p_skip_self;
-        float p_km = 1.0f - p_kk;
-        // p_kb not needed, equivalent to B->K
-
-        // log-transform and store
-        BlockTransitions& bt = transitions[ki];
-
-        bt.lp_mk = log(p_mk);
-        bt.lp_mb = log(p_mb);
-        bt.lp_mm_self = log(p_mm_self);
-        bt.lp_mm_next = log(p_mm_next);
-
-        bt.lp_bb = log(p_bb);
-        bt.lp_bk = log(p_bk);
-        bt.lp_bm_next = log(p_bm_next);
-        bt.lp_bm_self = log(p_bm_self);
-        
-        bt.lp_kk = log(p_kk);
-        bt.lp_km = log(p_km);
-    }
-
-    return transitions;
+    // transitions from match state in previous block
+    float p_mk = p_skip; // probability of not observing an event at all
+    float p_mb = p_bad; // probabilty of observing a bad event
+    float p_mm_self = p_stay; // probability of observing additional events from this k-mer
+    float p_mm_next = 1.0f - p_mm_self - p_mk - p_mb; // normal movement from state to state
+
+    // transitions from event split state in previous block
+    float p_bb = p_bad_self;
+    float p_bk, p_bm_next, p_bm_self;
+    p_bk = p_bm_next = p_bm_self = (1.0f - p_bb) / 3;
+
+    // transitions from kmer skip state in previous block
+    float p_kk = p_skip_self;
+    float p_km = 1.0f - p_kk;
+    // p_kb not needed, equivalent to B->K
+
+    // log-transform and store
+    BlockTransitions bt;
+
+    bt.lp_mk = log(p_mk);
+    bt.lp_mb = log(p_mb);
+    bt.lp_mm_self = log(p_mm_self);
+    bt.lp_mm_next = log(p_mm_next);
+
+    bt.lp_bb = log(p_bb);
+    bt.lp_bk = log(p_bk);
+    bt.lp_bm_next = log(p_bm_next);
+    bt.lp_bm_self = log(p_bm_self);
+    
+    bt.lp_kk = log(p_kk);
+    bt.lp_km = log(p_km);
+    return bt;
 }
 
 // Output writer for the Forward Algorithm
@@ -113,6 +108,17 @@ class ProfileHMMForwardOutputR9
         {
             return p_fm->n_rows;
         }
+
+        // the range of blocks that are computed for a row
+        inline uint32_t get_first_block(uint32_t) const
+        {
+            return 1;
+        }
+
+        inline uint32_t get_last_block(uint32_t) const
+        {
+            return p_fm->n_cols / PSR9_NUM_STATES - 2;
+        }
     
     private:
         ProfileHMMForwardOutputR9(); // not allowed
@@ -120,6 +126,246 @@ class ProfileHMMForwardOutputR9
         float lp_end;
 };
 
+// Output writer for the Forward Algorithm that only keeps the previous
+// and current rows of the matrix. This is sufficient when only the
+// probability of the end state is needed.
+class ProfileHMMTwoRowForwardOutputR9
+{
+    public:
+        ProfileHMMTwoRowForwardOutputR9(uint32_t n_rows, uint32_t n_cols) : lease(fm, 2, n_cols), num_rows(n_rows), lp_end(-INFINITY)
+        {
+            // Every cell starts as -INFINITY. The fill never writes
+            // the start and terminal blocks so they stay that way.
+            for(uint32_t ri = 0; ri < fm.n_rows; ri++) {
+                for(uint32_t si = 0; si < fm.n_cols; si++) {
+                    ::set(fm, ri, si, -INFINITY);
+                }
+            }
+        }
+
+        inline void update_cell(uint32_t row, uint32_t col, const HMMUpdateScores& scores, float lp_emission)
+        {
+            float sum = scores.x[0];
+            for(auto i = 1; i < HMT_NUM_MOVEMENT_TYPES; ++i) {
+                sum = add_logs(sum, scores.x[i]);
+            }
+            sum += lp_emission;
+            ::set(fm, row & 1, col, sum);
+        }
+
+        inline void update_end(float v, uint32_t, uint32_t)
+        {
+            lp_end = add_logs(lp_end, v);
+        }
+
+        // only valid for the current and previous row
+        inline float get(uint32_t row, uint32_t col) const
+        {
+            return ::get(fm, row & 1, col);
+        }
+
+        inline float get_end() const
+        {
+            return lp_end;
+        }
+
+        inline size_t get_num_columns() const
+        {
+            return fm.n_cols;
+        }
+
+        inline size_t get_num_rows() const
+        {
+            return num_rows;
+        }
+
+        inline uint32_t get_first_block(uint32_t) const
+        {
+            return 1;
+        }
+
+        inline uint32_t get_last_block(uint32_t) const
+        {
+            return fm.n_cols / PSR9_NUM_STATES - 2;
+        }
+
+    private:
+        ProfileHMMTwoRowForwardOutputR9(); // not allowed
+        ProfileHMMTwoRowForwardOutputR9(const ProfileHMMTwoRowForwardOutputR9&); // not allowed
+
+        FloatMatrix fm;
+        MatrixLease<float> lease;
+        uint32_t num_rows;
+        float lp_end;
+};
+
+// Output writer for the Forward Algorithm that keeps the previous and
+// current rows, like ProfileHMMTwoRowForwardOutputR9, and a copy of
+// every interval-th row. The forward rows between two checkpoints can
+// be recomputed from the first one with ProfileHMMSegmentForwardOutputR9.
+class ProfileHMMCheckpointForwardOutputR9
+{
+    public:
+        ProfileHMMCheckpointForwardOutputR9(uint32_t n_rows, uint32_t n_cols, uint32_t interval) :
+            lease(fm, 2, n_cols),
+            checkpoint_lease(checkpoints, (n_rows - 1) / interval + 1, n_cols),
+            num_rows(n_rows),
+            checkpoint_interval(interval),
+            lp_end(-INFINITY)
+        {
+            // Row 0 is the first checkpoint. As for the two row
+            // writer, cells that are never written stay -INFINITY.
+            std::fill(fm.cells, fm.cells + fm.n_rows * fm.n_cols, -INFINITY);
+            std::fill(checkpoints.cells, checkpoints.cells + checkpoints.n_rows * checkpoints.n_cols, -INFINITY);
+        }
+
+        inline void update_cell(uint32_t row, uint32_t col, const HMMUpdateScores& scores, float lp_emission)
+        {
+            float sum = scores.x[0];
+            for(auto i = 1; i < HMT_NUM_MOVEMENT_TYPES; ++i) {
+                sum = add_logs(sum, scores.x[i]);
+            }
+            sum += lp_emission;
+            ::set(fm, row & 1, col, sum);
+
+            if(row % checkpoint_interval == 0) {
+                ::set(checkpoints, row / checkpoint_interval, col, sum);
+            }
+        }
+
+        inline void update_end(float v, uint32_t, uint32_t)
+        {
+            lp_end = add_logs(lp_end, v);
+        }
+
+        // only valid for the current and previous row
+        inline float get(uint32_t row, uint32_t col) const
+        {
+            return ::get(fm, row & 1, col);
+        }
+
+        // the saved row, which must be a multiple of the interval
+        inline const float* get_checkpoint(uint32_t row) const
+        {
+            assert(row % checkpoint_interval == 0);
+            return checkpoints.cells + (row / checkpoint_interval) * checkpoints.n_cols;
+        }
+
+        inline float get_end() const
+        {
+            return lp_end;
+        }
+
+        inline size_t get_num_columns() const
+        {
+            return fm.n_cols;
+        }
+
+        inline size_t get_num_rows() const
+        {
+            return num_rows;
+        }
+
+        inline uint32_t get_first_block(uint32_t) const
+        {
+            return 1;
+        }
+
+        inline uint32_t get_last_block(uint32_t) const
+        {
+            return fm.n_cols / PSR9_NUM_STATES - 2;
+        }
+
+    private:
+        ProfileHMMCheckpointForwardOutputR9(); // not allowed
+        ProfileHMMCheckpointForwardOutputR9(const ProfileHMMCheckpointForwardOutputR9&); // not allowed
+
+        FloatMatrix fm;
+        MatrixLease<float> lease;
+        FloatMatrix checkpoints;
+        MatrixLease<float> checkpoint_lease;
+        uint32_t num_rows;
+        uint32_t checkpoint_interval;
+        float lp_end;
+};
+
+// Output writer for the Forward Algorithm that only stores rows
+// first_row - 1 to last_row of the matrix. Row first_row - 1 is
+// copied from seed_row. Fill it with the same row range.
+class ProfileHMMSegmentForwardOutputR9
+{
+    public:
+        ProfileHMMSegmentForwardOutputR9(uint32_t n_rows, uint32_t n_cols,
+                                         uint32_t first_row, uint32_t last_row,
+                                         const float* seed_row) :
+            lease(fm, last_row - first_row + 2, n_cols),
+            num_rows(n_rows),
+            row_offset(first_row - 1),
+            lp_end(-INFINITY)
+        {
+            assert(first_row >= 1 && last_row < n_rows);
+            std::copy(seed_row, seed_row + n_cols, fm.cells);
+            std::fill(fm.cells + n_cols, fm.cells + fm.n_rows * fm.n_cols, -INFINITY);
+        }
+
+        inline void update_cell(uint32_t row, uint32_t col, const HMMUpdateScores& scores, float lp_emission)
+        {
+            float sum = scores.x[0];
+            for(auto i = 1; i < HMT_NUM_MOVEMENT_TYPES; ++i) {
+                sum = add_logs(sum, scores.x[i]);
+            }
+            sum += lp_emission;
+            ::set(fm, row - row_offset, col, sum);
+        }
+
+        // only the part of the end state from this segment's rows
+        inline void update_end(float v, uint32_t, uint32_t)
+        {
+            lp_end = add_logs(lp_end, v);
+        }
+
+        inline float get(uint32_t row, uint32_t col) const
+        {
+            return ::get(fm, row - row_offset, col);
+        }
+
+        inline float get_end() const
+        {
+            return lp_end;
+        }
+
+        inline size_t get_num_columns() const
+        {
+            return fm.n_cols;
+        }
+
+        // the number of rows of the full matrix
+        inline size_t get_num_rows() const
+        {
+            return num_rows;
+        }
+
+        inline uint32_t get_first_block(uint32_t) const
+        {
+            return 1;
+        }
+
+        inline uint32_t get_last_block(uint32_t) const
+        {
+            return fm.n_cols / PSR9_NUM_STATES - 2;
+        }
+
+    private:
+        ProfileHMMSegmentForwardOutputR9(); // not allowed
+        ProfileHMMSegmentForwardOutputR9(const ProfileHMMSegmentForwardOutputR9&); // not allowed
+
+        FloatMatrix fm;
+        MatrixLease<float> lease;
+        uint32_t num_rows;
+        uint32_t row_offset;
+        float lp_end;
+};
+
 // Output writer for the Viterbi Algorithm
 class ProfileHMMViterbiOutputR9
 {
@@ -178,6 +424,23 @@ class ProfileHMMViterbiOutputR9
         {
             return p_fm->n_rows;
         }
+
+        // the range of blocks that are computed for a row
+        inline uint32_t get_first_block(uint32_t) const
+        {
+            return 1;
+        }
+
+        inline uint32_t get_last_block(uint32_t) const
+        {
+            return p_fm->n_cols / PSR9_NUM_STATES - 2;
+        }
+
+        // get the movement that lead to a particular row/column
+        inline uint8_t get_backtrack(uint32_t row, uint32_t col) const
+        {
+            return ::get(*p_bm, row, col);
+        }
     
     private:
         ProfileHMMViterbiOutputR9(); // not allowed
@@ -190,95 +453,289 @@ class ProfileHMMViterbiOutputR9
         uint32_t end_col;
 };
 
-// Allocate a vector with the model probabilities of skipping the first i events
-inline std::vector<float> make_pre_flanking(const HMMInputData& data,
-                                            const uint32_t e_start,
-                                            const uint32_t num_events)
+// Storage for a matrix restricted to a band. Only the blocks within
+// the band are stored, every other cell reads as -INFINITY. Row 0
+// holds the start state which is never reachable in the R9 model.
+template<typename T>
+class ProfileHMMBandedMatrixR9
 {
-    std::vector<float> pre_flank(num_events + 1, 0.0f);
-    
+    public:
+        ProfileHMMBandedMatrixR9(const HMMBand* pb) : p_band(pb), lease(m, pb->kmer_start.size(), PSR9_NUM_STATES * pb->width) {}
+
+        inline bool in_band(uint32_t row, uint32_t col) const
+        {
+            if(row == 0) {
+                return false;
+            }
+            uint32_t first_block = p_band->kmer_start[row - 1] + 1;
+            uint32_t block = col / PSR9_NUM_STATES;
+            return block >= first_block && block < first_block + p_band->width;
+        }
+
+        template<typename U>
+        inline void set(uint32_t row, uint32_t col, U v)
+        {
+            assert(in_band(row, col));
+            ::set(m, row - 1, local_col(row, col), v);
+        }
+
+        inline T get(uint32_t row, uint32_t col, T outside) const
+        {
+            return in_band(row, col) ? ::get(m, row - 1, local_col(row, col)) : outside;
+        }
+
+    private:
+        ProfileHMMBandedMatrixR9(); // not allowed
+        ProfileHMMBandedMatrixR9(const ProfileHMMBandedMatrixR9&); // not allowed
+
+        inline uint32_t local_col(uint32_t row, uint32_t col) const
+        {
+            return col - PSR9_NUM_STATES * (p_band->kmer_start[row - 1] + 1);
+        }
+
+        const HMMBand* p_band;
+        Matrix<T> m;
+        MatrixLease<T> lease;
+};
+
+// Output writer for the Forward Algorithm restricted to a band
+class ProfileHMMBandedForwardOutputR9
+{
+    public:
+        ProfileHMMBandedForwardOutputR9(const HMMBand* pb) : p_band(pb), fm(pb), lp_end(-INFINITY) {}
+
+        inline void update_cell(uint32_t row, uint32_t col, const HMMUpdateScores& scores, float lp_emission)
+        {
+            float sum = scores.x[0];
+            for(auto i = 1; i < HMT_NUM_MOVEMENT_TYPES; ++i) {
+                sum = add_logs(sum, scores.x[i]);
+            }
+            sum += lp_emission;
+            fm.set(row, col, sum);
+        }
+
+        inline void update_end(float v, uint32_t, uint32_t)
+        {
+            lp_end = add_logs(lp_end, v);
+        }
+
+        inline float get(uint32_t row, uint32_t col) const
+        {
+            return fm.get(row, col, -INFINITY);
+        }
+
+        inline float get_end() const
+        {
+            return lp_end;
+        }
+
+        inline size_t get_num_columns() const
+        {
+            return PSR9_NUM_STATES * (p_band->num_kmers + 2);
+        }
+
+        inline size_t get_num_rows() const
+        {
+            return p_band->kmer_start.size() + 1;
+        }
+
+        inline uint32_t get_first_block(uint32_t row) const
+        {
+            return p_band->kmer_start[row - 1] + 1;
+        }
+
+        inline uint32_t get_last_block(uint32_t row) const
+        {
+            return p_band->kmer_start[row - 1] + p_band->width;
+        }
+
+    private:
+        ProfileHMMBandedForwardOutputR9(); // not allowed
+        const HMMBand* p_band;
+        ProfileHMMBandedMatrixR9<float> fm;
+        float lp_end;
+};
+
+// Output writer for the Viterbi Algorithm restricted to a band
+class ProfileHMMBandedViterbiOutputR9
+{
+    public:
+        ProfileHMMBandedViterbiOutputR9(const HMMBand* pb) : p_band(pb), fm(pb), bm(pb), lp_end(-INFINITY) {}
+
+        inline void update_cell(uint32_t row, uint32_t col, const HMMUpdateScores& scores, float lp_emission)
+        {
+            float max = scores.x[0];
+            uint8_t from = 0;
+            for(auto i = 1; i < HMT_NUM_MOVEMENT_TYPES; ++i) {
+                max = scores.x[i] > max ? scores.x[i] : max;
+                from = max == scores.x[i] ? i : from;
+            }
+
+            fm.set(row, col, max + lp_emission);
+            bm.set(row, col, from);
+        }
+
+        inline void update_end(float v, uint32_t row, uint32_t col)
+        {
+            if(v > lp_end) {
+                lp_end = v;
+                end_row = row;
+                end_col = col;
+            }
+        }
+
+        inline float get(uint32_t row, uint32_t col) const
+        {
+            return fm.get(row, col, -INFINITY);
+        }
+
+        inline float get_end() const
+        {
+            return lp_end;
+        }
+
+        inline void get_end_cell(uint32_t& row, uint32_t& col)
+        {
+            row = end_row;
+            col = end_col;
+        }
+
+        inline size_t get_num_columns() const
+        {
+            return PSR9_NUM_STATES * (p_band->num_kmers + 2);
+        }
+
+        inline size_t get_num_rows() const
+        {
+            return p_band->kmer_start.size() + 1;
+        }
+
+        inline uint32_t get_first_block(uint32_t row) const
+        {
+            return p_band->kmer_start[row - 1] + 1;
+        }
+
+        inline uint32_t get_last_block(uint32_t row) const
+        {
+            return p_band->kmer_start[row - 1] + p_band->width;
+        }
+
+        inline uint8_t get_backtrack(uint32_t row, uint32_t col) const
+        {
+            return bm.get(row, col, HMT_FROM_SOFT);
+        }
+
+    private:
+        ProfileHMMBandedViterbiOutputR9(); // not allowed
+
+        const HMMBand* p_band;
+        ProfileHMMBandedMatrixR9<float> fm;
+        ProfileHMMBandedMatrixR9<uint8_t> bm;
+
+        float lp_end;
+        uint32_t end_row;
+        uint32_t end_col;
+};
+
+// The log probability of emitting the first i events of the alignment from
+// the background (clipping) state, for i = 0 to num_events. The background
+// emission is the same for every event so skipping events at the start and
+// at the end of the alignment have the same probabilities.
+inline std::vector<float> calculate_flanking_r9(uint32_t num_events, float lp_background)
+{
+    std::vector<float> flank(num_events + 1, 0.0f);
+
     // base cases
 
     // no skipping
-    pre_flank[0] = log(1 - TRANS_START_TO_CLIP);
+    flank[0] = log(1 - TRANS_START_TO_CLIP);
 
     // skipping the first event
     // this includes the transition probability into and out of the skip state
-    pre_flank[1] = log(TRANS_START_TO_CLIP) + // transition from start to the background state
-                   log_probability_background(*data.read, e_start, data.strand) + // emit from background
+    if(num_events > 0) {
+        flank[1] = log(TRANS_START_TO_CLIP) + // transition from start to the background state
+                   lp_background + // emit from background
                    log(1 - TRANS_CLIP_SELF); // transition to silent pre state
+    }
 
     // skip the remaining events
-    for(size_t i = 2; i < pre_flank.size(); ++i) {
-        uint32_t event_idx = e_start + (i - 1) * data.event_stride;
-        pre_flank[i] = log(TRANS_CLIP_SELF) + 
-                       log_probability_background(*data.read, event_idx, data.strand) + // emit from background
-                       pre_flank[i - 1]; // this accounts for the transition from the start & to the silent pre
-    
+    for(size_t i = 2; i < flank.size(); ++i) {
+        flank[i] = log(TRANS_CLIP_SELF) + 
+                   lp_background + // emit from background
+                   flank[i - 1]; // this accounts for the transition from the start & to the silent pre
     }
 
-    return pre_flank;
+    return flank;
+}
+
+// Allocate a vector with the model probabilities of skipping the first i events
+inline std::vector<float> make_pre_flanking(const HMMInputData& data,
+                                            const uint32_t,
+                                            const uint32_t num_events)
+{
+    const std::vector<float>& flank = get_flanking_r9(data, num_events);
+    return std::vector<float>(flank.begin(), flank.begin() + num_events + 1);
 }
 
 // Allocate a vector with the model probabilities of skipping the remaining
 // events after the alignment of event i
 inline std::vector<float> make_post_flanking(const HMMInputData& data,
-                                             const uint32_t e_start,
+                                             const uint32_t,
                                              const uint32_t num_events)
 {
     // post_flank[i] means that the i-th event was the last one
     // aligned and the remainder should be emitted from the background model
-    std::vector<float> post_flank(num_events, 0.0f);
-
-    // base case, all events aligned
-    post_flank[num_events - 1] = log(1 - TRANS_START_TO_CLIP);
-
-    if(num_events > 1) {
-        // base case, all events aligned but 1
-        {
-            uint32_t event_idx = e_start + (num_events - 1) * data.event_stride; // last event
-            assert(event_idx == data.event_stop_idx);
-            post_flank[num_events - 2] = log(TRANS_START_TO_CLIP) + // transition from pre to background state
-                                         log_probability_background(*data.read, event_idx, data.strand) + // emit from background
-                                         log(1 - TRANS_CLIP_SELF); // transition to silent pre state
-        }
-
-        for(int i = num_events - 3; i >= 0; --i) {
-            uint32_t event_idx = e_start + (i + 1) * data.event_stride;
-            post_flank[i] = log(TRANS_CLIP_SELF) +
-                            log_probability_background(*data.read, event_idx, data.strand) + // emit from background
-                            post_flank[i + 1]; // this accounts for the transition from start, and to silent pre
-        }
+    const std::vector<float>& flank = get_flanking_r9(data, num_events);
+    std::vector<float> post_flank(num_events);
+    for(uint32_t i = 0; i < num_events; ++i) {
+        post_flank[i] = flank[num_events - 1 - i];
     }
     return post_flank;
 }
 
-// This function fills in a matrix with the result of running the HMM.
-// The templated ProfileHMMOutput class allows one to run either Viterbi
-// or the Forward algorithm.
-template<class ProfileHMMOutput>
-inline float profile_hmm_fill_generic_r9(const HMMInputSequence& _sequence,
-                                         const HMMInputData& _data,
-                                         const uint32_t,
-                                         uint32_t flags,
-                                         ProfileHMMOutput& output)
+// The tables used by the fill that depend on the whole sequence and read
+// rather than on the rows being filled
+struct ProfileHMMFillTablesR9
 {
-    PROFILE_FUNC("profile_hmm_fill_generic")
-    HMMInputSequence sequence = _sequence;
-    HMMInputData data = _data;
-    assert( (data.rc && data.event_stride == -1) || (!data.rc && data.event_stride == 1));
+    const std::vector<BlockTransitions>* transitions;
+    std::vector<uint32_t> kmer_ranks;
+    std::vector<float> pre_flank;
+    std::vector<float> post_flank;
+    std::shared_ptr<EmissionTableCells> emission_cells;
+};
 
-#if HMM_REVERSE_FIX
-    if(data.event_stride == -1) {
-        sequence.swap();
-        uint32_t tmp = data.event_stop_idx;
-        data.event_stop_idx = data.event_start_idx;
-        data.event_start_idx = tmp;
-        data.event_stride = 1;
-        data.rc = false;
-    }
-#endif
+inline void make_fill_tables_r9(const HMMInputSequenceView& sequence,
+                                const HMMInputData& data,
+                                uint32_t num_kmers,
+                                uint32_t num_events,
+                                ProfileHMMFillTablesR9& tables)
+{
+    tables.transitions = &get_transitions_r9(num_kmers);
+
+    // Make sure the HMMInputSequence's alphabet matches the state space of the read
+    uint32_t k = data.read->pore_model[data.strand].k;
+    assert( data.read->pore_model[data.strand].states.size() == sequence.get_num_kmer_ranks(k) );
+
+    tables.kmer_ranks = sequence.get_kmer_ranks(k, data.rc);
+    assert(tables.kmer_ranks.size() == num_kmers);
+
+    tables.pre_flank = make_pre_flanking(data, data.event_start_idx, num_events);
+    tables.post_flank = make_post_flanking(data, data.event_start_idx, num_events);
+    tables.emission_cells = get_emission_cells_r9(*data.read, data.strand);
+}
 
+// Fill rows first_row to last_row (inclusive) of the output, reading row
+// first_row - 1 from it, using tables made by make_fill_tables_r9 for the
+// same sequence and data. Fills of a few rows at a time, like the segments
+// of profile_hmm_posterior_r9, make the tables once for all of them.
+template<class ProfileHMMOutput>
+inline float profile_hmm_fill_rows_r9(const HMMInputData& data,
+                                      const ProfileHMMFillTablesR9& tables,
+                                      uint32_t flags,
+                                      ProfileHMMOutput& output,
+                                      uint32_t first_row,
+                                      uint32_t last_row)
+{
     uint32_t e_start = data.event_start_idx;
     
     // Calculate number of blocks
@@ -286,26 +743,16 @@ inline float profile_hmm_fill_generic_r9(const HMMInputSequence& _sequence,
     uint32_t num_blocks = output.get_num_columns() / PSR9_NUM_STATES;
     uint32_t last_event_row_idx = output.get_num_rows() - 1;
 
-    // Precompute the transition probabilites for each kmer block
     uint32_t num_kmers = num_blocks - 2; // two terminal blocks
     uint32_t last_kmer_idx = num_kmers - 1;
     
-    std::vector<BlockTransitions> transitions = calculate_transitions(num_kmers, sequence, data);
- 
-    // Precompute kmer ranks
-    uint32_t k = data.read->pore_model[data.strand].k;
-
-    // Make sure the HMMInputSequence's alphabet matches the state space of the read
-    assert( data.read->pore_model[data.strand].states.size() == sequence.get_num_kmer_ranks(k) );
-
-    std::vector<uint32_t> kmer_ranks(num_kmers);
-    for(size_t ki = 0; ki < num_kmers; ++ki)
-        kmer_ranks[ki] = sequence.get_kmer_rank(ki, k, data.rc);
-
-    size_t num_events = output.get_num_rows() - 1;
-
-    std::vector<float> pre_flank = make_pre_flanking(data, e_start, num_events);
-    std::vector<float> post_flank = make_post_flanking(data, e_start, num_events);
+    const std::vector<BlockTransitions>& transitions = *tables.transitions;
+    const std::vector<uint32_t>& kmer_ranks = tables.kmer_ranks;
+    const std::vector<float>& pre_flank = tables.pre_flank;
+    const std::vector<float>& post_flank = tables.post_flank;
+    EmissionTableCells* emission_cells = tables.emission_cells.get();
+    assert(kmer_ranks.size() == num_kmers);
+    assert(post_flank.size() == last_event_row_idx);
     
     // The model is currently constrainted to always transition
     // from the terminal/clipped state to the first kmer (and from the
@@ -318,15 +765,19 @@ inline float profile_hmm_fill_generic_r9(const HMMInputSequence& _sequence,
     float BAD_EVENT_PENALTY = 0.0f;
 
     // Fill in matrix
-    for(uint32_t row = 1; row < output.get_num_rows(); row++) {
+    last_row = std::min(last_row, last_event_row_idx);
+    for(uint32_t row = first_row; row <= last_row; row++) {
 
         // Skip the first block which is the start state, it was initialized above
-        // Similarily skip the last block, which is calculated in the terminate() function
-        for(uint32_t block = 1; block < num_blocks - 1; block++) {
+        // Similarily skip the last block, which is calculated in the terminate() function.
+        // Banded outputs only compute the blocks within the band.
+        uint32_t first_block = output.get_first_block(row);
+        uint32_t last_block = output.get_last_block(row);
+        for(uint32_t block = first_block; block <= last_block; block++) {
 
             // retrieve transitions
             uint32_t kmer_idx = block - 1;
-            BlockTransitions& bt = transitions[kmer_idx];
+            const BlockTransitions& bt = transitions[kmer_idx];
 
             uint32_t prev_block = block - 1;
             uint32_t prev_block_offset = PSR9_NUM_STATES * prev_block;
@@ -335,7 +786,7 @@ inline float profile_hmm_fill_generic_r9(const HMMInputSequence& _sequence,
             // Emission probabilities
             uint32_t event_idx = e_start + (row - 1) * data.event_stride;
             uint32_t rank = kmer_ranks[kmer_idx];
-            float lp_emission_m = log_probability_match_r9(*data.read, rank, event_idx, data.strand);
+            float lp_emission_m = log_probability_match_r9(*data.read, rank, event_idx, data.strand, emission_cells);
             float lp_emission_b = BAD_EVENT_PENALTY;
             
             HMMUpdateScores scores;
@@ -426,3 +877,42 @@ inline float profile_hmm_fill_generic_r9(const HMMInputSequence& _sequence,
     return output.get_end();
 }
 
+// This function fills in a matrix with the result of running the HMM.
+// The templated ProfileHMMOutput class allows one to run either Viterbi
+// or the Forward algorithm. By default every row is filled, otherwise
+// only rows first_row to last_row (inclusive) are, reading row
+// first_row - 1 from the output.
+template<class ProfileHMMOutput>
+inline float profile_hmm_fill_generic_r9(const HMMInputSequenceView& _sequence,
+                                         const HMMInputData& _data,
+                                         const uint32_t,
+                                         uint32_t flags,
+                                         ProfileHMMOutput& output,
+                                         uint32_t first_row = 1,
+                                         uint32_t last_row = UINT32_MAX)
+{
+    PROFILE_FUNC("profile_hmm_fill_generic")
+    HMMInputSequenceView sequence = _sequence;
+    HMMInputData data = _data;
+    assert( (data.rc && data.event_stride == -1) || (!data.rc && data.event_stride == 1));
+
+#if HMM_REVERSE_FIX
+    if(data.event_stride == -1) {
+        sequence.swap();
+        uint32_t tmp = data.event_stop_idx;
+        data.event_stop_idx = data.event_start_idx;
+        data.event_start_idx = tmp;
+        data.event_stride = 1;
+        data.rc = false;
+    }
+#endif
+
+    // Precompute the transition probabilites for each kmer block, the kmer ranks and the flanking probabilities
+    uint32_t num_kmers = output.get_num_columns() / PSR9_NUM_STATES - 2; // two terminal blocks
+    uint32_t num_events = output.get_num_rows() - 1;
+    ProfileHMMFillTablesR9 tables;
+    make_fill_tables_r9(sequence, data, num_kmers, num_events, tables);
+
+    return profile_hmm_fill_rows_r9(data, tables, flags, output, first_row, last_row);
+}
+
@@ -0,0 +1,1385 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_profile_hmm_r9_simd -- vectorized forward
+// algorithm for the R7 and R9 profile HMMs
+//
+#include <vector>
+#include <algorithm>
+#include <map>
+#include "nanopolish_profile_hmm_r7.h"
+#include "nanopolish_profile_hmm_r9.h"
+#include "nanopolish_profile_hmm_r9_simd.h"
+
+// The kernels are compiled for their instruction set with target pragmas
+// so the rest of the program does not need to be built with -mavx2.
+// Dispatch happens at runtime based on CPUID.
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define HMM_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if HMM_REVERSE_FIX
+#error "the vectorized forward kernel does not support HMM_REVERSE_FIX"
+#endif
+
+//
+// The R7 and R9 models have the same three states per block and differ
+// in which transitions between them exist, and in whether the second state
+// emits. A topology describes a model at compile time so one kernel can be
+// instantiated for each without any per-cell branches. The states are
+// labelled with the R9 names: the R7 event split state is the bad event state.
+//
+// Each into_* mask has a bit set for every HMMMovementType that leads
+// to the state. The match and bad event states are reached from the
+// previous row and the silent kmer skip state from the current row.
+#define HMT_MASK(t) (1u << (t))
+
+struct ProfileHMMTopologyR9
+{
+    static constexpr uint32_t into_match = HMT_MASK(HMT_FROM_SAME_M) | HMT_MASK(HMT_FROM_PREV_M) |
+                                           HMT_MASK(HMT_FROM_SAME_B) | HMT_MASK(HMT_FROM_PREV_B) |
+                                           HMT_MASK(HMT_FROM_PREV_K) | HMT_MASK(HMT_FROM_SOFT);
+    static constexpr uint32_t into_bad_event = HMT_MASK(HMT_FROM_SAME_M) | HMT_MASK(HMT_FROM_SAME_B);
+    static constexpr uint32_t into_kmer_skip = HMT_MASK(HMT_FROM_PREV_M) | HMT_MASK(HMT_FROM_PREV_B) |
+                                               HMT_MASK(HMT_FROM_PREV_K);
+    static constexpr bool bad_event_emits = false;
+
+    static std::vector<BlockTransitions> get_transitions(uint32_t num_kmers, const HMMInputSequenceView& sequence, const HMMInputData& data)
+    {
+        const std::vector<BlockTransitions>& table = get_transitions_r9(num_kmers);
+        return std::vector<BlockTransitions>(table.begin(), table.begin() + num_kmers);
+    }
+
+    static std::vector<float> get_pre_flanking(const HMMInputData& data, uint32_t e_start, uint32_t num_events)
+    {
+        return make_pre_flanking(data, e_start, num_events);
+    }
+
+    static std::vector<float> get_post_flanking(const HMMInputData& data, uint32_t e_start, uint32_t num_events)
+    {
+        return make_post_flanking(data, e_start, num_events);
+    }
+
+    static std::shared_ptr<EmissionTableCells> get_emission_cells(const HMMInputData& data)
+    {
+        return get_emission_cells_r9(*data.read, data.strand);
+    }
+
+    static float lp_match(const SquiggleRead& read, uint32_t rank, uint32_t event_idx, uint8_t strand, EmissionTableCells* cells)
+    {
+        return log_probability_match_r9(read, rank, event_idx, strand, cells);
+    }
+
+    static float lp_bad_event(const SquiggleRead&, uint32_t, uint32_t, uint8_t)
+    {
+        return 0.0f;
+    }
+};
+
+// R7 has no self transitions into the match state and
+// no transition from the event split state to the skip state
+struct ProfileHMMTopologyR7
+{
+    static constexpr uint32_t into_match = HMT_MASK(HMT_FROM_PREV_M) | HMT_MASK(HMT_FROM_PREV_B) |
+                                           HMT_MASK(HMT_FROM_PREV_K) | HMT_MASK(HMT_FROM_SOFT);
+    static constexpr uint32_t into_bad_event = HMT_MASK(HMT_FROM_SAME_M) | HMT_MASK(HMT_FROM_SAME_B);
+    static constexpr uint32_t into_kmer_skip = HMT_MASK(HMT_FROM_PREV_M) | HMT_MASK(HMT_FROM_PREV_K);
+    static constexpr bool bad_event_emits = true;
+
+    // Store the R7 transitions in the R9 layout, absent transitions are -INFINITY
+    static std::vector<BlockTransitions> get_transitions(uint32_t num_kmers, const HMMInputSequenceView& sequence, const HMMInputData& data)
+    {
+        std::vector<BlockTransitionsR7> transitions_r7 = calculate_transitions_r7(num_kmers, sequence, data);
+        std::vector<BlockTransitions> transitions(num_kmers);
+        for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+            const BlockTransitionsR7& in = transitions_r7[ki];
+            BlockTransitions& out = transitions[ki];
+            out.lp_mm_self = -INFINITY;
+            out.lp_mb = in.lp_me;
+            out.lp_mk = in.lp_mk;
+            out.lp_mm_next = in.lp_mm;
+            out.lp_bb = in.lp_ee;
+            out.lp_bk = -INFINITY;
+            out.lp_bm_next = in.lp_em;
+            out.lp_bm_self = -INFINITY;
+            out.lp_kk = in.lp_kk;
+            out.lp_km = in.lp_km;
+        }
+        return transitions;
+    }
+
+    static std::vector<float> get_pre_flanking(const HMMInputData& data, uint32_t e_start, uint32_t num_events)
+    {
+        return make_pre_flanking_r7(data, data.read->parameters[data.strand], e_start, num_events);
+    }
+
+    static std::vector<float> get_post_flanking(const HMMInputData& data, uint32_t e_start, uint32_t num_events)
+    {
+        return make_post_flanking_r7(data, data.read->parameters[data.strand], e_start, num_events);
+    }
+
+    // R7 emissions are not cached
+    static std::shared_ptr<EmissionTableCells> get_emission_cells(const HMMInputData&)
+    {
+        return NULL;
+    }
+
+    static float lp_match(const SquiggleRead& read, uint32_t rank, uint32_t event_idx, uint8_t strand, EmissionTableCells*)
+    {
+        return log_probability_match_r7(read, rank, event_idx, strand);
+    }
+
+    static float lp_bad_event(const SquiggleRead& read, uint32_t rank, uint32_t event_idx, uint8_t strand)
+    {
+        return log_probability_event_insert_r7(read, rank, event_idx, strand);
+    }
+};
+
+// Log-scaled transitions into each block, in structure-of-arrays layout
+struct R9SIMDTransitions
+{
+    const float* lp_mm_self;
+    const float* lp_mb;
+    const float* lp_mk;
+    const float* lp_mm_next;
+    const float* lp_bb;
+    const float* lp_bk;
+    const float* lp_bm_next;
+    const float* lp_bm_self;
+    const float* lp_kk;
+    const float* lp_km;
+};
+
+// Everything needed to compute one row of the matrix besides the previous row
+struct R9SIMDRowInput
+{
+    const R9SIMDTransitions* transitions;
+    const float* lp_emission; // match emission, by block
+    const float* lp_emission_b; // bad event emission, by block. Only used when the topology emits.
+    const float* lp_soft; // transition from the start state, by block
+    uint32_t first_block; // blocks before this are not computed
+    uint32_t num_kmers;
+};
+
+// One row of the forward matrix. Index 0 is the start block.
+struct R9SIMDRow
+{
+    float* m;
+    float* b;
+    float* k;
+};
+
+// Everything needed to compute one row of the rescaled linear-space
+// matrix besides the previous row, see profile_hmm_forward_linear
+struct R9SIMDLinearRowInput
+{
+    const R9SIMDTransitions* transitions; // probabilities rather than log probabilities
+    const float* lp_emission; // match emission, log-scaled, by block
+    const float* lp_emission_b; // bad event emission, log-scaled, by block. Only used when the topology emits.
+    const float* soft; // probability of the transition from the start state relative to the previous row, by block
+    float prev_scale; // multiplies every cell of the previous row
+    uint32_t num_kmers;
+};
+
+#if HMM_SIMD_X86
+
+//
+// SSE4.1, 4 lanes
+//
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+namespace r9_sse4 {
+
+typedef __m128 vfloat;
+static const uint32_t VEC_WIDTH = 4;
+
+static inline vfloat v_set1(float x) { return _mm_set1_ps(x); }
+static inline vfloat v_load(const float* p) { return _mm_loadu_ps(p); }
+static inline void v_store(float* p, vfloat v) { _mm_storeu_ps(p, v); }
+static inline vfloat v_add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+static inline vfloat v_sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+static inline vfloat v_mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+static inline vfloat v_max(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+static inline vfloat v_min(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+
+// return -INFINITY in the lanes where max is -INFINITY, x otherwise
+static inline vfloat v_mask_ninf(vfloat max, vfloat x)
+{
+    return _mm_blendv_ps(x, max, _mm_cmpeq_ps(max, v_set1(-INFINITY)));
+}
+
+// exp(x), Cephes expf. Inputs below log(FLT_MIN), -INFINITY and NaN
+// are clamped to log(FLT_MIN) which is ~0 for our purposes.
+static inline vfloat v_exp(vfloat x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, v_set1(-87.3365447f)), v_set1(88.3762626f));
+
+    // express exp(x) as exp(g + n*log(2))
+    vfloat fx = _mm_floor_ps(v_fmadd(x, v_set1(1.44269504088896341f), v_set1(0.5f)));
+    x = v_sub(x, v_mul(fx, v_set1(0.693359375f)));
+    x = v_sub(x, v_mul(fx, v_set1(-2.12194440e-4f)));
+
+    vfloat y = v_set1(1.9875691500E-4f);
+    y = v_fmadd(y, x, v_set1(1.3981999507E-3f));
+    y = v_fmadd(y, x, v_set1(8.3334519073E-3f));
+    y = v_fmadd(y, x, v_set1(4.1665795894E-2f));
+    y = v_fmadd(y, x, v_set1(1.6666665459E-1f));
+    y = v_fmadd(y, x, v_set1(5.0000001201E-1f));
+    y = v_fmadd(y, v_mul(x, x), v_add(x, v_set1(1.0f)));
+
+    // build 2^n
+    __m128i n = _mm_cvttps_epi32(fx);
+    n = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(0x7f)), 23);
+    return v_mul(y, _mm_castsi128_ps(n));
+}
+
+// log(x) for positive, normal x. Cephes logf.
+static inline vfloat v_log(vfloat x)
+{
+    __m128i e_bits = _mm_srli_epi32(_mm_castps_si128(x), 23);
+    vfloat e = _mm_cvtepi32_ps(_mm_sub_epi32(e_bits, _mm_set1_epi32(0x7e)));
+
+    // mantissa in [0.5, 1)
+    x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+    x = _mm_or_ps(x, v_set1(0.5f));
+
+    // shift the mantissa to [sqrt(0.5) - 1, sqrt(2) - 1)
+    vfloat mask = _mm_cmplt_ps(x, v_set1(0.707106781186547524f));
+    vfloat tmp = _mm_and_ps(x, mask);
+    x = v_sub(x, v_set1(1.0f));
+    e = v_sub(e, _mm_and_ps(v_set1(1.0f), mask));
+    x = v_add(x, tmp);
+
+    vfloat z = v_mul(x, x);
+    vfloat y = v_set1(7.0376836292E-2f);
+    y = v_fmadd(y, x, v_set1(-1.1514610310E-1f));
+    y = v_fmadd(y, x, v_set1(1.1676998740E-1f));
+    y = v_fmadd(y, x, v_set1(-1.2420140846E-1f));
+    y = v_fmadd(y, x, v_set1(1.4249322787E-1f));
+    y = v_fmadd(y, x, v_set1(-1.6668057665E-1f));
+    y = v_fmadd(y, x, v_set1(2.0000714765E-1f));
+    y = v_fmadd(y, x, v_set1(-2.4999993993E-1f));
+    y = v_fmadd(y, x, v_set1(3.3333331174E-1f));
+    y = v_mul(v_mul(y, x), z);
+
+    y = v_fmadd(e, v_set1(-2.12194440e-4f), y);
+    y = v_fmadd(z, v_set1(-0.5f), y);
+    x = v_add(x, y);
+    return v_fmadd(e, v_set1(0.693359375f), x);
+}
+
+#include "nanopolish_profile_hmm_r9_simd.inl"
+
+} // namespace r9_sse4
+#pragma GCC pop_options
+
+//
+// AVX2 + FMA, 8 lanes
+//
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace r9_avx2 {
+
+typedef __m256 vfloat;
+static const uint32_t VEC_WIDTH = 8;
+
+static inline vfloat v_set1(float x) { return _mm256_set1_ps(x); }
+static inline vfloat v_load(const float* p) { return _mm256_loadu_ps(p); }
+static inline void v_store(float* p, vfloat v) { _mm256_storeu_ps(p, v); }
+static inline vfloat v_add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+static inline vfloat v_sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+static inline vfloat v_mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+static inline vfloat v_max(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+static inline vfloat v_min(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+
+// return -INFINITY in the lanes where max is -INFINITY, x otherwise
+static inline vfloat v_mask_ninf(vfloat max, vfloat x)
+{
+    return _mm256_blendv_ps(x, max, _mm256_cmp_ps(max, v_set1(-INFINITY), _CMP_EQ_OQ));
+}
+
+// exp(x), see the SSE4 version
+static inline vfloat v_exp(vfloat x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, v_set1(-87.3365447f)), v_set1(88.3762626f));
+
+    vfloat fx = _mm256_floor_ps(v_fmadd(x, v_set1(1.44269504088896341f), v_set1(0.5f)));
+    x = _mm256_fnmadd_ps(fx, v_set1(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, v_set1(-2.12194440e-4f), x);
+
+    vfloat y = v_set1(1.9875691500E-4f);
+    y = v_fmadd(y, x, v_set1(1.3981999507E-3f));
+    y = v_fmadd(y, x, v_set1(8.3334519073E-3f));
+    y = v_fmadd(y, x, v_set1(4.1665795894E-2f));
+    y = v_fmadd(y, x, v_set1(1.6666665459E-1f));
+    y = v_fmadd(y, x, v_set1(5.0000001201E-1f));
+    y = v_fmadd(y, v_mul(x, x), v_add(x, v_set1(1.0f)));
+
+    __m256i n = _mm256_cvttps_epi32(fx);
+    n = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(0x7f)), 23);
+    return v_mul(y, _mm256_castsi256_ps(n));
+}
+
+// log(x), see the SSE4 version
+static inline vfloat v_log(vfloat x)
+{
+    __m256i e_bits = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+    vfloat e = _mm256_cvtepi32_ps(_mm256_sub_epi32(e_bits, _mm256_set1_epi32(0x7e)));
+
+    x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+    x = _mm256_or_ps(x, v_set1(0.5f));
+
+    vfloat mask = _mm256_cmp_ps(x, v_set1(0.707106781186547524f), _CMP_LT_OQ);
+    vfloat tmp = _mm256_and_ps(x, mask);
+    x = v_sub(x, v_set1(1.0f));
+    e = v_sub(e, _mm256_and_ps(v_set1(1.0f), mask));
+    x = v_add(x, tmp);
+
+    vfloat z = v_mul(x, x);
+    vfloat y = v_set1(7.0376836292E-2f);
+    y = v_fmadd(y, x, v_set1(-1.1514610310E-1f));
+    y = v_fmadd(y, x, v_set1(1.1676998740E-1f));
+    y = v_fmadd(y, x, v_set1(-1.2420140846E-1f));
+    y = v_fmadd(y, x, v_set1(1.4249322787E-1f));
+    y = v_fmadd(y, x, v_set1(-1.6668057665E-1f));
+    y = v_fmadd(y, x, v_set1(2.0000714765E-1f));
+    y = v_fmadd(y, x, v_set1(-2.4999993993E-1f));
+    y = v_fmadd(y, x, v_set1(3.3333331174E-1f));
+    y = v_mul(v_mul(y, x), z);
+
+    y = v_fmadd(e, v_set1(-2.12194440e-4f), y);
+    y = v_fmadd(z, v_set1(-0.5f), y);
+    x = v_add(x, y);
+    return v_fmadd(e, v_set1(0.693359375f), x);
+}
+
+#include "nanopolish_profile_hmm_r9_simd.inl"
+
+} // namespace r9_avx2
+#pragma GCC pop_options
+
+//
+// AVX-512, 16 lanes
+//
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace r9_avx512 {
+
+typedef __m512 vfloat;
+static const uint32_t VEC_WIDTH = 16;
+
+static inline vfloat v_set1(float x) { return _mm512_set1_ps(x); }
+static inline vfloat v_load(const float* p) { return _mm512_loadu_ps(p); }
+static inline void v_store(float* p, vfloat v) { _mm512_storeu_ps(p, v); }
+static inline vfloat v_add(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+static inline vfloat v_sub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+static inline vfloat v_mul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+static inline vfloat v_max(vfloat a, vfloat b) { return _mm512_max_ps(a, b); }
+static inline vfloat v_min(vfloat a, vfloat b) { return _mm512_min_ps(a, b); }
+static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return _mm512_fmadd_ps(a, b, c); }
+
+// return -INFINITY in the lanes where max is -INFINITY, x otherwise
+static inline vfloat v_mask_ninf(vfloat max, vfloat x)
+{
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(max, v_set1(-INFINITY), _CMP_EQ_OQ), x, max);
+}
+
+// exp(x), see the SSE4 version
+static inline vfloat v_exp(vfloat x)
+{
+    x = _mm512_min_ps(_mm512_max_ps(x, v_set1(-87.3365447f)), v_set1(88.3762626f));
+
+    vfloat fx = _mm512_roundscale_ps(v_fmadd(x, v_set1(1.44269504088896341f), v_set1(0.5f)), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(fx, v_set1(0.693359375f), x);
+    x = _mm512_fnmadd_ps(fx, v_set1(-2.12194440e-4f), x);
+
+    vfloat y = v_set1(1.9875691500E-4f);
+    y = v_fmadd(y, x, v_set1(1.3981999507E-3f));
+    y = v_fmadd(y, x, v_set1(8.3334519073E-3f));
+    y = v_fmadd(y, x, v_set1(4.1665795894E-2f));
+    y = v_fmadd(y, x, v_set1(1.6666665459E-1f));
+    y = v_fmadd(y, x, v_set1(5.0000001201E-1f));
+    y = v_fmadd(y, v_mul(x, x), v_add(x, v_set1(1.0f)));
+
+    __m512i n = _mm512_cvttps_epi32(fx);
+    n = _mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(0x7f)), 23);
+    return v_mul(y, _mm512_castsi512_ps(n));
+}
+
+// log(x), see the SSE4 version
+static inline vfloat v_log(vfloat x)
+{
+    __m512i bits = _mm512_castps_si512(x);
+    vfloat e = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(0x7e)));
+
+    bits = _mm512_and_si512(bits, _mm512_set1_epi32(~0x7f800000));
+    x = _mm512_castsi512_ps(_mm512_or_si512(bits, _mm512_castps_si512(v_set1(0.5f))));
+
+    __mmask16 mask = _mm512_cmp_ps_mask(x, v_set1(0.707106781186547524f), _CMP_LT_OQ);
+    vfloat tmp = _mm512_maskz_mov_ps(mask, x);
+    x = v_sub(x, v_set1(1.0f));
+    e = _mm512_mask_sub_ps(e, mask, e, v_set1(1.0f));
+    x = v_add(x, tmp);
+
+    vfloat z = v_mul(x, x);
+    vfloat y = v_set1(7.0376836292E-2f);
+    y = v_fmadd(y, x, v_set1(-1.1514610310E-1f));
+    y = v_fmadd(y, x, v_set1(1.1676998740E-1f));
+    y = v_fmadd(y, x, v_set1(-1.2420140846E-1f));
+    y = v_fmadd(y, x, v_set1(1.4249322787E-1f));
+    y = v_fmadd(y, x, v_set1(-1.6668057665E-1f));
+    y = v_fmadd(y, x, v_set1(2.0000714765E-1f));
+    y = v_fmadd(y, x, v_set1(-2.4999993993E-1f));
+    y = v_fmadd(y, x, v_set1(3.3333331174E-1f));
+    y = v_mul(v_mul(y, x), z);
+
+    y = v_fmadd(e, v_set1(-2.12194440e-4f), y);
+    y = v_fmadd(z, v_set1(-0.5f), y);
+    x = v_add(x, y);
+    return v_fmadd(e, v_set1(0.693359375f), x);
+}
+
+#include "nanopolish_profile_hmm_r9_simd.inl"
+
+} // namespace r9_avx512
+#pragma GCC pop_options
+
+#endif // HMM_SIMD_X86
+
+//
+// Plain floats, 1 lane. The log-space kernel is not used at this level,
+// the original implementation is, but the linear-space one is.
+//
+namespace r9_scalar {
+
+typedef float vfloat;
+static const uint32_t VEC_WIDTH = 1;
+
+static inline vfloat v_set1(float x) { return x; }
+static inline vfloat v_load(const float* p) { return *p; }
+static inline void v_store(float* p, vfloat v) { *p = v; }
+static inline vfloat v_add(vfloat a, vfloat b) { return a + b; }
+static inline vfloat v_sub(vfloat a, vfloat b) { return a - b; }
+static inline vfloat v_mul(vfloat a, vfloat b) { return a * b; }
+static inline vfloat v_max(vfloat a, vfloat b) { return std::max(a, b); }
+static inline vfloat v_min(vfloat a, vfloat b) { return std::min(a, b); }
+static inline vfloat v_fmadd(vfloat a, vfloat b, vfloat c) { return a * b + c; }
+static inline vfloat v_mask_ninf(vfloat max, vfloat x) { return max == -INFINITY ? max : x; }
+static inline vfloat v_exp(vfloat x) { return expf(x); }
+static inline vfloat v_log(vfloat x) { return logf(x); }
+
+#include "nanopolish_profile_hmm_r9_simd.inl"
+
+} // namespace r9_scalar
+
+HMMSIMDLevel detect_hmm_simd_level()
+{
+#if HMM_SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        return HSL_AVX512;
+    }
+
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return HSL_AVX2;
+    }
+
+    if(__builtin_cpu_supports("sse4.1")) {
+        return HSL_SSE4;
+    }
+#endif
+    return HSL_SCALAR;
+}
+
+static HMMSIMDLevel& hmm_simd_level()
+{
+    static HMMSIMDLevel level = detect_hmm_simd_level();
+    return level;
+}
+
+HMMSIMDLevel get_hmm_simd_level()
+{
+    return hmm_simd_level();
+}
+
+void set_hmm_simd_level(HMMSIMDLevel level)
+{
+    // never allow a level higher than what the CPU supports
+    hmm_simd_level() = std::min(level, detect_hmm_simd_level());
+}
+
+static bool& hmm_simd_r7()
+{
+    static bool enabled = false;
+    return enabled;
+}
+
+bool get_hmm_simd_r7()
+{
+    return hmm_simd_r7();
+}
+
+void set_hmm_simd_r7(bool enabled)
+{
+    hmm_simd_r7() = enabled;
+}
+
+void hmm_simd_logadd(const float* a, const float* b, float* out, size_t n)
+{
+    switch(get_hmm_simd_level()) {
+#if HMM_SIMD_X86
+        case HSL_AVX512:
+            r9_avx512::logadd_array(a, b, out, n);
+            return;
+        case HSL_AVX2:
+            r9_avx2::logadd_array(a, b, out, n);
+            return;
+        case HSL_SSE4:
+            r9_sse4::logadd_array(a, b, out, n);
+            return;
+#endif
+        default:
+            for(size_t i = 0; i < n; ++i) {
+                out[i] = p7_FLogsumPoly(a[i], b[i]);
+            }
+    }
+}
+
+
+typedef void (*R9SIMDForwardRowFunc)(const R9SIMDRowInput&, const R9SIMDRow&, R9SIMDRow&);
+
+template<class Topology>
+static R9SIMDForwardRowFunc get_forward_row_func()
+{
+    R9SIMDForwardRowFunc forward_row = NULL;
+#if HMM_SIMD_X86
+    switch(get_hmm_simd_level()) {
+        case HSL_AVX512:
+            forward_row = r9_avx512::forward_row<Topology>;
+            break;
+        case HSL_AVX2:
+            forward_row = r9_avx2::forward_row<Topology>;
+            break;
+        case HSL_SSE4:
+            forward_row = r9_sse4::forward_row<Topology>;
+            break;
+        case HSL_SCALAR:
+            break;
+    }
+#endif
+    return forward_row;
+}
+
+// The kernel that scores get_interleaved_lanes() reads at once, or NULL at HSL_SCALAR
+template<class Topology>
+static R9SIMDForwardRowFunc get_interleaved_row_func()
+{
+    R9SIMDForwardRowFunc interleaved_row = NULL;
+#if HMM_SIMD_X86
+    switch(get_hmm_simd_level()) {
+        case HSL_AVX512:
+            interleaved_row = r9_avx512::interleaved_row<Topology>;
+            break;
+        case HSL_AVX2:
+            interleaved_row = r9_avx2::interleaved_row<Topology>;
+            break;
+        case HSL_SSE4:
+            interleaved_row = r9_sse4::interleaved_row<Topology>;
+            break;
+        case HSL_SCALAR:
+            break;
+    }
+#endif
+    return interleaved_row;
+}
+
+static uint32_t get_interleaved_lanes()
+{
+#if HMM_SIMD_X86
+    switch(get_hmm_simd_level()) {
+        case HSL_AVX512:
+            return r9_avx512::VEC_WIDTH;
+        case HSL_AVX2:
+            return r9_avx2::VEC_WIDTH;
+        case HSL_SSE4:
+            return r9_sse4::VEC_WIDTH;
+        case HSL_SCALAR:
+            break;
+    }
+#endif
+    return r9_scalar::VEC_WIDTH;
+}
+
+typedef float (*R9SIMDLinearRowFunc)(const R9SIMDLinearRowInput&, const R9SIMDRow&, R9SIMDRow&);
+
+template<class Topology>
+static R9SIMDLinearRowFunc get_linear_row_func()
+{
+#if HMM_SIMD_X86
+    switch(get_hmm_simd_level()) {
+        case HSL_AVX512:
+            return r9_avx512::linear_row<Topology>;
+        case HSL_AVX2:
+            return r9_avx2::linear_row<Topology>;
+        case HSL_SSE4:
+            return r9_sse4::linear_row<Topology>;
+        case HSL_SCALAR:
+            break;
+    }
+#endif
+    return r9_scalar::linear_row<Topology>;
+}
+
+// Each array has one entry per block, plus padding so the
+// last vector load of a row never reads past the end
+static inline size_t get_simd_row_stride(uint32_t num_kmers)
+{
+    const uint32_t MAX_VEC_WIDTH = 16;
+    return num_kmers + 1 + MAX_VEC_WIDTH;
+}
+
+// The parts of the calculation that only depend on the read,
+// shared by every sequence scored against it
+template<class Topology>
+struct R9SIMDReadInput
+{
+    R9SIMDReadInput(const HMMInputData& d, uint32_t f) : data(d), flags(f)
+    {
+        assert( (data.rc && data.event_stride == -1) || (!data.rc && data.event_stride == 1));
+        uint32_t e_start = data.event_start_idx;
+        uint32_t e_end = data.event_stop_idx;
+        num_events = e_end > e_start ? e_end - e_start + 1 : e_start - e_end + 1;
+        pre_flank = Topology::get_pre_flanking(data, e_start, num_events);
+        post_flank = Topology::get_post_flanking(data, e_start, num_events);
+        forward_row = get_forward_row_func<Topology>();
+        emission_cells = Topology::get_emission_cells(data);
+    }
+
+    const HMMInputData& data;
+    uint32_t flags;
+    uint32_t num_events;
+    std::vector<float> pre_flank;
+    std::vector<float> post_flank;
+    R9SIMDForwardRowFunc forward_row;
+    std::shared_ptr<EmissionTableCells> emission_cells;
+};
+
+// Emissions for every event of a read and a set of k-mer ranks.
+// The tables are stored by event so filling in a row reads a single line.
+struct R9SIMDEmissionCache
+{
+    std::vector<uint32_t> slot_by_rank;
+    uint32_t num_slots;
+    std::vector<float> lp_emission; // match, num_events * num_slots
+    std::vector<float> lp_emission_b; // bad event, empty if the state does not emit
+};
+
+// The rows of the forward matrix of another sequence, used to
+// skip computing the first k-mers when they are the same
+struct R9SIMDPrefix
+{
+    const float* rows;
+    size_t stride;
+    uint32_t num_blocks;
+};
+
+// Run the forward algorithm on the vectorized kernel. If cache is not NULL the
+// emissions are read from it. If prefix is not NULL the first prefix->num_blocks
+// blocks of each row are copied from it instead of being computed. If saved_rows
+// is not NULL every row is written to it, using get_simd_row_stride(num_kmers).
+// If xdrop is not NULL this either records the reference rows or stops early
+// and returns -INFINITY, see profile_hmm_score.
+template<class Topology>
+static float profile_hmm_forward_simd(const R9SIMDReadInput<Topology>& read,
+                                      const HMMInputSequenceView& sequence,
+                                      const std::vector<uint32_t>& kmer_ranks,
+                                      const R9SIMDEmissionCache* cache,
+                                      const R9SIMDPrefix* prefix,
+                                      float* saved_rows,
+                                      HMMXDrop* xdrop)
+{
+    // there is no log-space kernel at HSL_SCALAR
+    assert(read.forward_row != NULL);
+
+    const HMMInputData& data = read.data;
+    uint32_t num_kmers = kmer_ranks.size();
+    uint32_t num_events = read.num_events;
+    uint32_t e_start = data.event_start_idx;
+
+    std::vector<BlockTransitions> transitions = Topology::get_transitions(num_kmers, sequence, data);
+
+    // See profile_hmm_fill_generic_r9
+    float lp_sm, lp_ms;
+    lp_sm = lp_ms = 0.0f;
+
+    const size_t stride = get_simd_row_stride(num_kmers);
+
+    enum { RA_PREV_M = 0, RA_PREV_B, RA_PREV_K, RA_CURR_M, RA_CURR_B, RA_CURR_K,
+           RA_EMISSION, RA_EMISSION_B, RA_SOFT, RA_NUM_ROW_ARRAYS };
+    FloatMatrix row_data;
+    MatrixLease<float> row_lease(row_data, RA_NUM_ROW_ARRAYS, stride);
+    std::fill(row_data.cells, row_data.cells + RA_NUM_ROW_ARRAYS * stride, -INFINITY);
+
+    FloatMatrix transition_data;
+    MatrixLease<float> transition_lease(transition_data, 10, stride);
+    std::fill(transition_data.cells, transition_data.cells + 10 * stride, 0.0f);
+
+    float* rp = row_data.cells;
+    R9SIMDRow prev = { rp + RA_PREV_M * stride, rp + RA_PREV_B * stride, rp + RA_PREV_K * stride };
+    R9SIMDRow curr = { rp + RA_CURR_M * stride, rp + RA_CURR_B * stride, rp + RA_CURR_K * stride };
+    float* lp_emission = rp + RA_EMISSION * stride;
+    float* lp_emission_b = rp + RA_EMISSION_B * stride;
+    float* lp_soft = rp + RA_SOFT * stride;
+
+    float* tp = transition_data.cells;
+    R9SIMDTransitions st = { tp, tp + stride, tp + 2 * stride, tp + 3 * stride, tp + 4 * stride,
+                             tp + 5 * stride, tp + 6 * stride, tp + 7 * stride, tp + 8 * stride, tp + 9 * stride };
+
+    for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+        const BlockTransitions& bt = transitions[ki];
+        uint32_t block = ki + 1;
+        tp[0 * stride + block] = bt.lp_mm_self;
+        tp[1 * stride + block] = bt.lp_mb;
+        tp[2 * stride + block] = bt.lp_mk;
+        tp[3 * stride + block] = bt.lp_mm_next;
+        tp[4 * stride + block] = bt.lp_bb;
+        tp[5 * stride + block] = bt.lp_bk;
+        tp[6 * stride + block] = bt.lp_bm_next;
+        tp[7 * stride + block] = bt.lp_bm_self;
+        tp[8 * stride + block] = bt.lp_kk;
+        tp[9 * stride + block] = bt.lp_km;
+    }
+
+    // the start block of the prefix is never copied so it stays -INFINITY
+    uint32_t prefix_blocks = prefix != NULL ? prefix->num_blocks : 0;
+    assert(prefix_blocks < num_kmers);
+
+    R9SIMDRowInput input;
+    input.transitions = &st;
+    input.lp_emission = lp_emission;
+    input.lp_emission_b = lp_emission_b;
+    input.lp_soft = lp_soft;
+    input.first_block = prefix_blocks + 1;
+    input.num_kmers = num_kmers;
+
+    float lp_end = -INFINITY;
+    uint32_t last_block = num_kmers;
+
+    bool record_xdrop = xdrop != NULL && xdrop->lp_reference_rows.empty();
+    if(record_xdrop) {
+        xdrop->lp_reference_rows.reserve(num_events);
+    } else if(xdrop != NULL) {
+        assert(xdrop->lp_reference_rows.size() == num_events);
+    }
+
+    for(uint32_t row = 1; row <= num_events; row++) {
+
+        uint32_t event_idx = e_start + (row - 1) * data.event_stride;
+        if(cache != NULL) {
+            const float* cache_row = &cache->lp_emission[(row - 1) * cache->num_slots];
+            for(uint32_t ki = prefix_blocks; ki < num_kmers; ++ki) {
+                lp_emission[ki + 1] = cache_row[cache->slot_by_rank[kmer_ranks[ki]]];
+            }
+
+            if(Topology::bad_event_emits) {
+                const float* cache_row_b = &cache->lp_emission_b[(row - 1) * cache->num_slots];
+                for(uint32_t ki = prefix_blocks; ki < num_kmers; ++ki) {
+                    lp_emission_b[ki + 1] = cache_row_b[cache->slot_by_rank[kmer_ranks[ki]]];
+                }
+            }
+        } else {
+            for(uint32_t ki = prefix_blocks; ki < num_kmers; ++ki) {
+                lp_emission[ki + 1] = Topology::lp_match(*data.read, kmer_ranks[ki], event_idx, data.strand, read.emission_cells.get());
+            }
+
+            if(Topology::bad_event_emits) {
+                for(uint32_t ki = prefix_blocks; ki < num_kmers; ++ki) {
+                    lp_emission_b[ki + 1] = Topology::lp_bad_event(*data.read, kmer_ranks[ki], event_idx, data.strand);
+                }
+            }
+        }
+
+        if(prefix_blocks > 0) {
+            const float* prefix_row = prefix->rows + (row - 1) * 3 * prefix->stride;
+            size_t bytes = prefix_blocks * sizeof(float);
+            memcpy(curr.m + 1, prefix_row + 1, bytes);
+            memcpy(curr.b + 1, prefix_row + prefix->stride + 1, bytes);
+            memcpy(curr.k + 1, prefix_row + 2 * prefix->stride + 1, bytes);
+        }
+
+        // Only the first k-mer can be reached from the start state
+        lp_soft[1] = (event_idx == e_start || (read.flags & HAF_ALLOW_PRE_CLIP)) ? lp_sm + read.pre_flank[row - 1] : -INFINITY;
+
+        read.forward_row(input, prev, curr);
+
+        if(saved_rows != NULL) {
+            float* saved_row = saved_rows + (row - 1) * 3 * stride;
+            memcpy(saved_row, curr.m, stride * sizeof(float));
+            memcpy(saved_row + stride, curr.b, stride * sizeof(float));
+            memcpy(saved_row + 2 * stride, curr.k, stride * sizeof(float));
+        }
+
+        // transition to the end state from the last k-mer
+        if( (read.flags & HAF_ALLOW_POST_CLIP) || row == num_events) {
+            lp_end = add_logs(lp_end, lp_ms + curr.m[last_block] + read.post_flank[row - 1]);
+            lp_end = add_logs(lp_end, lp_ms + curr.b[last_block] + read.post_flank[row - 1]);
+            lp_end = add_logs(lp_end, lp_ms + curr.k[last_block] + read.post_flank[row - 1]);
+        }
+
+        if(xdrop != NULL) {
+            float lp_row_max = -INFINITY;
+            for(uint32_t block = 1; block <= num_kmers; ++block) {
+                lp_row_max = std::max(lp_row_max, std::max(curr.m[block], std::max(curr.b[block], curr.k[block])));
+            }
+
+            if(record_xdrop) {
+                xdrop->lp_reference_rows.push_back(lp_row_max);
+            } else if(lp_row_max < xdrop->lp_reference_rows[row - 1] - xdrop->x_drop) {
+                return -INFINITY;
+            }
+        }
+
+        std::swap(prev, curr);
+    }
+
+    return lp_end;
+}
+
+// Run the forward algorithm in linear probability space. The sums of
+// the log-space algorithm become multiply-adds and only one exp and one
+// log are needed per emitting cell. Each row is stored divided by its
+// largest cell, with the log of the divisor accumulated in lp_row_scale,
+// so the values stay in the range of a float. Cells that are
+// more than ~87 nats below the largest cell of their row underflow to
+// zero, which only loses paths that contribute nothing to the score.
+template<class Topology>
+static float profile_hmm_forward_linear(const R9SIMDReadInput<Topology>& read,
+                                        const HMMInputSequenceView& sequence,
+                                        const std::vector<uint32_t>& kmer_ranks)
+{
+#if HMM_SIMD_X86
+    // the tiny values that are about to underflow are not worth the
+    // slow arithmetic on denormals
+    unsigned int saved_csr = _mm_getcsr();
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+#endif
+
+    const HMMInputData& data = read.data;
+    uint32_t num_kmers = kmer_ranks.size();
+    uint32_t num_events = read.num_events;
+    uint32_t e_start = data.event_start_idx;
+
+    std::vector<BlockTransitions> transitions = Topology::get_transitions(num_kmers, sequence, data);
+
+    // See profile_hmm_fill_generic_r9
+    float lp_sm, lp_ms;
+    lp_sm = lp_ms = 0.0f;
+
+    const size_t stride = get_simd_row_stride(num_kmers);
+
+    enum { RA_PREV_M = 0, RA_PREV_B, RA_PREV_K, RA_CURR_M, RA_CURR_B, RA_CURR_K,
+           RA_SOFT, RA_EMISSION, RA_EMISSION_B, RA_NUM_ROW_ARRAYS };
+    FloatMatrix row_data;
+    MatrixLease<float> row_lease(row_data, RA_NUM_ROW_ARRAYS, stride);
+    std::fill(row_data.cells, row_data.cells + RA_EMISSION * stride, 0.0f);
+    std::fill(row_data.cells + RA_EMISSION * stride, row_data.cells + RA_NUM_ROW_ARRAYS * stride, -INFINITY);
+
+    FloatMatrix transition_data;
+    MatrixLease<float> transition_lease(transition_data, 10, stride);
+    std::fill(transition_data.cells, transition_data.cells + 10 * stride, 0.0f);
+
+    float* rp = row_data.cells;
+    R9SIMDRow prev = { rp + RA_PREV_M * stride, rp + RA_PREV_B * stride, rp + RA_PREV_K * stride };
+    R9SIMDRow curr = { rp + RA_CURR_M * stride, rp + RA_CURR_B * stride, rp + RA_CURR_K * stride };
+    float* soft = rp + RA_SOFT * stride;
+    float* lp_emission = rp + RA_EMISSION * stride;
+    float* lp_emission_b = rp + RA_EMISSION_B * stride;
+
+    float* tp = transition_data.cells;
+    R9SIMDTransitions st = { tp, tp + stride, tp + 2 * stride, tp + 3 * stride, tp + 4 * stride,
+                             tp + 5 * stride, tp + 6 * stride, tp + 7 * stride, tp + 8 * stride, tp + 9 * stride };
+
+    for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+        const BlockTransitions& bt = transitions[ki];
+        uint32_t block = ki + 1;
+        tp[0 * stride + block] = expf(bt.lp_mm_self);
+        tp[1 * stride + block] = expf(bt.lp_mb);
+        tp[2 * stride + block] = expf(bt.lp_mk);
+        tp[3 * stride + block] = expf(bt.lp_mm_next);
+        tp[4 * stride + block] = expf(bt.lp_bb);
+        tp[5 * stride + block] = expf(bt.lp_bk);
+        tp[6 * stride + block] = expf(bt.lp_bm_next);
+        tp[7 * stride + block] = expf(bt.lp_bm_self);
+        tp[8 * stride + block] = expf(bt.lp_kk);
+        tp[9 * stride + block] = expf(bt.lp_km);
+    }
+
+    R9SIMDLinearRowInput input;
+    input.transitions = &st;
+    input.lp_emission = lp_emission;
+    input.lp_emission_b = lp_emission_b;
+    input.soft = soft;
+    input.num_kmers = num_kmers;
+
+    R9SIMDLinearRowFunc linear_row = get_linear_row_func<Topology>();
+
+    // the true value of a cell of the previous row is its stored
+    // value times exp(lp_row_scale), -INFINITY when the row is empty
+    float lp_row_scale = -INFINITY;
+    float lp_end = -INFINITY;
+    uint32_t last_block = num_kmers;
+
+    for(uint32_t row = 1; row <= num_events; row++) {
+
+        uint32_t event_idx = e_start + (row - 1) * data.event_stride;
+        for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+            lp_emission[ki + 1] = Topology::lp_match(*data.read, kmer_ranks[ki], event_idx, data.strand, read.emission_cells.get());
+        }
+
+        if(Topology::bad_event_emits) {
+            for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+                lp_emission_b[ki + 1] = Topology::lp_bad_event(*data.read, kmer_ranks[ki], event_idx, data.strand);
+            }
+        }
+
+        // Only the first k-mer can be reached from the start state. The
+        // previous row is rescaled when the start state is more likely
+        // than all of it so that the soft transition is at most one.
+        float lp_soft = (event_idx == e_start || (read.flags & HAF_ALLOW_PRE_CLIP)) ? lp_sm + read.pre_flank[row - 1] : -INFINITY;
+        float lp_base = std::max(lp_row_scale, lp_soft);
+        if(lp_base == -INFINITY) {
+            lp_base = 0.0f;
+        }
+        input.prev_scale = lp_row_scale != -INFINITY ? expf(lp_row_scale - lp_base) : 0.0f;
+        soft[1] = expf(lp_soft - lp_base);
+
+        float lp_scale = linear_row(input, prev, curr);
+        lp_row_scale = lp_base + lp_scale;
+
+        // transition to the end state from the last k-mer
+        float p_last = curr.m[last_block] + curr.b[last_block] + curr.k[last_block];
+        if( ((read.flags & HAF_ALLOW_POST_CLIP) || row == num_events) && p_last > 0.0f) {
+            lp_end = add_logs(lp_end, lp_ms + logf(p_last) + lp_row_scale + read.post_flank[row - 1]);
+        }
+
+        std::swap(prev, curr);
+    }
+
+#if HMM_SIMD_X86
+    _mm_setcsr(saved_csr);
+#endif
+    return lp_end;
+}
+
+static std::vector<uint32_t> get_kmer_ranks(const HMMInputSequenceView& sequence, const HMMInputData& data)
+{
+    const uint32_t k = data.read->pore_model[data.strand].k;
+
+    // Make sure the HMMInputSequence's alphabet matches the state space of the read
+    assert( data.read->pore_model[data.strand].states.size() == sequence.get_num_kmer_ranks(k) );
+
+    return sequence.get_kmer_ranks(k, data.rc);
+}
+
+template<class Topology>
+static float profile_hmm_score_simd(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags, HMMXDrop* xdrop)
+{
+    R9SIMDReadInput<Topology> read(data, flags);
+    return profile_hmm_forward_simd(read, sequence, get_kmer_ranks(sequence, data), NULL, NULL, NULL, xdrop);
+}
+
+template<class Topology>
+static float profile_hmm_score_linear(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
+{
+    R9SIMDReadInput<Topology> read(data, flags);
+    return profile_hmm_forward_linear(read, sequence, get_kmer_ranks(sequence, data));
+}
+
+template<class Topology>
+static std::vector<float> profile_hmm_score_batch_simd(const std::vector<HMMInputSequence>& sequences,
+                                                       const HMMInputData& data,
+                                                       const uint32_t flags)
+{
+    std::vector<float> scores(sequences.size(), -INFINITY);
+    if(sequences.empty()) {
+        return scores;
+    }
+
+    R9SIMDReadInput<Topology> read(data, flags);
+
+    std::vector< std::vector<uint32_t> > kmer_ranks(sequences.size());
+    for(size_t si = 0; si < sequences.size(); ++si) {
+        kmer_ranks[si] = get_kmer_ranks(sequences[si], data);
+    }
+
+    // Compute the emissions of every k-mer used by any sequence once
+    const uint32_t k = data.read->pore_model[data.strand].k;
+    R9SIMDEmissionCache cache;
+    cache.slot_by_rank.resize(sequences[0].get_num_kmer_ranks(k), UINT32_MAX);
+    std::vector<uint32_t> cached_ranks;
+    for(size_t si = 0; si < sequences.size(); ++si) {
+        for(size_t ki = 0; ki < kmer_ranks[si].size(); ++ki) {
+            uint32_t rank = kmer_ranks[si][ki];
+            if(cache.slot_by_rank[rank] == UINT32_MAX) {
+                cache.slot_by_rank[rank] = cached_ranks.size();
+                cached_ranks.push_back(rank);
+            }
+        }
+    }
+    cache.num_slots = cached_ranks.size();
+
+    cache.lp_emission.resize(read.num_events * cache.num_slots);
+    if(Topology::bad_event_emits) {
+        cache.lp_emission_b.resize(read.num_events * cache.num_slots);
+    }
+
+    for(uint32_t ei = 0; ei < read.num_events; ++ei) {
+        uint32_t event_idx = data.event_start_idx + ei * data.event_stride;
+        float* cache_row = &cache.lp_emission[ei * cache.num_slots];
+        for(uint32_t slot = 0; slot < cache.num_slots; ++slot) {
+            cache_row[slot] = Topology::lp_match(*data.read, cached_ranks[slot], event_idx, data.strand, read.emission_cells.get());
+        }
+
+        if(Topology::bad_event_emits) {
+            float* cache_row_b = &cache.lp_emission_b[ei * cache.num_slots];
+            for(uint32_t slot = 0; slot < cache.num_slots; ++slot) {
+                cache_row_b[slot] = Topology::lp_bad_event(*data.read, cached_ranks[slot], event_idx, data.strand);
+            }
+        }
+    }
+
+    // The first sequence is the base. Every row of its matrix is saved
+    // so the other sequences only compute the blocks after the first
+    // k-mer that differs from it. The transitions into a block only
+    // depend on its k-mer and the previous one so they are the same
+    // for the shared blocks.
+    const std::vector<uint32_t>& base_ranks = kmer_ranks[0];
+    size_t base_stride = get_simd_row_stride(base_ranks.size());
+    FloatMatrix base_rows;
+    MatrixLease<float> base_lease(base_rows, read.num_events, 3 * base_stride);
+    scores[0] = profile_hmm_forward_simd(read, sequences[0], base_ranks, &cache, NULL, base_rows.cells, NULL);
+
+    for(size_t si = 1; si < sequences.size(); ++si) {
+        const std::vector<uint32_t>& ranks = kmer_ranks[si];
+
+        // always compute the last block as the end state is calculated from it
+        uint32_t max_shared = std::min(ranks.size(), base_ranks.size());
+        max_shared = std::min(max_shared, (uint32_t)ranks.size() - 1);
+
+        R9SIMDPrefix prefix = { base_rows.cells, base_stride, 0 };
+        while(prefix.num_blocks < max_shared && ranks[prefix.num_blocks] == base_ranks[prefix.num_blocks]) {
+            prefix.num_blocks++;
+        }
+        scores[si] = profile_hmm_forward_simd(read, sequences[si], ranks, &cache, &prefix, NULL, NULL);
+    }
+    return scores;
+}
+
+// Run the forward algorithm for up to get_interleaved_lanes() reads at once,
+// one read per lane, see interleaved_row. kmer_ranks[rc] holds the ranks of the
+// sequence on each strand, so the reads must use k-mers of the same length.
+// The rows are padded to the number of events of the longest read. The lanes
+// of the reads that have run out of events compute rows that are never read.
+template<class Topology>
+static void profile_hmm_forward_interleaved(const HMMInputSequenceView& sequence,
+                                            const std::vector<uint32_t>* kmer_ranks,
+                                            const HMMInputData* const* data,
+                                            uint32_t num_reads,
+                                            const uint32_t flags,
+                                            float* scores)
+{
+    R9SIMDForwardRowFunc interleaved_row = get_interleaved_row_func<Topology>();
+    assert(interleaved_row != NULL);
+
+#if HMM_SIMD_X86
+    // The log-sums of cells far below their neighbours produce denormals,
+    // which are slow and do not change the result
+    unsigned int saved_csr = _mm_getcsr();
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+#endif
+
+    const uint32_t num_lanes = get_interleaved_lanes();
+    assert(num_reads <= num_lanes);
+
+    uint32_t num_kmers = kmer_ranks[data[0]->rc].size();
+    uint32_t max_events = 0;
+    std::vector< R9SIMDReadInput<Topology> > reads;
+    reads.reserve(num_reads);
+    for(uint32_t lane = 0; lane < num_reads; ++lane) {
+        reads.emplace_back(*data[lane], flags);
+        max_events = std::max(max_events, reads.back().num_events);
+    }
+
+    // See profile_hmm_fill_generic_r9
+    float lp_sm, lp_ms;
+    lp_sm = lp_ms = 0.0f;
+
+    // every array has num_lanes entries per block, including the start block
+    const size_t stride = (num_kmers + 1) * num_lanes;
+
+    enum { RA_PREV_M = 0, RA_PREV_B, RA_PREV_K, RA_CURR_M, RA_CURR_B, RA_CURR_K,
+           RA_EMISSION, RA_EMISSION_B, RA_SOFT, RA_NUM_ROW_ARRAYS };
+    FloatMatrix row_data;
+    MatrixLease<float> row_lease(row_data, RA_NUM_ROW_ARRAYS, stride);
+    std::fill(row_data.cells, row_data.cells + RA_NUM_ROW_ARRAYS * stride, -INFINITY);
+
+    FloatMatrix transition_data;
+    MatrixLease<float> transition_lease(transition_data, 10, stride);
+    std::fill(transition_data.cells, transition_data.cells + 10 * stride, 0.0f);
+
+    float* rp = row_data.cells;
+    R9SIMDRow prev = { rp + RA_PREV_M * stride, rp + RA_PREV_B * stride, rp + RA_PREV_K * stride };
+    R9SIMDRow curr = { rp + RA_CURR_M * stride, rp + RA_CURR_B * stride, rp + RA_CURR_K * stride };
+    float* lp_emission = rp + RA_EMISSION * stride;
+    float* lp_emission_b = rp + RA_EMISSION_B * stride;
+    float* lp_soft = rp + RA_SOFT * stride;
+
+    float* tp = transition_data.cells;
+    R9SIMDTransitions st = { tp, tp + stride, tp + 2 * stride, tp + 3 * stride, tp + 4 * stride,
+                             tp + 5 * stride, tp + 6 * stride, tp + 7 * stride, tp + 8 * stride, tp + 9 * stride };
+
+    // The R9 transitions are the same for every read. The R7
+    // transitions depend on the read's parameters.
+    for(uint32_t lane = 0; lane < num_reads; ++lane) {
+        std::vector<BlockTransitions> transitions = Topology::get_transitions(num_kmers, sequence, reads[lane].data);
+        for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+            const BlockTransitions& bt = transitions[ki];
+            size_t i = (ki + 1) * num_lanes + lane;
+            tp[0 * stride + i] = bt.lp_mm_self;
+            tp[1 * stride + i] = bt.lp_mb;
+            tp[2 * stride + i] = bt.lp_mk;
+            tp[3 * stride + i] = bt.lp_mm_next;
+            tp[4 * stride + i] = bt.lp_bb;
+            tp[5 * stride + i] = bt.lp_bk;
+            tp[6 * stride + i] = bt.lp_bm_next;
+            tp[7 * stride + i] = bt.lp_bm_self;
+            tp[8 * stride + i] = bt.lp_kk;
+            tp[9 * stride + i] = bt.lp_km;
+        }
+    }
+
+    R9SIMDRowInput input;
+    input.transitions = &st;
+    input.lp_emission = lp_emission;
+    input.lp_emission_b = lp_emission_b;
+    input.lp_soft = lp_soft;
+    input.first_block = 1;
+    input.num_kmers = num_kmers;
+
+    std::fill(scores, scores + num_reads, -INFINITY);
+    const size_t last_block = num_kmers * num_lanes;
+
+    for(uint32_t row = 1; row <= max_events; row++) {
+
+        for(uint32_t lane = 0; lane < num_reads; ++lane) {
+            const R9SIMDReadInput<Topology>& read = reads[lane];
+            if(row > read.num_events) {
+                continue;
+            }
+
+            const HMMInputData& d = read.data;
+            const std::vector<uint32_t>& ranks = kmer_ranks[d.rc];
+            uint32_t event_idx = d.event_start_idx + (row - 1) * d.event_stride;
+            for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+                lp_emission[(ki + 1) * num_lanes + lane] = Topology::lp_match(*d.read, ranks[ki], event_idx, d.strand, read.emission_cells.get());
+            }
+
+            if(Topology::bad_event_emits) {
+                for(uint32_t ki = 0; ki < num_kmers; ++ki) {
+                    lp_emission_b[(ki + 1) * num_lanes + lane] = Topology::lp_bad_event(*d.read, ranks[ki], event_idx, d.strand);
+                }
+            }
+
+            // Only the first k-mer can be reached from the start state
+            lp_soft[num_lanes + lane] = (row == 1 || (flags & HAF_ALLOW_PRE_CLIP)) ? lp_sm + read.pre_flank[row - 1] : -INFINITY;
+        }
+
+        interleaved_row(input, prev, curr);
+
+        // transition to the end state from the last k-mer
+        for(uint32_t lane = 0; lane < num_reads; ++lane) {
+            const R9SIMDReadInput<Topology>& read = reads[lane];
+            if(row > read.num_events || !( (flags & HAF_ALLOW_POST_CLIP) || row == read.num_events)) {
+                continue;
+            }
+
+            float lp_post = lp_ms + read.post_flank[row - 1];
+            scores[lane] = add_logs(scores[lane], curr.m[last_block + lane] + lp_post);
+            scores[lane] = add_logs(scores[lane], curr.b[last_block + lane] + lp_post);
+            scores[lane] = add_logs(scores[lane], curr.k[last_block + lane] + lp_post);
+        }
+
+        std::swap(prev, curr);
+    }
+
+#if HMM_SIMD_X86
+    _mm_setcsr(saved_csr);
+#endif
+}
+
+template<class Topology>
+static std::vector<float> profile_hmm_score_reads_simd(const HMMInputSequenceView& sequence,
+                                                       const std::vector<HMMInputData>& data,
+                                                       const uint32_t flags)
+{
+    std::vector<float> scores(data.size(), -INFINITY);
+    const uint32_t num_lanes = get_interleaved_lanes();
+
+    // Sort the reads by k-mer length, then by number of events, so the
+    // reads that share the lanes of one forward pass need about the same
+    // number of rows and as little work as possible is padding
+    std::vector<uint32_t> order(data.size());
+    std::vector<uint32_t> read_k(data.size());
+    std::vector<uint32_t> read_events(data.size());
+    for(uint32_t ri = 0; ri < data.size(); ++ri) {
+        const HMMInputData& d = data[ri];
+        read_k[ri] = d.read->pore_model[d.strand].k;
+        read_events[ri] = d.event_stop_idx > d.event_start_idx ? d.event_stop_idx - d.event_start_idx + 1
+                                                               : d.event_start_idx - d.event_stop_idx + 1;
+        order[ri] = ri;
+
+        // Make sure the HMMInputSequence's alphabet matches the state space of the read
+        assert( d.read->pore_model[d.strand].states.size() == sequence.get_num_kmer_ranks(read_k[ri]) );
+    }
+
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return read_k[a] != read_k[b] ? read_k[a] < read_k[b] : read_events[a] < read_events[b];
+    });
+
+    // The k-mer ranks of the sequence on both strands for every k-mer length
+    // and the first read of every group of reads scored together
+    std::map< uint32_t, std::vector<uint32_t> > ranks_by_k[2];
+    std::vector<uint32_t> group_starts;
+    for(uint32_t oi = 0; oi < order.size(); ++oi) {
+        const HMMInputData& d = data[order[oi]];
+        uint32_t k = read_k[order[oi]];
+        if(ranks_by_k[d.rc].find(k) == ranks_by_k[d.rc].end()) {
+            ranks_by_k[d.rc][k] = sequence.get_kmer_ranks(k, d.rc);
+        }
+
+        if(group_starts.empty() || oi - group_starts.back() == num_lanes || read_k[order[group_starts.back()]] != k) {
+            group_starts.push_back(oi);
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(size_t gi = 0; gi < group_starts.size(); ++gi) {
+        uint32_t start = group_starts[gi];
+        uint32_t end = gi + 1 < group_starts.size() ? group_starts[gi + 1] : order.size();
+        uint32_t k = read_k[order[start]];
+
+        std::vector<uint32_t> kmer_ranks[2];
+        for(uint32_t rc = 0; rc < 2; ++rc) {
+            if(ranks_by_k[rc].find(k) != ranks_by_k[rc].end()) {
+                kmer_ranks[rc] = ranks_by_k[rc].find(k)->second;
+            }
+        }
+
+        std::vector<const HMMInputData*> group_data;
+        for(uint32_t oi = start; oi < end; ++oi) {
+            group_data.push_back(&data[order[oi]]);
+        }
+
+        std::vector<float> group_scores(group_data.size());
+        profile_hmm_forward_interleaved<Topology>(sequence, kmer_ranks, group_data.data(), group_data.size(), flags, group_scores.data());
+
+        for(uint32_t oi = start; oi < end; ++oi) {
+            scores[order[oi]] = group_scores[oi - start];
+        }
+    }
+    return scores;
+}
+
+float profile_hmm_score_simd_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags, HMMXDrop* xdrop)
+{
+    PROFILE_FUNC("profile_hmm_score_simd_r9")
+    return profile_hmm_score_simd<ProfileHMMTopologyR9>(sequence, data, flags, xdrop);
+}
+
+std::vector<float> profile_hmm_score_batch_simd_r9(const std::vector<HMMInputSequence>& sequences,
+                                                   const HMMInputData& data,
+                                                   const uint32_t flags)
+{
+    PROFILE_FUNC("profile_hmm_score_batch_simd_r9")
+    return profile_hmm_score_batch_simd<ProfileHMMTopologyR9>(sequences, data, flags);
+}
+
+float profile_hmm_forward_matrix_simd_r9(const HMMInputSequenceView& sequence,
+                                        const HMMInputData& data,
+                                        const uint32_t flags,
+                                        std::vector<float>& forward)
+{
+    PROFILE_FUNC("profile_hmm_forward_matrix_simd_r9")
+    R9SIMDReadInput<ProfileHMMTopologyR9> read(data, flags);
+    std::vector<uint32_t> kmer_ranks = get_kmer_ranks(sequence, data);
+    uint32_t num_kmers = kmer_ranks.size();
+    uint32_t num_events = read.num_events;
+    size_t stride = get_simd_row_stride(num_kmers);
+
+    std::vector<float> saved_rows(num_events * 3 * stride);
+    float lp_end = profile_hmm_forward_simd(read, sequence, kmer_ranks, NULL, NULL, saved_rows.data(), NULL);
+
+    // Convert the rows from structure-of-arrays to the layout of the scalar fill.
+    // Row 0, the start block and the terminal block are never reached.
+    uint32_t n_cols = PSR9_NUM_STATES * (num_kmers + 2);
+    forward.assign((num_events + 1) * n_cols, -INFINITY);
+    for(uint32_t row = 1; row <= num_events; ++row) {
+        const float* saved_row = &saved_rows[(row - 1) * 3 * stride];
+        float* out = &forward[row * n_cols];
+        for(uint32_t block = 1; block <= num_kmers; ++block) {
+            out[PSR9_NUM_STATES * block + PSR9_MATCH] = saved_row[block];
+            out[PSR9_NUM_STATES * block + PSR9_BAD_EVENT] = saved_row[stride + block];
+            out[PSR9_NUM_STATES * block + PSR9_KMER_SKIP] = saved_row[2 * stride + block];
+        }
+    }
+    return lp_end;
+}
+
+float profile_hmm_score_simd_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags, HMMXDrop* xdrop)
+{
+    PROFILE_FUNC("profile_hmm_score_simd_r7")
+    return profile_hmm_score_simd<ProfileHMMTopologyR7>(sequence, data, flags, xdrop);
+}
+
+std::vector<float> profile_hmm_score_batch_simd_r7(const std::vector<HMMInputSequence>& sequences,
+                                                   const HMMInputData& data,
+                                                   const uint32_t flags)
+{
+    PROFILE_FUNC("profile_hmm_score_batch_simd_r7")
+    return profile_hmm_score_batch_simd<ProfileHMMTopologyR7>(sequences, data, flags);
+}
+
+std::vector<float> profile_hmm_score_reads_simd_r9(const HMMInputSequenceView& sequence,
+                                                   const std::vector<HMMInputData>& data,
+                                                   const uint32_t flags)
+{
+    PROFILE_FUNC("profile_hmm_score_reads_simd_r9")
+    return profile_hmm_score_reads_simd<ProfileHMMTopologyR9>(sequence, data, flags);
+}
+
+std::vector<float> profile_hmm_score_reads_simd_r7(const HMMInputSequenceView& sequence,
+                                                   const std::vector<HMMInputData>& data,
+                                                   const uint32_t flags)
+{
+    PROFILE_FUNC("profile_hmm_score_reads_simd_r7")
+    return profile_hmm_score_reads_simd<ProfileHMMTopologyR7>(sequence, data, flags);
+}
+
+float profile_hmm_score_linear_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
+{
+    PROFILE_FUNC("profile_hmm_score_linear_r9")
+    return profile_hmm_score_linear<ProfileHMMTopologyR9>(sequence, data, flags);
+}
+
+float profile_hmm_score_linear_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags)
+{
+    PROFILE_FUNC("profile_hmm_score_linear_r7")
+    return profile_hmm_score_linear<ProfileHMMTopologyR7>(sequence, data, flags);
+}
@@ -0,0 +1,93 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_profile_hmm_r9_simd -- vectorized forward
+// algorithm for the R7 and R9 profile HMMs
+//
+#ifndef NANOPOLISH_PROFILE_HMM_R9_SIMD_H
+#define NANOPOLISH_PROFILE_HMM_R9_SIMD_H
+
+#include <stdint.h>
+#include <vector>
+#include "nanopolish_common.h"
+#include "nanopolish_hmm_input_sequence.h"
+
+// The instruction sets the vectorized kernels can use
+enum HMMSIMDLevel
+{
+    HSL_SCALAR = 0,
+    HSL_SSE4,
+    HSL_AVX2,
+    HSL_AVX512
+};
+
+// Returns the best instruction set supported by this CPU
+HMMSIMDLevel detect_hmm_simd_level();
+
+// Get/set the instruction set used by the HMM. This defaults to
+// the value returned by detect_hmm_simd_level(). Setting HSL_SCALAR
+// forces the original cell-by-cell implementation.
+HMMSIMDLevel get_hmm_simd_level();
+void set_hmm_simd_level(HMMSIMDLevel level);
+
+// Get/set whether R7 reads are scored by the vectorized kernels. Their
+// approximations of exp and log change R7 scores slightly from the
+// reference implementation so this is off by default.
+bool get_hmm_simd_r7();
+void set_hmm_simd_r7(bool enabled);
+
+// out[i] = log(exp(a[i]) + exp(b[i])) using the log-add of the kernels for
+// the current instruction set. At HSL_SCALAR this is p7_FLogsumPoly.
+void hmm_simd_logadd(const float* a, const float* b, float* out, size_t n);
+
+// Calculate the probability of the nanopore events given a sequence
+// using the vectorized forward kernel. The full matrix is never stored,
+// only the previous and current rows in structure-of-arrays layout.
+// If xdrop is not NULL the calculation may stop early, see profile_hmm_score.
+float profile_hmm_score_simd_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0, HMMXDrop* xdrop = NULL);
+
+// As above but every row of the forward matrix is stored in forward, with
+// the rows and columns of the matrix filled by profile_hmm_fill_generic_r9.
+// Returns the same score. Not available at HSL_SCALAR.
+float profile_hmm_forward_matrix_simd_r9(const HMMInputSequenceView& sequence,
+                                        const HMMInputData& data,
+                                        const uint32_t flags,
+                                        std::vector<float>& forward);
+
+// Score multiple sequences against the same events. The emissions are
+// computed once for all sequences and the columns of the matrix for the
+// k-mers each sequence shares with the start of sequences[0] are reused.
+std::vector<float> profile_hmm_score_batch_simd_r9(const std::vector<HMMInputSequence>& sequences,
+                                                   const HMMInputData& data,
+                                                   const uint32_t flags = 0);
+
+// Score one sequence against each of a set of reads. The forward matrices
+// of 4, 8 or 16 reads, depending on the instruction set, are computed at
+// once with one read per lane of the vector unit, so short segments use the
+// whole vector width. Reads with similar numbers of events are grouped
+// together to reduce padding. Not available at HSL_SCALAR.
+std::vector<float> profile_hmm_score_reads_simd_r9(const HMMInputSequenceView& sequence,
+                                                   const std::vector<HMMInputData>& data,
+                                                   const uint32_t flags = 0);
+
+// Approximate profile_hmm_score_simd_r9 by running the forward algorithm
+// in linear probability space with rescaled rows, see profile_hmm_score_linear.
+// This is also available at HSL_SCALAR.
+float profile_hmm_score_linear_r9(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
+
+// The same for the R7 model
+float profile_hmm_score_simd_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0, HMMXDrop* xdrop = NULL);
+
+std::vector<float> profile_hmm_score_batch_simd_r7(const std::vector<HMMInputSequence>& sequences,
+                                                   const HMMInputData& data,
+                                                   const uint32_t flags = 0);
+
+std::vector<float> profile_hmm_score_reads_simd_r7(const HMMInputSequenceView& sequence,
+                                                   const std::vector<HMMInputData>& data,
+                                                   const uint32_t flags = 0);
+
+float profile_hmm_score_linear_r7(const HMMInputSequenceView& sequence, const HMMInputData& data, const uint32_t flags = 0);
+
+#endif
@@ -0,0 +1,342 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_profile_hmm_r9_simd -- vectorized forward
+// algorithm for the R7 and R9 profile HMMs
+//
+// This file is included once per instruction set by
+// nanopolish_profile_hmm_r9_simd.cpp. The includer must define
+// the vfloat type, VEC_WIDTH and the v_* primitives below.
+// There is intentionally no include guard.
+//
+
+// log(exp(a) + exp(b)), lane-wise. This is max + log(1 + exp(min - max))
+// with the polynomial of p7_FLog1pExp so it needs one exp and no log.
+static inline vfloat v_logadd(vfloat a, vfloat b)
+{
+    vfloat max = v_max(a, b);
+    vfloat t = v_exp(v_sub(v_min(a, b), max));
+    vfloat p = v_set1(p7_LOG1P_C8);
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C7));
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C6));
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C5));
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C4));
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C3));
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C2));
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C1));
+    p = v_fmadd(p, t, v_set1(p7_LOG1P_C0));
+    return v_mask_ninf(max, v_fmadd(t, p, max));
+}
+
+// log-add two arrays of n values with v_logadd
+static void logadd_array(const float* a, const float* b, float* out, size_t n)
+{
+    size_t i = 0;
+    for(; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        v_store(out + i, v_logadd(v_load(a + i), v_load(b + i)));
+    }
+
+    if(i < n) {
+        float ta[VEC_WIDTH], tb[VEC_WIDTH], tout[VEC_WIDTH];
+        for(size_t j = 0; j < VEC_WIDTH; ++j) {
+            ta[j] = i + j < n ? a[i + j] : -INFINITY;
+            tb[j] = i + j < n ? b[i + j] : -INFINITY;
+        }
+        v_store(tout, v_logadd(v_load(ta), v_load(tb)));
+        for(size_t j = 0; i + j < n; ++j) {
+            out[i + j] = tout[j];
+        }
+    }
+}
+
+// log(exp(s[0]) + ... + exp(s[5])), lane-wise, over the terms whose
+// HMMMovementType bit is set in MASK. The other terms are never read.
+// MASK is a compile-time constant so the tests below are folded away.
+// Adjacent pairs of terms are summed before being added to the total.
+template<uint32_t MASK>
+static inline vfloat v_logsum_masked(const vfloat* s)
+{
+    // a single term needs no log-sum and two terms use the cheaper v_logadd
+    if(__builtin_popcount(MASK) == 1) {
+        return s[__builtin_ctz(MASK)];
+    } else if(__builtin_popcount(MASK) == 2) {
+        return v_logadd(s[__builtin_ctz(MASK)], s[31 - __builtin_clz(MASK)]);
+    }
+
+    vfloat max = v_set1(-INFINITY);
+    for(uint32_t i = 0; i < HMT_NUM_MOVEMENT_TYPES; ++i) {
+        if(MASK & HMT_MASK(i)) {
+            max = v_max(max, s[i]);
+        }
+    }
+
+    vfloat sum = v_set1(0.0f);
+    for(uint32_t i = 0; i < HMT_NUM_MOVEMENT_TYPES; i += 2) {
+        bool has_first = MASK & HMT_MASK(i);
+        bool has_second = MASK & HMT_MASK(i + 1);
+        if(has_first && has_second) {
+            sum = v_add(sum, v_add(v_exp(v_sub(s[i], max)), v_exp(v_sub(s[i + 1], max))));
+        } else if(has_first) {
+            sum = v_add(sum, v_exp(v_sub(s[i], max)));
+        } else if(has_second) {
+            sum = v_add(sum, v_exp(v_sub(s[i + 1], max)));
+        }
+    }
+    return v_mask_ninf(max, v_add(max, v_log(sum)));
+}
+
+// Fill in one row of the forward matrix for the model described by
+// Topology, see ProfileHMMTopologyR9. The match and bad event states
+// only depend on the previous row so VEC_WIDTH blocks are computed at once.
+// The kmer skip state is silent and depends on the previous block of the
+// current row, so it is finished with a serial scan once the row's match
+// and bad event states are known. Blocks before in.first_block must
+// already be filled in.
+template<class Topology>
+static void forward_row(const R9SIMDRowInput& in, const R9SIMDRow& prev, R9SIMDRow& curr)
+{
+    const R9SIMDTransitions& t = *in.transitions;
+    const uint32_t into_kmer_skip_vec = Topology::into_kmer_skip & ~HMT_MASK(HMT_FROM_PREV_K);
+
+    for(uint32_t block = in.first_block; block <= in.num_kmers; block += VEC_WIDTH) {
+        vfloat prev_m_same = v_load(prev.m + block);
+        vfloat prev_b_same = v_load(prev.b + block);
+
+        // state PSR9_MATCH
+        vfloat s[HMT_NUM_MOVEMENT_TYPES];
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SAME_M)) {
+            s[HMT_FROM_SAME_M] = v_add(v_load(t.lp_mm_self + block), prev_m_same);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_M)) {
+            s[HMT_FROM_PREV_M] = v_add(v_load(t.lp_mm_next + block), v_load(prev.m + block - 1));
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SAME_B)) {
+            s[HMT_FROM_SAME_B] = v_add(v_load(t.lp_bm_self + block), prev_b_same);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_B)) {
+            s[HMT_FROM_PREV_B] = v_add(v_load(t.lp_bm_next + block), v_load(prev.b + block - 1));
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_K)) {
+            s[HMT_FROM_PREV_K] = v_add(v_load(t.lp_km + block), v_load(prev.k + block - 1));
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SOFT)) {
+            s[HMT_FROM_SOFT] = v_load(in.lp_soft + block);
+        }
+        vfloat m = v_logsum_masked<Topology::into_match>(s);
+        v_store(curr.m + block, v_add(m, v_load(in.lp_emission + block)));
+
+        // state PSR9_BAD_EVENT
+        s[HMT_FROM_SAME_M] = v_add(v_load(t.lp_mb + block), prev_m_same);
+        s[HMT_FROM_SAME_B] = v_add(v_load(t.lp_bb + block), prev_b_same);
+        vfloat b = v_logsum_masked<Topology::into_bad_event>(s);
+        if(Topology::bad_event_emits) {
+            b = v_add(b, v_load(in.lp_emission_b + block));
+        }
+        v_store(curr.b + block, b);
+    }
+
+    // state PSR9_KMER_SKIP, transitions from the match and bad event states
+    for(uint32_t block = in.first_block; block <= in.num_kmers; block += VEC_WIDTH) {
+        vfloat s[HMT_NUM_MOVEMENT_TYPES];
+        if(into_kmer_skip_vec & HMT_MASK(HMT_FROM_PREV_M)) {
+            s[HMT_FROM_PREV_M] = v_add(v_load(t.lp_mk + block), v_load(curr.m + block - 1));
+        }
+        if(into_kmer_skip_vec & HMT_MASK(HMT_FROM_PREV_B)) {
+            s[HMT_FROM_PREV_B] = v_add(v_load(t.lp_bk + block), v_load(curr.b + block - 1));
+        }
+        v_store(curr.k + block, v_logsum_masked<into_kmer_skip_vec>(s));
+    }
+
+    // state PSR9_KMER_SKIP, transitions from the previous skip state
+    if(Topology::into_kmer_skip & HMT_MASK(HMT_FROM_PREV_K)) {
+        for(uint32_t block = in.first_block; block <= in.num_kmers; ++block) {
+            curr.k[block] = add_logs(curr.k[block], t.lp_kk[block] + curr.k[block - 1]);
+        }
+    }
+}
+
+// Fill in one row of the forward matrices of VEC_WIDTH reads at once, see
+// profile_hmm_forward_interleaved. Each lane holds a different read so the
+// arrays have VEC_WIDTH entries per block and every state of a block,
+// including the kmer skip state, is computed for all of the reads with
+// the same instructions. The blocks are visited in order so the kmer skip
+// state can use the previous block of the current row directly.
+template<class Topology>
+static void interleaved_row(const R9SIMDRowInput& in, const R9SIMDRow& prev, R9SIMDRow& curr)
+{
+    const R9SIMDTransitions& t = *in.transitions;
+
+    for(uint32_t block = in.first_block; block <= in.num_kmers; ++block) {
+        const size_t i = block * VEC_WIDTH;
+        const size_t j = i - VEC_WIDTH;
+
+        vfloat prev_m_same = v_load(prev.m + i);
+        vfloat prev_b_same = v_load(prev.b + i);
+
+        // state PSR9_MATCH
+        vfloat s[HMT_NUM_MOVEMENT_TYPES];
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SAME_M)) {
+            s[HMT_FROM_SAME_M] = v_add(v_load(t.lp_mm_self + i), prev_m_same);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_M)) {
+            s[HMT_FROM_PREV_M] = v_add(v_load(t.lp_mm_next + i), v_load(prev.m + j));
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SAME_B)) {
+            s[HMT_FROM_SAME_B] = v_add(v_load(t.lp_bm_self + i), prev_b_same);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_B)) {
+            s[HMT_FROM_PREV_B] = v_add(v_load(t.lp_bm_next + i), v_load(prev.b + j));
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_K)) {
+            s[HMT_FROM_PREV_K] = v_add(v_load(t.lp_km + i), v_load(prev.k + j));
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SOFT)) {
+            s[HMT_FROM_SOFT] = v_load(in.lp_soft + i);
+        }
+        vfloat m = v_logsum_masked<Topology::into_match>(s);
+        v_store(curr.m + i, v_add(m, v_load(in.lp_emission + i)));
+
+        // state PSR9_BAD_EVENT
+        s[HMT_FROM_SAME_M] = v_add(v_load(t.lp_mb + i), prev_m_same);
+        s[HMT_FROM_SAME_B] = v_add(v_load(t.lp_bb + i), prev_b_same);
+        vfloat b = v_logsum_masked<Topology::into_bad_event>(s);
+        if(Topology::bad_event_emits) {
+            b = v_add(b, v_load(in.lp_emission_b + i));
+        }
+        v_store(curr.b + i, b);
+
+        // state PSR9_KMER_SKIP
+        if(Topology::into_kmer_skip & HMT_MASK(HMT_FROM_PREV_M)) {
+            s[HMT_FROM_PREV_M] = v_add(v_load(t.lp_mk + i), v_load(curr.m + j));
+        }
+        if(Topology::into_kmer_skip & HMT_MASK(HMT_FROM_PREV_B)) {
+            s[HMT_FROM_PREV_B] = v_add(v_load(t.lp_bk + i), v_load(curr.b + j));
+        }
+        if(Topology::into_kmer_skip & HMT_MASK(HMT_FROM_PREV_K)) {
+            s[HMT_FROM_PREV_K] = v_add(v_load(t.lp_kk + i), v_load(curr.k + j));
+        }
+        v_store(curr.k + i, v_logsum_masked<Topology::into_kmer_skip>(s));
+    }
+}
+
+// The largest lane of v
+static inline float v_hmax(vfloat v)
+{
+    float lanes[VEC_WIDTH];
+    v_store(lanes, v);
+    float max = lanes[0];
+    for(uint32_t i = 1; i < VEC_WIDTH; ++i) {
+        max = std::max(max, lanes[i]);
+    }
+    return max;
+}
+
+// Fill in one row of the rescaled linear-space forward matrix, see
+// profile_hmm_forward_linear. The match and bad event states are first
+// summed over their incoming transitions. The row is then divided by its
+// largest cell, which is found in log space so that small emissions do not
+// underflow before the division, and the kmer skip states are filled in.
+// Returns the log of the factor the row was divided by, or -INFINITY if
+// every cell of the row is zero.
+template<class Topology>
+static float linear_row(const R9SIMDLinearRowInput& in, const R9SIMDRow& prev, R9SIMDRow& curr)
+{
+    const R9SIMDTransitions& t = *in.transitions;
+    const uint32_t into_kmer_skip_vec = Topology::into_kmer_skip & ~HMT_MASK(HMT_FROM_PREV_K);
+    const vfloat zero = v_set1(0.0f);
+    const vfloat prev_scale = v_set1(in.prev_scale);
+
+    vfloat lp_max = v_set1(-INFINITY);
+    vfloat max_b = zero; // only used when the bad event state is silent
+    vfloat max_cell = zero;
+
+    for(uint32_t block = 1; block <= in.num_kmers; block += VEC_WIDTH) {
+        vfloat prev_m_same = v_load(prev.m + block);
+        vfloat prev_b_same = v_load(prev.b + block);
+
+        // state PSR9_MATCH, before the emission
+        vfloat m = zero;
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SAME_M)) {
+            m = v_fmadd(v_load(t.lp_mm_self + block), prev_m_same, m);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_M)) {
+            m = v_fmadd(v_load(t.lp_mm_next + block), v_load(prev.m + block - 1), m);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SAME_B)) {
+            m = v_fmadd(v_load(t.lp_bm_self + block), prev_b_same, m);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_B)) {
+            m = v_fmadd(v_load(t.lp_bm_next + block), v_load(prev.b + block - 1), m);
+        }
+        if(Topology::into_match & HMT_MASK(HMT_FROM_PREV_K)) {
+            m = v_fmadd(v_load(t.lp_km + block), v_load(prev.k + block - 1), m);
+        }
+        m = v_mul(m, prev_scale);
+        if(Topology::into_match & HMT_MASK(HMT_FROM_SOFT)) {
+            m = v_add(m, v_load(in.soft + block));
+        }
+        v_store(curr.m + block, m);
+        lp_max = v_max(lp_max, v_add(v_log(m), v_load(in.lp_emission + block)));
+
+        // state PSR9_BAD_EVENT, before the emission
+        vfloat b = zero;
+        if(Topology::into_bad_event & HMT_MASK(HMT_FROM_SAME_M)) {
+            b = v_fmadd(v_load(t.lp_mb + block), prev_m_same, b);
+        }
+        if(Topology::into_bad_event & HMT_MASK(HMT_FROM_SAME_B)) {
+            b = v_fmadd(v_load(t.lp_bb + block), prev_b_same, b);
+        }
+        b = v_mul(b, prev_scale);
+        v_store(curr.b + block, b);
+        if(Topology::bad_event_emits) {
+            lp_max = v_max(lp_max, v_add(v_log(b), v_load(in.lp_emission_b + block)));
+        } else {
+            max_b = v_max(max_b, b);
+        }
+        max_cell = v_max(max_cell, v_max(m, b));
+    }
+
+    // an empty row is left empty
+    bool empty = v_hmax(max_cell) == 0.0f;
+    float lp_scale = empty ? 0.0f : std::max(v_hmax(lp_max), logf(v_hmax(max_b)));
+
+    // apply the emissions and the scale. lp_scale is at least the log of
+    // every cell so the cells are at most one and the factors below
+    // can only overflow for cells that are zero
+    const vfloat v_lp_scale = v_set1(lp_scale);
+    const vfloat b_scale = v_set1(expf(std::min(-lp_scale, 88.0f)));
+    for(uint32_t block = 1; block <= in.num_kmers; block += VEC_WIDTH) {
+        vfloat m = v_load(curr.m + block);
+        v_store(curr.m + block, v_mul(m, v_exp(v_sub(v_load(in.lp_emission + block), v_lp_scale))));
+
+        vfloat b = v_load(curr.b + block);
+        if(Topology::bad_event_emits) {
+            b = v_mul(b, v_exp(v_sub(v_load(in.lp_emission_b + block), v_lp_scale)));
+        } else {
+            b = v_mul(b, b_scale);
+        }
+        v_store(curr.b + block, b);
+    }
+
+    // state PSR9_KMER_SKIP, transitions from the match and bad event states
+    for(uint32_t block = 1; block <= in.num_kmers; block += VEC_WIDTH) {
+        vfloat k = zero;
+        if(into_kmer_skip_vec & HMT_MASK(HMT_FROM_PREV_M)) {
+            k = v_fmadd(v_load(t.lp_mk + block), v_load(curr.m + block - 1), k);
+        }
+        if(into_kmer_skip_vec & HMT_MASK(HMT_FROM_PREV_B)) {
+            k = v_fmadd(v_load(t.lp_bk + block), v_load(curr.b + block - 1), k);
+        }
+        v_store(curr.k + block, k);
+    }
+
+    // state PSR9_KMER_SKIP, transitions from the previous skip state
+    if(Topology::into_kmer_skip & HMT_MASK(HMT_FROM_PREV_K)) {
+        for(uint32_t block = 1; block <= in.num_kmers; ++block) {
+            curr.k[block] += t.lp_kk[block] * curr.k[block - 1];
+        }
+    }
+    return empty ? -INFINITY : lp_scale;
+}
@@ -8,6 +8,7 @@
 #include <math.h>
 #include <assert.h>
 #include <stdio.h>
+#include <algorithm>
 #include "nanopolish_transition_parameters.h"
 #include "nanopolish_poremodel.h"
 #include "nanopolish_squiggle_read.h"
@@ -44,11 +45,49 @@ TransitionParameters::TransitionParameters()
 }
 
 //
+TransitionParameters::TransitionParameters(const TransitionParameters& other) :
+    trans_m_to_e_not_k(other.trans_m_to_e_not_k),
+    trans_e_to_e(other.trans_e_to_e),
+    trans_start_to_clip(other.trans_start_to_clip),
+    trans_clip_self(other.trans_clip_self),
+    is_initialized(other.is_initialized),
+    skip_probabilities(other.skip_probabilities),
+    skip_bin_width(other.skip_bin_width)
+{
+    // the training data owns its matrix, make a deep copy
+    TransitionTrainingData& td = training_data;
+    td.n_matches = other.training_data.n_matches;
+    td.n_merges = other.training_data.n_merges;
+    td.n_skips = other.training_data.n_skips;
+    td.kmer_transitions = other.training_data.kmer_transitions;
+    copy_matrix(td.state_transitions, other.training_data.state_transitions);
+}
+
 TransitionParameters::~TransitionParameters()
 {
     free_matrix(training_data.state_transitions);
 }
 
+TransitionParameters& TransitionParameters::operator=(const TransitionParameters& other)
+{
+    if(this != &other) {
+        TransitionParameters tmp(other);
+        std::swap(training_data.state_transitions, tmp.training_data.state_transitions);
+        trans_m_to_e_not_k = other.trans_m_to_e_not_k;
+        trans_e_to_e = other.trans_e_to_e;
+        trans_start_to_clip = other.trans_start_to_clip;
+        trans_clip_self = other.trans_clip_self;
+        is_initialized = other.is_initialized;
+        skip_probabilities = other.skip_probabilities;
+        skip_bin_width = other.skip_bin_width;
+        training_data.n_matches = other.training_data.n_matches;
+        training_data.n_merges = other.training_data.n_merges;
+        training_data.n_skips = other.training_data.n_skips;
+        training_data.kmer_transitions = other.training_data.kmer_transitions;
+    }
+    return *this;
+}
+
 void TransitionParameters::initialize(const ModelMetadata& metadata)
 {
     is_initialized = true;
@@ -291,7 +330,7 @@ void TransitionParameters::add_transition_observation(char state_from, char stat
     set(training_data.state_transitions, f_idx, t_idx, count + 1);
 }
 
-void TransitionParameters::add_training_from_alignment(const HMMInputSequence& sequence,
+void TransitionParameters::add_training_from_alignment(const HMMInputSequenceView& sequence,
                                                        const HMMInputData& data,
                                                        const std::vector<HMMAlignmentState>& alignment,
                                                        size_t ignore_edge_length)
@@ -305,6 +344,7 @@ void TransitionParameters::add_training_from_alignment(const HMMInputSequence& s
     const uint32_t k = pm.k;
 
     size_t n_kmers = sequence.length() - k + 1;
+    std::vector<uint32_t> kmer_ranks = sequence.get_kmer_ranks(k, data.rc);
 #ifdef PRINT_TRAINING_MESSAGES
     uint32_t strand_idx = 0;
 #endif
@@ -341,8 +381,8 @@ void TransitionParameters::add_training_from_alignment(const HMMInputSequence& s
                 
                 assert(transition_kmer_from < n_kmers && transition_kmer_to < n_kmers);
 
-                uint32_t rank_1 = sequence.get_kmer_rank(transition_kmer_from, k, data.rc);
-                uint32_t rank_2 = sequence.get_kmer_rank(transition_kmer_to, k, data.rc);
+                uint32_t rank_1 = kmer_ranks[transition_kmer_from];
+                uint32_t rank_2 = kmer_ranks[transition_kmer_to];
             
                 GaussianParameters level_1 = pm.get_scaled_parameters(rank_1);
                 GaussianParameters level_2 = pm.get_scaled_parameters(rank_2);
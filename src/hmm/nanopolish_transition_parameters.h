@@ -43,8 +43,11 @@ class TransitionParameters
         // functions
         //
         TransitionParameters();
+        TransitionParameters(const TransitionParameters& other);
         ~TransitionParameters();
 
+        TransitionParameters& operator=(const TransitionParameters& other);
+
         void initialize(const ModelMetadata& metadata);
 
         // update transition parameters from training data
@@ -57,7 +60,7 @@ class TransitionParameters
         void add_transition_observation(char hmm_state_from, char hmm_state_to, bool kmer_move);
 
         // update the training data using the alignment
-        void add_training_from_alignment(const HMMInputSequence& sequence,
+        void add_training_from_alignment(const HMMInputSequenceView& sequence,
                                          const HMMInputData& data,
                                          const std::vector<HMMAlignmentState>& alignment,
                                          size_t ignore_edge_length = 5);
@@ -94,9 +97,6 @@ class TransitionParameters
         void initialize_sqkmap007_template();
         void initialize_sqkmap007_complement();
 
-        // Not allowed
-        TransitionParameters(const TransitionParameters&) {}
-
         // Calculate which bin of the skip probability table this level difference falls in
         inline size_t get_skip_bin(double k_level1, double k_level2) const
         {
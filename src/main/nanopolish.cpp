@@ -14,10 +14,12 @@
 #include "nanopolish_consensus.h"
 #include "nanopolish_eventalign.h"
 #include "nanopolish_getmodel.h"
+#include "nanopolish_index.h"
 #include "nanopolish_methyltrain.h"
 #include "nanopolish_methyltest.h"
 #include "nanopolish_scorereads.h"
 #include "nanopolish_train_poremodel_from_basecalls.h"
+#include "nanopolish_view_eventalign.h"
 
 int print_usage(int argc, char **argv);
 
@@ -28,11 +30,13 @@ static std::map< std::string, std::function<int(int, char**)> > programs = {
     {"consensus",   consensus_main},
     {"eventalign",  eventalign_main},
     {"getmodel",    getmodel_main},
+    {"index",       index_main},
     {"variants",    call_variants_main},
     {"methyltrain", methyltrain_main},
     {"methyltest",  methyltest_main},
     {"scorereads",  scorereads_main} ,
-    {"train-poremodel-from-basecalls",  train_poremodel_from_basecalls_main}
+    {"train-poremodel-from-basecalls",  train_poremodel_from_basecalls_main},
+    {"view-eventalign",  view_eventalign_main}
 };
 
 int print_usage(int, char **)
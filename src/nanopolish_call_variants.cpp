@@ -14,6 +14,7 @@
 #include <assert.h>
 #include <math.h>
 #include <sys/time.h>
+#include <limits.h>
 #include <algorithm>
 #include <queue>
 #include <sstream>
@@ -22,7 +23,9 @@
 #include <omp.h>
 #include <getopt.h>
 #include <iterator>
+#include <atomic>
 #include "htslib/faidx.h"
+#include "nanopolish_call_variants.h"
 #include "nanopolish_poremodel.h"
 #include "nanopolish_transition_parameters.h"
 #include "nanopolish_matrix.h"
@@ -34,6 +37,7 @@
 #include "nanopolish_variant.h"
 #include "nanopolish_haplotype.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_squiggle_read_cache.h"
 #include "nanopolish_duration_model.h"
 #include "profiler.h"
 #include "progress.h"
@@ -78,6 +82,10 @@ static const char *CONSENSUS_USAGE_MESSAGE =
 "      --consensus                      run in consensus calling mode\n"
 "      --fix-homopolymers               run the experimental homopolymer caller\n"
 "  -w, --window=STR                     find variants in window STR (format: ctg:start-end)\n"
+"      --regions=FILE                   find variants in each region listed in FILE, one per line (format: ctg or ctg:start-end)\n"
+"      --all-contigs                    find variants in every contig of the genome\n"
+"      --window-size=NUM                split --regions/--all-contigs into windows of NUM bases (default: 50000)\n"
+"      --window-overlap=NUM             extend each window by NUM bases into the next (default: 200)\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the reference genome are in bam FILE\n"
 "  -e, --event-bam=FILE                 the events aligned to the reference genome are in bam FILE\n"
@@ -89,6 +97,8 @@ static const char *CONSENSUS_USAGE_MESSAGE =
 "  -c, --candidates=VCF                 read variant candidates from VCF, rather than discovering them from aligned reads\n"
 "      --calculate-all-support          when making a call, also calculate the support of the 3 other possible bases\n"
 "      --models-fofn=FILE               read alternative k-mer models from FILE\n"
+"      --emission-cache=NUM             cache up to NUM MB of emission probabilities per read strand (default: 0, disabled)\n"
+"      --read-cache=NUM                 keep up to NUM MB of loaded reads for use by later windows (default: 0, disabled)\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -102,6 +112,10 @@ namespace opt
     static std::string candidates_file;
     static std::string models_fofn;
     static std::string window;
+    static std::string regions_file;
+    static int all_contigs = 0;
+    static int window_size = 50000;
+    static int window_overlap = 200;
     static std::string consensus_output;
     static std::string alternative_model_type = DEFAULT_MODEL_TYPE;
     static double min_candidate_frequency = 0.2f;
@@ -117,6 +131,8 @@ namespace opt
     static int min_flanking_sequence = 30;
     static int max_haplotypes = 1000;
     static int debug_alignments = 0;
+    static int emission_cache_mb = 0;
+    static int read_cache_mb = 0;
 }
 
 static const char* shortopts = "r:b:g:t:w:o:e:m:c:d:v";
@@ -133,7 +149,13 @@ enum { OPT_HELP = 1,
        OPT_P_SKIP,
        OPT_P_SKIP_SELF,
        OPT_P_BAD,
-       OPT_P_BAD_SELF };
+       OPT_P_BAD_SELF,
+       OPT_EMISSION_CACHE,
+       OPT_REGIONS,
+       OPT_ALL_CONTIGS,
+       OPT_WINDOW_SIZE,
+       OPT_WINDOW_OVERLAP,
+       OPT_READ_CACHE };
 
 static const struct option longopts[] = {
     { "verbose",                 no_argument,       NULL, 'v' },
@@ -142,6 +164,10 @@ static const struct option longopts[] = {
     { "event-bam",               required_argument, NULL, 'e' },
     { "genome",                  required_argument, NULL, 'g' },
     { "window",                  required_argument, NULL, 'w' },
+    { "regions",                 required_argument, NULL, OPT_REGIONS },
+    { "all-contigs",             no_argument,       NULL, OPT_ALL_CONTIGS },
+    { "window-size",             required_argument, NULL, OPT_WINDOW_SIZE },
+    { "window-overlap",          required_argument, NULL, OPT_WINDOW_OVERLAP },
     { "outfile",                 required_argument, NULL, 'o' },
     { "threads",                 required_argument, NULL, 't' },
     { "min-candidate-frequency", required_argument, NULL, 'm' },
@@ -152,6 +178,8 @@ static const struct option longopts[] = {
     { "p-skip-self",             required_argument, NULL, OPT_P_SKIP_SELF },
     { "p-bad",                   required_argument, NULL, OPT_P_BAD },
     { "p-bad-self",              required_argument, NULL, OPT_P_BAD_SELF },
+    { "emission-cache",          required_argument, NULL, OPT_EMISSION_CACHE },
+    { "read-cache",              required_argument, NULL, OPT_READ_CACHE },
     { "consensus",               required_argument, NULL, OPT_CONSENSUS },
     { "fix-homopolymers",        no_argument,       NULL, OPT_FIX_HOMOPOLYMERS },
     { "calculate-all-support",   no_argument,       NULL, OPT_CALC_ALL_SUPPORT },
@@ -169,7 +197,7 @@ std::string get_single_contig_or_fail()
     faidx_t *fai = fai_load(opt::genome_file.c_str());
     size_t n_contigs = faidx_nseq(fai);
     if(n_contigs > 1) {
-        fprintf(stderr, "Error: genome has multiple contigs, please use -w to specify input region\n");
+        fprintf(stderr, "Error: genome has multiple contigs, please use -w to specify input region, or --regions/--all-contigs\n");
         exit(EXIT_FAILURE);
     }
 
@@ -214,6 +242,11 @@ void annotate_with_all_support(std::vector<Variant>& variants,
             curr_haplotypes.push_back(tmp);
         }
 
+        std::vector<HMMInputSequence> curr_sequences;
+        for(size_t hap_idx = 0; hap_idx < curr_haplotypes.size(); ++hap_idx) {
+            curr_sequences.push_back(curr_haplotypes[hap_idx].get_sequence());
+        }
+
         // Test all reads against the 4 haplotypes
         std::vector<int> support_count(4, 0);
 
@@ -222,8 +255,9 @@ void annotate_with_all_support(std::vector<Variant>& variants,
             size_t best_hap_idx = 0;
 
             // calculate which haplotype this read supports best
+            std::vector<float> scores = profile_hmm_score_batch(curr_sequences, input[input_idx], alignment_flags);
             for(size_t hap_idx = 0; hap_idx < curr_haplotypes.size(); ++hap_idx) {
-                double score = profile_hmm_score(curr_haplotypes[hap_idx].get_sequence(), input[input_idx], alignment_flags);
+                double score = scores[hap_idx];
                 if(score > best_score) {
                     best_score = score;
                     best_hap_idx = hap_idx;
@@ -298,6 +332,17 @@ std::vector<Variant> screen_variants_by_score(const AlignmentDB& alignments,
 
     std::vector<Variant> out_variants;
     std::string contig = alignments.get_region_contig();
+
+    // Each candidate is scored in a window of min_flanking_sequence bases
+    // around it. The reference haplotype of the window is scored keeping the
+    // matrices, so a candidate only recomputes the part around its edit. The
+    // matrices are reused by the following candidates with the same window,
+    // which are the other substitutions and insertions at the same position.
+    // Other candidates, like the deletions, score their window again.
+    int base_start = -1;
+    int base_end = -1;
+    std::vector<HMMScoredBase> base_scores;
+
     for(size_t vi = 0; vi < candidate_variants.size(); ++vi) {
         const Variant& v = candidate_variants[vi];
 
@@ -308,10 +353,20 @@ std::vector<Variant> screen_variants_by_score(const AlignmentDB& alignments,
                                  calling_start,
                                  alignments.get_reference_substring(contig, calling_start, calling_end));
 
-        std::vector<HMMInputData> event_sequences =
-            alignments.get_event_subsequences(contig, calling_start, calling_end);
+        if(calling_start != base_start || calling_end != base_end) {
+            std::vector<HMMInputData> event_sequences =
+                alignments.get_event_subsequences(contig, calling_start, calling_end);
+
+            base_scores.resize(event_sequences.size());
+            #pragma omp parallel for
+            for(size_t j = 0; j < event_sequences.size(); ++j) {
+                base_scores[j] = profile_hmm_score_base(HMMInputSequenceView(test_haplotype.get_sequence()), event_sequences[j], alignment_flags);
+            }
+            base_start = calling_start;
+            base_end = calling_end;
+        }
 
-        Variant scored_variant = score_variant(v, test_haplotype, event_sequences, alignment_flags);
+        Variant scored_variant = score_variant(v, test_haplotype, base_scores);
         scored_variant.info = "";
         if(scored_variant.quality > 0) {
             out_variants.push_back(scored_variant);
@@ -411,8 +466,8 @@ void print_debug_stats(const std::string& contig,
 
         // summarize score
         double num_events = abs(data.event_start_idx - data.event_stop_idx) + 1;
-        double base_score = profile_hmm_score(base_haplotype.get_sequence(), data, alignment_flags);
-        double called_score = profile_hmm_score(called_haplotype.get_sequence(), data, alignment_flags);
+        double base_score = profile_hmm_score(HMMInputSequenceView(base_haplotype.get_sequence()), data, alignment_flags);
+        double called_score = profile_hmm_score(HMMInputSequenceView(called_haplotype.get_sequence()), data, alignment_flags);
         double base_avg = base_score / num_events;
         double called_avg = called_score / num_events;
         const PoreModel& pm = data.read->pore_model[data.strand];
@@ -421,8 +476,8 @@ void print_debug_stats(const std::string& contig,
         fprintf(stats_out, "%.2lf\t%.2lf\t%.4lf\t%.2lf\n", pm.shift, pm.scale, pm.drift, pm.var);
 
         // print paired alignment
-        std::vector<HMMAlignmentState> base_align = profile_hmm_align(base_haplotype.get_sequence(), data, alignment_flags);
-        std::vector<HMMAlignmentState> called_align = profile_hmm_align(called_haplotype.get_sequence(), data, alignment_flags);
+        std::vector<HMMAlignmentState> base_align = profile_hmm_align(HMMInputSequenceView(base_haplotype.get_sequence()), data, alignment_flags);
+        std::vector<HMMAlignmentState> called_align = profile_hmm_align(HMMInputSequenceView(called_haplotype.get_sequence()), data, alignment_flags);
         size_t k = pm.k;
         size_t bi = 0;
         size_t ci = 0;
@@ -601,7 +656,7 @@ Haplotype fix_homopolymers(const Haplotype& input_haplotype,
                                                                                                   event_sequences[j],
                                                                                                   alignment_flags);
                 // event current measurement likelihood using the standard HMM
-                event_likelihoods[var_sequence_length] += profile_hmm_score(variant_sequence, event_sequences[j], alignment_flags);
+                event_likelihoods[var_sequence_length] += profile_hmm_score(HMMInputSequenceView(variant_sequence), event_sequences[j], alignment_flags);
 
                 // the call window parameter determines how much flanking sequence around the HP we include in the total duration calculation
                 int call_window = 2;
@@ -801,7 +856,18 @@ Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
 }
 
 
-Haplotype call_variants_for_region(const std::string& contig, int region_start, int region_end)
+// Call variants in the region using alignments, which is
+// reloaded to hold the reads around the region
+// Set load_start/load_end to the part of the genome that is loaded to call
+// variants between region_start and region_end
+void get_loaded_region(int region_start, int region_end, int& load_start, int& load_end)
+{
+    const int BUFFER = opt::min_flanking_sequence + 10;
+    load_start = std::max(region_start, BUFFER) - BUFFER;
+    load_end = region_end + BUFFER;
+}
+
+Haplotype call_variants_for_region(AlignmentDB& alignments, const std::string& contig, int region_start, int region_end)
 {
     const int BUFFER = opt::min_flanking_sequence + 10;
     uint32_t alignment_flags = HAF_ALLOW_PRE_CLIP | HAF_ALLOW_POST_CLIP;
@@ -809,13 +875,10 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
     // load the region, accounting for the buffering
     if(region_start < BUFFER)
         region_start = BUFFER;
-    AlignmentDB alignments(opt::reads_file, opt::genome_file, opt::bam_file, opt::event_bam_file, opt::calibrate);
-
-    if(!opt::alternative_model_type.empty()) {
-        alignments.set_alternative_model_type(opt::alternative_model_type);
-    }
 
-    alignments.load_region(contig, region_start - BUFFER, region_end + BUFFER);
+    int load_start, load_end;
+    get_loaded_region(region_start, region_end, load_start, load_end);
+    alignments.load_region(contig, load_start, load_end);
 
     // if the end of the region plus the buffer sequence goes past
     // the end of the chromosome, we adjust the region end here
@@ -902,16 +965,247 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
         called_haplotype = fix_homopolymers(called_haplotype, alignments);
     }
 
-    if(opt::consensus_mode) {
-        FILE* consensus_fp = fopen(opt::consensus_output.c_str(), "w");
-        fprintf(consensus_fp, ">%s:%d-%d\n%s\n", contig.c_str(),
-                                  alignments.get_region_start(),
-                                  alignments.get_region_end(),
-                                  called_haplotype.get_sequence().c_str());
-        fclose(consensus_fp);
+    return called_haplotype;
+}
+
+// Format the consensus sequence for the region loaded in alignments as a fasta record
+std::string get_consensus_record(const AlignmentDB& alignments, const Haplotype& haplotype)
+{
+    std::stringstream ss;
+    ss << ">" << alignments.get_region_contig() << ":"
+       << alignments.get_region_start() << "-"
+       << alignments.get_region_end() << "\n"
+       << haplotype.get_sequence() << "\n";
+    return ss.str();
+}
+
+std::string get_window_consensus_record(const Haplotype& haplotype, const VariantCallingWindow& w)
+{
+    // The coordinate map of the haplotype marks every base of a variant's
+    // alt sequence as inserted, so walk the reference and variants instead
+    std::vector<Variant> variants = haplotype.get_variants();
+    std::sort(variants.begin(), variants.end(), sortByPosition);
+
+    const std::string& reference = haplotype.get_reference();
+    int ref_start = haplotype.get_reference_position();
+    std::string core;
+    size_t vi = 0;
+    for(size_t i = 0; i < reference.size(); ) {
+        int ref_position = ref_start + i;
+        if(vi < variants.size() && (int)variants[vi].ref_position == ref_position) {
+            if(w.owns(ref_position)) {
+                core.append(variants[vi].alt_seq);
+            }
+            i += variants[vi].ref_seq.size();
+            vi++;
+        } else {
+            if(w.owns(ref_position)) {
+                core.push_back(reference[i]);
+            }
+            i++;
+        }
     }
 
-    return called_haplotype;
+    std::stringstream ss;
+    ss << ">" << w.contig << ":" << w.owned_start << "-" << w.owned_end - 1 << "\n"
+       << core << "\n";
+    return ss.str();
+}
+
+void parse_region_string(const std::string& region, std::string& contig, int& start_base, int& end_base)
+{
+    if(region.find(':') == std::string::npos) {
+        contig = region;
+        start_base = 0;
+        end_base = INT_MAX;
+        return;
+    }
+
+    // Replace ":" and "-" with spaces to make it parseable with stringstream
+    std::string tmp = region;
+    std::replace(tmp.begin(), tmp.end(), ':', ' ');
+    std::replace(tmp.begin(), tmp.end(), '-', ' ');
+    std::stringstream parser(tmp);
+
+    parser >> contig >> start_base >> end_base;
+}
+
+// As above, with end_base clamped to the last base of the contig
+static void parse_genome_region_string(const std::string& region, std::string& contig, int& start_base, int& end_base)
+{
+    parse_region_string(region, contig, start_base, end_base);
+    end_base = std::min(end_base, get_contig_length(contig) - 1);
+}
+
+std::vector<VariantCallingWindow> make_windows(const std::string& contig,
+                                               int start_base,
+                                               int end_base,
+                                               int window_size,
+                                               int window_overlap)
+{
+    std::vector<VariantCallingWindow> windows;
+    for(int n = start_base; n <= end_base; n += window_size) {
+        VariantCallingWindow w;
+        w.contig = contig;
+        w.start = n;
+        w.end = std::min(n + window_size + window_overlap, end_base);
+        w.owned_start = n;
+        w.owned_end = std::min(n + window_size, end_base + 1);
+        windows.push_back(w);
+    }
+    return windows;
+}
+
+std::vector<Variant> get_owned_variants(const std::vector<Variant>& variants, const VariantCallingWindow& w)
+{
+    std::vector<Variant> owned_variants;
+    for(size_t vi = 0; vi < variants.size(); ++vi) {
+        if(w.owns((int)variants[vi].ref_position)) {
+            owned_variants.push_back(variants[vi]);
+        }
+    }
+    return owned_variants;
+}
+
+// Split the regions into windows of --window-size bases
+static std::vector<VariantCallingWindow> make_region_windows(const std::vector<std::string>& regions)
+{
+    std::vector<VariantCallingWindow> windows;
+    for(size_t ri = 0; ri < regions.size(); ++ri) {
+        std::string contig;
+        int start_base;
+        int end_base;
+        parse_genome_region_string(regions[ri], contig, start_base, end_base);
+
+        std::vector<VariantCallingWindow> region_windows = make_windows(contig, start_base, end_base, opt::window_size, opt::window_overlap);
+        windows.insert(windows.end(), region_windows.begin(), region_windows.end());
+    }
+    return windows;
+}
+
+std::vector<std::string> get_regions()
+{
+    std::vector<std::string> regions;
+    if(opt::all_contigs) {
+        faidx_t *fai = fai_load(opt::genome_file.c_str());
+        for(int i = 0; i < faidx_nseq(fai); ++i) {
+            regions.push_back(faidx_iseq(fai, i));
+        }
+        fai_destroy(fai);
+    } else {
+        std::ifstream in_file(opt::regions_file.c_str());
+        if(!in_file.good()) {
+            fprintf(stderr, "Error: could not read regions file %s\n", opt::regions_file.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        std::string line;
+        while(getline(in_file, line)) {
+            if(!line.empty() && line[0] != '#') {
+                regions.push_back(line);
+            }
+        }
+    }
+    return regions;
+}
+
+// Call variants in each window, in parallel. The BAMs are opened and
+// the fast5 map is parsed once per worker thread rather than per window.
+// The reads are loaded through the SquiggleReadCache, which opens one
+// fast5 file at a time so HDF5 does not need to be threadsafe.
+// Windows are handed out dynamically so a thread that finishes a window
+// with low coverage immediately takes the next one. The results are
+// written in window order as soon as all earlier windows are complete.
+void call_variants_for_windows(const std::vector<VariantCallingWindow>& windows, FILE* out_fp, FILE* consensus_fp)
+{
+    std::shared_ptr<const Fast5Map> fast5_name_map = std::make_shared<const Fast5Map>(opt::reads_file);
+
+    std::vector<std::vector<Variant>> window_variants(windows.size());
+    std::vector<std::string> window_consensus(windows.size());
+    std::vector<bool> window_done(windows.size(), false);
+    size_t next_to_write = 0;
+
+    // Windows still being processed. Once there are fewer windows left
+    // than threads, the remaining ones use the spare threads for the
+    // parallel loops within the window.
+    std::atomic<int> windows_in_flight(0);
+    omp_set_max_active_levels(2);
+
+    // When reads are cached, each thread claims its next window when it starts
+    // a window so that the reads for the next window can be loaded in the
+    // background. Otherwise the next window is claimed when a window is done.
+    bool prefetch = SquiggleReadCache::instance().is_enabled();
+    std::atomic<size_t> next_window(0);
+
+    #pragma omp parallel
+    {
+        AlignmentDB alignments(fast5_name_map, opt::genome_file, opt::bam_file, opt::event_bam_file, opt::calibrate);
+        if(!opt::alternative_model_type.empty()) {
+            alignments.set_alternative_model_type(opt::alternative_model_type);
+        }
+
+        size_t wi = next_window++;
+        while(wi < windows.size()) {
+            const VariantCallingWindow& w = windows[wi];
+            int in_flight = ++windows_in_flight;
+            omp_set_num_threads(std::max(1, opt::num_threads / in_flight));
+
+            size_t prefetch_idx = prefetch ? next_window++ : windows.size();
+            if(prefetch_idx < windows.size()) {
+                const VariantCallingWindow& pw = windows[prefetch_idx];
+                int load_start, load_end;
+                get_loaded_region(pw.start, pw.end, load_start, load_end);
+                alignments.prefetch_region(pw.contig, load_start, load_end);
+            }
+
+            Haplotype haplotype = call_variants_for_region(alignments, w.contig, w.start, w.end);
+
+            std::vector<Variant> owned_variants = get_owned_variants(haplotype.get_variants(), w);
+
+            std::string consensus;
+            if(consensus_fp != NULL) {
+                consensus = get_window_consensus_record(haplotype, w);
+            }
+            windows_in_flight--;
+
+            #pragma omp critical(write_windows)
+            {
+                window_variants[wi].swap(owned_variants);
+                window_consensus[wi].swap(consensus);
+                window_done[wi] = true;
+
+                // write every window that is now at the head of the queue
+                while(next_to_write < windows.size() && window_done[next_to_write]) {
+                    const std::vector<Variant>& vw = window_variants[next_to_write];
+                    for(size_t vi = 0; vi < vw.size(); vi++) {
+                        vw[vi].write_vcf(out_fp);
+                    }
+
+                    if(consensus_fp != NULL) {
+                        fputs(window_consensus[next_to_write].c_str(), consensus_fp);
+                    }
+
+                    // release the memory for this window
+                    std::vector<Variant>().swap(window_variants[next_to_write]);
+                    std::string().swap(window_consensus[next_to_write]);
+                    next_to_write++;
+                }
+                fflush(out_fp);
+            }
+
+            if(opt::verbose > 0) {
+                fprintf(stderr, "[variants] finished window %s:%d-%d\n", w.contig.c_str(), w.start, w.end);
+            }
+            wi = prefetch ? prefetch_idx : next_window++;
+        }
+    }
+    assert(next_to_write == windows.size());
+
+    if(opt::verbose > 0 && SquiggleReadCache::instance().is_enabled()) {
+        SquiggleReadCacheStats stats = SquiggleReadCache::instance().get_stats();
+        fprintf(stderr, "[variants] read cache hits: %zu misses: %zu size: %.1lfMB\n",
+            stats.hits, stats.misses, stats.bytes / (1024.0 * 1024.0));
+    }
 }
 
 void parse_call_variants_options(int argc, char** argv)
@@ -942,6 +1236,12 @@ void parse_call_variants_options(int argc, char** argv)
             case OPT_P_SKIP_SELF: arg >> g_p_skip_self; break;
             case OPT_P_BAD: arg >> g_p_bad; break;
             case OPT_P_BAD_SELF: arg >> g_p_bad_self; break;
+            case OPT_EMISSION_CACHE: arg >> opt::emission_cache_mb; break;
+            case OPT_READ_CACHE: arg >> opt::read_cache_mb; break;
+            case OPT_REGIONS: arg >> opt::regions_file; break;
+            case OPT_ALL_CONTIGS: opt::all_contigs = 1; break;
+            case OPT_WINDOW_SIZE: arg >> opt::window_size; break;
+            case OPT_WINDOW_OVERLAP: arg >> opt::window_overlap; break;
             case OPT_HELP:
                 std::cout << CONSENSUS_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -964,6 +1264,30 @@ void parse_call_variants_options(int argc, char** argv)
         die = true;
     }
 
+    if((!opt::window.empty()) + (!opt::regions_file.empty()) + opt::all_contigs > 1) {
+        std::cerr << SUBPROGRAM ": only one of --window, --regions and --all-contigs can be used\n";
+        die = true;
+    }
+
+    if(opt::window_size <= 0 || opt::window_overlap < 0) {
+        std::cerr << SUBPROGRAM ": invalid window size or overlap\n";
+        die = true;
+    }
+
+    if(opt::emission_cache_mb < 0) {
+        std::cerr << SUBPROGRAM ": invalid emission cache size: " << opt::emission_cache_mb << "\n";
+        die = true;
+    } else {
+        EmissionTable::set_max_bytes((size_t)opt::emission_cache_mb * 1024 * 1024);
+    }
+
+    if(opt::read_cache_mb < 0) {
+        std::cerr << SUBPROGRAM ": invalid read cache size: " << opt::read_cache_mb << "\n";
+        die = true;
+    } else {
+        SquiggleReadCache::instance().set_max_bytes((size_t)opt::read_cache_mb * 1024 * 1024);
+    }
+
     if(opt::reads_file.empty()) {
         std::cerr << SUBPROGRAM ": a --reads file must be provided\n";
         die = true;
@@ -999,27 +1323,6 @@ int call_variants_main(int argc, char** argv)
     parse_call_variants_options(argc, argv);
     omp_set_num_threads(opt::num_threads);
 
-    std::string contig;
-    int start_base;
-    int end_base;
-
-    // If a window has been specified, only call variants/polish in that range
-    if(!opt::window.empty()) {
-        // Parse the window string
-        // Replace ":" and "-" with spaces to make it parseable with stringstream
-        std::replace(opt::window.begin(), opt::window.end(), ':', ' ');
-        std::replace(opt::window.begin(), opt::window.end(), '-', ' ');
-        std::stringstream parser(opt::window);
-
-        parser >> contig >> start_base >> end_base;
-        end_base = std::min(end_base, get_contig_length(contig) - 1);
-    } else {
-        // otherwise, run on the whole genome
-        contig = get_single_contig_or_fail();
-        start_base = 0;
-        end_base = get_contig_length(contig) - 1;
-    }
-
     FILE* out_fp;
     if(!opt::output_file.empty()) {
         out_fp = fopen(opt::output_file.c_str(), "w");
@@ -1029,11 +1332,53 @@ int call_variants_main(int argc, char** argv)
 
     Variant::write_vcf_header(out_fp);
 
-    Haplotype haplotype = call_variants_for_region(contig, start_base, end_base);
+    FILE* consensus_fp = NULL;
+    if(opt::consensus_mode) {
+        consensus_fp = fopen(opt::consensus_output.c_str(), "w");
+    }
 
-    std::vector<Variant> variants = haplotype.get_variants();
-    for(size_t vi = 0; vi < variants.size(); vi++) {
-        variants[vi].write_vcf(out_fp);
+    if(!opt::regions_file.empty() || opt::all_contigs) {
+        // Split the regions into windows and process them all in this process
+        std::vector<VariantCallingWindow> windows = make_region_windows(get_regions());
+        call_variants_for_windows(windows, out_fp, consensus_fp);
+    } else {
+        std::string contig;
+        int start_base;
+        int end_base;
+
+        // If a window has been specified, only call variants/polish in that range
+        if(!opt::window.empty()) {
+            parse_genome_region_string(opt::window, contig, start_base, end_base);
+        } else {
+            // otherwise, run on the whole genome
+            contig = get_single_contig_or_fail();
+            start_base = 0;
+            end_base = get_contig_length(contig) - 1;
+        }
+
+        AlignmentDB alignments(opt::reads_file, opt::genome_file, opt::bam_file, opt::event_bam_file, opt::calibrate);
+        if(!opt::alternative_model_type.empty()) {
+            alignments.set_alternative_model_type(opt::alternative_model_type);
+        }
+
+        Haplotype haplotype = call_variants_for_region(alignments, contig, start_base, end_base);
+
+        std::vector<Variant> variants = haplotype.get_variants();
+        for(size_t vi = 0; vi < variants.size(); vi++) {
+            variants[vi].write_vcf(out_fp);
+        }
+
+        if(consensus_fp != NULL) {
+            fputs(get_consensus_record(alignments, haplotype).c_str(), consensus_fp);
+        }
+    }
+
+    // Stop loading reads in the background before the output is closed,
+    // rather than when the cache is destroyed at exit
+    SquiggleReadCache::instance().stop_prefetch();
+
+    if(consensus_fp != NULL) {
+        fclose(consensus_fp);
     }
 
     if(out_fp != stdout) {
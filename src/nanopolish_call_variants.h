@@ -8,6 +8,47 @@
 #ifndef NANOPOLISH_CALL_VARIANTS_H
 #define NANOPOLISH_CALL_VARIANTS_H
 
+#include <string>
+#include <vector>
+#include "nanopolish_variant.h"
+#include "nanopolish_haplotype.h"
+
+// A window of the genome processed by call_variants_for_windows.
+// Adjacent windows overlap so each window only reports the variants
+// starting in [owned_start, owned_end).
+struct VariantCallingWindow
+{
+    std::string contig;
+    int start;
+    int end; // inclusive
+    int owned_start;
+    int owned_end;
+
+    bool owns(int ref_position) const { return ref_position >= owned_start && ref_position < owned_end; }
+};
+
+// Parse a region string of the form ctg:start-end. For a region that is
+// just ctg, start_base is 0 and end_base is INT_MAX.
+void parse_region_string(const std::string& region, std::string& contig, int& start_base, int& end_base);
+
+// Split [start_base, end_base] into windows that each own window_size bases
+// and extend window_overlap bases into the next window, in the same way as
+// nanopolish_makerange.py
+std::vector<VariantCallingWindow> make_windows(const std::string& contig,
+                                               int start_base,
+                                               int end_base,
+                                               int window_size,
+                                               int window_overlap);
+
+// The variants the window reports
+std::vector<Variant> get_owned_variants(const std::vector<Variant>& variants, const VariantCallingWindow& w);
+
+// Format the part of the consensus sequence that the window owns as a fasta
+// record. The alt sequence of a variant belongs to the variant's ref_position,
+// as in get_owned_variants, so the records of adjacent windows can simply be
+// concatenated.
+std::string get_window_consensus_record(const Haplotype& haplotype, const VariantCallingWindow& w);
+
 int call_variants_main(int argc, char** argv);
 
 #endif
@@ -19,6 +19,7 @@
 #include <set>
 #include <omp.h>
 #include <getopt.h>
+#include "nanopolish_consensus.h"
 #include "nanopolish_poremodel.h"
 #include "nanopolish_transition_parameters.h"
 #include "nanopolish_matrix.h"
@@ -155,9 +156,15 @@ std::vector<HMMInputData> get_input_for_columns(HMMRealignmentInput& window,
 // Handy wrappers for scoring/debugging functions
 // The consensus algorithms call into these so we can switch
 // scoring functions without writing a bunch of code
-double score_sequence(const std::string& sequence, const HMMInputData& data)
+double score_sequence(const std::string& sequence, const HMMInputData& data, HMMXDrop* xdrop = NULL)
 {
-    return profile_hmm_score(sequence, data);
+    return profile_hmm_score(HMMInputSequenceView(sequence), data, 0, xdrop);
+}
+
+// A faster approximation of score_sequence, see profile_hmm_score_linear
+double screen_sequence(const std::string& sequence, const HMMInputData& data)
+{
+    return profile_hmm_score_linear(HMMInputSequenceView(sequence), data, 0);
 }
 
 void update_training_with_segment(const HMMInputSequence& sequence, const HMMInputData& data)
@@ -198,15 +205,26 @@ bool sortPathConsRankDesc(const PathCons& a, const PathCons& b)
     return a.sum_rank > b.sum_rank;
 }
 
-struct IndexedPathScore
+bool sortIndexedPathScoreDesc(const IndexedPathScore& a, const IndexedPathScore& b)
 {
-    double score;
-    uint32_t path_index;
-};
+    return a.score > b.score || (a.score == b.score && !a.pruned && b.pruned);
+}
 
-bool sortIndexedPathScoreDesc(const IndexedPathScore& a, const IndexedPathScore& b)
+void rank_path_scores(std::vector<IndexedPathScore>& result, double x_drop)
 {
-    return a.score > b.score;
+    double pruned_score = result[0].score - x_drop;
+    for(size_t ri = 0; ri < result.size(); ++ri) {
+        if(!result[ri].pruned) {
+            pruned_score = std::min(pruned_score, result[ri].score);
+        }
+    }
+
+    for(size_t ri = 0; ri < result.size(); ++ri) {
+        if(result[ri].pruned) {
+            result[ri].score = pruned_score;
+        }
+    }
+    std::stable_sort(result.begin(), result.end(), sortIndexedPathScoreDesc);
 }
 
 // This scores each path using the HMM and 
@@ -218,6 +236,15 @@ void score_paths(PathConsVector& paths, const std::vector<HMMInputData>& input)
     double CULL_MIN_SCORE = -30.0f;
     double CULL_MIN_IMPROVED_FRACTION = 0.2f;
 
+    // Stop scoring a path against a read when it falls this far behind
+    // the first path, see rank_path_scores for the score it is given
+    double PRUNE_X_DROP = 20.0f;
+
+    // Paths are screened with the linear-space approximation of the HMM.
+    // Only the paths that come within this of the first path are
+    // re-scored exactly, the others keep the approximate score.
+    double RESCORE_MARGIN = 5.0f;
+
     // cache the initial sequence
     std::string first = paths[0].path;
     
@@ -250,11 +277,24 @@ void score_paths(PathConsVector& paths, const std::vector<HMMInputData>& input)
         //const HMMInputData& data = input[ri];
         std::vector<IndexedPathScore> result(paths.size());
 
-        // Score all paths
+        // Score the first path, then the others against it
+        HMMXDrop xdrop(PRUNE_X_DROP);
+        result[0].score = score_sequence(paths[0].path, input[ri], &xdrop);
+        result[0].path_index = 0;
+        result[0].pruned = false;
+        double first_path_screen = screen_sequence(paths[0].path, input[ri]);
+
         #pragma omp parallel for
-        for(size_t pi = 0; pi < paths.size(); ++pi) {
-            double curr = score_sequence(paths[pi].path, input[ri]);
-            result[pi].score = curr;
+        for(size_t pi = 1; pi < paths.size(); ++pi) {
+            // the screen fails when a row underflows, score those exactly too
+            double screen = screen_sequence(paths[pi].path, input[ri]);
+            if(screen == -INFINITY || screen > first_path_screen - RESCORE_MARGIN) {
+                result[pi].score = score_sequence(paths[pi].path, input[ri], &xdrop);
+                result[pi].pruned = result[pi].score == -INFINITY;
+            } else {
+                result[pi].score = result[0].score + (screen - first_path_screen);
+                result[pi].pruned = false;
+            }
             result[pi].path_index = pi;
         }
 
@@ -262,7 +302,7 @@ void score_paths(PathConsVector& paths, const std::vector<HMMInputData>& input)
         double first_path_score = result[0].score;
 
         // Sort result by score
-        std::stable_sort(result.begin(), result.end(), sortIndexedPathScoreDesc);
+        rank_path_scores(result, PRUNE_X_DROP);
 
         for(size_t pri = 0; pri < result.size(); ++pri) {
             size_t pi = result[pri].path_index;
@@ -629,7 +669,7 @@ void run_splice_segment(HMMRealignmentInput& window, uint32_t segment_id, const
     for(uint32_t ri = 0; ri < data.size(); ++ri) {
 
         // Realign to the consensus sequence
-        std::vector<HMMAlignmentState> decodes = profile_hmm_align(base, data[ri]);
+        std::vector<HMMAlignmentState> decodes = profile_hmm_align(HMMInputSequenceView(base), data[ri]);
 
         // Get the closest event aligned to the target kmer
         int32_t min_k_dist = base.length();
@@ -672,7 +712,7 @@ void train_segment(HMMRealignmentInput& window, uint32_t segment_id)
     std::string segment_sequence = join_sequences_at_kmer(s_m_base, m_e_base, k);
      
     for(uint32_t ri = 0; ri < input.size(); ++ri) {
-        std::vector<HMMAlignmentState> decodes = profile_hmm_align(segment_sequence, input[ri]);
+        std::vector<HMMAlignmentState> decodes = profile_hmm_align(HMMInputSequenceView(segment_sequence), input[ri]);
         update_training_with_segment(segment_sequence, input[ri]);
     }
 }
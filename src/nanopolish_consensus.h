@@ -9,6 +9,24 @@
 #ifndef NANOPOLISH_CONSENSUS_H
 #define NANOPOLISH_CONSENSUS_H
 
+#include <stdint.h>
+#include <vector>
+
+// The score of a candidate path against one read
+struct IndexedPathScore
+{
+    double score;
+    uint32_t path_index;
+    bool pruned; // abandoned by the x-drop, the score is only a bound
+};
+
+// Sort the scores of the paths against one read, best first. result[0]
+// must be the score of the first path, which the others were compared
+// to. A pruned path fell more than x_drop behind the first path. It is
+// given a score no better than the worst score that was computed and
+// is ranked after every path that was scored.
+void rank_path_scores(std::vector<IndexedPathScore>& result, double x_drop);
+
 int consensus_main(int argc, char** argv);
 
 #endif
@@ -0,0 +1,101 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_index.cpp - build the index mapping read names
+// to fast5 files
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <getopt.h>
+#include "nanopolish_common.h"
+#include "nanopolish_fast5_map.h"
+
+//
+// Getopt
+//
+#define SUBPROGRAM "index"
+
+static const char *INDEX_VERSION_MESSAGE =
+SUBPROGRAM " Version " PACKAGE_VERSION "\n"
+"Written by Jared Simpson.\n"
+"\n"
+"Copyright 2015 Ontario Institute for Cancer Research\n";
+
+static const char *INDEX_USAGE_MESSAGE =
+"Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] reads.fa\n"
+"Build the index mapping the names of the reads in reads.fa to their fast5 files.\n"
+"The index is written to reads.fa.fast5.idx and used by the other subprograms.\n"
+"\n"
+"  -v, --verbose                        display verbose output\n"
+"      --version                        display version\n"
+"      --help                           display this help and exit\n"
+"\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
+
+namespace opt
+{
+    static unsigned int verbose;
+    static std::string reads_file;
+}
+
+static const char* shortopts = "v";
+
+enum { OPT_HELP = 1, OPT_VERSION };
+
+static const struct option longopts[] = {
+    { "verbose",     no_argument,       NULL, 'v' },
+    { "help",        no_argument,       NULL, OPT_HELP },
+    { "version",     no_argument,       NULL, OPT_VERSION },
+    { NULL, 0, NULL, 0 }
+};
+
+void parse_index_options(int argc, char** argv)
+{
+    bool die = false;
+    for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case '?': die = true; break;
+            case 'v': opt::verbose++; break;
+            case OPT_HELP:
+                std::cout << INDEX_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+            case OPT_VERSION:
+                std::cout << INDEX_VERSION_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (argc - optind < 1) {
+        std::cerr << SUBPROGRAM ": not enough arguments\n";
+        die = true;
+    }
+
+    if (argc - optind > 1) {
+        std::cerr << SUBPROGRAM ": too many arguments\n";
+        die = true;
+    }
+
+    if (die)
+    {
+        std::cout << "\n" << INDEX_USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+    }
+
+    opt::reads_file = argv[optind++];
+}
+
+int index_main(int argc, char** argv)
+{
+    parse_index_options(argc, argv);
+
+    size_t num_reads = Fast5Map::build_index(opt::reads_file);
+    if(opt::verbose > 0) {
+        fprintf(stderr, "[index] wrote %zu reads to %s.fast5.idx\n", num_reads, opt::reads_file.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_index.h - build the index mapping read names
+// to fast5 files
+//
+#ifndef NANOPOLISH_INDEX_H
+#define NANOPOLISH_INDEX_H
+
+int index_main(int argc, char** argv);
+
+#endif
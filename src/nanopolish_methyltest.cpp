@@ -31,7 +31,7 @@
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_methyltrain.h"
 #include "nanopolish_pore_model_set.h"
-#include "H5pubconf.h"
+#include "nanopolish_read_pipeline.h"
 #include "profiler.h"
 #include "progress.h"
 
@@ -97,7 +97,8 @@ static const char *METHYLTEST_USAGE_MESSAGE =
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
 "  -g, --genome=FILE                    the genome we are computing a consensus for is in FILE\n"
-"  -t, --threads=NUM                    use NUM threads (default: 1)\n"
+"  -t, --threads=NUM                    process reads on NUM threads (default: 1). A bam reader and a\n"
+"                                       fast5 loader thread, plus two bgzf threads if NUM > 1, run alongside\n"
 "      --progress                       print out a progress message\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
@@ -112,7 +113,6 @@ namespace opt
     static std::string cpg_methylation_model_type = "reftrained";
     static int progress = 0;
     static int num_threads = 1;
-    static int batch_size = 128;
 }
 
 static const char* shortopts = "r:b:g:t:w:m:vn";
@@ -134,18 +134,13 @@ static const struct option longopts[] = {
 };
 
 // Test CpG sites in this read for methylation
-void calculate_methylation_for_read(const Fast5Map& name_map,
+void calculate_methylation_for_read(SquiggleRead& sr,
                                     const faidx_t* fai,
                                     const bam_hdr_t* hdr,
                                     const bam1_t* record,
                                     size_t read_idx,
                                     const OutputHandles& handles)
 {
-    // Load a squiggle read for the mapped read
-    std::string read_name = bam_get_qname(record);
-    std::string fast5_path = name_map.get_path(read_name);
-    SquiggleRead sr(read_name, fast5_path);
-
     // Skip non-2D reads
     if(!sr.has_events_for_strand(T_IDX) || !sr.has_events_for_strand(C_IDX)) {
         return;
@@ -260,7 +255,7 @@ void calculate_methylation_for_read(const Fast5Map& name_map,
                     data.event_stride = data.event_start_idx <= data.event_stop_idx ? 1 : -1;
                  
                     // Calculate the likelihood of the unmethylated sequence
-                    HMMInputSequence unmethylated(subseq, rc_subseq, mtest_alphabet);
+                    HMMInputSequenceView unmethylated(subseq, rc_subseq, mtest_alphabet);
                     double unmethylated_score = profile_hmm_score(unmethylated, data, hmm_flags);
 
                     // Methylate all CpGs in the sequence and score again
@@ -268,7 +263,7 @@ void calculate_methylation_for_read(const Fast5Map& name_map,
                     std::string rc_mcpg_subseq = mtest_alphabet->reverse_complement(mcpg_subseq);
                     
                     // Calculate the likelihood of the methylated sequence
-                    HMMInputSequence methylated(mcpg_subseq, rc_mcpg_subseq, mtest_alphabet);
+                    HMMInputSequenceView methylated(mcpg_subseq, rc_mcpg_subseq, mtest_alphabet);
                     double methylated_score = profile_hmm_score(methylated, data, hmm_flags);
 
                     // Aggregate score
@@ -339,11 +334,11 @@ void calculate_methylation_for_read(const Fast5Map& name_map,
         }
 
         std::string complement_model = sr.pore_model[C_IDX].name;
-        fprintf(handles.read_writer, "%s\t%.2lf\t%zu\t%s\tNumPositive=%zu\n", fast5_path.c_str(), ll_ratio_sum_both, site_score_map.size(), complement_model.c_str(), num_positive);
+        fprintf(handles.read_writer, "%s\t%.2lf\t%zu\t%s\tNumPositive=%zu\n", sr.fast5_path.c_str(), ll_ratio_sum_both, site_score_map.size(), complement_model.c_str(), num_positive);
     
         for(size_t si = 0; si < NUM_STRANDS; ++si) {
             std::string model = sr.pore_model[si].name;
-            fprintf(handles.strand_writer, "%s\t%.2lf\t%zu\t%s\n", fast5_path.c_str(), ll_ratio_sum_strand[si], site_score_map.size(), model.c_str());
+            fprintf(handles.strand_writer, "%s\t%.2lf\t%zu\t%s\n", sr.fast5_path.c_str(), ll_ratio_sum_strand[si], site_score_map.size(), model.c_str());
         }
     }
 }
@@ -423,46 +418,13 @@ int methyltest_main(int argc, char** argv)
     Fast5Map name_map(opt::reads_file);
 
     // Open the BAM and iterate over reads
-
-    // load bam file
-    htsFile* bam_fh = sam_open(opt::bam_file.c_str(), "r");
-    assert(bam_fh != NULL);
-
-    // load bam index file
-    std::string index_filename = opt::bam_file + ".bai";
-    hts_idx_t* bam_idx = bam_index_load(index_filename.c_str());
-    assert(bam_idx != NULL);
-
-    // read the bam header
-    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
+    ReadPipeline pipeline(opt::bam_file, opt::region, name_map, 0, opt::num_threads);
+    pipeline.set_show_progress(opt::progress);
+    const bam_hdr_t* hdr = pipeline.get_bam_header();
 
     // load reference fai file
     faidx_t *fai = fai_load(opt::genome_file.c_str());
 
-    hts_itr_t* itr;
-
-    // If processing a region of the genome, only emit events aligned to this window
-    int clip_start = -1;
-    int clip_end = -1;
-
-    if(opt::region.empty()) {
-        // TODO: is this valid?
-        itr = sam_itr_queryi(bam_idx, HTS_IDX_START, 0, 0);
-    } else {
-
-        fprintf(stderr, "Region: %s\n", opt::region.c_str());
-        itr = sam_itr_querys(bam_idx, hdr, opt::region.c_str());
-        hts_parse_reg(opt::region.c_str(), &clip_start, &clip_end);
-    }
-
-#ifndef H5_HAVE_THREADSAFE
-    if(opt::num_threads > 1) {
-        fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
-        fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
-        exit(1);
-    }
-#endif
-
     // Initialize writers
     OutputHandles handles;
     handles.site_writer = fopen(std::string(opt::bam_file + ".methyltest.sites.bed").c_str(), "w");
@@ -475,61 +437,20 @@ int methyltest_main(int argc, char** argv)
     // strand header
     fprintf(handles.strand_writer, "name\tsum_ll_ratio\tn_cpg\tmodel\n");
 
-
-    // Initialize iteration
-    std::vector<bam1_t*> records(opt::batch_size, NULL);
-    for(size_t i = 0; i < records.size(); ++i) {
-        records[i] = bam_init1();
-    }
-
-    int result;
-    size_t num_reads_processed = 0;
-    size_t num_records_buffered = 0;
     Progress progress("[methyltest]");
-
-    do {
-        assert(num_records_buffered < records.size());
-
-        // read a record into the next slot in the buffer
-        result = sam_itr_next(bam_fh, itr, records[num_records_buffered]);
-        num_records_buffered += result >= 0;
-
-        // realign if we've hit the max buffer size or reached the end of file
-        if(num_records_buffered == records.size() || result < 0) {
-
-            #pragma omp parallel for
-            for(size_t i = 0; i < num_records_buffered; ++i) {
-                bam1_t* record = records[i];
-                size_t read_idx = num_reads_processed + i;
-                if( (record->core.flag & BAM_FUNMAP) == 0) {
-                    calculate_methylation_for_read(name_map, fai, hdr, record, read_idx, handles);
-                }
-            }
-
-            num_reads_processed += num_records_buffered;
-            num_records_buffered = 0;
-
+    pipeline.run([&](const bam1_t* record, size_t read_idx, SquiggleRead* sr) {
+        if(sr != NULL) {
+            calculate_methylation_for_read(*sr, fai, hdr, record, read_idx, handles);
         }
-    } while(result >= 0);
-
-    assert(num_records_buffered == 0);
+    });
     progress.end();
 
-    // cleanup records
-    for(size_t i = 0; i < records.size(); ++i) {
-        bam_destroy1(records[i]);
-    }
-
     // cleanup
     fclose(handles.site_writer);
     fclose(handles.read_writer);
     fclose(handles.strand_writer);
 
-    sam_itr_destroy(itr);
-    bam_hdr_destroy(hdr);
     fai_destroy(fai);
-    sam_close(bam_fh);
-    hts_idx_destroy(bam_idx);
     
     return EXIT_SUCCESS;
 }
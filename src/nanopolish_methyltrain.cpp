@@ -35,8 +35,8 @@
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_model_names.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_read_pipeline.h"
 #include "training_core.hpp"
-#include "H5pubconf.h"
 #include "profiler.h"
 #include "progress.h"
 #include "logger.hpp"
@@ -104,7 +104,8 @@ static const char *METHYLTRAIN_USAGE_MESSAGE =
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
 "  -g, --genome=FILE                    the reference genome is in FILE\n"
-"  -t, --threads=NUM                    use NUM threads (default: 1)\n"
+"  -t, --threads=NUM                    process reads on NUM threads (default: 1). A bam reader and a\n"
+"                                       fast5 loader thread, plus two bgzf threads if NUM > 1, run alongside\n"
 "      --filter-policy=STR              filter reads for [R7] or [R9] project\n"
 "  -s, --out-suffix=STR                 name output files like <strand>.out_suffix\n"
 "      --out-fofn=FILE                  write the names of the output models into FILE\n"
@@ -132,7 +133,6 @@ namespace opt
     static bool output_scores = false;
     static unsigned progress = 0;
     static unsigned num_threads = 1;
-    static unsigned batch_size = 128;
 
     // Constants that determine which events to use for training
     static float min_event_duration = 0.002;
@@ -299,7 +299,7 @@ bool recalibrate_model(SquiggleRead &sr,
 }
 
 // Update the training data with aligned events from a read
-void add_aligned_events(const Fast5Map& name_map,
+void add_aligned_events(SquiggleRead& sr,
                         const faidx_t* fai,
                         const bam_hdr_t* hdr,
                         const bam1_t* record,
@@ -309,13 +309,6 @@ void add_aligned_events(const Fast5Map& name_map,
                         size_t round,
                         ModelTrainingMap& training)
 {
-    // Load a squiggle read for the mapped read
-    std::string read_name = bam_get_qname(record);
-    std::string fast5_path = name_map.get_path(read_name);
-
-    // load read
-    SquiggleRead sr(read_name, fast5_path);
-
     // replace the models that are built into the read with the current trained model
     sr.replace_models(opt::trained_model_type);
 
@@ -556,84 +549,23 @@ void train_one_round(const Fast5Map& name_map, size_t round)
     }
 
     // Open the BAM and iterate over reads
-
-    // load bam file
-    htsFile* bam_fh = sam_open(opt::bam_file.c_str(), "r");
-    assert(bam_fh != NULL);
-
-    // load bam index file
-    std::string index_filename = opt::bam_file + ".bai";
-    hts_idx_t* bam_idx = bam_index_load(index_filename.c_str());
-    assert(bam_idx != NULL);
-
-    // read the bam header
-    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
+    ReadPipeline pipeline(opt::bam_file, opt::region, name_map, 0, opt::num_threads);
+    pipeline.set_show_progress(opt::progress);
+    const bam_hdr_t* hdr = pipeline.get_bam_header();
 
     // load reference fai file
     faidx_t *fai = fai_load(opt::genome_file.c_str());
 
-    hts_itr_t* itr;
-
     // If processing a region of the genome, only emit events aligned to this window
-    int clip_start = -1;
-    int clip_end = -1;
+    int clip_start = pipeline.get_region_start();
+    int clip_end = pipeline.get_region_end();
 
-    if(opt::region.empty()) {
-        // TODO: is this valid?
-        itr = sam_itr_queryi(bam_idx, HTS_IDX_START, 0, 0);
-    } else {
-        fprintf(stderr, "Region: %s\n", opt::region.c_str());
-        itr = sam_itr_querys(bam_idx, hdr, opt::region.c_str());
-        hts_parse_reg(opt::region.c_str(), &clip_start, &clip_end);
-    }
-
-#ifndef H5_HAVE_THREADSAFE
-    if(opt::num_threads > 1) {
-        fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
-        fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
-        exit(1);
-    }
-#endif
-
-    // Initialize iteration
-    std::vector<bam1_t*> records(opt::batch_size, NULL);
-    for(size_t i = 0; i < records.size(); ++i) {
-        records[i] = bam_init1();
-    }
-
-    int result;
-    size_t num_reads_realigned = 0;
-    size_t num_records_buffered = 0;
     Progress progress("[methyltrain]");
-
-    do {
-        assert(num_records_buffered < records.size());
-        
-        // read a record into the next slot in the buffer
-        result = sam_itr_next(bam_fh, itr, records[num_records_buffered]);
-        num_records_buffered += result >= 0;
-
-        // realign if we've hit the max buffer size or reached the end of file
-        if(num_records_buffered == records.size() || result < 0) {
-            #pragma omp parallel for            
-            for(size_t i = 0; i < num_records_buffered; ++i) {
-                bam1_t* record = records[i];
-                size_t read_idx = num_reads_realigned + i;
-                if( (record->core.flag & BAM_FUNMAP) == 0) {
-                    add_aligned_events(name_map, fai, hdr, record, read_idx, clip_start, clip_end, round, model_training_data);
-                }
-            }
-
-            num_reads_realigned += num_records_buffered;
-            num_records_buffered = 0;
+    pipeline.run([&](const bam1_t* record, size_t read_idx, SquiggleRead* sr) {
+        if(sr != NULL) {
+            add_aligned_events(*sr, fai, hdr, record, read_idx, clip_start, clip_end, round, model_training_data);
         }
-
-        if(opt::progress) {
-            fprintf(stderr, "Realigned %zu reads in %.1lfs\r", num_reads_realigned, progress.get_elapsed_seconds());
-        }
-    } while(result >= 0);
-    
-    assert(num_records_buffered == 0);
+    });
     progress.end();
     
     // open the summary file
@@ -783,17 +715,8 @@ void train_one_round(const Fast5Map& name_map, size_t round)
         }
     }
 
-    // cleanup records
-    for(size_t i = 0; i < records.size(); ++i) {
-        bam_destroy1(records[i]);
-    }
-
     // cleanup
-    sam_itr_destroy(itr);
-    bam_hdr_destroy(hdr);
     fai_destroy(fai);
-    sam_close(bam_fh);
-    hts_idx_destroy(bam_idx);
     fclose(summary_fp);
 }
 
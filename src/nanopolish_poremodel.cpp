@@ -10,6 +10,7 @@
 #include <fstream>
 #include <sstream>
 #include <cstring>
+#include <atomic>
 #include <bits/stl_algo.h>
 #include <fast5.hpp>
 
@@ -17,6 +18,7 @@ void PoreModel::bake_gaussian_parameters()
 {
     scaled_params.resize(states.size());
     scaled_states.resize(states.size());
+    scaled_levels.resize(states.size());
 
     for(unsigned i = 0; i < states.size(); ++i) {
 
@@ -34,8 +36,16 @@ void PoreModel::bake_gaussian_parameters()
         scaled_params[i].mean = scaled_states[i].level_mean;
         scaled_params[i].stdv = scaled_states[i].level_stdv;
         scaled_params[i].log_stdv = scaled_states[i].level_log_stdv;
+
+        // compact copy for the HMM
+        scaled_levels[i].mean = scaled_states[i].level_mean;
+        scaled_levels[i].inv_stdv = 1.0 / scaled_states[i].level_stdv;
+        scaled_levels[i].log_stdv = scaled_states[i].level_log_stdv;
     }
     is_scaled = true;
+
+    static std::atomic<uint64_t> next_scaled_states_id(1);
+    scaled_states_id = next_scaled_states_id++;
 }
 
 void add_found_bases(char *known, const char *kmer) {
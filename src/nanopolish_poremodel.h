@@ -56,6 +56,15 @@ struct PoreModelStateParams
     }
 };
 
+// The scaled level parameters needed by the HMM emissions,
+// packed into floats so the inner loops touch less memory
+struct PoreModelScaledLevel
+{
+    float mean;
+    float inv_stdv; // 1 / stdv
+    float log_stdv;
+};
+
 //
 class PoreModel
 {
@@ -86,6 +95,12 @@ class PoreModel
             return scaled_states[kmer_rank];
         }
 
+        inline const PoreModelScaledLevel& get_scaled_level(const uint32_t kmer_rank) const
+        {
+            assert(is_scaled);
+            return scaled_levels[kmer_rank];
+        }
+
         inline PoreModelStateParams get_parameters(const uint32_t kmer_rank) const
         {
             return states[kmer_rank];
@@ -128,11 +143,17 @@ class PoreModel
 
         bool is_scaled;
 
+        // Identifies the contents of scaled_states. A new value is assigned
+        // every time the parameters are baked so that cached emissions
+        // can tell when the model has changed. 0 means not baked.
+        uint64_t scaled_states_id = 0;
+
         const Alphabet *pmalphabet; 
 
         std::vector<PoreModelStateParams> states;
         std::vector<PoreModelStateParams> scaled_states;
         std::vector<GaussianParameters> scaled_params;
+        std::vector<PoreModelScaledLevel> scaled_levels;
 };
 
 #endif
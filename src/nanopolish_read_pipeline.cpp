@@ -0,0 +1,188 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_read_pipeline -- read the records of a bam,
+// load their signal and process them in parallel
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <omp.h>
+#include "nanopolish_read_pipeline.h"
+
+// The time spent processing reads, in microseconds, to report how busy the workers are
+typedef std::chrono::steady_clock PipelineClock;
+
+static uint64_t elapsed_us(PipelineClock::time_point start, PipelineClock::time_point end)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+ReadPipeline::ReadPipeline(const std::string& bam_file,
+                           const std::string& region,
+                           const Fast5Map& name_map,
+                           uint32_t squiggle_read_flags,
+                           int num_threads) : m_name_map(name_map),
+                                              m_squiggle_read_flags(squiggle_read_flags),
+                                              m_num_threads(num_threads),
+                                              m_show_progress(false),
+                                              m_longest_first(true),
+                                              m_itr(NULL),
+                                              m_region_start(-1),
+                                              m_region_end(-1)
+{
+    assert(m_num_threads > 0);
+
+    // load bam file
+    m_bam_fh = sam_open(bam_file.c_str(), "r");
+    assert(m_bam_fh != NULL);
+
+    // decompress the bgzf blocks ahead of the reader thread. The records are
+    // consumed much slower than they are decompressed so a couple of threads is enough.
+    if(m_num_threads > 1) {
+        hts_set_threads(m_bam_fh, 2);
+    }
+
+    // load bam index file
+    std::string index_filename = bam_file + ".bai";
+    m_bam_idx = bam_index_load(index_filename.c_str());
+    assert(m_bam_idx != NULL);
+
+    // read the bam header
+    m_hdr = sam_hdr_read(m_bam_fh);
+
+    if(region.empty()) {
+        // TODO: is this valid?
+        m_itr = sam_itr_queryi(m_bam_idx, HTS_IDX_START, 0, 0);
+    } else {
+        fprintf(stderr, "Region: %s\n", region.c_str());
+        m_itr = sam_itr_querys(m_bam_idx, m_hdr, region.c_str());
+        hts_parse_reg(region.c_str(), &m_region_start, &m_region_end);
+    }
+}
+
+ReadPipeline::~ReadPipeline()
+{
+    sam_itr_destroy(m_itr);
+    bam_hdr_destroy(m_hdr);
+    sam_close(m_bam_fh);
+    hts_idx_destroy(m_bam_idx);
+}
+
+// Stage 1: decode the records
+static void read_records(htsFile* bam_fh, hts_itr_t* itr, PipelineQueue* out)
+{
+    size_t read_idx = 0;
+    while(true) {
+        PipelineRead read;
+        read.record = bam_init1();
+        if(sam_itr_next(bam_fh, itr, read.record) < 0) {
+            bam_destroy1(read.record);
+            break;
+        }
+        read.read_idx = read_idx++;
+
+        // until the read is loaded the reference span is the best guess of its cost
+        if( (read.record->core.flag & BAM_FUNMAP) == 0) {
+            read.cost = bam_endpos(read.record) - read.record->core.pos;
+        }
+        out->push(read);
+    }
+    out->close();
+}
+
+// Stage 2: load the signal of the mapped records
+static void load_reads(const Fast5Map* name_map, uint32_t flags, PipelineQueue* in, PipelineQueue* out)
+{
+    PipelineRead read;
+    while(in->pop(read)) {
+        if( (read.record->core.flag & BAM_FUNMAP) == 0) {
+            std::string read_name = bam_get_qname(read.record);
+            std::string fast5_path = name_map->get_path(read_name);
+            read.sr = new SquiggleRead(read_name, fast5_path, flags);
+
+            // the reads are aligned in event space, so the cost is the number of
+            // events in the aligned part of the read
+            size_t num_events = read.sr->events[0].size() + read.sr->events[1].size();
+            size_t read_length = std::max<size_t>(read.sr->read_sequence.size(), 1);
+            read.cost *= (double)num_events / read_length;
+        }
+        out->push(read);
+    }
+    out->close();
+}
+
+size_t ReadPipeline::run(const ProcessFunction& process)
+{
+    assert(m_itr != NULL);
+
+    // The loaded reads hold the events, and possibly the raw samples, so only
+    // a few are kept per worker. Records are small so the reader can run further ahead and
+    // a long read can be loaded and started as soon as the reader finds it.
+    PipelineQueue record_queue(std::max(64, 16 * m_num_threads), m_longest_first);
+    PipelineQueue loaded_queue(2 * m_num_threads, m_longest_first);
+
+    std::thread reader_thread(read_records, m_bam_fh, m_itr, &record_queue);
+    std::thread loader_thread(load_reads, &m_name_map, m_squiggle_read_flags, &record_queue, &loaded_queue);
+
+    // The fraction of the workers' time spent processing reads, rather than
+    // waiting for them to be loaded. It is reported for the reads since the last report.
+    std::atomic<size_t> num_processed(0);
+    std::atomic<uint64_t> busy_us(0);
+    std::mutex progress_mutex;
+    PipelineClock::time_point start_time = PipelineClock::now();
+    PipelineClock::time_point report_time = start_time;
+    uint64_t report_busy_us = 0;
+
+    #pragma omp parallel num_threads(m_num_threads)
+    {
+        PipelineRead read;
+        while(loaded_queue.pop(read)) {
+            PipelineClock::time_point read_start = PipelineClock::now();
+            process(read.record, read.read_idx, read.sr);
+
+            delete read.sr;
+            bam_destroy1(read.record);
+            read.sr = NULL;
+            read.record = NULL;
+
+            PipelineClock::time_point read_end = PipelineClock::now();
+            busy_us += elapsed_us(read_start, read_end);
+            size_t n = ++num_processed;
+
+            if(m_show_progress && n % 128 == 0) {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                uint64_t total_busy_us = busy_us;
+                double utilization = (double)(total_busy_us - report_busy_us) / (m_num_threads * std::max<uint64_t>(elapsed_us(report_time, read_end), 1));
+                fprintf(stderr, "Processed %zu reads in %.1lfs, worker utilization %.0lf%%\r",
+                        n, elapsed_us(start_time, read_end) / 1e6, std::min(utilization, 1.0) * 100);
+                report_time = read_end;
+                report_busy_us = total_busy_us;
+            }
+        }
+    }
+
+    reader_thread.join();
+    loader_thread.join();
+
+    if(m_show_progress) {
+        PipelineClock::time_point end_time = PipelineClock::now();
+        double utilization = (double)busy_us / (m_num_threads * std::max<uint64_t>(elapsed_us(start_time, end_time), 1));
+        fprintf(stderr, "Processed %zu reads in %.1lfs, worker utilization %.0lf%%\n",
+                (size_t)num_processed, elapsed_us(start_time, end_time) / 1e6, std::min(utilization, 1.0) * 100);
+    }
+
+    // the iterator is at the end of the file
+    sam_itr_destroy(m_itr);
+    m_itr = NULL;
+    return num_processed;
+}
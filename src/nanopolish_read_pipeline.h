@@ -0,0 +1,185 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_read_pipeline -- read the records of a bam,
+// load their signal and process them in parallel
+//
+#ifndef NANOPOLISH_READ_PIPELINE_H
+#define NANOPOLISH_READ_PIPELINE_H
+
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "htslib/hts.h"
+#include "htslib/sam.h"
+#include "nanopolish_fast5_map.h"
+#include "nanopolish_squiggle_read.h"
+
+// A record moving through the stages of the pipeline
+struct PipelineRead
+{
+    PipelineRead() : record(NULL), read_idx(0), sr(NULL), cost(0.0) {}
+
+    bam1_t* record;
+    size_t read_idx;
+    SquiggleRead* sr;
+
+    // the estimated time to process the read, in arbitrary units
+    double cost;
+};
+
+// The reads waiting for the next stage. With longest_first the read
+// with the highest cost is taken first, so that a long read is started
+// early rather than running on its own at the end. Otherwise the reads
+// are taken in the order of the bam. push() waits while capacity reads
+// are waiting.
+class PipelineQueue
+{
+    public:
+        PipelineQueue(size_t capacity, bool longest_first) : m_capacity(capacity),
+                                                             m_longest_first(longest_first),
+                                                             m_closed(false)
+        {
+            assert(m_capacity > 0);
+        }
+
+        void push(const PipelineRead& read)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_space_cv.wait(lock, [&] { return m_heap.size() < m_capacity; });
+            m_heap.push_back(read);
+            std::push_heap(m_heap.begin(), m_heap.end(), Compare(m_longest_first));
+            lock.unlock();
+            m_item_cv.notify_one();
+        }
+
+        // Wait for the next read. Returns false once the
+        // queue is closed and every read has been popped.
+        bool pop(PipelineRead& read)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_item_cv.wait(lock, [&] { return m_closed || !m_heap.empty(); });
+            if(m_heap.empty()) {
+                return false;
+            }
+
+            std::pop_heap(m_heap.begin(), m_heap.end(), Compare(m_longest_first));
+            read = m_heap.back();
+            m_heap.pop_back();
+            lock.unlock();
+            m_space_cv.notify_one();
+            return true;
+        }
+
+        // No more reads will be pushed
+        void close()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_closed = true;
+            }
+            m_item_cv.notify_all();
+        }
+
+    private:
+
+        // true if a should be taken after b
+        struct Compare
+        {
+            Compare(bool longest_first) : longest_first(longest_first) {}
+            bool operator()(const PipelineRead& a, const PipelineRead& b) const
+            {
+                if(longest_first && a.cost != b.cost) {
+                    return a.cost < b.cost;
+                }
+                return a.read_idx > b.read_idx;
+            }
+            bool longest_first;
+        };
+
+        size_t m_capacity;
+        bool m_longest_first;
+
+        std::mutex m_mutex;
+        std::condition_variable m_space_cv;
+        std::condition_variable m_item_cv;
+        std::vector<PipelineRead> m_heap;
+        bool m_closed;
+};
+
+// Processes every record of a bam file, or of a region of it, in three
+// overlapping stages connected by bounded queues:
+//   1. a reader thread decodes the records, with htslib decompressing
+//      the bgzf blocks on its own threads
+//   2. a loader thread loads the SquiggleRead of each mapped record from
+//      its fast5 file. It is the only thread that uses HDF5.
+//   3. num_threads workers take the loaded reads as they become free
+// The reader, the loader and (when num_threads > 1) two bgzf threads run
+// in addition to the workers. They mostly wait on I/O, so they are not
+// taken from num_threads; the usage of --threads says so.
+// There is no barrier between batches of reads, so the reader and the loader
+// work ahead while the workers are busy and no worker waits for the slowest
+// read of a batch. Each stage takes the most expensive of the waiting reads
+// first, estimated from the reference span and then the number of events,
+// so long reads are not left to run alone at the end.
+class ReadPipeline
+{
+    public:
+
+        // Called once for every record, from the worker threads. sr is NULL
+        // for unmapped records and is deleted after the call returns.
+        typedef std::function<void(const bam1_t* record, size_t read_idx, SquiggleRead* sr)> ProcessFunction;
+
+        // region is empty to process the whole file. squiggle_read_flags
+        // are passed to the SquiggleRead constructor.
+        ReadPipeline(const std::string& bam_file,
+                     const std::string& region,
+                     const Fast5Map& name_map,
+                     uint32_t squiggle_read_flags,
+                     int num_threads);
+        ~ReadPipeline();
+
+        const bam_hdr_t* get_bam_header() const { return m_hdr; }
+
+        // the bounds of the region, or -1 when processing the whole file
+        int get_region_start() const { return m_region_start; }
+        int get_region_end() const { return m_region_end; }
+
+        // write the number of processed reads, and how busy the workers are, to stderr
+        void set_show_progress(bool show_progress) { m_show_progress = show_progress; }
+
+        // Take the reads in the order of the bam rather than the most expensive
+        // first. A consumer that needs the reads in order can then only wait
+        // for reads that are already being processed.
+        void set_in_order(bool in_order) { m_longest_first = !in_order; }
+
+        // Process every record and return the number of records. Can only be called once.
+        size_t run(const ProcessFunction& process);
+
+    private:
+
+        // not allowed
+        ReadPipeline(const ReadPipeline&);
+        ReadPipeline& operator=(const ReadPipeline&);
+
+        const Fast5Map& m_name_map;
+        uint32_t m_squiggle_read_flags;
+        int m_num_threads;
+        bool m_show_progress;
+        bool m_longest_first;
+
+        htsFile* m_bam_fh;
+        hts_idx_t* m_bam_idx;
+        bam_hdr_t* m_hdr;
+        hts_itr_t* m_itr;
+        int m_region_start;
+        int m_region_end;
+};
+
+#endif
@@ -162,7 +162,7 @@ double model_score(SquiggleRead &sr,
         const Alphabet *alphabet = sr.pore_model[strand_idx].pmalphabet;
     
         ref_seq = alphabet->disambiguate(ref_seq);
-        HMMInputSequence sequence(ref_seq, alphabet->reverse_complement(ref_seq), alphabet);
+        HMMInputSequenceView sequence(ref_seq, alphabet);
 
         // Run HMM using current model
         double segment_score = profile_hmm_score(sequence, data, 0);
@@ -266,7 +266,7 @@ void sweep_offset_parameters(SquiggleRead &sr,
 
     const Alphabet *alphabet = sr.pore_model[strand_idx].pmalphabet;
     ref_seq = alphabet->disambiguate(ref_seq);
-    HMMInputSequence sequence(ref_seq, alphabet->reverse_complement(ref_seq), alphabet);
+    HMMInputSequenceView sequence(ref_seq, alphabet);
 
     // Run HMM using current model
     double base_score = profile_hmm_score(sequence, data, 0);
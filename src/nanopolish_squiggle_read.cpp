@@ -7,6 +7,7 @@
 // space nanopore read
 //
 #include <algorithm>
+#include <new>
 #include "nanopolish_common.h"
 #include "nanopolish_squiggle_read.h"
 #include "nanopolish_pore_model_set.h"
@@ -32,6 +33,86 @@ SquiggleRead::~SquiggleRead()
 {
 }
 
+//
+EmissionTableCells::EmissionTableCells(uint64_t model_key, size_t n_events, size_t n_ranks) :
+    key(model_key),
+    num_ranks(n_ranks),
+    blocks((n_events + BLOCK_EVENTS - 1) / BLOCK_EVENTS),
+    allocated_bytes(0)
+{
+    for(size_t bi = 0; bi < blocks.size(); ++bi) {
+        blocks[bi].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+EmissionTableCells::~EmissionTableCells()
+{
+    for(size_t bi = 0; bi < blocks.size(); ++bi) {
+        free(blocks[bi].load(std::memory_order_relaxed));
+    }
+}
+
+std::atomic<float>* EmissionTableCells::allocate_block(size_t bi)
+{
+    size_t n = BLOCK_EVENTS * num_ranks;
+    size_t bytes = n * sizeof(std::atomic<float>);
+    if(allocated_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes > EmissionTable::get_max_bytes()) {
+        allocated_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    // align to the cache line so rows do not share lines needlessly
+    void* ptr = NULL;
+    if(posix_memalign(&ptr, 64, bytes) != 0) {
+        allocated_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    std::atomic<float>* block = (std::atomic<float>*)ptr;
+    for(size_t i = 0; i < n; ++i) {
+        new (&block[i]) std::atomic<float>(NAN);
+    }
+
+    // another thread may have allocated the block in the meantime
+    std::atomic<float>* expected = NULL;
+    if(!blocks[bi].compare_exchange_strong(expected, block, std::memory_order_acq_rel)) {
+        free(block);
+        allocated_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        return expected;
+    }
+    return block;
+}
+
+size_t& EmissionTable::max_bytes()
+{
+    static size_t bytes = 0;
+    return bytes;
+}
+
+void EmissionTable::set_max_bytes(size_t bytes)
+{
+    max_bytes() = bytes;
+}
+
+std::shared_ptr<EmissionTableCells> EmissionTable::get_cells(uint64_t model_key, size_t n_events, size_t n_ranks)
+{
+    if(get_max_bytes() == 0 || model_key == 0) {
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!cells || cells->get_key() != model_key) {
+        cells = std::make_shared<EmissionTableCells>(model_key, n_events, n_ranks);
+    }
+    return cells;
+}
+
+void EmissionTable::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    cells.reset();
+}
+
 // helper for get_closest_event_to
 int SquiggleRead::get_next_event(int start, int stop, int stride, uint32_t strand) const
 {
@@ -74,9 +155,32 @@ void SquiggleRead::transform()
             double time = event.start_time - events[si][0].start_time;
             event.mean -= (time * pore_model[si].drift);
         }
+        emission_table[si].clear();
     }
 
     drift_correction_performed = true;
+    update_event_arrays();
+}
+
+//
+void SquiggleRead::update_event_arrays()
+{
+    for (size_t si = 0; si < 2; ++si) {
+        SquiggleEventArrays& arrays = event_arrays[si];
+        size_t n_events = events[si].size();
+        arrays.means.resize(n_events);
+        arrays.stdvs.resize(n_events);
+        arrays.log_stdvs.resize(n_events);
+        arrays.durations.resize(n_events);
+
+        for(size_t ei = 0; ei < n_events; ++ei) {
+            const SquiggleEvent& event = events[si][ei];
+            arrays.means[ei] = event.mean;
+            arrays.stdvs[ei] = event.stdv;
+            arrays.log_stdvs[ei] = event.log_stdv;
+            arrays.durations[ei] = event.duration;
+        }
+    }
 }
 
 //
@@ -531,6 +635,7 @@ void SquiggleRead::replace_model(size_t strand_idx, const std::string& model_typ
 void SquiggleRead::replace_model(size_t strand_idx, const PoreModel& model)
 {
     this->pore_model[strand_idx].update_states( model );
+    emission_table[strand_idx].clear();
 }
 
 // Return a vector of eventalignments for the events that made up the 2D basecalls in the read
@@ -572,6 +677,7 @@ std::vector<EventAlignment> SquiggleRead::get_eventalignment_for_1d_basecalls(co
             ea.rc = false;
             ea.model_kmer = kmer;
             ea.hmm_state = prev_kmer_rank != kmer_rank ? 'M' : 'E';
+            ea.l_event = -INFINITY; // not computed
             alignment.push_back(ea);
             prev_kmer_rank = kmer_rank;
         }
@@ -14,6 +14,9 @@
 #include "nanopolish_transition_parameters.h"
 #include "nanopolish_eventalign.h"
 #include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 enum PoreType
 {
@@ -48,6 +51,17 @@ struct SquiggleEvent
     float log_stdv;   // precompute for efficiency
 };
 
+// The event fields used by the HMMs stored as one array per field.
+// This is a copy of SquiggleRead::events that is rebuilt by
+// SquiggleRead::update_event_arrays() when the events change.
+struct SquiggleEventArrays
+{
+    std::vector<float> means; // drift corrected once transform() has run
+    std::vector<float> stdvs;
+    std::vector<float> log_stdvs;
+    std::vector<float> durations;
+};
+
 struct IndexPair
 {
     IndexPair() : start(-1), stop(-1) {}
@@ -62,6 +76,84 @@ struct EventRangeForBase
     IndexPair indices[2]; // one per strand
 };
 
+// The cells of an EmissionTable for one version of the pore model, indexed
+// by (event_idx, kmer_rank). The events are grouped into blocks that are
+// allocated the first time one of their cells is used, so only the events
+// that are scored take memory.
+class EmissionTableCells
+{
+    public:
+        EmissionTableCells(uint64_t model_key, size_t n_events, size_t n_ranks);
+        ~EmissionTableCells();
+
+        // Get the cell for the event and rank. NaN cells have not been computed
+        // yet. Returns NULL if the block of the event would exceed the memory
+        // limit, the caller should compute the value directly.
+        inline std::atomic<float>* get_cell(uint32_t event_idx, uint32_t kmer_rank)
+        {
+            size_t bi = event_idx / BLOCK_EVENTS;
+            std::atomic<float>* block = blocks[bi].load(std::memory_order_acquire);
+            if(block == NULL) {
+                block = allocate_block(bi);
+                if(block == NULL) {
+                    return NULL;
+                }
+            }
+            return &block[(event_idx % BLOCK_EVENTS) * num_ranks + kmer_rank];
+        }
+
+        uint64_t get_key() const { return key; }
+
+    private:
+
+        // not allowed
+        EmissionTableCells(const EmissionTableCells&);
+        EmissionTableCells& operator=(const EmissionTableCells&);
+
+        std::atomic<float>* allocate_block(size_t bi);
+
+        static const size_t BLOCK_EVENTS = 8;
+
+        uint64_t key;
+        size_t num_ranks;
+        std::vector< std::atomic<std::atomic<float>*> > blocks;
+        std::atomic<size_t> allocated_bytes;
+};
+
+// A lazily filled table of match emission log-probabilities for one strand
+// of a read. The cells belong to one version of the pore model, identified
+// by a key built from PoreModel::scaled_states_id. Asking for a different
+// key replaces them with new cells. Threads still using the old cells keep
+// them alive through their shared_ptr.
+class EmissionTable
+{
+    public:
+        EmissionTable() {}
+
+        // Get the cells of the table for this model. Returns NULL if
+        // the table is disabled, the caller should compute directly.
+        std::shared_ptr<EmissionTableCells> get_cells(uint64_t model_key, size_t n_events, size_t n_ranks);
+
+        // forget all values
+        void clear();
+
+        // The most memory that is allocated for the cells of one strand of a read.
+        // 0, the default, disables the tables.
+        static void set_max_bytes(size_t bytes);
+        static size_t get_max_bytes() { return max_bytes(); }
+
+        // copies start out empty, the values are not shared
+        EmissionTable(const EmissionTable&) : EmissionTable() {}
+        EmissionTable& operator=(const EmissionTable&) { clear(); return *this; }
+
+    private:
+
+        static size_t& max_bytes();
+
+        std::mutex mutex;
+        std::shared_ptr<EmissionTableCells> cells;
+};
+
 //
 class SquiggleRead
 {
@@ -69,6 +161,10 @@ class SquiggleRead
 
         SquiggleRead() : drift_correction_performed(false) {} // legacy TODO remove
         SquiggleRead(const std::string& name, const std::string& path, const uint32_t flags = 0);
+
+        // Copy a loaded read. The fast5 file is only open while
+        // a read is loading so copies never share it.
+        SquiggleRead(const SquiggleRead&) = default;
         ~SquiggleRead();
 
         //
@@ -82,27 +178,27 @@ class SquiggleRead
         // Return the duration of the specified event for one strand
         inline float get_duration(uint32_t event_idx, uint32_t strand) const
         {
-            assert(event_idx < events[strand].size());
-            return events[strand][event_idx].duration;
+            assert(event_idx < event_arrays[strand].durations.size());
+            return event_arrays[strand].durations[event_idx];
         }
 
         // Return the observed current level after correcting for drift
         inline float get_drift_corrected_level(uint32_t event_idx, uint32_t strand) const
         {
             assert(drift_correction_performed);
-            return events[strand][event_idx].mean;
+            return event_arrays[strand].means[event_idx];
         }
 
         // Return the current stdv for the given event
         inline float get_stdv(uint32_t event_idx, uint32_t strand) const
         {
-            return events[strand][event_idx].stdv;
+            return event_arrays[strand].stdvs[event_idx];
         }
 
         // Return log of the current stdv for the given event
         inline float get_log_stdv(uint32_t event_idx, uint32_t strand) const
         {
-            return events[strand][event_idx].log_stdv;
+            return event_arrays[strand].log_stdvs[event_idx];
         }
 
         // Return the observed current level after correcting for drift, shift and scale
@@ -116,7 +212,7 @@ class SquiggleRead
         // Return the observed current level stdv, after correcting for scale
         inline float get_scaled_stdv(uint32_t event_idx, uint32_t strand) const
         {
-            return events[strand][event_idx].stdv / pore_model[strand].scale_sd;
+            return event_arrays[strand].stdvs[event_idx] / pore_model[strand].scale_sd;
         }
 
         inline float get_time(uint32_t event_idx, uint32_t strand) const
@@ -145,6 +241,10 @@ class SquiggleRead
         // Transform each event by correcting for current drift
         void transform();
 
+        // Rebuild event_arrays from events. This must be called
+        // after modifying the events of a read directly.
+        void update_event_arrays();
+
         // get the index of the event that is nearest to the given kmer 
         int get_closest_event_to(int k_idx, uint32_t strand) const;
 
@@ -193,6 +293,9 @@ class SquiggleRead
 
         // one event sequence for each strand
         std::vector<SquiggleEvent> events[2];
+
+        // the events in structure-of-arrays form, for the HMM
+        SquiggleEventArrays event_arrays[2];
         
         // optional fields holding the raw data
         // this is not split into strands so there is only one vector, unlike events
@@ -206,13 +309,14 @@ class SquiggleRead
         // one set of parameters per strand
         TransitionParameters parameters[2];
 
+        // optional cache of emission probabilities, one per strand
+        mutable EmissionTable emission_table[2];
+
     private:
         // private data
         fast5::File* f_p;
         std::string basecall_group;
 
-        SquiggleRead(const SquiggleRead&) {}
-
         // Load all the read data from a fast5 file
         void load_from_fast5(const uint32_t flags);
 
@@ -0,0 +1,233 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_squiggle_read_cache -- process-wide cache of
+// loaded SquiggleReads
+//
+#include <assert.h>
+#include <algorithm>
+#include "nanopolish_squiggle_read_cache.h"
+
+// An estimate of the memory used by a read
+static size_t get_read_bytes(const SquiggleRead& sr)
+{
+    size_t bytes = sizeof(SquiggleRead) + sr.read_sequence.size();
+    bytes += sr.samples.size() * sizeof(float);
+    bytes += sr.base_to_event_map.size() * sizeof(EventRangeForBase);
+    for(size_t si = 0; si < 2; ++si) {
+        size_t n_events = sr.events[si].size();
+        bytes += n_events * sizeof(SquiggleEvent);
+        bytes += n_events * 4 * sizeof(float); // event_arrays
+        bytes += sr.pore_model[si].states.size() * (2 * sizeof(PoreModelStateParams) +
+                                                    sizeof(GaussianParameters) +
+                                                    sizeof(PoreModelScaledLevel));
+
+        // the emission table is filled as the read is scored, count the most it can grow to
+        size_t table_bytes = n_events * sr.pore_model[si].get_num_states() * sizeof(float);
+        bytes += std::min(table_bytes, EmissionTable::get_max_bytes());
+    }
+    return bytes;
+}
+
+SquiggleReadCache::~SquiggleReadCache()
+{
+    stop_prefetch();
+}
+
+void SquiggleReadCache::stop_prefetch()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop_prefetch = true;
+        m_prefetch_queue.clear();
+    }
+    m_prefetch_cv.notify_all();
+
+    if(m_prefetch_thread.joinable()) {
+        m_prefetch_thread.join();
+    }
+}
+
+SquiggleReadCache& SquiggleReadCache::instance()
+{
+    static SquiggleReadCache cache;
+    return cache;
+}
+
+std::shared_ptr<SquiggleRead> SquiggleReadCache::load(const std::string& read_name,
+                                                      const std::string& fast5_path,
+                                                      const std::string& model_type)
+{
+    // The window threads and the prefetch thread all load reads through the
+    // cache. HDF5 may not be threadsafe so only one fast5 file is read at a time.
+    static std::mutex load_mutex;
+    std::shared_ptr<SquiggleRead> sr;
+    {
+        std::lock_guard<std::mutex> lock(load_mutex);
+        sr = std::make_shared<SquiggleRead>(read_name, fast5_path);
+    }
+
+    // Switch the read to use an alternative kmer model
+    if(!model_type.empty()) {
+        sr->replace_models(model_type);
+    }
+    return sr;
+}
+
+std::shared_ptr<SquiggleRead> SquiggleReadCache::get(const std::string& read_name,
+                                                     const std::string& fast5_path,
+                                                     const std::string& model_type)
+{
+    if(!is_enabled()) {
+        return load(read_name, fast5_path, model_type);
+    }
+
+    std::string key = read_name + "\t" + model_type;
+    std::promise<std::shared_ptr<SquiggleRead>> promise;
+    std::shared_future<std::shared_ptr<SquiggleRead>> cached_read;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, Entry>::iterator iter = m_entries.find(key);
+        if(iter != m_entries.end()) {
+            // move to the front of the LRU list
+            m_lru.splice(m_lru.begin(), m_lru, iter->second.lru_iter);
+            m_hits++;
+            cached_read = iter->second.read;
+        } else {
+            // Insert a placeholder so that other threads wait for this load
+            // instead of starting their own
+            m_misses++;
+            m_lru.push_front(key);
+            Entry& entry = m_entries[key];
+            entry.read = promise.get_future().share();
+            entry.bytes = 0;
+            entry.lru_iter = m_lru.begin();
+        }
+    }
+
+    // this waits if another thread is still loading the read
+    if(cached_read.valid()) {
+        return cached_read.get();
+    }
+
+    std::shared_ptr<SquiggleRead> sr;
+    try {
+        sr = load(read_name, fast5_path, model_type);
+    } catch(...) {
+        // Pass the error to the threads waiting for this read and drop the
+        // placeholder so that a later call tries to load the read again
+        promise.set_exception(std::current_exception());
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, Entry>::iterator iter = m_entries.find(key);
+        if(iter != m_entries.end() && iter->second.bytes == 0) {
+            m_lru.erase(iter->second.lru_iter);
+            m_entries.erase(iter);
+        }
+        throw;
+    }
+    promise.set_value(sr);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, Entry>::iterator iter = m_entries.find(key);
+    if(iter != m_entries.end() && iter->second.bytes == 0) {
+        iter->second.bytes = get_read_bytes(*sr);
+        m_bytes += iter->second.bytes;
+        evict();
+    }
+    return sr;
+}
+
+std::shared_ptr<SquiggleRead> SquiggleReadCache::get_copy(const std::string& read_name,
+                                                          const std::string& fast5_path,
+                                                          const std::string& model_type)
+{
+    if(!is_enabled()) {
+        return load(read_name, fast5_path, model_type);
+    }
+    return std::make_shared<SquiggleRead>(*get(read_name, fast5_path, model_type));
+}
+
+void SquiggleReadCache::evict()
+{
+    std::list<std::string>::iterator iter = m_lru.end();
+    while(m_bytes > m_max_bytes && iter != m_lru.begin()) {
+        --iter;
+        std::map<std::string, Entry>::iterator entry_iter = m_entries.find(*iter);
+        assert(entry_iter != m_entries.end());
+
+        // reads that are still being loaded have no size yet, keep them
+        if(entry_iter->second.bytes == 0) {
+            continue;
+        }
+
+        m_bytes -= entry_iter->second.bytes;
+        m_entries.erase(entry_iter);
+        iter = m_lru.erase(iter);
+    }
+}
+
+void SquiggleReadCache::prefetch(const std::vector<SquiggleReadCacheRequest>& requests,
+                                 const std::string& model_type)
+{
+    if(!is_enabled() || requests.empty()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(size_t i = 0; i < requests.size(); ++i) {
+            if(m_entries.find(requests[i].read_name + "\t" + model_type) == m_entries.end()) {
+                m_prefetch_queue.push_back(std::make_pair(requests[i], model_type));
+            }
+        }
+
+        if(m_stop_prefetch) {
+            return;
+        }
+
+        if(!m_prefetch_thread.joinable()) {
+            m_prefetch_thread = std::thread(&SquiggleReadCache::prefetch_thread, this);
+        }
+    }
+    m_prefetch_cv.notify_one();
+}
+
+void SquiggleReadCache::prefetch_thread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true) {
+        m_prefetch_cv.wait(lock, [this] { return m_stop_prefetch || !m_prefetch_queue.empty(); });
+        if(m_stop_prefetch) {
+            return;
+        }
+
+        std::pair<SquiggleReadCacheRequest, std::string> request = m_prefetch_queue.front();
+        m_prefetch_queue.pop_front();
+
+        lock.unlock();
+        try {
+            get(request.first.read_name, request.first.fast5_path, request.second);
+        } catch(...) {
+            // the error is reported when the read is needed
+        }
+        lock.lock();
+    }
+}
+
+void SquiggleReadCache::set_max_bytes(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_max_bytes = bytes;
+    evict();
+}
+
+SquiggleReadCacheStats SquiggleReadCache::get_stats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SquiggleReadCacheStats stats = { m_hits, m_misses, m_bytes };
+    return stats;
+}
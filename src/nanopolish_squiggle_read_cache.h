@@ -0,0 +1,118 @@
+//---------------------------------------------------------
+// Copyright 2015 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_squiggle_read_cache -- process-wide cache of
+// loaded SquiggleReads
+//
+#ifndef NANOPOLISH_SQUIGGLE_READ_CACHE_H
+#define NANOPOLISH_SQUIGGLE_READ_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "nanopolish_squiggle_read.h"
+
+// A read to load, see SquiggleReadCache::prefetch
+struct SquiggleReadCacheRequest
+{
+    std::string read_name;
+    std::string fast5_path;
+};
+
+//
+struct SquiggleReadCacheStats
+{
+    size_t hits;
+    size_t misses;
+    size_t bytes;
+};
+
+// Reads are long and overlap many adjacent windows of the genome.
+// This cache keeps the reads loaded from their fast5 files, keyed by
+// read name and model type, so each read is parsed once rather than once
+// per window. The least recently used reads are dropped when the cache
+// holds more than the memory limit. Dropped reads stay alive while
+// they are still in use.
+class SquiggleReadCache
+{
+    public:
+        ~SquiggleReadCache();
+
+        // the cache shared by the whole process
+        static SquiggleReadCache& instance();
+
+        // Return the read, loading it and switching it to the model_type
+        // models (if not empty) when it is not in the cache. The read may
+        // be shared by other threads so it must not be modified.
+        std::shared_ptr<SquiggleRead> get(const std::string& read_name,
+                                          const std::string& fast5_path,
+                                          const std::string& model_type);
+
+        // As above but the returned read belongs to the caller, who can modify it
+        std::shared_ptr<SquiggleRead> get_copy(const std::string& read_name,
+                                               const std::string& fast5_path,
+                                               const std::string& model_type);
+
+        // Load the reads on a background thread so later calls to get() do not wait.
+        // The thread opens the fast5 files under the same lock as get(), so it
+        // never reads a fast5 file at the same time as another thread.
+        void prefetch(const std::vector<SquiggleReadCacheRequest>& requests,
+                      const std::string& model_type);
+
+        // Drop the queued prefetch requests and join the background thread.
+        // Later calls to prefetch() do nothing.
+        void stop_prefetch();
+
+        // The memory limit of the cache. 0, the default, disables caching
+        // and every call to get() loads the read again.
+        void set_max_bytes(size_t bytes);
+        bool is_enabled() const { return m_max_bytes > 0; }
+
+        SquiggleReadCacheStats get_stats();
+
+    private:
+
+        SquiggleReadCache() : m_bytes(0), m_max_bytes(0), m_hits(0), m_misses(0), m_stop_prefetch(false) {}
+
+        struct Entry
+        {
+            std::shared_future<std::shared_ptr<SquiggleRead>> read;
+            size_t bytes; // 0 while the read is being loaded
+            std::list<std::string>::iterator lru_iter;
+        };
+
+        static std::shared_ptr<SquiggleRead> load(const std::string& read_name,
+                                                  const std::string& fast5_path,
+                                                  const std::string& model_type);
+
+        // drop the least recently used reads until the cache is within the limit
+        // the caller must hold m_mutex
+        void evict();
+
+        void prefetch_thread();
+
+        std::mutex m_mutex;
+        std::map<std::string, Entry> m_entries;
+        std::list<std::string> m_lru; // most recently used first
+        size_t m_bytes;
+        size_t m_max_bytes;
+        size_t m_hits;
+        size_t m_misses;
+
+        // background loading
+        std::thread m_prefetch_thread;
+        std::condition_variable m_prefetch_cv;
+        std::deque<std::pair<SquiggleReadCacheRequest, std::string>> m_prefetch_queue;
+        bool m_stop_prefetch;
+};
+
+#endif
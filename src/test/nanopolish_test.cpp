@@ -7,21 +7,80 @@
 //
 #define CATCH_CONFIG_MAIN
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
 #include <string>
 #include <array>
 #include <vector>
 #include <random>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
 
 #include "logsum.h"
 #include "catch.hpp"
 #include "nanopolish_common.h"
 #include "nanopolish_alphabet.h"
+#include "nanopolish_call_variants.h"
 #include "nanopolish_emissions.h"
+#include "nanopolish_fast5_map.h"
+#include "nanopolish_matrix.h"
 #include "nanopolish_profile_hmm.h"
+#include "nanopolish_profile_hmm_r9.h"
+#include "nanopolish_profile_hmm_r9_simd.h"
+#include "nanopolish_read_pipeline.h"
+#include "nanopolish_consensus.h"
+#include "nanopolish_squiggle_read_cache.h"
+#include "nanopolish_text_format.h"
+#include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_format.h"
 #include "training_core.hpp"
 #include "invgauss.hpp"
 #include "logger.hpp"
 
+// A directory for the files written by a test. It is removed with
+// everything in it when it goes out of scope, even if the test fails.
+class TestDirectory
+{
+    public:
+        TestDirectory()
+        {
+            char name[] = "/tmp/nanopolish_test.XXXXXX";
+            if(mkdtemp(name) == NULL) {
+                fprintf(stderr, "error: could not create a temporary directory\n");
+                exit(EXIT_FAILURE);
+            }
+            path = name;
+        }
+
+        ~TestDirectory()
+        {
+            DIR* dir = opendir(path.c_str());
+            if(dir != NULL) {
+                struct dirent* entry;
+                while((entry = readdir(dir)) != NULL) {
+                    std::string name = entry->d_name;
+                    if(name != "." && name != "..") {
+                        unlink(get_file(name).c_str());
+                    }
+                }
+                closedir(dir);
+            }
+            rmdir(path.c_str());
+        }
+
+        std::string get_file(const std::string& name) const { return path + "/" + name; }
+
+    private:
+        TestDirectory(const TestDirectory&); // not allowed
+        std::string path;
+};
+
 TEST_CASE( "alphabet", "[alphabet]" ) {
 
     // DNA alphabet
@@ -71,6 +130,21 @@ TEST_CASE( "alphabet", "[alphabet]" ) {
     }
     REQUIRE(kmer == "TTT");
 
+    // The rolling kmer ranks agree with kmer_rank, on both strands
+    std::string seq = "ACGTTGCAMGATCGGCMGTA";
+    HMMInputSequence hmm_seq(seq, mc_alphabet.reverse_complement(seq), &mc_alphabet);
+    for(uint32_t rk = 3; rk <= 6; ++rk) {
+        std::vector<uint32_t> ranks = hmm_seq.get_kmer_ranks(rk, false);
+        std::vector<uint32_t> rc_ranks = hmm_seq.get_kmer_ranks(rk, true);
+        REQUIRE(ranks.size() == seq.size() - rk + 1);
+        for(size_t i = 0; i < ranks.size(); ++i) {
+            std::string rc_kmer = mc_alphabet.reverse_complement(seq).substr(seq.size() - i - rk, rk);
+            REQUIRE(ranks[i] == mc_alphabet.kmer_rank(seq.c_str() + i, rk));
+            REQUIRE(rc_ranks[i] == mc_alphabet.kmer_rank(rc_kmer.c_str(), rk));
+            REQUIRE(hmm_seq.get_kmer_rank(i, rk, true) == rc_ranks[i]);
+        }
+    }
+
     // Test the methylate function in the CpG alphabet
     REQUIRE( mc_alphabet.methylate("C") == "C");
     REQUIRE( mc_alphabet.methylate("G") == "G");
@@ -260,6 +334,196 @@ TEST_CASE( "string functions", "[string_functions]" ) {
     REQUIRE( ! ends_with("abcd", "e") );
     REQUIRE( ends_with("abcd", "d") );
     REQUIRE( ends_with("abcd", "") );
+
+    // number formatting matches printf
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> level(-200.0f, 200.0f);
+    char buffer[64];
+    for(size_t i = 0; i < 10000; ++i) {
+        // every 8th value is a tie at the second decimal
+        float x = i % 8 == 0 ? roundf(level(rng) * 8) / 8 : level(rng);
+        for(int precision : { 2, 3, 5 }) {
+            std::string formatted;
+            append_fixed(formatted, x, precision);
+            snprintf(buffer, sizeof(buffer), "%.*lf", precision, x);
+            REQUIRE( formatted == buffer );
+        }
+    }
+
+    for(double x : { -0.001, -0.0, (double)INFINITY, (double)NAN }) {
+        std::string formatted;
+        append_fixed(formatted, x, 2);
+        snprintf(buffer, sizeof(buffer), "%.2lf", x);
+        REQUIRE( formatted == buffer );
+    }
+
+    std::string integers;
+    append_int(integers, -1203);
+    integers.push_back(' ');
+    append_uint(integers, 0);
+    integers.push_back(' ');
+    append_uint(integers, 18446744073709551615ull);
+    REQUIRE( integers == "-1203 0 18446744073709551615" );
+}
+
+TEST_CASE( "eventalign format", "[eventalign]" ) {
+    EventalignFileHeader header;
+    header.write_samples = true;
+    header.contig_names = { "chr1", "chr2" };
+
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> level(40.0f, 140.0f);
+    std::vector<EventalignBlock> blocks(2);
+    for(size_t bi = 0; bi < blocks.size(); ++bi) {
+        EventalignBlock& block = blocks[bi];
+        block.read_idx = 1000 * bi;
+        block.read_name = "read" + std::to_string(bi);
+        block.contig_id = 1 - bi;
+        block.k = 6;
+
+        for(int i = 0; i < 200; ++i) {
+            EventalignRecord record;
+            record.ref_position = 5000 + i / 2 - (bi == 1 ? 3 * i : 0);
+            record.ref_kmer_rank = rng() % 4096;
+            record.strand_idx = i >= 150;
+            record.event_idx = record.strand_idx ? 900 - i : 20 + i;
+            record.event_level_mean = level(rng);
+            record.event_stdv = level(rng) / 40;
+            record.event_length = level(rng) / 10000;
+            record.model_kmer_rank = i % 10 == 0 ? EVENTALIGN_NO_KMER : rng() % 4096;
+            record.model_mean = level(rng);
+            record.model_stdv = level(rng) / 50;
+            record.standardized_level = (record.event_level_mean - record.model_mean) / record.model_stdv;
+            record.samples_start = block.samples.size();
+            record.num_samples = i % 4;
+            for(uint32_t j = 0; j < record.num_samples; ++j) {
+                block.samples.push_back(level(rng));
+            }
+            block.records.push_back(record);
+        }
+    }
+
+    TestDirectory dir;
+    std::string filename = dir.get_file("eventalign_format_test.bin");
+    FILE* fp = fopen(filename.c_str(), "wb");
+    REQUIRE( fp != NULL );
+    EventalignBinaryWriter writer(fp, header);
+    std::vector<EventalignIndexEntry> entries(blocks.size());
+    for(size_t bi = 0; bi < blocks.size(); ++bi) {
+        std::string encoded;
+        encode_eventalign_block(encoded, header, blocks[bi], entries[bi]);
+        writer.write_block(encoded, entries[bi]);
+    }
+    writer.close();
+    fclose(fp);
+
+    // the tsv converted from the file is the tsv of the blocks
+    EventalignReader reader(filename);
+    REQUIRE( reader.get_header().write_samples );
+    REQUIRE( reader.get_header().contig_names == header.contig_names );
+
+    EventalignBlock block;
+    for(size_t bi = 0; bi < blocks.size(); ++bi) {
+        REQUIRE( reader.next_block(block) );
+        std::string expected;
+        std::string decoded;
+        format_eventalign_block_tsv(expected, header, "ctg", blocks[bi]);
+        format_eventalign_block_tsv(decoded, reader.get_header(), "ctg", block);
+        REQUIRE( decoded == expected );
+        REQUIRE( block.read_name == blocks[bi].read_name );
+        REQUIRE( block.contig_id == blocks[bi].contig_id );
+    }
+    REQUIRE( !reader.next_block(block) );
+
+    // the index finds the blocks by reference position
+    REQUIRE( reader.load_index() );
+    REQUIRE( reader.get_index().size() == 2 );
+    REQUIRE( reader.get_index()[1].contig_id == 0 );
+    REQUIRE( reader.get_index()[1].start == 5000 + 199 / 2 - 3 * 199 );
+    REQUIRE( reader.get_index()[1].end == 5000 );
+    reader.read_block_at(reader.get_index()[1].offset, block);
+    REQUIRE( block.read_idx == 1000 );
+}
+
+// An alignment of one event per reference base in [ref_start, ref_end) where the
+// event of base i is event_offset + event_stride * i, as a chunk labelled name
+static std::vector<EventAlignment> make_chunk_alignment(const std::string& name,
+                                                        int ref_start,
+                                                        int ref_end,
+                                                        int event_offset,
+                                                        int event_stride)
+{
+    std::vector<EventAlignment> alignment;
+    for(int i = ref_start; i < ref_end; ++i) {
+        EventAlignment ea;
+        ea.ref_name = name;
+        ea.ref_position = i;
+        ea.read_idx = 0;
+        ea.strand_idx = event_stride == 1 ? 0 : 1;
+        ea.event_idx = event_offset + event_stride * i;
+        ea.rc = false;
+        ea.hmm_state = 'M';
+        ea.l_event = -1.0;
+        alignment.push_back(ea);
+    }
+    return alignment;
+}
+
+TEST_CASE( "chunk stitching", "[eventalign]" ) {
+
+    // the chunks meet at reference base 400 and overlap on [200, 600]
+    const int boundary = 400;
+    const int flank = 200;
+
+    for(int stride = 1; stride >= -1; stride -= 2) {
+        int offset = stride == 1 ? 1000 : 5000;
+
+        // the chunks agree on the whole overlap, the join is made at the
+        // match that both chunks are the most confident of
+        std::vector<EventAlignment> out = make_chunk_alignment("out", 0, 600, offset, stride);
+        std::vector<EventAlignment> next = make_chunk_alignment("next", 300, 900, offset, stride);
+        out[350].l_event = -0.1;
+        next[350 - 300].l_event = -0.1;
+
+        std::vector<EventAlignment> stitched;
+        stitch_chunk_alignment(stitched, out, 0, flank);
+        REQUIRE( stitched.size() == out.size() );
+        stitch_chunk_alignment(stitched, next, boundary, flank);
+        REQUIRE( stitched.size() == 900 );
+        for(int i = 0; i < 900; ++i) {
+            REQUIRE( stitched[i].ref_position == i );
+            REQUIRE( stitched[i].event_idx == offset + stride * i );
+            REQUIRE( stitched[i].ref_name == (i <= 350 ? "out" : "next") );
+        }
+
+        // a match only one chunk is confident of is not preferred, the join
+        // falls back to the agreeing match closest to the boundary
+        out[350].l_event = -0.1;
+        next[350 - 300].l_event = -5.0;
+        out[450].l_event = -5.0;
+        next[450 - 300].l_event = -0.1;
+        stitched = out;
+        stitch_chunk_alignment(stitched, next, boundary, flank);
+        REQUIRE( stitched.size() == 900 );
+        REQUIRE( stitched[boundary].ref_name == "out" );
+        REQUIRE( stitched[boundary + 1].ref_name == "next" );
+
+        // the chunks never agree on a match, the join is made before the boundary
+        // where next continues with the event following the last event of out
+        next = make_chunk_alignment("next", 300, 900, offset + stride, stride);
+        stitched = out;
+        stitch_chunk_alignment(stitched, next, boundary, flank);
+        REQUIRE( stitched.size() == 901 );
+        REQUIRE( stitched[boundary - 1].ref_name == "out" );
+        REQUIRE( stitched[boundary].ref_name == "next" );
+        for(size_t i = 0; i < stitched.size(); ++i) {
+            REQUIRE( stitched[i].event_idx == offset + stride * (int)i );
+        }
+
+        // an empty chunk leaves the alignment as it is
+        stitch_chunk_alignment(stitched, std::vector<EventAlignment>(), boundary + 500, flank);
+        REQUIRE( stitched.size() == 901 );
+    }
 }
 
 TEST_CASE( "math", "[math]") {
@@ -272,6 +536,281 @@ TEST_CASE( "math", "[math]") {
     REQUIRE( log_normal_pdf(2.25, params) == Approx(log(normal_pdf(2.25, params))) );
 }
 
+TEST_CASE( "variant calling windows", "[call_variants]") {
+    std::string contig;
+    int start_base;
+    int end_base;
+    parse_region_string("chr1:100-219", contig, start_base, end_base);
+    REQUIRE( contig == "chr1" );
+    REQUIRE( start_base == 100 );
+    REQUIRE( end_base == 219 );
+
+    parse_region_string("chr2", contig, start_base, end_base);
+    REQUIRE( contig == "chr2" );
+    REQUIRE( start_base == 0 );
+    REQUIRE( end_base == INT_MAX );
+
+    // the owned ranges tile the region and each window extends into the next
+    std::vector<VariantCallingWindow> windows = make_windows("chr1", 100, 219, 50, 10);
+    REQUIRE( windows.size() == 3 );
+    REQUIRE( windows[0].start == 100 );
+    REQUIRE( windows[0].end == 160 );
+    REQUIRE( windows[1].start == 150 );
+    REQUIRE( windows[1].end == 210 );
+    REQUIRE( windows[2].start == 200 );
+    REQUIRE( windows[2].end == 219 );
+
+    REQUIRE( windows.front().owned_start == 100 );
+    REQUIRE( windows.back().owned_end == 220 );
+    for(size_t i = 0; i < windows.size(); ++i) {
+        REQUIRE( windows[i].contig == "chr1" );
+        REQUIRE( windows[i].owned_start == windows[i].start );
+        if(i + 1 < windows.size()) {
+            REQUIRE( windows[i].owned_end == windows[i + 1].owned_start );
+        }
+    }
+    REQUIRE( windows[0].owns(149) );
+    REQUIRE( !windows[0].owns(150) );
+    REQUIRE( windows[1].owns(150) );
+
+    // a region shorter than a window
+    std::vector<VariantCallingWindow> single = make_windows("chr1", 5, 5, 50, 10);
+    REQUIRE( single.size() == 1 );
+    REQUIRE( single[0].start == 5 );
+    REQUIRE( single[0].end == 5 );
+    REQUIRE( single[0].owned_start == 5 );
+    REQUIRE( single[0].owned_end == 6 );
+
+    // reference bases 100..219
+    std::string reference;
+    for(int i = 0; i < 120; ++i) {
+        reference.push_back("ACGT"[(i * 7 + i / 3) % 4]);
+    }
+
+    // variants at the ends of the owned ranges and in the overlaps
+    std::vector<Variant> variants;
+    int substitutions[] = { 149, 150, 155 };
+    for(int position : substitutions) {
+        Variant v;
+        v.ref_name = "chr1";
+        v.ref_position = position;
+        v.ref_seq = reference.substr(position - 100, 1);
+        v.alt_seq = v.ref_seq == "A" ? "C" : "A";
+        variants.push_back(v);
+    }
+
+    Variant insertion;
+    insertion.ref_name = "chr1";
+    insertion.ref_position = 199;
+    insertion.ref_seq = reference.substr(99, 1);
+    insertion.alt_seq = insertion.ref_seq + "GG";
+    variants.push_back(insertion);
+
+    Variant deletion;
+    deletion.ref_name = "chr1";
+    deletion.ref_position = 205;
+    deletion.ref_seq = reference.substr(105, 2);
+    deletion.alt_seq = reference.substr(105, 1);
+    variants.push_back(deletion);
+
+    Haplotype expected("chr1", 100, reference);
+    for(const Variant& v : variants) {
+        REQUIRE( expected.apply_variant(v) );
+    }
+
+    std::vector<int> times_reported(variants.size(), 0);
+    std::string consensus;
+    for(const VariantCallingWindow& w : windows) {
+        // each window sees every variant within its bounds, overlap included
+        Haplotype haplotype(w.contig, w.start, reference.substr(w.start - 100, w.end - w.start + 1));
+        std::vector<Variant> window_variants;
+        for(const Variant& v : variants) {
+            if((int)v.ref_position >= w.start && (int)(v.ref_position + v.ref_seq.size()) <= w.end + 1) {
+                REQUIRE( haplotype.apply_variant(v) );
+                window_variants.push_back(v);
+            }
+        }
+
+        for(const Variant& v : get_owned_variants(window_variants, w)) {
+            REQUIRE( w.owns(v.ref_position) );
+            for(size_t i = 0; i < variants.size(); ++i) {
+                if(variants[i].ref_position == v.ref_position) {
+                    times_reported[i]++;
+                }
+            }
+        }
+
+        std::string record = get_window_consensus_record(haplotype, w);
+        std::stringstream header;
+        header << ">chr1:" << w.owned_start << "-" << w.owned_end - 1 << "\n";
+        REQUIRE( record.substr(0, header.str().size()) == header.str() );
+        consensus += record.substr(header.str().size(), record.size() - header.str().size() - 1);
+    }
+
+    for(size_t i = 0; i < variants.size(); ++i) {
+        REQUIRE( times_reported[i] == 1 );
+    }
+    REQUIRE( consensus == expected.get_sequence() );
+}
+
+// set the modification time of the file to seconds before now
+static void set_file_age(const std::string& filename, int seconds)
+{
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - seconds;
+    REQUIRE( utime(filename.c_str(), &times) == 0 );
+}
+
+TEST_CASE( "fast5 map", "[fast5_map]") {
+
+    TestDirectory dir;
+    std::string fasta = dir.get_file("reads.fa");
+    std::string index_filename = fasta + ".fast5.idx";
+    std::string path_a = dir.get_file("a.fast5");
+    std::string path_b = dir.get_file("b.fast5");
+    std::ofstream(path_a.c_str()) << "";
+
+    std::ofstream(fasta.c_str()) << ">read_b 2D " << path_b << "\nACGT\n"
+                                 << ">read_a 2D " << path_a << "\nACGT\n";
+    set_file_age(fasta, 100);
+
+    // the first map parses the fasta and writes the index
+    {
+        Fast5Map map(fasta);
+        REQUIRE( map.get_path("read_a") == path_a );
+        REQUIRE( map.get_path("read_b") == path_b );
+    }
+
+    Fast5MapIndex index(index_filename);
+    REQUIRE( index.is_open() );
+    REQUIRE( index.size() == 2 );
+    REQUIRE( std::string(index.find("read_a")) == path_a );
+    REQUIRE( std::string(index.find("read_b")) == path_b );
+    REQUIRE( index.find("read_c") == NULL );
+    REQUIRE( index.find("") == NULL );
+
+    // the next map reads the index rather than the fasta
+    std::ofstream(fasta.c_str()) << ">read_a 2D " << path_b << "\nACGT\n";
+    set_file_age(fasta, 100);
+    {
+        Fast5Map map(fasta);
+        REQUIRE( map.get_path("read_a") == path_a );
+    }
+
+    // a truncated index is rejected
+    std::map<std::string, std::string> read_to_path_map = { { "read_a", path_a }, { "read_b", path_b } };
+    REQUIRE( Fast5MapIndex::write(index_filename, read_to_path_map) );
+    struct stat index_s;
+    REQUIRE( stat(index_filename.c_str(), &index_s) == 0 );
+    REQUIRE( truncate(index_filename.c_str(), index_s.st_size - 1) == 0 );
+    REQUIRE( !Fast5MapIndex(index_filename).is_open() );
+
+    // as are an index that claims more reads than it holds and one with a bad magic
+    REQUIRE( Fast5MapIndex::write(index_filename, read_to_path_map) );
+    FILE* fp = fopen(index_filename.c_str(), "r+b");
+    REQUIRE( fp != NULL );
+    uint64_t num_reads = 1000000;
+    fseek(fp, offsetof(Fast5MapIndexHeader, num_reads), SEEK_SET);
+    fwrite(&num_reads, sizeof(num_reads), 1, fp);
+    fclose(fp);
+    REQUIRE( !Fast5MapIndex(index_filename).is_open() );
+
+    std::ofstream(index_filename.c_str()) << "not a fast5 index, but long enough for the header";
+    REQUIRE( !Fast5MapIndex(index_filename).is_open() );
+
+    // an index that can not be used falls back to an existing fofn
+    std::ofstream(fasta + ".fast5.fofn") << "read_a " << path_b << "\n";
+    {
+        Fast5Map map(fasta);
+        REQUIRE( map.get_path("read_a") == path_b );
+    }
+}
+
+TEST_CASE( "matrix arena", "[matrix]") {
+
+    // a released lease is handed out again for the same or a smaller size
+    FloatMatrix a;
+    float* cells = NULL;
+    {
+        MatrixLease<float> lease(a, 100, 100);
+        cells = a.cells;
+        REQUIRE( cells != NULL );
+        REQUIRE( ((uintptr_t)cells % 64) == 0 );
+    }
+    REQUIRE( a.cells == NULL );
+    {
+        MatrixLease<float> lease(a, 50, 100);
+        REQUIRE( a.cells == cells );
+    }
+
+    // nested leases get their own blocks and the outer block is still reused
+    FloatMatrix b;
+    {
+        MatrixLease<float> outer(a, 100, 100);
+        MatrixLease<float> inner(b, 10, 10);
+        REQUIRE( a.cells == cells );
+        REQUIRE( b.cells != cells );
+        a.cells[100 * 100 - 1] = 1.0f;
+        b.cells[10 * 10 - 1] = 2.0f;
+        REQUIRE( a.cells[100 * 100 - 1] == 1.0f );
+    }
+
+    // a larger lease grows the block, which is then reused
+    {
+        MatrixLease<float> lease(a, 1000, 1000);
+        cells = a.cells;
+        a.cells[1000 * 1000 - 1] = 1.0f;
+    }
+    {
+        MatrixLease<float> lease(a, 800, 1000);
+        REQUIRE( a.cells == cells );
+    }
+}
+
+TEST_CASE( "logsum", "[logsum]") {
+
+    // differences of 0 to 20 nats, and -INFINITY inputs
+    std::vector<float> a, b;
+    for(int i = 0; i <= 20000; ++i) {
+        a.push_back(-10.0f);
+        b.push_back(-10.0f - i * 0.001f);
+    }
+    a.push_back(-INFINITY); b.push_back(-3.0f);
+    a.push_back(-INFINITY); b.push_back(-INFINITY);
+
+    std::vector<double> exact(a.size());
+    for(size_t i = 0; i < a.size(); ++i) {
+        exact[i] = log(exp((double)a[i]) + exp((double)b[i]));
+    }
+
+    // the lookup table is accurate to 0.001 nats, the polynomial to float precision
+    for(size_t i = 0; i < a.size(); ++i) {
+        if(exact[i] == -INFINITY) {
+            REQUIRE( p7_FLogsum(a[i], b[i]) == -INFINITY );
+            REQUIRE( p7_FLogsumPoly(a[i], b[i]) == -INFINITY );
+        } else {
+            REQUIRE( fabs(p7_FLogsum(a[i], b[i]) - exact[i]) < 1e-3 );
+            REQUIRE( fabs(p7_FLogsumPoly(a[i], b[i]) - exact[i]) < 1e-5 );
+        }
+    }
+
+    // the vectorized log-add of each instruction set this CPU supports
+    HMMSIMDLevel simd_level = get_hmm_simd_level();
+    std::vector<float> out(a.size());
+    for(int level = HSL_SCALAR; level <= detect_hmm_simd_level(); ++level) {
+        set_hmm_simd_level((HMMSIMDLevel)level);
+        hmm_simd_logadd(a.data(), b.data(), out.data(), a.size());
+        for(size_t i = 0; i < a.size(); ++i) {
+            if(exact[i] == -INFINITY) {
+                REQUIRE( out[i] == -INFINITY );
+            } else {
+                REQUIRE( fabs(out[i] - exact[i]) < 1e-5 );
+            }
+        }
+    }
+    set_hmm_simd_level(simd_level);
+}
+
 std::string event_alignment_to_string(const std::vector<HMMAlignmentState>& alignment)
 {
     std::string out;
@@ -327,7 +866,7 @@ TEST_CASE( "hmm", "[hmm]") {
     for(int si = 0; si <= 1; ++si) {
 
         // viterbi align
-        std::vector<HMMAlignmentState> event_alignment = profile_hmm_align(ref_subseq, input[si]);
+        std::vector<HMMAlignmentState> event_alignment = profile_hmm_align(HMMInputSequenceView(ref_subseq), input[si]);
         std::string ea_str = event_alignment_to_string(event_alignment);
     
         // check
@@ -335,9 +874,361 @@ TEST_CASE( "hmm", "[hmm]") {
         REQUIRE( event_alignment.back().l_fm == Approx(expected_viterbi_last_state[si]));
 
         // forward algorithm
-        double lp = profile_hmm_score(ref_subseq, input[si]);
+        double lp = profile_hmm_score(HMMInputSequenceView(ref_subseq), input[si]);
         REQUIRE(lp == Approx(expected_forward[si]));
+
+        // R7 reads are only scored by the vectorized kernel when it is
+        // enabled as it uses approximations of exp and log
+        HMMSIMDLevel simd_level = get_hmm_simd_level();
+        set_hmm_simd_r7(true);
+        double lp_simd = profile_hmm_score(HMMInputSequenceView(ref_subseq), input[si]);
+        REQUIRE(lp_simd == Approx(lp).epsilon(1e-4));
+
+        // the reference is scored in full, an unrelated sequence is abandoned
+        HMMXDrop xdrop(20.0f);
+        REQUIRE(profile_hmm_score(HMMInputSequenceView(ref_subseq), input[si], 0, &xdrop) == lp_simd);
+        if(simd_level != HSL_SCALAR) {
+            std::string unrelated = gDNAAlphabet.reverse_complement(ref_subseq);
+            REQUIRE(profile_hmm_score(HMMInputSequenceView(unrelated), input[si], 0, &xdrop) == -INFINITY);
+        }
+
+        // the linear-space screen agrees with the log-space score on the
+        // reference and on a substitution at every position of it
+        REQUIRE(profile_hmm_score_linear(HMMInputSequenceView(ref_subseq), input[si]) == Approx(lp_simd).epsilon(1e-4));
+        for(size_t i = 0; i < ref_subseq.size(); ++i) {
+            std::string substituted = ref_subseq;
+            substituted[i] = substituted[i] == 'A' ? 'C' : 'A';
+            double lp_substituted = profile_hmm_score(HMMInputSequenceView(substituted), input[si]);
+            REQUIRE(profile_hmm_score_linear(HMMInputSequenceView(substituted), input[si]) == Approx(lp_substituted).epsilon(1e-4));
+        }
+        set_hmm_simd_r7(false);
+
+        // score an edited sequence from the matrices of the original
+        HMMScoredBase base = profile_hmm_score_base(HMMInputSequenceView(ref_subseq), input[si]);
+        REQUIRE(base.score == Approx(lp));
+
+        std::string edited = ref_subseq;
+        edited.erase(edited.size() / 2, 1);
+        set_hmm_simd_level(HSL_SCALAR);
+        REQUIRE(profile_hmm_score_edit(base, HMMInputSequenceView(edited)) == Approx(profile_hmm_score(HMMInputSequenceView(edited), input[si])));
+        set_hmm_simd_level(simd_level);
+
+        // The R9 functions are called directly as the read is R7. A substitution
+        // and an insertion are scored from the base as a full rescore scores them,
+        // with the base filled by the vectorized kernel and by the scalar fill.
+        std::string substituted = ref_subseq;
+        substituted[substituted.size() / 2] = substituted[substituted.size() / 2] == 'A' ? 'C' : 'A';
+        std::string inserted = ref_subseq;
+        inserted.insert(inserted.size() / 2, "G");
+
+        HMMSIMDLevel levels[2] = { simd_level, HSL_SCALAR };
+        for(int li = 0; li < 2; ++li) {
+            set_hmm_simd_level(levels[li]);
+            HMMScoredBase base_r9;
+            profile_hmm_score_base_r9(HMMInputSequenceView(ref_subseq), input[si], 0, base_r9);
+            REQUIRE(base_r9.score == profile_hmm_score_r9(HMMInputSequenceView(ref_subseq), input[si]));
+            REQUIRE(profile_hmm_score_edit_r9(base_r9, HMMInputSequenceView(substituted)) == Approx(profile_hmm_score_r9(HMMInputSequenceView(substituted), input[si])).epsilon(1e-4));
+            REQUIRE(profile_hmm_score_edit_r9(base_r9, HMMInputSequenceView(inserted)) == Approx(profile_hmm_score_r9(HMMInputSequenceView(inserted), input[si])).epsilon(1e-4));
+        }
+        set_hmm_simd_level(simd_level);
+
+        // The R9 fills are run directly as the read is R7. A band around the
+        // viterbi path gives the same alignment as the full matrix, a band
+        // that does not contain the path is detected.
+        uint32_t n_kmers = ref_subseq.size() - sr.pore_model[si].k + 1;
+        uint32_t n_events = (input[si].event_stop_idx - input[si].event_start_idx) * input[si].event_stride + 1;
+        std::vector<HMMAlignmentState> full_alignment = profile_hmm_align_r9(HMMInputSequenceView(ref_subseq), input[si]);
+        std::vector<HMMBandAnchor> anchors;
+        for(size_t ai = 0; ai < full_alignment.size(); ++ai) {
+            if(full_alignment[ai].state != 'K') {
+                uint32_t event_offset = (full_alignment[ai].event_idx - input[si].event_start_idx) * input[si].event_stride;
+                anchors.push_back({ event_offset, full_alignment[ai].kmer_idx });
+            }
+        }
+
+        bool hit_band_edge = true;
+        HMMBand band = make_anchored_band(anchors, n_events, n_kmers, 20);
+        std::vector<HMMAlignmentState> banded_alignment = profile_hmm_align_banded_r9(HMMInputSequenceView(ref_subseq), input[si], band, 0, &hit_band_edge);
+        REQUIRE(!hit_band_edge);
+        REQUIRE(event_alignment_to_string(banded_alignment) == event_alignment_to_string(full_alignment));
+        REQUIRE(banded_alignment.back().l_fm == full_alignment.back().l_fm);
+
+        set_hmm_simd_level(HSL_SCALAR);
+        float lp_full = profile_hmm_score_r9(HMMInputSequenceView(ref_subseq), input[si]);
+        set_hmm_simd_level(simd_level);
+        REQUIRE(profile_hmm_score_banded_r9(HMMInputSequenceView(ref_subseq), input[si], band, 0, &hit_band_edge) == Approx(lp_full).epsilon(1e-3));
+        REQUIRE(!hit_band_edge);
+
+        // move the band ahead of the path so that it has to follow the edge
+        for(size_t ai = 0; ai < anchors.size(); ++ai) {
+            anchors[ai].kmer_idx += 15;
+        }
+        HMMBand shifted_band = make_anchored_band(anchors, n_events, n_kmers, 10);
+        profile_hmm_align_banded_r9(HMMInputSequenceView(ref_subseq), input[si], shifted_band, 0, &hit_band_edge);
+        REQUIRE(hit_band_edge);
+        REQUIRE(profile_hmm_score_banded_r9(HMMInputSequenceView(ref_subseq), input[si], shifted_band) < lp_full);
+
+        // the forward pass that only keeps checkpoint rows scores the same as the full matrix
+        uint32_t n_states = PSR9_NUM_STATES * (n_kmers + 2);
+        FloatMatrix fm;
+        allocate_matrix(fm, n_events + 1, n_states);
+        profile_hmm_forward_initialize_r9(fm);
+        ProfileHMMForwardOutputR9 full_output(&fm);
+        float lp_forward = profile_hmm_fill_generic_r9(HMMInputSequenceView(ref_subseq), input[si], input[si].event_start_idx, 0, full_output);
+        free_matrix(fm);
+
+        ProfileHMMCheckpointForwardOutputR9 checkpoint_output(n_events + 1, n_states, ceil(sqrt(n_events)));
+        REQUIRE(profile_hmm_fill_generic_r9(HMMInputSequenceView(ref_subseq), input[si], input[si].event_start_idx, 0, checkpoint_output) == lp_forward);
+
+        // Without clipping every event is emitted by the match or the bad
+        // event state of one kmer, so their posteriors sum to one
+        std::vector<HMMAlignmentState> emitting_states;
+        for(uint32_t row = 0; row < n_events; ++row) {
+            for(uint32_t kmer_idx = 0; kmer_idx < n_kmers; ++kmer_idx) {
+                HMMAlignmentState as = { input[si].event_start_idx + row * input[si].event_stride, kmer_idx, 0.0, 0.0, 0.0, 'M' };
+                emitting_states.push_back(as);
+                as.state = 'B';
+                emitting_states.push_back(as);
+            }
+        }
+
+        profile_hmm_posterior_r9(HMMInputSequenceView(ref_subseq), input[si], 0, emitting_states);
+        for(uint32_t row = 0; row < n_events; ++row) {
+            double sum = 0.0;
+            for(uint32_t i = 0; i < 2 * n_kmers; ++i) {
+                sum += exp(emitting_states[row * 2 * n_kmers + i].l_posterior);
+            }
+            REQUIRE(sum == Approx(1.0).epsilon(1e-3));
+        }
     }
+
+    // both strands scored at once on the vector unit, with the template
+    // strand repeated so the reads fill more than one group of lanes
+    std::vector<HMMInputData> reads;
+    for(int i = 0; i < 20; ++i) {
+        reads.push_back(input[i % 5 == 0]);
+    }
+
+    set_hmm_simd_r7(true);
+    std::vector<float> read_scores = profile_hmm_score_reads(HMMInputSequenceView(ref_subseq), reads);
+    set_hmm_simd_r7(false);
+    REQUIRE(read_scores.size() == reads.size());
+    for(size_t ri = 0; ri < reads.size(); ++ri) {
+        REQUIRE(read_scores[ri] == Approx(profile_hmm_score(HMMInputSequenceView(ref_subseq), reads[ri])).epsilon(1e-4));
+    }
+}
+
+TEST_CASE( "squiggle read cache", "[cache]") {
+
+    const std::string fast5_path = "test/data/LomanLabz_PC_Ecoli_K12_R7.3_2549_1_ch8_file30_strand.fast5";
+    SquiggleReadCache& cache = SquiggleReadCache::instance();
+    cache.set_max_bytes(1024 * 1024 * 1024);
+    SquiggleReadCacheStats start = cache.get_stats();
+
+    // the second lookup shares the loaded read
+    std::shared_ptr<SquiggleRead> a = cache.get("read_a", fast5_path, "");
+    REQUIRE( cache.get("read_a", fast5_path, "") == a );
+    SquiggleReadCacheStats stats = cache.get_stats();
+    REQUIRE( stats.misses == start.misses + 1 );
+    REQUIRE( stats.hits == start.hits + 1 );
+    size_t read_bytes = stats.bytes - start.bytes;
+    REQUIRE( read_bytes > 0 );
+
+    // a copy belongs to the caller and changing it does not change the cached read
+    std::shared_ptr<SquiggleRead> copy = cache.get_copy("read_a", fast5_path, "");
+    REQUIRE( copy != a );
+    float level = a->events[0][0].mean;
+    copy->events[0][0].mean += 10.0f;
+    copy->read_name = "changed";
+    REQUIRE( cache.get("read_a", fast5_path, "")->events[0][0].mean == level );
+    REQUIRE( cache.get("read_a", fast5_path, "")->read_name == "read_a" );
+
+    // a read that fails to load is not left in the cache, the next lookup tries again
+    stats = cache.get_stats();
+    REQUIRE_THROWS( cache.get("missing", "test/data/missing.fast5", "") );
+    REQUIRE_THROWS( cache.get("missing", "test/data/missing.fast5", "") );
+    REQUIRE( cache.get_stats().misses == stats.misses + 2 );
+    REQUIRE( cache.get_stats().bytes == stats.bytes );
+
+    // when the cache only has room for one read the least recently used one is dropped
+    cache.get("read_b", fast5_path, "");
+    cache.get("read_a", fast5_path, "");
+    cache.set_max_bytes(start.bytes + read_bytes);
+    stats = cache.get_stats();
+    REQUIRE( stats.bytes <= start.bytes + read_bytes );
+    REQUIRE( cache.get("read_a", fast5_path, "") == a );
+    REQUIRE( cache.get_stats().hits == stats.hits + 1 );
+    cache.get("read_b", fast5_path, "");
+    REQUIRE( cache.get_stats().misses == stats.misses + 1 );
+
+    // the dropped read stays alive while it is in use
+    REQUIRE( cache.get("read_b", fast5_path, "") != a );
+    REQUIRE( a->read_name == "read_a" );
+
+    cache.set_max_bytes(0);
+}
+
+// pop every read from the queue and return their indices in the order they were taken
+static std::vector<size_t> drain_queue(PipelineQueue& queue)
+{
+    std::vector<size_t> order;
+    PipelineRead read;
+    while(queue.pop(read)) {
+        order.push_back(read.read_idx);
+    }
+    return order;
+}
+
+// write a bam file of num_reads unmapped records named read_<i>, and its index
+static void write_unmapped_bam(const std::string& bam_file, size_t num_reads)
+{
+    std::string header_text = "@HD\tVN:1.0\tSO:coordinate\n@SQ\tSN:chr1\tLN:1000\n";
+    bam_hdr_t* hdr = sam_hdr_parse(header_text.size(), header_text.c_str());
+    REQUIRE( hdr != NULL );
+    hdr->l_text = header_text.size();
+    hdr->text = strdup(header_text.c_str());
+
+    htsFile* fp = hts_open(bam_file.c_str(), "wb");
+    REQUIRE( fp != NULL );
+    REQUIRE( sam_hdr_write(fp, hdr) == 0 );
+
+    bam1_t* record = bam_init1();
+    for(size_t i = 0; i < num_reads; ++i) {
+        std::string line = "read_" + std::to_string(i) + "\t4\t*\t0\t0\t*\t*\t0\t0\tACGT\t*";
+        kstring_t str = { line.size(), line.size() + 1, &line[0] };
+        REQUIRE( sam_parse1(&str, hdr, record) >= 0 );
+        REQUIRE( sam_write1(fp, hdr, record) >= 0 );
+    }
+    bam_destroy1(record);
+    bam_hdr_destroy(hdr);
+    REQUIRE( hts_close(fp) == 0 );
+    REQUIRE( bam_index_build(bam_file.c_str(), 0) == 0 );
+}
+
+TEST_CASE( "read pipeline", "[read_pipeline]") {
+
+    // the queue takes the reads in bam order, or the most expensive first
+    double costs[] = { 5, 1, 9, 1, 7 };
+    for(int longest_first = 0; longest_first < 2; ++longest_first) {
+        PipelineQueue queue(8, longest_first);
+        for(size_t i = 0; i < 5; ++i) {
+            PipelineRead read;
+            read.read_idx = i;
+            read.cost = costs[i];
+            queue.push(read);
+        }
+        queue.close();
+
+        std::vector<size_t> expected = longest_first ? std::vector<size_t>{ 2, 4, 0, 1, 3 }
+                                                     : std::vector<size_t>{ 0, 1, 2, 3, 4 };
+        REQUIRE( drain_queue(queue) == expected );
+    }
+
+    // a queue smaller than the number of reads hands every read to exactly one consumer
+    size_t num_reads = 1000;
+    {
+        PipelineQueue queue(4, true);
+        std::thread producer([&] {
+            for(size_t i = 0; i < num_reads; ++i) {
+                PipelineRead read;
+                read.read_idx = i;
+                read.cost = i % 7;
+                queue.push(read);
+            }
+            queue.close();
+        });
+
+        std::vector<std::vector<size_t>> taken(4);
+        std::vector<std::thread> consumers;
+        for(size_t ci = 0; ci < taken.size(); ++ci) {
+            consumers.push_back(std::thread([&, ci] { taken[ci] = drain_queue(queue); }));
+        }
+        producer.join();
+        for(size_t ci = 0; ci < consumers.size(); ++ci) {
+            consumers[ci].join();
+        }
+
+        std::vector<int> times_taken(num_reads, 0);
+        for(size_t ci = 0; ci < taken.size(); ++ci) {
+            for(size_t read_idx : taken[ci]) {
+                REQUIRE( read_idx < num_reads );
+                times_taken[read_idx]++;
+            }
+        }
+        REQUIRE( std::count(times_taken.begin(), times_taken.end(), 1) == (int)num_reads );
+    }
+
+    // the whole pipeline over a bam of unmapped reads, which are not loaded from fast5
+    TestDirectory dir;
+    std::string bam_file = dir.get_file("reads.bam");
+    std::string fasta = dir.get_file("reads.fa");
+    std::ofstream(fasta.c_str()) << "";
+    write_unmapped_bam(bam_file, num_reads);
+    Fast5Map name_map(fasta);
+
+    // the process function runs on the workers, so it only records what it was
+    // given and the checks are made afterwards on this thread
+    for(int num_threads = 1; num_threads <= 4; num_threads += 3) {
+        for(int in_order = 0; in_order < 2; ++in_order) {
+            ReadPipeline pipeline(bam_file, "", name_map, 0, num_threads);
+            pipeline.set_in_order(in_order);
+
+            std::mutex processed_mutex;
+            std::vector<size_t> processed;
+            bool names_match = true;
+            bool reads_unloaded = true;
+            size_t n = pipeline.run([&](const bam1_t* record, size_t read_idx, SquiggleRead* sr) {
+                std::lock_guard<std::mutex> lock(processed_mutex);
+                processed.push_back(read_idx);
+                names_match = names_match && bam_get_qname(record) == "read_" + std::to_string(read_idx);
+                reads_unloaded = reads_unloaded && sr == NULL;
+            });
+
+            REQUIRE( n == num_reads );
+            REQUIRE( processed.size() == num_reads );
+            REQUIRE( names_match );
+            REQUIRE( reads_unloaded );
+
+            // with a single worker the reads are processed in the order they are taken
+            if(num_threads == 1 && in_order) {
+                for(size_t i = 0; i < num_reads; ++i) {
+                    REQUIRE( processed[i] == i );
+                }
+            }
+
+            std::sort(processed.begin(), processed.end());
+            for(size_t i = 0; i < num_reads; ++i) {
+                REQUIRE( processed[i] == i );
+            }
+        }
+    }
+}
+
+TEST_CASE( "path scores", "[consensus]") {
+
+    // the first path, a better path, a path pruned by the x-drop and a
+    // screened path that is further behind the first than the x-drop
+    std::vector<IndexedPathScore> result = { { -100.0, 0, false },
+                                             { -90.0, 1, false },
+                                             { -INFINITY, 2, true },
+                                             { -125.0, 3, false } };
+    rank_path_scores(result, 20.0);
+
+    REQUIRE(result[0].path_index == 1);
+    REQUIRE(result[1].path_index == 0);
+    REQUIRE(result[2].path_index == 3);
+    REQUIRE(result[3].path_index == 2);
+    REQUIRE(result[3].score <= -125.0);
+
+    // a pruned path ranks last even when it ties with the worst scored path
+    result = { { -100.0, 0, false },
+               { -130.0, 1, true },
+               { -120.0, 2, false } };
+    rank_path_scores(result, 20.0);
+    REQUIRE(result[0].path_index == 0);
+    REQUIRE(result[1].path_index == 2);
+    REQUIRE(result[2].path_index == 1);
+    REQUIRE(result[2].score == -120.0);
 }
 
 std::vector< StateTrainingData >